@@ -8,6 +8,8 @@
 #ifndef INC_BTL_CONFIG_H_
 #define INC_BTL_CONFIG_H_
 
+/* Record trace events and stream them over USART2 (see BTL_Trace.h) */
+#define BTL_TRACE_ENABLE          1
 
 
 #endif /* INC_BTL_CONFIG_H_ */
@@ -0,0 +1,57 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.8.0                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#ifndef INC_BTL_FLASHQUEUE_H_
+#define INC_BTL_FLASHQUEUE_H_
+
+#include <stdint.h>
+#include "BTL_Private.h"
+
+/* Operations the queue holds, must be a power of two */
+#define BTL_FLASH_QUEUE_DEPTH     16U
+
+/* Bytes of the program runs the queue holds, must be a power of two */
+#define BTL_FLASH_QUEUE_SIZE      2048U
+
+/* Value of an erased byte. Programming it changes no bit, so the bytes of
+ * a run holding it are skipped and a run of nothing else ends at once */
+#define BTL_FLASH_ERASED_VALUE    0xFFU
+
+/* Kinds of flash operation */
+typedef enum
+{
+  BTL_FLASH_OP_PROGRAM         = 0x00U, /* Program a run of bytes */
+  BTL_FLASH_OP_ERASE           = 0x01U, /* Erase one sector */
+} BTL_FlashOpKindTypeDef;
+
+/* Completion callback of an operation: first address of the run or erased
+ * sector, bytes of the run (0 for an erase) and result */
+typedef void (*BTL_FlashDoneTypeDef)(uint32_t address, uint16_t length, BTL_StatusTypeDef BTL_STATUS);
+
+/* Structure to hold one queued flash operation */
+typedef struct
+{
+  uint8_t  BTL_KIND;                /* BTL_FlashOpKindTypeDef */
+  uint32_t BTL_ADDRESS;             /* First address of a run, sector of an erase */
+  const uint8_t* BTL_DATA;          /* Bytes of a run, kept in the queue */
+  uint16_t BTL_LENGTH;              /* Bytes of a run, 0 for an erase */
+  uint32_t BTL_DATA_END;            /* Queue byte index past the run, its bytes are freed up to there */
+  BTL_FlashDoneTypeDef BTL_DONE;    /* Completion callback, NULL for none */
+  BTL_StatusTypeDef BTL_STATUS;     /* Result, set when the flash is done with it */
+} BTL_FlashOpTypeDef;
+
+BTL_StatusTypeDef BTL_FlashQueueProgram(uint32_t address, const uint8_t* data, uint16_t length,
+                                        BTL_FlashDoneTypeDef done);
+BTL_StatusTypeDef BTL_FlashQueueErase(uint8_t sector, BTL_FlashDoneTypeDef done);
+void BTL_FlashQueuePoll(void);
+void BTL_FlashQueueWait(void);
+uint8_t BTL_FlashQueueDepth(void);
+uint8_t BTL_FlashQueuePeak(void);
+void BTL_FlashQueuePeakRestart(void);
+void BTL_FlashQueueOpDone(BTL_StatusTypeDef BTL_STATUS);
+
+#endif /* INC_BTL_FLASHQUEUE_H_ */
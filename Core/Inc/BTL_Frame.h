@@ -0,0 +1,57 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.9.0                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#ifndef INC_BTL_FRAME_H_
+#define INC_BTL_FRAME_H_
+
+#include <stdint.h>
+#include "BTL_Private.h"
+#include "BTL_Interface.h"
+
+/* Framed link: every request the host sends (header and request, or a
+ * whole packet with its header) is one frame:
+ *   COBS(bytes, CRC-16)  0x00
+ * The CRC is CRC-16/CCITT-FALSE of the bytes (polynomial 0x1021, initial
+ * value 0xFFFF), sent big endian. COBS leaves no 0x00 in the frame, so a
+ * frame always ends at the next 0x00 whatever was lost or added before */
+#define BTL_FRAME_DELIMITER       0x00U
+#define BTL_FRAME_CRC_SIZE        2U
+
+/* Largest frame, decoded: a full message buffer and its CRC */
+#define BTL_FRAME_SIZE            (DATA_BUFFER_SIZE + BTL_FRAME_CRC_SIZE)
+
+/* Shortest frame answered when it is bad, a header and its CRC. Shorter
+ * ones are line noise between two frames and are dropped silently */
+#define BTL_FRAME_MIN             (BTL_HEADER_SIZE + BTL_FRAME_CRC_SIZE)
+
+/* Bytes taken from the receive ring at a time */
+#define BTL_FRAME_CHUNK           64U
+
+/* Result of BTL_FramePoll */
+typedef enum
+{
+  BTL_FRAME_NONE               = 0x00U, /* No complete frame yet */
+  BTL_FRAME_READY              = 0x01U, /* A good frame is ready for BTL_FrameRead */
+  BTL_FRAME_BAD                = 0x02U, /* A frame failed its CRC or its encoding and was dropped */
+} BTL_FrameStatusTypeDef;
+
+/* Structure to hold the counters of the framed link */
+typedef struct
+{
+  uint32_t BTL_FRAMES;              /* Good frames */
+  uint32_t BTL_BAD_FRAMES;          /* Frames dropped for their CRC, their encoding or their length */
+  uint32_t BTL_NOISE_BYTES;         /* Bytes dropped between frames */
+} BTL_FrameStatsTypeDef;
+
+void BTL_FrameReset(void);
+BTL_FrameStatusTypeDef BTL_FramePoll(void);
+BTL_StatusTypeDef BTL_FrameRead(uint8_t* data, uint16_t length);
+uint16_t BTL_FrameLeft(void);
+void BTL_FrameRelease(void);
+void BTL_FrameGetStats(BTL_FrameStatsTypeDef* frameStats);
+
+#endif /* INC_BTL_FRAME_H_ */
@@ -13,13 +13,32 @@
 
 #define DATA_BUFFER_SIZE 2048
 
+/* Largest packet the host may send, reported in the first BTL_APP_FLASH acknowledgment */
+#define BTL_MAX_PACKET_SIZE   (DATA_BUFFER_SIZE - BTL_DATA_START)
+
 #define BTL_DATA_SIZE0        0
 #define BTL_DATA_SIZE1        1
 
 BTL_StatusTypeDef BTL_SendMessage(char* messageFormat, ...);
 BTL_CMDTypeDef BTL_GetMessage(uint8_t* messageBuffer);
-BTL_StatusTypeDef BTL_GetVersion(void);
+uint8_t BTL_MessagePending(void);
+BTL_StatusTypeDef BTL_ProcessMessage(uint8_t* messageBuffer);
+uint8_t BTL_RunJobs(uint8_t* messageBuffer);
+void BTL_Poll(uint8_t* messageBuffer);
+BTL_StatusTypeDef BTL_GetVersion(uint8_t* messageBuffer, uint16_t dataLength);
+BTL_StatusTypeDef BTL_GetHelp(uint8_t* messageBuffer, uint16_t dataLength);
+BTL_StatusTypeDef BTL_GetId(uint8_t* messageBuffer, uint16_t dataLength);
+BTL_StatusTypeDef BTL_GetMemoryUsage(uint8_t* messageBuffer, uint16_t dataLength);
 BTL_StatusTypeDef BTL_UpdateFirmware(uint8_t* messageBuffer, uint16_t dataLength);
-static uint8_t CalculateChecksum(const uint8_t *data, size_t length);
+BTL_StatusTypeDef BTL_MemRead(uint8_t* messageBuffer, uint16_t dataLength);
+BTL_StatusTypeDef BTL_FlashErase(uint8_t* messageBuffer, uint16_t dataLength);
+void BTL_LinkInit(void);
+void BTL_SessionInit(void);
+BTL_StatusTypeDef BTL_SetLink(uint8_t* messageBuffer, uint16_t dataLength);
+BTL_StatusTypeDef BTL_OtpRead(uint8_t* messageBuffer, uint16_t dataLength);
+BTL_StatusTypeDef BTL_SetStripe(uint8_t* messageBuffer, uint16_t dataLength);
+BTL_StatusTypeDef BTL_SetFraming(uint8_t* messageBuffer, uint16_t dataLength);
+BTL_StatusTypeDef BTL_ResumeSession(uint8_t* messageBuffer, uint16_t dataLength);
+BTL_StatusTypeDef BTL_RunBatch(uint8_t* messageBuffer, uint16_t dataLength);
 
 #endif /* INC_BTL_INTERFACE_H_ */
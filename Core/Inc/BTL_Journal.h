@@ -0,0 +1,73 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 2.1.0                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#ifndef INC_BTL_JOURNAL_H_
+#define INC_BTL_JOURNAL_H_
+
+#include <stdint.h>
+#include "BTL_Private.h"
+
+/* Update journal: the last BTL_JOURNAL_SIZE bytes of the last application
+ * sector, erased with the application area at the start of every
+ * BTL_APP_FLASH session. Entries are only appended, through the flash
+ * queue, so a checkpoint never needs an erase. An entry, little endian:
+ *   uint16    BTL_JOURNAL_CHECKPOINT or BTL_JOURNAL_DONE
+ *   uint16    extended address of the checkpoint (high 16 bits)
+ *   uint32    session ID
+ *   uint32    records programmed
+ *   uint32    data bytes of their packets
+ *   uint32    image CRC of their complete words
+ *   uint32    bytes fed to the image CRC
+ *   uint8[4]  unfinished word of the image CRC
+ *   uint32    CRC-32 of the first 28 bytes
+ * The first checkpoint of a session is the one at record 0. At reset the
+ * last valid checkpoint or done entry tells what power cut short: a
+ * checkpoint is a session to resume from there, a done entry or none is no
+ * session. An entry cut short by the reset fails its CRC and the one
+ * before it counts.
+ * A link entry keeps the link profile of BTL_SET_LINK, the last valid one
+ * is the active profile:
+ *   uint16    BTL_JOURNAL_LINK
+ *   uint8     longest record, data bytes
+ *   uint8     transfer mode flags (BTL_LinkFlagTypeDef bits)
+ *   uint32    baud rate
+ *   uint16    largest packet
+ *   uint8[18] 0xFF
+ *   uint32    CRC-32 of the first 28 bytes
+ * Every erase of the journal is followed by a link entry of the active
+ * profile, a reset in between only loses the profile */
+#define BTL_JOURNAL_BASE          0x0803F000U
+#define BTL_JOURNAL_SECTOR        5U
+#define BTL_JOURNAL_SIZE          0x1000U
+#define BTL_JOURNAL_ENTRY_SIZE    32U
+#define BTL_JOURNAL_ENTRIES       (BTL_JOURNAL_SIZE / BTL_JOURNAL_ENTRY_SIZE)
+#define BTL_JOURNAL_CHECKPOINT    0x434AU /* "JC" */
+#define BTL_JOURNAL_DONE          0x444AU /* "JD" */
+#define BTL_JOURNAL_LINK          0x4C4AU /* "JL" */
+
+/* Programmed bytes between two journaled checkpoints. The application area
+ * less the journal takes 110 of them, the rest of the entries are left for
+ * suspended sessions, link entries and the done entry */
+#define BTL_JOURNAL_INTERVAL      2048U
+
+/* What the journal holds at reset */
+typedef enum
+{
+  BTL_JOURNAL_EMPTY            = 0x00U, /* No session since the last erase */
+  BTL_JOURNAL_OPEN             = 0x01U, /* A session was cut short at its last checkpoint */
+  BTL_JOURNAL_CLOSED           = 0x02U, /* The last session ended */
+} BTL_JournalStateTypeDef;
+
+BTL_JournalStateTypeDef BTL_JournalInit(uint32_t* sessionId, BTL_CheckpointTypeDef* checkpoint);
+void BTL_JournalReset(void);
+BTL_StatusTypeDef BTL_JournalAppend(uint32_t sessionId, const BTL_CheckpointTypeDef* checkpoint);
+BTL_StatusTypeDef BTL_JournalClose(uint32_t sessionId);
+void BTL_JournalFindLink(BTL_LinkProfileTypeDef* profile);
+uint8_t BTL_JournalFree(void);
+BTL_StatusTypeDef BTL_JournalAppendLink(const BTL_LinkProfileTypeDef* profile);
+
+#endif /* INC_BTL_JOURNAL_H_ */
@@ -0,0 +1,67 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.1.1                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#ifndef INC_BTL_PORT_H_
+#define INC_BTL_PORT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "BTL_Private.h"
+
+/* Timeout value meaning "wait forever" (same value as HAL_MAX_DELAY) */
+#define BTL_PORT_MAX_DELAY        0xFFFFFFFFU
+
+/* Pattern painted on the unused stack, and the bytes left unpainted below
+ * the stack pointer of the painting function */
+#define BTL_STACK_PAINT_VALUE     0xA5A5A5A5U
+#define BTL_STACK_PAINT_MARGIN    64
+
+/* Receive ring of the host link and of the second lane, holds the largest
+ * packet twice (power of 2) */
+#define BTL_PORT_RX_RING_SIZE     4096U
+
+/* Longest wait for the trace transfer on USART2 before the second lane reconfigures it */
+#define BTL_PORT_TRACE_WAIT       100U
+
+/* Port layer between the bootloader core and the hardware.
+ * BTL_Port.c implements it on top of the STM32 HAL, Host/BTL_SimPort.c
+ * implements it on a Linux host with a simulated flash and a pty link. */
+BTL_StatusTypeDef BTL_PortTransmit(uint8_t* data, uint16_t length, uint32_t timeout);
+BTL_StatusTypeDef BTL_PortReceive(uint8_t* data, uint16_t length, uint32_t timeout);
+void BTL_PortReceiveStart(void);
+uint16_t BTL_PortReceiveAvailable(void);
+BTL_StatusTypeDef BTL_PortStripeStart(uint32_t baudRate);
+BTL_StatusTypeDef BTL_PortStripeReceive(uint8_t* data, uint16_t length, uint32_t timeout);
+uint16_t BTL_PortStripeAvailable(void);
+void BTL_PortIdle(void);
+void BTL_PortFlashUnlock(void);
+void BTL_PortFlashLock(void);
+BTL_StatusTypeDef BTL_PortFlashProgram(uint32_t address, uint8_t data);
+BTL_StatusTypeDef BTL_PortFlashProgramStart(uint32_t address, const uint8_t* data, uint16_t length);
+BTL_StatusTypeDef BTL_PortFlashEraseStart(uint8_t sector);
+const uint8_t* BTL_PortMemoryMap(uint32_t address, uint32_t length);
+BTL_StatusTypeDef BTL_PortTransmitDMA(const uint8_t* data, uint16_t length);
+BTL_StatusTypeDef BTL_PortTransmitWait(uint32_t timeout);
+uint32_t BTL_PortCrc(const uint8_t* data, uint32_t length);
+void BTL_PortCrcStart(void);
+uint32_t BTL_PortCrcAccumulate(uint32_t word);
+uint32_t BTL_PortGetBaudRate(void);
+BTL_StatusTypeDef BTL_PortSetBaudRate(uint32_t baudRate);
+uint32_t BTL_PortGetDeviceId(void);
+void BTL_PortGetUniqueId(uint8_t* uniqueId);
+uint32_t BTL_PortGetTick(void);
+void BTL_PortMemoryInit(void);
+void BTL_PortMemoryRestart(void);
+void BTL_PortGetMemoryUsage(BTL_MemoryUsageTypeDef* memoryUsage);
+uint32_t BTL_PortTraceInit(void);
+uint32_t BTL_PortTraceTimestamp(void);
+BTL_StatusTypeDef BTL_PortTraceTransmit(uint8_t* data, uint16_t length);
+
+/* Target only: the flash interrupt of the operations started above, called by FLASH_IRQHandler */
+void BTL_PortFlashIRQHandler(void);
+
+#endif /* INC_BTL_PORT_H_ */
@@ -8,6 +8,8 @@
 #ifndef INC_BTL_PRIVATE_H_
 #define INC_BTL_PRIVATE_H_
 
+#include <stdint.h>
+
 /* Bit positions for various fields in a record */
 #define BTL_CC_0                  0
 #define BTL_CC_1                  1
@@ -46,21 +48,199 @@
 
 #define BTL_DATA_START            7
 
+/* Bytes of the command header: data length (2 x 4 bits) and command type */
+#define BTL_HEADER_SIZE           3
+
 /* Some MCU and Bootloader related data */
 #define BTL_BOOTLOADER_SIZE       0x8000 /* 32 Kilobyte */
 
+/* Application sectors erased before flashing (sector 2 up to sector 5) */
+#define BTL_APP_FIRST_SECTOR      2
+#define BTL_APP_NB_SECTORS        4
+#define BTL_NB_SECTORS            6
+
+/* BTL_FLASH_ERASE: the request carries the first sector and the number of
+ * sectors, 0 sectors erases the whole application area. Erasing a 128K
+ * sector takes up to 4 s */
+#define BTL_ERASE_REQUEST         2
+#define BTL_ERASE_SECTOR_TIMEOUT  5000U
+
 #define BTL_MIN_ADDRESS 		  0x08000000
 #define BTL_MAX_ADDRESS 		  0x0805FFFF
 
+/* Data bytes of a record, the full 8 bits range of the Intel HEX byte count */
 #define BTL_MIN_CC 		          0x00
-#define BTL_MAX_CC 		          0x10
+#define BTL_MAX_CC 		          0xFF
+
+/* ASCII characters of a record besides its data:
+ * 11 = 2 (CC) + 4 (ADD) + 2 (RT) + 2 (CHSUM) + 1 (\n) */
+#define BTL_RECORD_OVERHEAD       11
+
+/* Sparse format: a fill record (BTL_FILL_RECORD_TYPE) stands for a run of
+ * one repeated byte starting at its address, its data is the byte (uint8)
+ * and the length of the run (uint16, big endian like the other fields).
+ * The run is programmed like the data record holding it would be and is
+ * read back into the image CRC the same way, a run of the erased value
+ * programs nothing and only checks that the flash is erased */
+#define BTL_FILL_CC               3
+
+/* The last BTL_APP_FLASH packet may end with the CRC-32 the host expects
+ * for the image (uint32, little endian, right after the last record): the
+ * STM32 CRC unit over the data bytes of all the data records in the order
+ * they were sent, the last word padded with BTL_IMAGE_CRC_PAD. The device
+ * reads every record back from the flash into the same CRC as soon as it
+ * is programmed and answers the last packet with crc=, bytes= and
+ * verify=ok|none, or with a NAck carrying crc=, expected= and verify=fail */
+#define BTL_IMAGE_CRC_SIZE        4
+#define BTL_IMAGE_CRC_PAD         0xFFU
+#define BTL_IMAGE_CRC_POLYNOMIAL  0x04C11DB7U
 
 #define MAX_TIMEOUT               5
 
+/* BTL_MEM_READ: the request carries the address and the length (both
+ * uint32, little endian, multiples of 4), the answer is a stream of chunks:
+ * header (address uint32, length uint16, sequence uint16), the memory bytes
+ * and the CRC-32 of those bytes (uint32, STM32 CRC unit) */
+#define BTL_MEM_READ_REQUEST      8
+#define BTL_MEM_READ_CHUNK        1024U
+#define BTL_MEM_READ_HEADER       8
+#define BTL_MEM_READ_TRAILER      4
+#define BTL_MEM_READ_TIMEOUT      5000U /* ms, one chunk takes ~1.1 s at 9600 baud */
+
+/* Every reply is one BTL_SendMessage buffer of this size */
+#define BTL_REPLY_SIZE            512
+
+/* BTL_GET_HELP answers with a capability descriptor after the acknowledgment
+ * byte, little endian:
+ *   uint8     protocol version (BTL_PROTOCOL_VERSION)
+ *   uint8[3]  bootloader version: major, minor, patch
+ *   uint16    largest packet (BTL_MAX_PACKET_SIZE)
+ *   uint8     window depth: packets the host may send before an acknowledgment
+ *   uint8     longest record, data bytes (BTL_MAX_CC)
+ *   uint32    commands, bit n set when command n is implemented
+ *   uint32    transfer formats (BTL_FormatTypeDef bits)
+ *   uint16    BTL_MEM_READ chunk size
+ *   uint8     number of baud rates N, then uint32[N] baud rates
+ *   uint32    flash base, uint8 number of sectors S, then uint32[S] sector sizes
+ *   uint32    application start, uint32 application size: the sectors of the
+ *             application area less the update journal at their end
+ *   uint32    device ID (DBGMCU IDCODE), uint8[12] unique ID
+ * BTL_GET_ID answers with the device ID and the unique ID only */
+#define BTL_PROTOCOL_VERSION      1
+#define BTL_WINDOW_DEPTH          1
+#define BTL_UID_SIZE              12
+
+/* Link profile: the baud rate, packet size, record length and transfer mode
+ * a host settled on, kept as a link entry of the update journal
+ * (BTL_Journal.h) so the next entry starts in it. A new profile is only
+ * appended when it differs from the active one and no session is
+ * suspended, whose checkpoints need the entries left; a full journal takes
+ * none until the next BTL_APP_FLASH session erases it.
+ * BTL_SET_LINK carries baud rate (uint32), largest packet (uint16), longest
+ * record (uint8) and flags (uint8). It is acknowledged at the current baud
+ * rate, the host then resends the 3 bytes BTL_SET_LINK header at the new
+ * one within BTL_LINK_PROBE_TIMEOUT and gets a second acknowledgment once
+ * the profile is stored; without it the device goes back to its baud rate.
+ * BTL_OTP_READ, named after where the first profiles were kept, answers
+ * with the current baud rate (uint32), the stored profile (baud rate
+ * uint32, 0 when none, largest packet uint16, longest record uint8, flags
+ * uint8), the journal entries in use and the entries a profile may take
+ * (uint8 each) */
+#define BTL_LINK_REQUEST          8
+#define BTL_LINK_PROBE_TIMEOUT    500U /* ms the host has to answer in a stored or requested profile */
+
+/* Striped transfer: BTL_STRIPE carries the baud rate of a second lane
+ * (uint32, little endian, 0 turns striping off) on the receive side of
+ * USART2, which also sends the trace stream at that baud rate from then on.
+ * It is acknowledged with lanes= and frame=. The BTL_APP_FLASH sessions
+ * that follow keep their first header on USART1; every byte the host would
+ * send after it (first packet, headers and later packets) is cut into
+ * frames sent on either lane, in the order of their sequence number:
+ *   uint16    sequence number, 0 for the first frame of the session
+ *   uint16    length, 1 to BTL_STRIPE_FRAME bytes
+ *   uint8[]   bytes of the session stream
+ * The device reads the frames back in sequence order. Each lane carries
+ * its frames in order, so the host may share them out to suit the speed of
+ * each lane */
+#define BTL_STRIPE_REQUEST        4
+#define BTL_STRIPE_LANES          2
+#define BTL_STRIPE_HEADER         4
+#define BTL_STRIPE_FRAME          256U
+#define BTL_STRIPE_TIMEOUT        1000U /* ms the next frame of a started read may take */
+
+/* Framed link: BTL_FRAMING carries the framing of the requests that follow
+ * (uint8, BTL_FRAMING_OFF or BTL_FRAMING_COBS) and is acknowledged with
+ * framing= and the frames=, bad= and noise= counters of the framing it
+ * ends. The host sends its next request once the acknowledgment is in.
+ * With BTL_FRAMING_COBS every request is one frame (see BTL_Frame.h); a
+ * frame failing its CRC or its encoding is answered with a NAck holding
+ * frame=bad and dropped, the host resends it. A request does not carry on
+ * into the next frame, the rest of a frame after its request is dropped.
+ * Replies are not framed. Striping and framing exclude each other */
+#define BTL_FRAMING_REQUEST       1
+#define BTL_FRAMING_OFF           0U
+#define BTL_FRAMING_COBS          1U
+
+/* Resumable sessions: the first BTL_APP_FLASH acknowledgment carries the
+ * ID of the session (session=). A session that waits BTL_SESSION_TIMEOUT
+ * for its next packet, refuses one (bad record, packet cut short by
+ * BTL_PACKET_TIMEOUT) or gets a BTL_RESUME between two packets is
+ * suspended: the flash is locked and the session is kept at its
+ * checkpoint, the packets programmed and read back into the image CRC so
+ * far. BTL_RESUME carries an operation (uint8, BTL_RESUME_QUERY or
+ * BTL_RESUME_START) and a session ID (uint32, little endian, unused by a
+ * query) and is acknowledged with session=, state= (none, erase, active or
+ * suspended), records= and offset=, the records of the checkpoint and
+ * their data bytes, and crc=, the image CRC of their complete words.
+ * BTL_RESUME_START of the suspended session takes it back to its
+ * checkpoint without erasing: the host then sends its packets from record
+ * records= on, each with its BTL_APP_FLASH header. A new session or a
+ * BTL_FLASH_ERASE drops a suspended one. Checkpoints are also kept in the
+ * update journal (BTL_Journal.h), a session cut short by a reset comes
+ * back suspended at the last one journaled */
+#define BTL_RESUME_REQUEST        5
+#define BTL_RESUME_QUERY          0U
+#define BTL_RESUME_START          1U
+#define BTL_SESSION_TIMEOUT       10000U /* ms a session waits for its next packet */
+#define BTL_PACKET_TIMEOUT        3000U  /* ms for a packet after its header, the largest takes 2.2 s at 9600 baud */
+
+/* BTL_BATCH: the request is a sequence of sub-commands, each laid out like
+ * a request of its own (header, then its data), run one after the other in
+ * a single round trip. A sub-command is over once the erase it started is,
+ * the batch stops at the first one that fails or answers with a NAck. A
+ * BTL_APP_FLASH header may only come last: it opens a session, its length
+ * is the one of the first packet, sent after the batch reply. A malformed
+ * batch or one longer than BTL_BATCH_SIZE is read and refused with a NAck
+ * before anything runs, otherwise the replies of the sub-commands are
+ * gathered into one reply, little endian:
+ *   uint8     BTL_BATCH
+ *   uint8     sub-commands run
+ *   uint8     sub-commands in the batch
+ *   uint8     BTL_OK, BTL_ERROR if the last one run failed or its replies did not fit
+ * then every reply of the sub-commands run, in order:
+ *   uint8     index of the sub-command in the batch
+ *   uint16    length of the reply
+ *   uint8[]   the reply, acknowledgment byte first, without its zero padding */
+#define BTL_BATCH_SIZE            256U
+#define BTL_BATCH_HEADER          4U
+#define BTL_BATCH_ENTRY_HEADER    3U
+
+/* Command dispatcher: BTL_Poll takes a command header off the receive ring
+ * as soon as one is there and runs the handler registered for it, one step
+ * of every background job (link probe, erase, BTL_APP_FLASH session, trace
+ * drain) runs in between. Handlers flagged BTL_CMD_EXCLUSIVE touch the flash
+ * or the link and are refused with a NAck while a job runs, the other ones
+ * are answered at any time. Handlers flagged BTL_CMD_BATCH may run inside a
+ * BTL_BATCH */
+#define BTL_NB_COMMANDS           (BTL_BATCH + 1)
+#define BTL_CMD_EXCLUSIVE         0x01U
+#define BTL_CMD_BATCH             0x02U
+#define BTL_REQUEST_TIMEOUT       500U /* ms for a header and the request that follows it */
+
 /* Version Information */
-#define BTL_V_MAJOR '1'
-#define BTL_V_MINOR '1'
-#define BTL_V_PATCH '1'
+#define BTL_V_MAJOR '2'
+#define BTL_V_MINOR '3'
+#define BTL_V_PATCH '0'
 
 /* Structure to hold information about the record being processed */
 typedef struct
@@ -72,11 +252,32 @@ typedef struct
   uint8_t BTL_CHECKSUM;             /* Checksum field of the record */
   uint16_t BTL_RECORD_INDEX;        /* Index indicating the position of the record in the data buffer */
   uint16_t BTL_BUFFER_POINTER;      /* Pointer to the start of current record */
+  uint16_t BTL_BUFFER_LENGTH;       /* Number of bytes of records in the data buffer */
   uint16_t BTL_ADDRESS_HIGH;        /* High bytes of the address field in the record */
   uint8_t BTL_NO_OF_BUFFER_RECORDS; /* Number of records in the received buffer for iteration */
 } BTL_RecordTypeDef;
 
 
+/* Structure to hold the RAM usage reported by BTL_GET_MEM_USAGE: the peaks
+ * of the last BTL_APP_FLASH session once it ended, of the session running
+ * since it opened, since reset before the first session */
+typedef struct
+{
+  uint32_t BTL_STACK_PEAK;          /* Deepest stack use */
+  uint32_t BTL_STACK_AVAILABLE;     /* RAM between the top of the heap and the top of the stack */
+  uint32_t BTL_HEAP_PEAK;           /* High watermark of the heap */
+  uint32_t BTL_STATIC_SIZE;         /* Size of .data and .bss, static buffers included */
+} BTL_MemoryUsageTypeDef;
+
+/* Structure to hold a link profile, kept in the update journal by BTL_SET_LINK */
+typedef struct
+{
+  uint32_t BTL_BAUD_RATE;           /* Baud rate of the host link, 0 when no profile is stored */
+  uint16_t BTL_MAX_PACKET;          /* Largest packet the host sends */
+  uint8_t  BTL_MAX_RECORD;          /* Longest record the host sends, data bytes */
+  uint8_t  BTL_FLAGS;               /* Transfer mode, BTL_LinkFlagTypeDef bits */
+} BTL_LinkProfileTypeDef;
+
 /* Enumeration for Bootloader Status */
 typedef enum
 {
@@ -92,6 +293,7 @@ typedef enum
   BTL_EXT_SEGMENT_ADDR_RECORD    = 0x02U, /* Extended Segment Address Record */
   BTL_EXT_LINEAR_ADDR_RECORD     = 0x04U, /* Extended Linear Address Record */
   BTL_START_LINEAR_ADDR_RECORD   = 0x05U, /* Start Linear Address Record (MDK-ARM only) */
+  BTL_FILL_RECORD_TYPE           = 0x10U, /* Fill Record, sparse format only */
 } BTL_RecordTypeTypeDef;
 
 /* Enumeration for Bootloader Commands */
@@ -105,6 +307,177 @@ typedef enum
 	BTL_MEM_READ                 = 0x06U,
 	BTL_OTP_READ                 = 0x07U,
 	BTL_ERROR_CMD                = 0x08U,
+	BTL_GET_MEM_USAGE            = 0x09U,
+	BTL_SET_LINK                 = 0x0AU,
+	BTL_STRIPE                   = 0x0BU,
+	BTL_FRAMING                  = 0x0CU,
+	BTL_RESUME                   = 0x0DU,
+	BTL_BATCH                    = 0x0EU,
 } BTL_CMDTypeDef;
 
+/* Handler of a command, called once its header is received */
+typedef BTL_StatusTypeDef (*BTL_HandlerTypeDef)(uint8_t* messageBuffer, uint16_t dataLength);
+
+/* Structure to hold an entry of the command table, indexed by BTL_CMDTypeDef */
+typedef struct
+{
+  BTL_HandlerTypeDef BTL_HANDLER;   /* NULL when the command is not implemented */
+  uint8_t BTL_FLAGS;                /* BTL_CMD_EXCLUSIVE, BTL_CMD_BATCH */
+} BTL_CommandTypeDef;
+
+/* Structure to hold the BTL_BATCH being run */
+typedef struct
+{
+  uint8_t BTL_RUNNING;              /* Requests are read from the batch and replies gathered */
+  uint8_t BTL_INDEX;                /* Sub-command running */
+  uint8_t BTL_FAILED;               /* The sub-command answered with a NAck */
+  uint8_t BTL_OVERFLOW;             /* A reply did not fit the batch reply */
+  uint16_t BTL_READ;                /* Next byte of the request the sub-command reads */
+  uint16_t BTL_END;                 /* End of the data of the sub-command */
+  uint16_t BTL_REPLY_LENGTH;        /* Bytes of the batch reply so far */
+} BTL_BatchTypeDef;
+
+/* Structure to hold the background erase started by BTL_FLASH_ERASE or a BTL_APP_FLASH session */
+typedef struct
+{
+  uint8_t BTL_FIRST_SECTOR;         /* First sector of the range */
+  uint8_t BTL_SECTOR_COUNT;         /* Sectors of the range, 0 when no erase runs */
+  uint8_t BTL_ERASED_SECTORS;       /* Sectors reported so far */
+  uint8_t BTL_DONE_SECTORS;         /* Sectors the flash queue finished erasing */
+  uint8_t BTL_FAILED;               /* A sector failed to erase */
+  uint8_t BTL_REPORT;               /* Send one progress message per sector (BTL_FLASH_ERASE) */
+  uint32_t BTL_TICK;                /* Tick of the last progress, for BTL_ERASE_SECTOR_TIMEOUT */
+} BTL_EraseJobTypeDef;
+
+/* Steps of a BTL_APP_FLASH session */
+typedef enum
+{
+  BTL_SESSION_IDLE             = 0x00U, /* No session */
+  BTL_SESSION_ERASE            = 0x01U, /* Acknowledged, the application area is being erased */
+  BTL_SESSION_FIRST_PACKET     = 0x02U, /* Waiting for the first packet, it comes without a header */
+  BTL_SESSION_NEXT_PACKET      = 0x03U, /* Waiting for the BTL_APP_FLASH header of the next packet */
+  BTL_SESSION_SUSPENDED        = 0x04U, /* Stopped at its checkpoint, BTL_RESUME takes it on again */
+} BTL_SessionStateTypeDef;
+
+/* Structure to hold the point a suspended BTL_APP_FLASH session resumes at */
+typedef struct
+{
+  uint32_t BTL_RECORDS;             /* Records of the packets programmed */
+  uint32_t BTL_OFFSET;              /* Data bytes of those packets */
+  uint32_t BTL_IMAGE_CRC;           /* Image CRC of their complete words */
+  uint32_t BTL_IMAGE_BYTES;         /* Bytes fed to the image CRC */
+  uint8_t  BTL_IMAGE_WORD[4];       /* Unfinished word of the image CRC */
+  uint16_t BTL_ADDRESS_HIGH;        /* Set by the last Extended Linear Address record */
+} BTL_CheckpointTypeDef;
+
+/* Packets decoded while the runs of earlier ones are still queued */
+#define BTL_SESSION_MARKS         4U
+
+/* Structure to hold the end of a decoded packet, its checkpoint once its runs are programmed */
+typedef struct
+{
+  uint32_t BTL_RECORDS;             /* Records up to the end of the packet */
+  uint32_t BTL_OFFSET;              /* Data bytes up to the end of the packet */
+  uint32_t BTL_IMAGE_BYTES;         /* Image bytes queued up to the end of the packet */
+  uint16_t BTL_ADDRESS_HIGH;        /* Extended Linear Address at the end of the packet */
+} BTL_PacketMarkTypeDef;
+
+/* Structure to hold a BTL_APP_FLASH session between its packets */
+typedef struct
+{
+  BTL_SessionStateTypeDef BTL_STATE; /* Step of the session */
+  uint8_t BTL_ERASE_FAILED;         /* The first packet is refused, the erase failed */
+  uint8_t BTL_PROGRAM_FAILED;       /* A queued run failed, the next acknowledgment is a NAck */
+  uint16_t BTL_DATA_LENGTH;         /* Length of the first packet */
+  uint16_t BTL_ADDRESS_HIGH;        /* Set by the last Extended Linear Address record, kept across packets */
+  uint32_t BTL_START;               /* Tick at the start of the session, for the throughput trace */
+  uint32_t BTL_BYTES;               /* Bytes received since the start of the session */
+  uint32_t BTL_ID;                  /* ID of the session, BTL_RESUME names it */
+  uint32_t BTL_ACTIVITY;            /* Tick of the last packet, for BTL_SESSION_TIMEOUT */
+  uint32_t BTL_RECORDS;             /* Records of the packets acknowledged */
+  uint32_t BTL_OFFSET;              /* Data bytes of those packets */
+  uint32_t BTL_QUEUED_BYTES;        /* Image bytes queued for programming */
+  uint8_t BTL_MARK_COUNT;           /* Packets in BTL_MARK, oldest first */
+  BTL_PacketMarkTypeDef BTL_MARK[BTL_SESSION_MARKS]; /* Decoded packets whose runs are not all programmed */
+  BTL_CheckpointTypeDef BTL_CHECKPOINT; /* Point the session resumes at */
+} BTL_SessionTypeDef;
+
+/* Structure to hold the reassembly of the striped session stream */
+typedef struct
+{
+  uint32_t BTL_BAUD_RATE;           /* Baud rate of the second lane, 0 when striping is off */
+  uint16_t BTL_SEQUENCE;            /* Sequence number of the next frame */
+  uint8_t  BTL_LANE;                /* Lane of the frame being read, BTL_STRIPE_LANES when none */
+  uint16_t BTL_FRAME_LEFT;          /* Bytes of that frame not read yet */
+  uint8_t  BTL_PENDING[BTL_STRIPE_LANES];           /* A lane holds a frame header already read */
+  uint16_t BTL_PENDING_SEQUENCE[BTL_STRIPE_LANES];  /* Sequence number of that frame */
+  uint16_t BTL_PENDING_LENGTH[BTL_STRIPE_LANES];    /* Length of that frame */
+} BTL_StripeTypeDef;
+
+/* Transfer formats of the capability descriptor */
+typedef enum
+{
+  BTL_FORMAT_HEX               = 0x01U, /* Colon-less Intel HEX records */
+  BTL_FORMAT_BINARY            = 0x02U, /* Raw binary blocks */
+  BTL_FORMAT_COMPRESSED        = 0x04U, /* Compressed blocks */
+  BTL_FORMAT_DELTA             = 0x08U, /* Delta against the programmed image */
+  BTL_FORMAT_SPARSE            = 0x10U, /* Colon-less Intel HEX records and fill records */
+} BTL_FormatTypeDef;
+
+#define BTL_FORMATS               (BTL_FORMAT_HEX | BTL_FORMAT_SPARSE)
+
+/* Transfer mode flags of a link profile, only the host acts on them */
+typedef enum
+{
+  BTL_LINK_ACK_PACED           = 0x01U, /* Next packet sent as soon as the acknowledgment arrives */
+  BTL_LINK_ADAPTIVE            = 0x02U, /* Packets sized from the acknowledgments */
+} BTL_LinkFlagTypeDef;
+
+/* Baud rates BTL_SET_LINK accepts */
+#define BTL_NB_BAUD_RATES         6
+
+/**
+ * @brief Read a little endian half word from a byte buffer.
+ * @param data First byte of the half word.
+ * @return uint16_t Value of the half word.
+ */
+static inline uint16_t BTL_GetHalfWord(const uint8_t* data)
+{
+    return (uint16_t) (data[0] | (data[1] << 8));
+}
+
+/**
+ * @brief Read a little endian word from a byte buffer.
+ * @param data First byte of the word.
+ * @return uint32_t Value of the word.
+ */
+static inline uint32_t BTL_GetWord(const uint8_t* data)
+{
+    return (uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+/**
+ * @brief Write a little endian half word to a byte buffer.
+ * @param data First byte of the half word.
+ * @param value Value of the half word.
+ */
+static inline void BTL_PutHalfWord(uint8_t* data, uint16_t value)
+{
+    data[0] = (uint8_t) value;
+    data[1] = (uint8_t) (value >> 8);
+}
+
+/**
+ * @brief Write a little endian word to a byte buffer.
+ * @param data First byte of the word.
+ * @param value Value of the word.
+ */
+static inline void BTL_PutWord(uint8_t* data, uint32_t value)
+{
+    data[0] = (uint8_t) value;
+    data[1] = (uint8_t) (value >> 8);
+    data[2] = (uint8_t) (value >> 16);
+    data[3] = (uint8_t) (value >> 24);
+}
+
 #endif /* INC_BTL_PRIVATE_H_ */
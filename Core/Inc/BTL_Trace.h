@@ -0,0 +1,60 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.1.1                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#ifndef INC_BTL_TRACE_H_
+#define INC_BTL_TRACE_H_
+
+#include <stdint.h>
+#include "BTL_Config.h"
+
+/* Number of events the trace ring holds, must be a power of two */
+#define BTL_TRACE_RING_SIZE       64
+
+/* Marker written last into an event, the event is complete once it is set */
+#define BTL_TRACE_SYNC            0xB7U
+
+/* Event IDs, the BEGIN/END pairs delimit the phases of a session */
+typedef enum
+{
+  BTL_TRACE_CLOCK              = 0x00U, /* ARG0: timestamp clock in Hz */
+  BTL_TRACE_RX_BEGIN           = 0x01U, /* ARG0: bytes expected */
+  BTL_TRACE_RX_END             = 0x02U, /* ARG0: status */
+  BTL_TRACE_DECODE_BEGIN       = 0x03U, /* ARG0: records in the packet */
+  BTL_TRACE_DECODE_END         = 0x04U, /* ARG0: status */
+  BTL_TRACE_PROGRAM_BEGIN      = 0x05U, /* ARG0: address, ARG1: bytes */
+  BTL_TRACE_PROGRAM_END        = 0x06U, /* ARG0: status */
+  BTL_TRACE_ACK_BEGIN          = 0x07U, /* ARG0: acknowledged command, 0 for a NAck */
+  BTL_TRACE_ACK_END            = 0x08U, /* ARG0: status */
+  BTL_TRACE_ERASE_BEGIN        = 0x09U, /* ARG0: first sector, ARG1: sectors */
+  BTL_TRACE_ERASE_END          = 0x0AU, /* ARG0: status */
+  BTL_TRACE_DROPPED            = 0x0BU, /* ARG0: events dropped because the ring was full */
+  BTL_TRACE_PACKET             = 0x0CU, /* ARG0: packet size, ARG1: session throughput in bytes per second */
+} BTL_TraceIdTypeDef;
+
+/* Wire and ring format of one event, 16 bytes little endian */
+typedef struct
+{
+  volatile uint8_t BTL_SYNC;        /* BTL_TRACE_SYNC once the event is complete */
+  uint8_t  BTL_SEQUENCE;            /* Low byte of the event index, shows drops to the decoder */
+  uint16_t BTL_EVENT_ID;            /* One of BTL_TraceIdTypeDef */
+  uint32_t BTL_TIMESTAMP;           /* Free running counter at the clock of BTL_TRACE_CLOCK */
+  uint32_t BTL_ARG0;                /* First argument */
+  uint32_t BTL_ARG1;                /* Second argument */
+} BTL_TraceEventTypeDef;
+
+#if BTL_TRACE_ENABLE
+#define BTL_TRACE(eventId, arg0, arg1)    BTL_TraceEvent((eventId), (uint32_t) (arg0), (uint32_t) (arg1))
+#else
+#define BTL_TRACE(eventId, arg0, arg1)    ((void) 0)
+#endif
+
+void BTL_TraceInit(void);
+void BTL_TraceEvent(BTL_TraceIdTypeDef eventId, uint32_t arg0, uint32_t arg1);
+void BTL_TraceDrain(void);
+void BTL_TraceTransmitComplete(void);
+
+#endif /* INC_BTL_TRACE_H_ */
@@ -0,0 +1,294 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.8.0                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#include <string.h>
+#include "BTL_FlashQueue.h"
+#include "BTL_Port.h"
+
+#define BTL_FLASH_QUEUE_MASK      (BTL_FLASH_QUEUE_DEPTH - 1U)
+#define BTL_FLASH_DATA_MASK       (BTL_FLASH_QUEUE_SIZE - 1U)
+
+/* The thread queues operations at BTL_FlashHead. The flash works on the one
+ * at BTL_FlashRun: the port starts it and reports its end from the flash
+ * interrupt with BTL_FlashQueueOpDone, which starts the next one. The thread
+ * then runs the completion callbacks up to BTL_FlashRun and frees the slots
+ * at BTL_FlashTail. The bytes of a run are copied into BTL_FlashData, the
+ * caller may reuse its buffer as soon as the run is queued.
+ *
+ * What runs alongside an operation differs between the target and the
+ * simulator. The STM32F401 flash has a single bank and the bootloader runs
+ * from it: while an operation is on, the core stalls at its next fetch from
+ * flash until the end of the operation, between two operations the thread
+ * runs. Only the UART DMA, which fills the receive ring in SRAM, goes on
+ * during an operation, so on target the next packet is received, not
+ * decoded, while the previous one is programmed. The simulator has no such
+ * stall and overlaps decoding too. */
+static BTL_FlashOpTypeDef BTL_FlashOp[BTL_FLASH_QUEUE_DEPTH];
+static uint8_t BTL_FlashData[BTL_FLASH_QUEUE_SIZE];
+static uint32_t BTL_FlashHead;
+static uint32_t BTL_FlashRun;
+static uint32_t BTL_FlashTail;
+static uint32_t BTL_FlashDataHead;
+static uint32_t BTL_FlashDataTail;
+static uint8_t BTL_FlashBusy;
+static uint8_t BTL_FlashPeak;
+
+/**
+ * @brief Find the bytes of a program run between its first and its last byte to program.
+ * @param flashOp Program run.
+ * @param first Filled with the offset of the first byte to program.
+ * @return uint16_t Bytes from there to the last byte to program, 0 when the run is all erased bytes.
+ */
+static uint16_t BTL_FlashQueueTrim(const BTL_FlashOpTypeDef* flashOp, uint16_t* first)
+{
+    uint16_t start = 0;
+    uint16_t end = flashOp->BTL_LENGTH;
+
+    while ((start < end) && (flashOp->BTL_DATA[start] == BTL_FLASH_ERASED_VALUE))
+    {
+        start++;
+    }
+    while ((end > start) && (flashOp->BTL_DATA[end - 1U] == BTL_FLASH_ERASED_VALUE))
+    {
+        end--;
+    }
+
+    *first = start;
+    return end - start;
+}
+
+/**
+ * @brief Start the next queued operation unless the flash is working on one.
+ */
+static void BTL_FlashQueueKick(void)
+{
+    uint8_t idle = 0;
+
+    if (!__atomic_compare_exchange_n(&BTL_FlashBusy, &idle, 1U, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        /* An operation is running, its end starts the next one */
+        return;
+    }
+
+    uint32_t run = __atomic_load_n(&BTL_FlashRun, __ATOMIC_RELAXED);
+
+    while (run != __atomic_load_n(&BTL_FlashHead, __ATOMIC_ACQUIRE))
+    {
+        BTL_FlashOpTypeDef* flashOp = &BTL_FlashOp[run & BTL_FLASH_QUEUE_MASK];
+        BTL_StatusTypeDef BTL_STATUS = BTL_OK;
+
+        if (flashOp->BTL_KIND == BTL_FLASH_OP_ERASE)
+        {
+            BTL_STATUS = BTL_PortFlashEraseStart((uint8_t) flashOp->BTL_ADDRESS);
+        }
+        else
+        {
+            uint16_t first = 0;
+            uint16_t length = BTL_FlashQueueTrim(flashOp, &first);
+
+            if (length == 0U)
+            {
+                /* Nothing to program, it ends here and its callback reads the erased bytes back */
+                flashOp->BTL_STATUS = BTL_OK;
+                run++;
+                __atomic_store_n(&BTL_FlashRun, run, __ATOMIC_RELEASE);
+                continue;
+            }
+
+            /* The port skips the erased bytes in between */
+            BTL_STATUS = BTL_PortFlashProgramStart(flashOp->BTL_ADDRESS + first, &flashOp->BTL_DATA[first], length);
+        }
+
+        if (BTL_STATUS == BTL_OK)
+        {
+            return;
+        }
+
+        /* The flash refused it (locked, bad address), it ends here */
+        flashOp->BTL_STATUS = BTL_ERROR;
+        run++;
+        __atomic_store_n(&BTL_FlashRun, run, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&BTL_FlashBusy, 0U, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Take a free slot with room for a run, waiting for the flash when the queue is full.
+ * @param length Bytes of the run, 0 for an erase.
+ * @return BTL_FlashOpTypeDef* Slot to fill, queued by BTL_FlashQueuePush.
+ */
+static BTL_FlashOpTypeDef* BTL_FlashQueueReserve(uint16_t length)
+{
+    while (1)
+    {
+        uint32_t dataStart = BTL_FlashDataHead;
+
+        /* A run is never split, it starts over at the beginning of the bytes when it does not fit at their end */
+        if ((dataStart & BTL_FLASH_DATA_MASK) + length > BTL_FLASH_QUEUE_SIZE)
+        {
+            dataStart += BTL_FLASH_QUEUE_SIZE - (dataStart & BTL_FLASH_DATA_MASK);
+        }
+
+        if ((BTL_FlashHead - BTL_FlashTail < BTL_FLASH_QUEUE_DEPTH) &&
+            (dataStart + length - BTL_FlashDataTail <= BTL_FLASH_QUEUE_SIZE))
+        {
+            BTL_FlashOpTypeDef* flashOp = &BTL_FlashOp[BTL_FlashHead & BTL_FLASH_QUEUE_MASK];
+
+            flashOp->BTL_DATA = &BTL_FlashData[dataStart & BTL_FLASH_DATA_MASK];
+            flashOp->BTL_LENGTH = length;
+            flashOp->BTL_DATA_END = dataStart + length;
+            return flashOp;
+        }
+
+        /* Full: free what the flash finished, sleep until its next interrupt otherwise */
+        uint32_t tail = BTL_FlashTail;
+
+        BTL_FlashQueuePoll();
+        if (BTL_FlashTail == tail)
+        {
+            BTL_PortIdle();
+        }
+    }
+}
+
+/**
+ * @brief Queue the slot taken by BTL_FlashQueueReserve and start it if the flash is idle.
+ * @param flashOp Filled slot.
+ */
+static void BTL_FlashQueuePush(BTL_FlashOpTypeDef* flashOp)
+{
+    BTL_FlashDataHead = flashOp->BTL_DATA_END;
+    __atomic_store_n(&BTL_FlashHead, BTL_FlashHead + 1U, __ATOMIC_RELEASE);
+
+    if (BTL_FlashHead - BTL_FlashTail > BTL_FlashPeak)
+    {
+        BTL_FlashPeak = (uint8_t) (BTL_FlashHead - BTL_FlashTail);
+    }
+
+    BTL_FlashQueueKick();
+}
+
+/**
+ * @brief Queue a run of bytes to program, the flash must be unlocked.
+ * @param address First flash address of the run.
+ * @param data Bytes of the run, copied into the queue.
+ * @param length Number of bytes, at most BTL_FLASH_QUEUE_SIZE.
+ * @param done Called with the result once the run is programmed, NULL for none.
+ * @return BTL_StatusTypeDef BTL_ERROR if the run does not fit in the queue.
+ */
+BTL_StatusTypeDef BTL_FlashQueueProgram(uint32_t address, const uint8_t* data, uint16_t length,
+                                        BTL_FlashDoneTypeDef done)
+{
+    if ((length == 0U) || (length > BTL_FLASH_QUEUE_SIZE))
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_FlashOpTypeDef* flashOp = BTL_FlashQueueReserve(length);
+
+    flashOp->BTL_KIND = BTL_FLASH_OP_PROGRAM;
+    flashOp->BTL_ADDRESS = address;
+    flashOp->BTL_DONE = done;
+    memcpy((uint8_t*) flashOp->BTL_DATA, data, length);
+    BTL_FlashQueuePush(flashOp);
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Queue the erase of one sector, the flash must be unlocked.
+ * @param sector Sector to erase.
+ * @param done Called with the result once the sector is erased, NULL for none.
+ * @return BTL_StatusTypeDef Status of the queuing.
+ */
+BTL_StatusTypeDef BTL_FlashQueueErase(uint8_t sector, BTL_FlashDoneTypeDef done)
+{
+    BTL_FlashOpTypeDef* flashOp = BTL_FlashQueueReserve(0);
+
+    flashOp->BTL_KIND = BTL_FLASH_OP_ERASE;
+    flashOp->BTL_ADDRESS = sector;
+    flashOp->BTL_DONE = done;
+    BTL_FlashQueuePush(flashOp);
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Run the completion callbacks of the finished operations, in queue order, and free their slots.
+ */
+void BTL_FlashQueuePoll(void)
+{
+    uint32_t run = __atomic_load_n(&BTL_FlashRun, __ATOMIC_ACQUIRE);
+
+    while (BTL_FlashTail != run)
+    {
+        BTL_FlashOpTypeDef* flashOp = &BTL_FlashOp[BTL_FlashTail & BTL_FLASH_QUEUE_MASK];
+
+        if (flashOp->BTL_DONE != NULL)
+        {
+            flashOp->BTL_DONE(flashOp->BTL_ADDRESS, flashOp->BTL_LENGTH, flashOp->BTL_STATUS);
+        }
+        BTL_FlashDataTail = flashOp->BTL_DATA_END;
+        BTL_FlashTail++;
+    }
+}
+
+/**
+ * @brief Wait until every queued operation is finished and its callback has run.
+ */
+void BTL_FlashQueueWait(void)
+{
+    BTL_FlashQueuePoll();
+
+    while (BTL_FlashTail != BTL_FlashHead)
+    {
+        BTL_PortIdle();
+        BTL_FlashQueuePoll();
+    }
+}
+
+/**
+ * @brief Get the number of operations queued and not reported yet.
+ * @return uint8_t Depth of the queue.
+ */
+uint8_t BTL_FlashQueueDepth(void)
+{
+    return (uint8_t) (BTL_FlashHead - BTL_FlashTail);
+}
+
+/**
+ * @brief Get the deepest the queue has been since the last restart of the peak.
+ * @return uint8_t Peak depth of the queue.
+ */
+uint8_t BTL_FlashQueuePeak(void)
+{
+    return BTL_FlashPeak;
+}
+
+/**
+ * @brief Measure the peak depth from the current one on.
+ */
+void BTL_FlashQueuePeakRestart(void)
+{
+    BTL_FlashPeak = BTL_FlashQueueDepth();
+}
+
+/**
+ * @brief End the running operation and start the next one, called by the port from the flash interrupt.
+ * @param BTL_STATUS Result of the operation.
+ */
+void BTL_FlashQueueOpDone(BTL_StatusTypeDef BTL_STATUS)
+{
+    uint32_t run = __atomic_load_n(&BTL_FlashRun, __ATOMIC_RELAXED);
+
+    BTL_FlashOp[run & BTL_FLASH_QUEUE_MASK].BTL_STATUS = BTL_STATUS;
+    __atomic_store_n(&BTL_FlashRun, run + 1U, __ATOMIC_RELEASE);
+    __atomic_store_n(&BTL_FlashBusy, 0U, __ATOMIC_RELEASE);
+
+    BTL_FlashQueueKick();
+}
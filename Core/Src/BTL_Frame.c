@@ -0,0 +1,228 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.9.0                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#include <string.h>
+#include "BTL_Frame.h"
+#include "BTL_Port.h"
+
+/* CRC-16/CCITT of a nibble, the CRC unit is kept for the image CRC of the
+ * session and cannot be loaded with a running value */
+static const uint16_t BTL_FrameCrcTable[16] =
+{
+    0x0000U, 0x1021U, 0x2042U, 0x3063U, 0x4084U, 0x50A5U, 0x60C6U, 0x70E7U,
+    0x8108U, 0x9129U, 0xA14AU, 0xB16BU, 0xC18CU, 0xD1ADU, 0xE1CEU, 0xF1EFU
+};
+
+/* BTL_FramePoll decodes the bytes of the receive ring into BTL_FrameBuffer
+ * as they come and checks the CRC at the delimiter. A good frame is then
+ * read with BTL_FrameRead up to BTL_FrameEnd, nothing more is decoded
+ * until it is all read or released. The bytes taken from the ring and not
+ * decoded yet wait in BTL_FrameRaw. */
+static uint8_t BTL_FrameBuffer[BTL_FRAME_SIZE];
+static uint16_t BTL_FrameLength;
+static uint16_t BTL_FrameIndex;
+static uint16_t BTL_FrameEnd;
+static uint16_t BTL_FrameCrc;
+static uint8_t BTL_FrameBlockLeft;
+static uint8_t BTL_FrameZero;
+static uint8_t BTL_FrameOverflow;
+static uint8_t BTL_FrameRaw[BTL_FRAME_CHUNK];
+static uint8_t BTL_FrameRawIndex;
+static uint8_t BTL_FrameRawLength;
+static BTL_FrameStatsTypeDef BTL_FrameStats;
+
+/**
+ * @brief Append one decoded byte to the frame.
+ * @param byte Decoded byte.
+ */
+static void BTL_FrameAppend(uint8_t byte)
+{
+    if (BTL_FrameLength >= BTL_FRAME_SIZE)
+    {
+        BTL_FrameOverflow = 1;
+        return;
+    }
+
+    BTL_FrameBuffer[BTL_FrameLength++] = byte;
+    BTL_FrameCrc = (uint16_t) ((BTL_FrameCrc << 4) ^ BTL_FrameCrcTable[(BTL_FrameCrc >> 12) ^ (byte >> 4)]);
+    BTL_FrameCrc = (uint16_t) ((BTL_FrameCrc << 4) ^ BTL_FrameCrcTable[(BTL_FrameCrc >> 12) ^ (byte & 0x0FU)]);
+}
+
+/**
+ * @brief Start decoding a new frame.
+ */
+static void BTL_FrameRestart(void)
+{
+    BTL_FrameLength = 0;
+    BTL_FrameCrc = 0xFFFFU;
+    BTL_FrameBlockLeft = 0;
+    BTL_FrameZero = 0;
+    BTL_FrameOverflow = 0;
+}
+
+/**
+ * @brief Close the frame at its delimiter.
+ * @return BTL_FrameStatusTypeDef Result of the frame.
+ */
+static BTL_FrameStatusTypeDef BTL_FrameClose(void)
+{
+    BTL_FrameStatusTypeDef frameStatus = BTL_FRAME_NONE;
+
+    if ((!BTL_FrameOverflow) && (BTL_FrameLength < BTL_FRAME_MIN))
+    {
+        BTL_FrameStats.BTL_NOISE_BYTES += BTL_FrameLength;
+    }
+    else if ((BTL_FrameOverflow) || (BTL_FrameBlockLeft != 0U))
+    {
+        /* Bytes were lost inside the frame, or it never ended */
+        frameStatus = BTL_FRAME_BAD;
+    }
+    else if (BTL_FrameCrc != 0U)
+    {
+        /* The CRC of the bytes followed by their CRC is 0 */
+        frameStatus = BTL_FRAME_BAD;
+    }
+    else
+    {
+        BTL_FrameIndex = 0;
+        BTL_FrameEnd = BTL_FrameLength - BTL_FRAME_CRC_SIZE;
+        frameStatus = BTL_FRAME_READY;
+    }
+
+    if (frameStatus == BTL_FRAME_BAD)
+    {
+        BTL_FrameStats.BTL_BAD_FRAMES++;
+    }
+    else if (frameStatus == BTL_FRAME_READY)
+    {
+        BTL_FrameStats.BTL_FRAMES++;
+    }
+
+    BTL_FrameRestart();
+    return frameStatus;
+}
+
+/**
+ * @brief Drop the frame being decoded, the one being read and the undecoded bytes, and clear the counters.
+ */
+void BTL_FrameReset(void)
+{
+    BTL_FrameRestart();
+    BTL_FrameIndex = 0;
+    BTL_FrameEnd = 0;
+    BTL_FrameRawIndex = 0;
+    BTL_FrameRawLength = 0;
+    memset(&BTL_FrameStats, 0, sizeof(BTL_FrameStats));
+}
+
+/**
+ * @brief Decode the bytes waiting in the receive ring up to the end of the next frame.
+ * @return BTL_FrameStatusTypeDef BTL_FRAME_READY while a frame is left to read.
+ */
+BTL_FrameStatusTypeDef BTL_FramePoll(void)
+{
+    if (BTL_FrameIndex < BTL_FrameEnd)
+    {
+        return BTL_FRAME_READY;
+    }
+
+    while (1)
+    {
+        if (BTL_FrameRawIndex == BTL_FrameRawLength)
+        {
+            uint16_t available = BTL_PortReceiveAvailable();
+
+            BTL_FrameRawIndex = 0;
+            BTL_FrameRawLength = 0;
+            if (available == 0U)
+            {
+                return BTL_FRAME_NONE;
+            }
+
+            available = (available < BTL_FRAME_CHUNK) ? available : BTL_FRAME_CHUNK;
+            if (BTL_PortReceive(BTL_FrameRaw, available, BTL_PORT_MAX_DELAY) != BTL_OK)
+            {
+                return BTL_FRAME_NONE;
+            }
+            BTL_FrameRawLength = (uint8_t) available;
+        }
+
+        uint8_t byte = BTL_FrameRaw[BTL_FrameRawIndex++];
+
+        if (byte == BTL_FRAME_DELIMITER)
+        {
+            BTL_FrameStatusTypeDef frameStatus = BTL_FrameClose();
+
+            if (frameStatus != BTL_FRAME_NONE)
+            {
+                return frameStatus;
+            }
+        }
+        else if (BTL_FrameBlockLeft == 0U)
+        {
+            /* Code byte: the block of byte - 1 bytes that follows ends with a
+             * 0x00, except a full block and the last block of the frame */
+            if (BTL_FrameZero)
+            {
+                BTL_FrameAppend(0x00U);
+            }
+            BTL_FrameBlockLeft = byte - 1U;
+            BTL_FrameZero = (byte != 0xFFU);
+        }
+        else
+        {
+            BTL_FrameAppend(byte);
+            BTL_FrameBlockLeft--;
+        }
+    }
+}
+
+/**
+ * @brief Read bytes of the ready frame, a read never goes past its end.
+ * @param data Buffer to store the bytes.
+ * @param length Number of bytes to read.
+ * @return BTL_StatusTypeDef BTL_ERROR if the frame holds fewer bytes, nothing is read then.
+ */
+BTL_StatusTypeDef BTL_FrameRead(uint8_t* data, uint16_t length)
+{
+    if (length > BTL_FrameLeft())
+    {
+        return BTL_ERROR;
+    }
+
+    memcpy(data, &BTL_FrameBuffer[BTL_FrameIndex], length);
+    BTL_FrameIndex += length;
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Get the number of bytes of the ready frame not read yet.
+ * @return uint16_t Bytes left, 0 when no frame is ready.
+ */
+uint16_t BTL_FrameLeft(void)
+{
+    return BTL_FrameEnd - BTL_FrameIndex;
+}
+
+/**
+ * @brief Drop the rest of the ready frame, the next one is decoded by BTL_FramePoll.
+ */
+void BTL_FrameRelease(void)
+{
+    BTL_FrameIndex = 0;
+    BTL_FrameEnd = 0;
+}
+
+/**
+ * @brief Get the counters of the framed link since the last BTL_FrameReset.
+ * @param frameStats Filled with the counters.
+ */
+void BTL_FrameGetStats(BTL_FrameStatsTypeDef* frameStats)
+{
+    *frameStats = BTL_FrameStats;
+}
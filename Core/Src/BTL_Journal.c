@@ -0,0 +1,260 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 2.1.0                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#include <string.h>
+#include "BTL_Journal.h"
+#include "BTL_FlashQueue.h"
+#include "BTL_Port.h"
+
+/* Bytes of an entry covered by its CRC */
+#define BTL_JOURNAL_CRC_OFFSET    (BTL_JOURNAL_ENTRY_SIZE - 4U)
+
+/* Next free entry. Entries are never rewritten, an entry left half
+ * programmed by a reset is skipped and stays unused */
+static uint8_t BTL_JournalNext = BTL_JOURNAL_ENTRIES;
+
+/**
+ * @brief CRC-32 of an entry, computed like the CRC unit does it.
+ *
+ * The CRC unit is not used: while a session runs it holds the image CRC.
+ *
+ * @param entry First byte of the entry.
+ * @return uint32_t CRC of the bytes before the CRC field.
+ */
+static uint32_t BTL_JournalCrc(const uint8_t* entry)
+{
+    uint32_t crc = 0xFFFFFFFFU;
+
+    for (uint8_t byteIndex = 0; byteIndex < BTL_JOURNAL_CRC_OFFSET; byteIndex += 4U)
+    {
+        crc ^= BTL_GetWord(&entry[byteIndex]);
+        for (uint8_t bit = 0; bit < 32U; bit++)
+        {
+            crc = (crc & 0x80000000U) ? ((crc << 1) ^ BTL_IMAGE_CRC_POLYNOMIAL) : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Queue an entry into the next free slot, the flash must be unlocked.
+ * @param entry Entry with its first BTL_JOURNAL_CRC_OFFSET bytes filled in, its CRC is added.
+ * @param lastSlot Last slot the entry may take.
+ * @return BTL_StatusTypeDef BTL_ERROR if the journal is full.
+ */
+static BTL_StatusTypeDef BTL_JournalWrite(uint8_t* entry, uint8_t lastSlot)
+{
+    if (BTL_JournalNext > lastSlot)
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_PutWord(&entry[BTL_JOURNAL_CRC_OFFSET], BTL_JournalCrc(entry));
+
+    /* Queued behind the runs of the checkpoint, it is only programmed once they are */
+    if (BTL_FlashQueueProgram(BTL_JOURNAL_BASE + BTL_JournalNext * BTL_JOURNAL_ENTRY_SIZE, entry,
+                              BTL_JOURNAL_ENTRY_SIZE, NULL) != BTL_OK)
+    {
+        return BTL_ERROR;
+    }
+    BTL_JournalNext++;
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Queue a checkpoint or done entry, the flash must be unlocked.
+ * @param kind BTL_JOURNAL_CHECKPOINT or BTL_JOURNAL_DONE.
+ * @param sessionId ID of the session.
+ * @param checkpoint Checkpoint of the entry.
+ * @param lastSlot Last slot the entry may take.
+ * @return BTL_StatusTypeDef BTL_ERROR if the journal is full.
+ */
+static BTL_StatusTypeDef BTL_JournalWriteCheckpoint(uint16_t kind, uint32_t sessionId,
+                                                    const BTL_CheckpointTypeDef* checkpoint, uint8_t lastSlot)
+{
+    uint8_t entry[BTL_JOURNAL_ENTRY_SIZE];
+
+    BTL_PutHalfWord(&entry[0], kind);
+    BTL_PutHalfWord(&entry[2], checkpoint->BTL_ADDRESS_HIGH);
+    BTL_PutWord(&entry[4], sessionId);
+    BTL_PutWord(&entry[8], checkpoint->BTL_RECORDS);
+    BTL_PutWord(&entry[12], checkpoint->BTL_OFFSET);
+    BTL_PutWord(&entry[16], checkpoint->BTL_IMAGE_CRC);
+    BTL_PutWord(&entry[20], checkpoint->BTL_IMAGE_BYTES);
+    memcpy(&entry[24], checkpoint->BTL_IMAGE_WORD, sizeof(checkpoint->BTL_IMAGE_WORD));
+
+    return BTL_JournalWrite(entry, lastSlot);
+}
+
+/**
+ * @brief Check an entry that is neither erased nor cut short by a reset.
+ * @param entry First byte of the entry.
+ * @return uint8_t 1 if the entry is programmed and passes its CRC.
+ */
+static uint8_t BTL_JournalValid(const uint8_t* entry)
+{
+    uint8_t erased = 1;
+
+    for (uint8_t byteIndex = 0; byteIndex < BTL_JOURNAL_ENTRY_SIZE; byteIndex++)
+    {
+        erased &= (entry[byteIndex] == 0xFFU);
+    }
+
+    return (!erased) && (BTL_GetWord(&entry[BTL_JOURNAL_CRC_OFFSET]) == BTL_JournalCrc(entry));
+}
+
+/**
+ * @brief Read the journal after a reset and find the next free entry.
+ * @param sessionId Filled with the session of the last entry.
+ * @param checkpoint Filled with the checkpoint of the last entry.
+ * @return BTL_JournalStateTypeDef BTL_JOURNAL_OPEN if a session is to be resumed.
+ */
+BTL_JournalStateTypeDef BTL_JournalInit(uint32_t* sessionId, BTL_CheckpointTypeDef* checkpoint)
+{
+    const uint8_t* journal = BTL_PortMemoryMap(BTL_JOURNAL_BASE, BTL_JOURNAL_SIZE);
+    BTL_JournalStateTypeDef journalState = BTL_JOURNAL_EMPTY;
+
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    *sessionId = 0;
+    BTL_JournalNext = BTL_JOURNAL_ENTRIES;
+    if (journal == NULL)
+    {
+        return BTL_JOURNAL_EMPTY;
+    }
+
+    BTL_JournalNext = 0;
+    for (uint8_t slot = 0; slot < BTL_JOURNAL_ENTRIES; slot++)
+    {
+        const uint8_t* entry = &journal[slot * BTL_JOURNAL_ENTRY_SIZE];
+        uint8_t erased = 1;
+
+        for (uint8_t byteIndex = 0; byteIndex < BTL_JOURNAL_ENTRY_SIZE; byteIndex++)
+        {
+            erased &= (entry[byteIndex] == 0xFFU);
+        }
+        if (erased)
+        {
+            continue;
+        }
+
+        BTL_JournalNext = slot + 1U;
+        if (BTL_GetWord(&entry[BTL_JOURNAL_CRC_OFFSET]) != BTL_JournalCrc(entry))
+        {
+            continue;
+        }
+
+        uint16_t kind = BTL_GetHalfWord(&entry[0]);
+
+        if (kind == BTL_JOURNAL_DONE)
+        {
+            journalState = BTL_JOURNAL_CLOSED;
+        }
+        else if (kind == BTL_JOURNAL_CHECKPOINT)
+        {
+            journalState = BTL_JOURNAL_OPEN;
+            *sessionId = BTL_GetWord(&entry[4]);
+            checkpoint->BTL_ADDRESS_HIGH = BTL_GetHalfWord(&entry[2]);
+            checkpoint->BTL_RECORDS = BTL_GetWord(&entry[8]);
+            checkpoint->BTL_OFFSET = BTL_GetWord(&entry[12]);
+            checkpoint->BTL_IMAGE_CRC = BTL_GetWord(&entry[16]);
+            checkpoint->BTL_IMAGE_BYTES = BTL_GetWord(&entry[20]);
+            memcpy(checkpoint->BTL_IMAGE_WORD, &entry[24], sizeof(checkpoint->BTL_IMAGE_WORD));
+        }
+    }
+
+    return journalState;
+}
+
+/**
+ * @brief Start appending at the first entry again, once the journal is queued for erasing.
+ */
+void BTL_JournalReset(void)
+{
+    BTL_JournalNext = 0;
+}
+
+/**
+ * @brief Append a checkpoint of a session, the flash must be unlocked.
+ * @param sessionId ID of the session.
+ * @param checkpoint Checkpoint, programmed and read back into the image CRC.
+ * @return BTL_StatusTypeDef BTL_ERROR if the journal is full, the last slot is kept for BTL_JournalClose.
+ */
+BTL_StatusTypeDef BTL_JournalAppend(uint32_t sessionId, const BTL_CheckpointTypeDef* checkpoint)
+{
+    return BTL_JournalWriteCheckpoint(BTL_JOURNAL_CHECKPOINT, sessionId, checkpoint, BTL_JOURNAL_ENTRIES - 2U);
+}
+
+/**
+ * @brief Append the end of a session, the flash must be unlocked.
+ * @param sessionId ID of the session.
+ * @return BTL_StatusTypeDef BTL_ERROR if the journal is full.
+ */
+BTL_StatusTypeDef BTL_JournalClose(uint32_t sessionId)
+{
+    const BTL_CheckpointTypeDef noCheckpoint = {0};
+
+    return BTL_JournalWriteCheckpoint(BTL_JOURNAL_DONE, sessionId, &noCheckpoint, BTL_JOURNAL_ENTRIES - 1U);
+}
+
+/**
+ * @brief Find the active link profile, the last valid link entry.
+ * @param profile Filled with the profile, zeroed when there is none.
+ */
+void BTL_JournalFindLink(BTL_LinkProfileTypeDef* profile)
+{
+    const uint8_t* journal = BTL_PortMemoryMap(BTL_JOURNAL_BASE, BTL_JOURNAL_SIZE);
+
+    memset(profile, 0, sizeof(*profile));
+    if (journal == NULL)
+    {
+        return;
+    }
+
+    for (uint8_t slot = 0; slot < BTL_JOURNAL_ENTRIES; slot++)
+    {
+        const uint8_t* entry = &journal[slot * BTL_JOURNAL_ENTRY_SIZE];
+
+        if ((BTL_JournalValid(entry)) && (BTL_GetHalfWord(&entry[0]) == BTL_JOURNAL_LINK))
+        {
+            profile->BTL_MAX_RECORD = entry[2];
+            profile->BTL_FLAGS = entry[3];
+            profile->BTL_BAUD_RATE = BTL_GetWord(&entry[4]);
+            profile->BTL_MAX_PACKET = BTL_GetHalfWord(&entry[8]);
+        }
+    }
+}
+
+/**
+ * @brief Get the number of entries left for checkpoints and link entries.
+ * @return uint8_t Free entries, the last slot kept for BTL_JournalClose not counted.
+ */
+uint8_t BTL_JournalFree(void)
+{
+    return (BTL_JournalNext < BTL_JOURNAL_ENTRIES - 1U) ? (BTL_JOURNAL_ENTRIES - 1U) - BTL_JournalNext : 0U;
+}
+
+/**
+ * @brief Append a link entry, the flash must be unlocked.
+ * @param profile Link profile to keep.
+ * @return BTL_StatusTypeDef BTL_ERROR if the journal is full, the last slot is kept for BTL_JournalClose.
+ */
+BTL_StatusTypeDef BTL_JournalAppendLink(const BTL_LinkProfileTypeDef* profile)
+{
+    uint8_t entry[BTL_JOURNAL_ENTRY_SIZE];
+
+    /* The padding is erased flash, it takes no program operation */
+    memset(entry, 0xFF, sizeof(entry));
+    BTL_PutHalfWord(&entry[0], BTL_JOURNAL_LINK);
+    entry[2] = profile->BTL_MAX_RECORD;
+    entry[3] = profile->BTL_FLAGS;
+    BTL_PutWord(&entry[4], profile->BTL_BAUD_RATE);
+    BTL_PutHalfWord(&entry[8], profile->BTL_MAX_PACKET);
+
+    return BTL_JournalWrite(entry, BTL_JOURNAL_ENTRIES - 2U);
+}
@@ -0,0 +1,714 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.1.1                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#include <string.h>
+#include "usart.h"
+#include "crc.h"
+#include "stm32f4xx_hal_flash.h"
+#include "BTL_Port.h"
+#include "BTL_Trace.h"
+#include "BTL_FlashQueue.h"
+
+extern uint32_t _sdata; /* Symbol defined in the linker script */
+extern uint32_t _ebss; /* Symbol defined in the linker script */
+extern uint32_t _end; /* Symbol defined in the linker script */
+extern uint32_t _estack; /* Symbol defined in the linker script */
+extern size_t _sbrk_heap_usage(void);
+
+/* Memory the host may read back with BTL_MEM_READ: base and size of flash, SRAM and the OTP area */
+static const uint32_t BTL_PortReadableRegion[][2] =
+{
+    { FLASH_BASE, FLASH_END - FLASH_BASE + 1U },
+    { SRAM1_BASE, 0x10000U },
+    { FLASH_OTP_BASE, FLASH_OTP_END - FLASH_OTP_BASE + 1U },
+};
+
+/* Receive ring of a UART, filled by its circular RX DMA */
+typedef struct
+{
+  UART_HandleTypeDef* BTL_UART;     /* UART feeding the ring */
+  uint8_t* BTL_RING;                /* BTL_PORT_RX_RING_SIZE bytes */
+  volatile uint16_t BTL_TAIL;       /* Next byte the core reads */
+} BTL_PortRingTypeDef;
+
+static uint8_t BTL_PortRxRing[BTL_PORT_RX_RING_SIZE];
+static uint8_t BTL_PortStripeRing[BTL_PORT_RX_RING_SIZE];
+
+/* Host link on USART1, second lane of a striped transfer on USART2 */
+static BTL_PortRingTypeDef BTL_PortLink = { &huart1, BTL_PortRxRing, 0 };
+static BTL_PortRingTypeDef BTL_PortStripe = { &huart2, BTL_PortStripeRing, 0 };
+
+/* Set while the second lane receives */
+static volatile uint8_t BTL_PortStripeOn = 0;
+
+/* Cleared while a DMA transfer on the host link is running */
+static volatile uint8_t BTL_PortTxComplete = 1;
+
+/* Error flags of a flash operation */
+#define BTL_PORT_FLASH_ERRORS     (FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | \
+                                   FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR)
+
+/* Run programmed by the flash interrupt, one unit per end of operation: a
+ * word x32 where it is word aligned, a byte x8 at its unaligned ends */
+static const uint8_t* volatile BTL_PortFlashData;
+static volatile uint32_t BTL_PortFlashAddress;
+static volatile uint16_t BTL_PortFlashLeft;
+
+/**
+ * @brief Transmit a buffer over the host link (USART1).
+ * @param data Buffer to transmit.
+ * @param length Number of bytes to transmit.
+ * @param timeout Timeout in milliseconds.
+ * @return BTL_StatusTypeDef Status of the transmission.
+ */
+BTL_StatusTypeDef BTL_PortTransmit(uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    if (HAL_UART_Transmit(&huart1, data, length, timeout) == HAL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Get the number of bytes waiting in a receive ring.
+ * @param ring Receive ring.
+ * @return uint16_t Bytes BTL_PortRingReceive returns without waiting.
+ */
+static uint16_t BTL_PortRingAvailable(BTL_PortRingTypeDef* ring)
+{
+    /* The DMA counts down the bytes left before it wraps around the ring */
+    uint16_t head = (uint16_t) (BTL_PORT_RX_RING_SIZE - __HAL_DMA_GET_COUNTER(ring->BTL_UART->hdmarx));
+
+    return (head - ring->BTL_TAIL) & (BTL_PORT_RX_RING_SIZE - 1U);
+}
+
+/**
+ * @brief Take bytes out of a receive ring, waiting for them to arrive.
+ * @param ring Receive ring.
+ * @param data Buffer to store the received bytes.
+ * @param length Number of bytes to receive.
+ * @param timeout Timeout in milliseconds.
+ * @return BTL_StatusTypeDef Status of the reception.
+ */
+static BTL_StatusTypeDef BTL_PortRingReceive(BTL_PortRingTypeDef* ring, uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    uint32_t startTick = HAL_GetTick();
+
+    while (BTL_PortRingAvailable(ring) < length)
+    {
+        if ((timeout != BTL_PORT_MAX_DELAY) && (HAL_GetTick() - startTick >= timeout))
+        {
+            return BTL_ERROR;
+        }
+    }
+
+    uint16_t tail = ring->BTL_TAIL;
+    for (uint16_t byteIndex = 0; byteIndex < length; byteIndex++)
+    {
+        data[byteIndex] = ring->BTL_RING[tail];
+        tail = (tail + 1U) & (BTL_PORT_RX_RING_SIZE - 1U);
+    }
+    ring->BTL_TAIL = tail;
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Start the circular DMA of a UART into its empty receive ring.
+ * @param ring Receive ring.
+ */
+static void BTL_PortRingStart(BTL_PortRingTypeDef* ring)
+{
+    HAL_UART_AbortReceive(ring->BTL_UART);
+    ring->BTL_TAIL = 0;
+    HAL_UART_Receive_DMA(ring->BTL_UART, ring->BTL_RING, BTL_PORT_RX_RING_SIZE);
+}
+
+/**
+ * @brief Receive a buffer from the host link (USART1) out of the receive ring.
+ * @param data Buffer to store the received bytes.
+ * @param length Number of bytes to receive.
+ * @param timeout Timeout in milliseconds.
+ * @return BTL_StatusTypeDef Status of the reception.
+ */
+BTL_StatusTypeDef BTL_PortReceive(uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    return BTL_PortRingReceive(&BTL_PortLink, data, length, timeout);
+}
+
+/**
+ * @brief Start the circular DMA of the host link into an empty receive ring.
+ */
+void BTL_PortReceiveStart(void)
+{
+    BTL_PortRingStart(&BTL_PortLink);
+}
+
+/**
+ * @brief Get the number of bytes waiting in the receive ring.
+ * @return uint16_t Bytes BTL_PortReceive returns without waiting.
+ */
+uint16_t BTL_PortReceiveAvailable(void)
+{
+    return BTL_PortRingAvailable(&BTL_PortLink);
+}
+
+/**
+ * @brief Set up the second lane of a striped transfer on the receive side of USART2.
+ *
+ * USART2 also sends the trace stream, which then runs at the lane baud rate.
+ *
+ * @param baudRate Baud rate of the lane, 0 stops the lane.
+ * @return BTL_StatusTypeDef Status of the reconfiguration.
+ */
+BTL_StatusTypeDef BTL_PortStripeStart(uint32_t baudRate)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    uint32_t startTick = HAL_GetTick();
+
+    /* Let the trace transfer on the wire end first */
+    while ((huart2.gState != HAL_UART_STATE_READY) && (HAL_GetTick() - startTick < BTL_PORT_TRACE_WAIT))
+    {
+    }
+
+    BTL_PortStripeOn = 0;
+    HAL_UART_AbortReceive(&huart2);
+    if (baudRate == 0U)
+    {
+        return BTL_OK;
+    }
+
+    huart2.Init.BaudRate = baudRate;
+    if (HAL_UART_Init(&huart2) == HAL_OK)
+    {
+        BTL_PortRingStart(&BTL_PortStripe);
+        BTL_PortStripeOn = 1;
+        BTL_STATUS = BTL_OK;
+    }
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Receive a buffer from the second lane (USART2) out of its receive ring.
+ * @param data Buffer to store the received bytes.
+ * @param length Number of bytes to receive.
+ * @param timeout Timeout in milliseconds.
+ * @return BTL_StatusTypeDef Status of the reception.
+ */
+BTL_StatusTypeDef BTL_PortStripeReceive(uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    return BTL_PortRingReceive(&BTL_PortStripe, data, length, timeout);
+}
+
+/**
+ * @brief Get the number of bytes waiting in the receive ring of the second lane.
+ * @return uint16_t Bytes BTL_PortStripeReceive returns without waiting.
+ */
+uint16_t BTL_PortStripeAvailable(void)
+{
+    return BTL_PortStripeOn ? BTL_PortRingAvailable(&BTL_PortStripe) : 0U;
+}
+
+/**
+ * @brief Sleep until the next interrupt, the SysTick wakes the core at least every millisecond.
+ */
+void BTL_PortIdle(void)
+{
+    __WFI();
+}
+
+/**
+ * @brief Unlock the flash control register.
+ */
+void BTL_PortFlashUnlock(void)
+{
+    HAL_FLASH_Unlock();
+}
+
+/**
+ * @brief Lock the flash control register.
+ */
+void BTL_PortFlashLock(void)
+{
+    HAL_FLASH_Lock();
+}
+
+/**
+ * @brief Program one byte of flash.
+ * @param address Flash address to program.
+ * @param data Byte to program.
+ * @return BTL_StatusTypeDef Status of the program operation.
+ */
+BTL_StatusTypeDef BTL_PortFlashProgram(uint32_t address, uint8_t data)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, address, data) == HAL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Check whether a unit of a run holds erased bytes only.
+ * @param data First byte of the unit.
+ * @param size Bytes of the unit.
+ * @return uint8_t 1 if programming the unit would change no bit.
+ */
+static uint8_t BTL_PortFlashErased(const uint8_t* data, uint8_t size)
+{
+    for (uint8_t byteIndex = 0; byteIndex < size; byteIndex++)
+    {
+        if (data[byteIndex] != BTL_FLASH_ERASED_VALUE)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Program the next unit of the run, the end of its operation raises the flash interrupt.
+ */
+static void BTL_PortFlashProgramNext(void)
+{
+    uint32_t address;
+    const uint8_t* data;
+    uint8_t size;
+
+    /* Units of erased bytes are stepped over, programming them changes no bit.
+     * The last byte of a run is never erased, a unit is always left to program */
+    do
+    {
+        address = BTL_PortFlashAddress;
+        data = BTL_PortFlashData;
+        size = (((address & 3U) == 0U) && (BTL_PortFlashLeft >= 4U)) ? 4U : 1U;
+        BTL_PortFlashAddress += size;
+        BTL_PortFlashData += size;
+        BTL_PortFlashLeft -= size;
+    } while (BTL_PortFlashErased(data, size));
+
+    /* x32 needs a 2.7 V to 3.6 V supply, the board runs at 3.3 V */
+    if (size == 4U)
+    {
+        uint32_t word;
+
+        memcpy(&word, data, sizeof(word));
+        MODIFY_REG(FLASH->CR, FLASH_CR_PSIZE, FLASH_PSIZE_WORD);
+        *(__IO uint32_t*) address = word;
+    }
+    else
+    {
+        MODIFY_REG(FLASH->CR, FLASH_CR_PSIZE, FLASH_PSIZE_BYTE);
+        *(__IO uint8_t*) address = *data;
+    }
+}
+
+/**
+ * @brief Prepare the flash for an operation driven by its interrupt.
+ * @return BTL_StatusTypeDef BTL_ERROR if the flash is locked or busy.
+ */
+static BTL_StatusTypeDef BTL_PortFlashPrepare(void)
+{
+    if ((READ_BIT(FLASH->CR, FLASH_CR_LOCK) != 0U) || (__HAL_FLASH_GET_FLAG(FLASH_FLAG_BSY) != RESET))
+    {
+        return BTL_ERROR;
+    }
+
+    __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | BTL_PORT_FLASH_ERRORS);
+
+    HAL_NVIC_SetPriority(FLASH_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+
+    /* The parallelism is set per operation */
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PSIZE | FLASH_CR_SNB);
+    __HAL_FLASH_ENABLE_IT(FLASH_IT_EOP | FLASH_IT_ERR);
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Start programming a run of bytes in the background, BTL_FlashQueueOpDone reports its end.
+ * @param address First flash address of the run.
+ * @param data Bytes of the run, left untouched until the end. The last byte is not BTL_FLASH_ERASED_VALUE.
+ * @param length Number of bytes.
+ * @return BTL_StatusTypeDef Status of the program start.
+ */
+BTL_StatusTypeDef BTL_PortFlashProgramStart(uint32_t address, const uint8_t* data, uint16_t length)
+{
+    if ((length == 0U) || (BTL_PortFlashPrepare() != BTL_OK))
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_PortFlashAddress = address;
+    BTL_PortFlashData = data;
+    BTL_PortFlashLeft = length;
+
+    SET_BIT(FLASH->CR, FLASH_CR_PG);
+    BTL_PortFlashProgramNext();
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Start erasing a flash sector in the background, BTL_FlashQueueOpDone reports its end.
+ * @param sector Sector to erase (FLASH_SECTOR_x).
+ * @return BTL_StatusTypeDef Status of the erase start.
+ */
+BTL_StatusTypeDef BTL_PortFlashEraseStart(uint8_t sector)
+{
+    if (BTL_PortFlashPrepare() != BTL_OK)
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_PortFlashLeft = 0;
+
+    /* x32 erases a 128K sector in 1 s instead of 2 s at x8 */
+    SET_BIT(FLASH->CR, FLASH_PSIZE_WORD | FLASH_CR_SER | ((uint32_t) sector << FLASH_CR_SNB_Pos));
+    SET_BIT(FLASH->CR, FLASH_CR_STRT);
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Flash interrupt: program the next unit of the run, or end the operation and start the next queued one.
+ */
+void BTL_PortFlashIRQHandler(void)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_OK;
+
+    if ((FLASH->SR & BTL_PORT_FLASH_ERRORS) != 0U)
+    {
+        __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | BTL_PORT_FLASH_ERRORS);
+        BTL_STATUS = BTL_ERROR;
+    }
+    else if (__HAL_FLASH_GET_FLAG(FLASH_FLAG_EOP) != RESET)
+    {
+        __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP);
+        if (BTL_PortFlashLeft != 0U)
+        {
+            BTL_PortFlashProgramNext();
+            return;
+        }
+    }
+    else
+    {
+        return;
+    }
+
+    /* An erase leaves stale lines in the data cache, flush it like HAL_FLASH_IRQHandler does */
+    if ((READ_BIT(FLASH->CR, FLASH_CR_SER) != 0U) && (READ_BIT(FLASH->ACR, FLASH_ACR_DCEN) != 0U))
+    {
+        __HAL_FLASH_DATA_CACHE_DISABLE();
+        __HAL_FLASH_DATA_CACHE_RESET();
+        __HAL_FLASH_DATA_CACHE_ENABLE();
+    }
+
+    __HAL_FLASH_DISABLE_IT(FLASH_IT_EOP | FLASH_IT_ERR);
+    CLEAR_BIT(FLASH->CR, FLASH_CR_PG | FLASH_CR_SER | FLASH_CR_SNB);
+
+    BTL_FlashQueueOpDone(BTL_STATUS);
+}
+
+/**
+ * @brief Check that a memory range can be read back and get a pointer to it.
+ * @param address First address of the range.
+ * @param length Number of bytes in the range.
+ * @return const uint8_t* The range, NULL if it is not inside one readable region.
+ */
+const uint8_t* BTL_PortMemoryMap(uint32_t address, uint32_t length)
+{
+    for (uint32_t region = 0; region < sizeof(BTL_PortReadableRegion) / sizeof(BTL_PortReadableRegion[0]); region++)
+    {
+        uint32_t regionBase = BTL_PortReadableRegion[region][0];
+        uint32_t regionSize = BTL_PortReadableRegion[region][1];
+
+        if ((address >= regionBase) && (length <= regionSize) && (address - regionBase <= regionSize - length))
+        {
+            return (const uint8_t*) address;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start sending a buffer over the host link (USART1) with DMA.
+ * @param data First byte to send, it must stay valid until BTL_PortTransmitWait returns.
+ * @param length Number of bytes to send.
+ * @return BTL_StatusTypeDef Status of the transfer start.
+ */
+BTL_StatusTypeDef BTL_PortTransmitDMA(const uint8_t* data, uint16_t length)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    BTL_PortTxComplete = 0;
+    if (HAL_UART_Transmit_DMA(&huart1, data, length) == HAL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+    else
+    {
+        BTL_PortTxComplete = 1;
+    }
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Wait for the end of the DMA transfer started by BTL_PortTransmitDMA.
+ * @param timeout Timeout in milliseconds, the transfer is aborted when it expires.
+ * @return BTL_StatusTypeDef Status of the transfer.
+ */
+BTL_StatusTypeDef BTL_PortTransmitWait(uint32_t timeout)
+{
+    uint32_t startTick = HAL_GetTick();
+
+    while (!BTL_PortTxComplete)
+    {
+        if (HAL_GetTick() - startTick >= timeout)
+        {
+            HAL_UART_AbortTransmit(&huart1);
+            BTL_PortTxComplete = 1;
+            return BTL_ERROR;
+        }
+    }
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Compute the CRC-32 of a buffer with the CRC unit.
+ * @param data Buffer, word aligned.
+ * @param length Number of bytes, a multiple of 4.
+ * @return uint32_t CRC of the buffer, starting from the reset value of the unit.
+ */
+uint32_t BTL_PortCrc(const uint8_t* data, uint32_t length)
+{
+    return HAL_CRC_Calculate(&hcrc, (uint32_t*) data, length / 4U);
+}
+
+/**
+ * @brief Reset the CRC unit for a running CRC, BTL_PortCrc restarts it too.
+ */
+void BTL_PortCrcStart(void)
+{
+    __HAL_CRC_DR_RESET(&hcrc);
+}
+
+/**
+ * @brief Feed one word to the running CRC of the CRC unit.
+ * @param word Word to feed.
+ * @return uint32_t CRC of all the words fed since BTL_PortCrcStart.
+ */
+uint32_t BTL_PortCrcAccumulate(uint32_t word)
+{
+    return HAL_CRC_Accumulate(&hcrc, &word, 1U);
+}
+
+/**
+ * @brief Get the baud rate of the host link (USART1).
+ * @return uint32_t Baud rate.
+ */
+uint32_t BTL_PortGetBaudRate(void)
+{
+    return huart1.Init.BaudRate;
+}
+
+/**
+ * @brief Change the baud rate of the host link (USART1), the receive ring is emptied.
+ * @param baudRate New baud rate, the other settings are kept.
+ * @return BTL_StatusTypeDef Status of the reconfiguration.
+ */
+BTL_StatusTypeDef BTL_PortSetBaudRate(uint32_t baudRate)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    /* HAL_UART_Init leaves the reception stopped, the bytes in the ring came at the old baud rate */
+    HAL_UART_AbortReceive(&huart1);
+    huart1.Init.BaudRate = baudRate;
+    if (HAL_UART_Init(&huart1) == HAL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+    BTL_PortReceiveStart();
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Get the device and revision identifiers.
+ * @return uint32_t DBGMCU IDCODE: device ID in bits 0-11, revision ID in bits 16-31.
+ */
+uint32_t BTL_PortGetDeviceId(void)
+{
+    return DBGMCU->IDCODE;
+}
+
+/**
+ * @brief Get the 96 bits unique device ID.
+ * @param uniqueId Buffer of BTL_UID_SIZE bytes, filled with the three ID words, little endian.
+ */
+void BTL_PortGetUniqueId(uint8_t* uniqueId)
+{
+    uint32_t uniqueIdWords[3] = { HAL_GetUIDw0(), HAL_GetUIDw1(), HAL_GetUIDw2() };
+
+    memcpy(uniqueId, uniqueIdWords, BTL_UID_SIZE);
+}
+
+/**
+ * @brief Get the millisecond tick counter.
+ * @return uint32_t Current tick value.
+ */
+uint32_t BTL_PortGetTick(void)
+{
+    return HAL_GetTick();
+}
+
+/**
+ * @brief Get the lowest address the stack may use, right above the heap.
+ * @return uint32_t* First word of the free RAM between the heap and the stack.
+ */
+static uint32_t* BTL_PortStackLimit(void)
+{
+    return (uint32_t*) (((uint32_t) &_end + _sbrk_heap_usage() + 3U) & ~3U);
+}
+
+/**
+ * @brief Paint the free RAM below the current stack pointer.
+ */
+static void BTL_PortStackPaint(void)
+{
+    volatile uint32_t* stackWord = BTL_PortStackLimit();
+    uint32_t* stackPointer = (uint32_t*) (__get_MSP() - BTL_STACK_PAINT_MARGIN);
+
+    /* No memset, its own frame would sit in the painted area */
+    while (stackWord < stackPointer)
+    {
+        *stackWord++ = BTL_STACK_PAINT_VALUE;
+    }
+}
+
+/**
+ * @brief Paint the stack, called once right after reset.
+ */
+void BTL_PortMemoryInit(void)
+{
+    BTL_PortStackPaint();
+}
+
+/**
+ * @brief Paint the stack again, the next peak is measured from here.
+ */
+void BTL_PortMemoryRestart(void)
+{
+    BTL_PortStackPaint();
+}
+
+/**
+ * @brief Report the RAM usage since the stack was last painted.
+ * @param memoryUsage Structure to fill.
+ */
+void BTL_PortGetMemoryUsage(BTL_MemoryUsageTypeDef* memoryUsage)
+{
+    uint32_t* stackWord = BTL_PortStackLimit();
+
+    /* The first word that lost its paint is the deepest point the stack reached */
+    while ((stackWord < &_estack) && (*stackWord == BTL_STACK_PAINT_VALUE))
+    {
+        stackWord++;
+    }
+
+    memoryUsage->BTL_STACK_PEAK = (uint32_t) &_estack - (uint32_t) stackWord;
+    memoryUsage->BTL_STACK_AVAILABLE = (uint32_t) &_estack - (uint32_t) BTL_PortStackLimit();
+    memoryUsage->BTL_HEAP_PEAK = _sbrk_heap_usage();
+    memoryUsage->BTL_STATIC_SIZE = (uint32_t) &_ebss - (uint32_t) &_sdata;
+}
+
+/**
+ * @brief Start the DWT cycle counter used to timestamp trace events.
+ * @return uint32_t Clock of the counter in Hz.
+ */
+uint32_t BTL_PortTraceInit(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    return SystemCoreClock;
+}
+
+/**
+ * @brief Get the timestamp of a trace event.
+ * @return uint32_t Current value of the DWT cycle counter.
+ */
+uint32_t BTL_PortTraceTimestamp(void)
+{
+    return DWT->CYCCNT;
+}
+
+/**
+ * @brief Start sending trace events over USART2 with DMA.
+ * @param data First byte to send, it must stay valid until the transfer ends.
+ * @param length Number of bytes to send.
+ * @return BTL_StatusTypeDef Status of the transfer start.
+ */
+BTL_StatusTypeDef BTL_PortTraceTransmit(uint8_t* data, uint16_t length)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    if (HAL_UART_Transmit_DMA(&huart2, data, length) == HAL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief UART transfer complete callback, releases the sent trace events
+ *        or ends a BTL_PortTransmitDMA transfer.
+ * @param huart UART handle of the finished transfer.
+ */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef* huart)
+{
+    if (huart->Instance == USART2)
+    {
+        BTL_TraceTransmitComplete();
+    }
+    else if (huart->Instance == USART1)
+    {
+        BTL_PortTxComplete = 1;
+    }
+}
+
+/**
+ * @brief UART error callback, an overrun or framing error on the host link
+ *        or the second lane stops the receive DMA, restart it.
+ * @param huart UART handle of the failed transfer.
+ */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef* huart)
+{
+    if (huart->Instance == USART1)
+    {
+        BTL_PortRingStart(&BTL_PortLink);
+    }
+    else if ((huart->Instance == USART2) && (BTL_PortStripeOn))
+    {
+        BTL_PortRingStart(&BTL_PortStripe);
+    }
+}
@@ -5,232 +5,2125 @@
 /*              Date: 27 Jan - 2024                  */
 /*****************************************************/
 
-#include "usart.h"
-#include "stm32f4xx_hal_flash.h"
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include "BTL_Private.h"
 #include "BTL_Config.h"
 #include "BTL_Interface.h"
-#include "crc.h"
-
+#include "BTL_Port.h"
+#include "BTL_Trace.h"
+#include "BTL_FlashQueue.h"
+#include "BTL_Frame.h"
+#include "BTL_Journal.h"
+
+static BTL_StatusTypeDef BTL_Receive(uint8_t* data, uint16_t length, uint32_t timeout);
+static BTL_StatusTypeDef BTL_ReceiveRequest(uint8_t* messageBuffer, uint16_t dataLength, uint16_t requestLength);
+static void BTL_DropRequest(uint8_t* messageBuffer, uint16_t dataLength);
 static BTL_StatusTypeDef BTL_SendAck(BTL_CMDTypeDef cmdID);
 static BTL_StatusTypeDef BTL_SendNAck();
+static BTL_StatusTypeDef BTL_SendReply(uint8_t* reply, uint16_t length);
+static BTL_StatusTypeDef BTL_TransmitReply(uint8_t* reply, uint16_t length);
+static BTL_StatusTypeDef BTL_Dispatch(const BTL_CommandTypeDef* command, uint8_t* messageBuffer, uint16_t dataLength);
+static BTL_StatusTypeDef BTL_BatchCount(uint16_t length, uint8_t* count);
+static void BTL_BatchWait(void);
 static uint8_t BTL_ASCHIIToHex(uint8_t ASCHIIValue);
 static BTL_StatusTypeDef BTL_HexFlasher(uint8_t* dataBuffer, BTL_RecordTypeDef* currentRecord);
 static BTL_StatusTypeDef BTL_FlashWrite(uint8_t* dataBuffer, uint16_t dataLength, BTL_RecordTypeDef* currentRecord);
 static BTL_StatusTypeDef BTL_CheckRecord(uint8_t* dataBuffer, BTL_RecordTypeDef* currentRecord);
 static uint8_t CalculateChecksum(const uint8_t *data, size_t length);
+static void BTL_LinkKeep(void);
+static void BTL_ImageCrcFeed(const uint8_t* data, uint16_t length);
+static BTL_StatusTypeDef BTL_SendImageAck(const uint8_t* dataBuffer, uint16_t dataLength, uint16_t recordsEnd);
+static uint8_t BTL_JobsActive(void);
+static void BTL_LinkStep(void);
+static BTL_StatusTypeDef BTL_EraseStart(uint8_t firstSector, uint8_t nbSectors, uint8_t report);
+static void BTL_EraseStep(void);
+static void BTL_EraseDone(uint32_t sector, uint16_t length, BTL_StatusTypeDef BTL_STATUS);
+static void BTL_ProgramDone(uint32_t address, uint16_t length, BTL_StatusTypeDef BTL_STATUS);
+static void BTL_SessionStep(uint8_t* messageBuffer);
+static BTL_StatusTypeDef BTL_SessionPacket(uint8_t* messageBuffer, uint16_t dataLength);
+static void BTL_SessionEnd(void);
+static void BTL_SessionSuspend(void);
+static void BTL_SessionStop(void);
+static BTL_StatusTypeDef BTL_SessionCheckpoint(void);
+static void BTL_SessionMark(void);
+static void BTL_SessionMarkReached(void);
+static void BTL_SessionLatch(const BTL_PacketMarkTypeDef* mark);
+static void BTL_SessionRollback(void);
+static void BTL_SessionJournal(uint8_t suspending);
+static uint32_t BTL_ImageCrcFixup(uint32_t crc);
+static BTL_StatusTypeDef BTL_SessionReceive(uint8_t* data, uint16_t length);
+static void BTL_StripeReset(void);
+static uint8_t BTL_StripePending(void);
+static BTL_StatusTypeDef BTL_StripeReceive(uint8_t* data, uint16_t length, uint32_t timeout);
+static uint8_t BTL_FrameReceived(void);
+static BTL_StatusTypeDef BTL_FrameWait(uint32_t timeout);
+
+/* Command table of the dispatcher, indexed by BTL_CMDTypeDef */
+static const BTL_CommandTypeDef BTL_Command[BTL_NB_COMMANDS] =
+{
+    [BTL_GET_VERSION]   = { BTL_GetVersion,     BTL_CMD_BATCH },
+    [BTL_GET_HELP]      = { BTL_GetHelp,        BTL_CMD_BATCH },
+    [BTL_GET_ID]        = { BTL_GetId,          BTL_CMD_BATCH },
+    [BTL_APP_FLASH]     = { BTL_UpdateFirmware, BTL_CMD_BATCH }, /* Carries its own session, refuses a new one while busy */
+    [BTL_FLASH_ERASE]   = { BTL_FlashErase,     BTL_CMD_EXCLUSIVE | BTL_CMD_BATCH },
+    [BTL_MEM_READ]      = { BTL_MemRead,        BTL_CMD_EXCLUSIVE }, /* Streams raw chunks, not replies */
+    [BTL_OTP_READ]      = { BTL_OtpRead,        BTL_CMD_BATCH },
+    [BTL_GET_MEM_USAGE] = { BTL_GetMemoryUsage, BTL_CMD_BATCH },
+    [BTL_SET_LINK]      = { BTL_SetLink,        BTL_CMD_EXCLUSIVE },
+    [BTL_STRIPE]        = { BTL_SetStripe,      BTL_CMD_EXCLUSIVE },
+    [BTL_FRAMING]       = { BTL_SetFraming,     BTL_CMD_EXCLUSIVE },
+    [BTL_RESUME]        = { BTL_ResumeSession,  BTL_CMD_BATCH }, /* Suspends a session waiting for its next packet */
+    [BTL_BATCH]         = { BTL_RunBatch,       0 },
+};
+
+/* Sector sizes of the STM32F401CC, reported by BTL_GET_HELP */
+static const uint32_t BTL_SectorSize[BTL_NB_SECTORS] =
+{
+    0x4000U, 0x4000U, 0x4000U, 0x4000U, 0x10000U, 0x20000U
+};
+
+/* Set by a BTL_FLASH_ERASE of the whole application area, the next
+ * BTL_APP_FLASH session then starts without erasing */
+static uint8_t BTL_AppErased = 0;
+
+/* Baud rates accepted by BTL_SET_LINK, USART1 divides its 16 MHz clock to
+ * all of them within 1 % */
+static const uint32_t BTL_BaudRate[BTL_NB_BAUD_RATES] =
+{
+    9600U, 19200U, 57600U, 115200U, 230400U, 460800U
+};
+
+/* Baud rate of the link after reset, the fallback of a stored profile */
+static uint32_t BTL_LinkDefaultBaud = 0;
+
+/* Active link profile of the update journal, zeroed when there is none */
+static BTL_LinkProfileTypeDef BTL_LinkProfile;
+
+/* Set while the link runs a stored profile the host has not answered yet,
+ * and the tick the probe window started at */
+static uint8_t BTL_LinkProbing = 0;
+static uint32_t BTL_LinkProbeStart = 0;
+
+/* Background erase and BTL_APP_FLASH session, stepped by BTL_RunJobs */
+static BTL_EraseJobTypeDef BTL_EraseJob;
+static BTL_SessionTypeDef BTL_Session;
+
+/* Second lane and reassembly of the striped session stream */
+static BTL_StripeTypeDef BTL_Stripe;
+
+/* Framing of the requests, BTL_FRAMING_OFF or BTL_FRAMING_COBS */
+static uint8_t BTL_Framing = BTL_FRAMING_OFF;
+
+/* Running CRC of the BTL_APP_FLASH session over the programmed bytes read
+ * back from the flash, the bytes fed so far and the unfinished word */
+static uint32_t BTL_ImageCrc;
+static uint32_t BTL_ImageBytes;
+static uint8_t BTL_ImageCrcWord[4];
+
+/* Image bytes of the last checkpoint appended to the update journal */
+static uint32_t BTL_JournalBytes;
+
+/* RAM usage and flash queue peak of the last session, latched when it ended */
+static BTL_MemoryUsageTypeDef BTL_SessionMemory;
+static uint8_t BTL_SessionFlashPeak;
+static uint8_t BTL_SessionMemoryLatched = 0;
+
+/* BTL_BATCH being run: its request, and the reply its sub-commands fill */
+static BTL_BatchTypeDef BTL_Batch;
+static uint8_t BTL_BatchRequest[BTL_BATCH_SIZE];
+static uint8_t BTL_BatchReply[BTL_REPLY_SIZE];
+
+
+/**
+ * @brief Send a formatted message over UART.
+ * @param messageFormat Format string for the message.
+ * @param ... Variable number of arguments for the formatted message.
+ * @return BTL_StatusTypeDef Status of the message transmission.
+ */
+BTL_StatusTypeDef BTL_SendMessage(char* messageFormat, ...)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    char message[BTL_REPLY_SIZE] = {0};
+    /* Initialize va_list to handle the message */
+    va_list args;
+    va_start(args, messageFormat);
+
+    /* Use vsnprintf to format the message */
+    int messageLength = vsnprintf(message, sizeof(message), messageFormat, args);
+
+    if (messageLength < 0)
+    {
+        messageLength = 0;
+    }
+    else if (messageLength >= (int) sizeof(message))
+    {
+        messageLength = sizeof(message) - 1;
+    }
+
+    /* Transmit the formatted data to the Host */
+    if (BTL_TransmitReply((uint8_t*) message, (uint16_t) messageLength) == BTL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+
+    va_end(args);
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Receive a message from UART.
+ * @param messageBuffer Buffer to store the received message.
+ * @return BTL_CMDTypeDef Type of command received.
+ */
+BTL_CMDTypeDef BTL_GetMessage(uint8_t* messageBuffer)
+{
+    BTL_CMDTypeDef BTL_CMD = BTL_ERROR_CMD;
+
+    /* Get the size of the data & command type */
+    if (BTL_Receive((uint8_t*) &messageBuffer[0], BTL_HEADER_SIZE, BTL_REQUEST_TIMEOUT) == BTL_OK)
+    {
+        BTL_CMD = messageBuffer[BTL_CMD_TYPE];
+    }
+
+    return BTL_CMD;
+}
+
+/**
+ * @brief Check whether a command header is waiting in the receive ring.
+ * @return uint8_t 1 if BTL_ProcessMessage can run without waiting for the header.
+ */
+uint8_t BTL_MessagePending(void)
+{
+    /* The first packet of a session has no header, the session job takes it,
+     * and it takes all of a striped session that is not suspended */
+    if ((BTL_Session.BTL_STATE == BTL_SESSION_ERASE) || (BTL_Session.BTL_STATE == BTL_SESSION_FIRST_PACKET) ||
+        ((BTL_Session.BTL_STATE == BTL_SESSION_NEXT_PACKET) && (BTL_Stripe.BTL_BAUD_RATE != 0U)))
+    {
+        return 0;
+    }
+
+    if (BTL_Framing != BTL_FRAMING_OFF)
+    {
+        return BTL_FrameReceived();
+    }
+
+    return BTL_PortReceiveAvailable() >= BTL_HEADER_SIZE;
+}
+
+/**
+ * @brief Receive one command from the host and run the handler of its command table entry.
+ * @param messageBuffer Buffer of DATA_BUFFER_SIZE bytes used for the whole command.
+ * @return BTL_StatusTypeDef Status of the command.
+ */
+BTL_StatusTypeDef BTL_ProcessMessage(uint8_t* messageBuffer)
+{
+    BTL_CMDTypeDef BTL_CMD = BTL_GetMessage(messageBuffer);
+
+    /* Same packing of the data length as BTL_BUFFER_NEXT_SIZE0/1 */
+    uint16_t dataLength = (messageBuffer[BTL_DATA_SIZE0] << 4) | messageBuffer[BTL_DATA_SIZE1];
+
+    const BTL_CommandTypeDef* command = (BTL_CMD < BTL_NB_COMMANDS) ? &BTL_Command[BTL_CMD] : NULL;
+
+    /* After a reset into a stored profile the first command tells whether
+     * the host talks at its baud rate */
+    if (BTL_LinkProbing)
+    {
+        BTL_LinkProbing = 0;
+        /* Line noise at the wrong baud rate may hit a command, rarely a
+         * whole header: a low length nibble and a length the buffer takes too */
+        if ((command == NULL) || (command->BTL_HANDLER == NULL) || (messageBuffer[BTL_DATA_SIZE1] > 0x0FU) ||
+            (dataLength > BTL_MAX_PACKET_SIZE))
+        {
+            /* The host did not answer in the stored profile, it talks at the default baud rate */
+            BTL_PortSetBaudRate(BTL_LinkDefaultBaud);
+            BTL_FrameRelease();
+            return BTL_ERROR;
+        }
+    }
+
+    BTL_StatusTypeDef BTL_STATUS = BTL_Dispatch(command, messageBuffer, dataLength);
+
+    /* What the request left of its frame is dropped, the next request starts a frame */
+    BTL_FrameRelease();
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Run the handler of a command table entry, unless the command is unknown or busy.
+ * @param command Command table entry, NULL for an unknown command.
+ * @param messageBuffer Buffer holding the command header.
+ * @param dataLength Length of the request.
+ * @return BTL_StatusTypeDef Status of the command, BTL_ERROR when it is refused.
+ */
+static BTL_StatusTypeDef BTL_Dispatch(const BTL_CommandTypeDef* command, uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    if ((command == NULL) || (command->BTL_HANDLER == NULL))
+    {
+        BTL_SendNAck();
+    }
+    else if ((command->BTL_FLAGS & BTL_CMD_EXCLUSIVE) && BTL_JobsActive())
+    {
+        /* Busy: the flash or the link is in use by a background job, the request is dropped */
+        BTL_DropRequest(messageBuffer, dataLength);
+        BTL_SendNAck();
+    }
+    else
+    {
+        BTL_STATUS = command->BTL_HANDLER(messageBuffer, dataLength);
+    }
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Run one step of every background job.
+ * @param messageBuffer Buffer of DATA_BUFFER_SIZE bytes, the session job receives its first packet in it.
+ * @return uint8_t 1 while an erase or a BTL_APP_FLASH session is running.
+ */
+uint8_t BTL_RunJobs(uint8_t* messageBuffer)
+{
+    /* Completion callbacks of the flash operations run first, the jobs see their results */
+    BTL_FlashQueuePoll();
+    BTL_LinkStep();
+    BTL_EraseStep();
+    BTL_SessionStep(messageBuffer);
+
+    /* Restarts the trace stream if a transfer could not be started */
+    BTL_TraceDrain();
+
+    return BTL_JobsActive();
+}
+
+/**
+ * @brief One pass of the main loop: step the jobs, then run the pending
+ *        command or sleep until the next interrupt.
+ * @param messageBuffer Buffer of DATA_BUFFER_SIZE bytes used for the commands.
+ */
+void BTL_Poll(uint8_t* messageBuffer)
+{
+    BTL_RunJobs(messageBuffer);
+
+    if (BTL_MessagePending())
+    {
+        BTL_ProcessMessage(messageBuffer);
+    }
+    else
+    {
+        BTL_PortIdle();
+    }
+}
+
+/**
+ * @brief Check whether a background job uses the flash.
+ * @return uint8_t 1 while an erase or a BTL_APP_FLASH session is running.
+ */
+static uint8_t BTL_JobsActive(void)
+{
+    /* A suspended session keeps the flash locked until it is resumed */
+    return (BTL_EraseJob.BTL_SECTOR_COUNT != 0U) ||
+           ((BTL_Session.BTL_STATE != BTL_SESSION_IDLE) && (BTL_Session.BTL_STATE != BTL_SESSION_SUSPENDED)) ||
+           (BTL_FlashQueueDepth() != 0U);
+}
+
+/**
+ * @brief Receive data from the host.
+ * @param data Buffer to store the received data.
+ * @param length Number of bytes to receive.
+ * @param timeout Timeout in milliseconds.
+ * @return BTL_StatusTypeDef Status of the reception.
+ */
+static BTL_StatusTypeDef BTL_Receive(uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    BTL_TRACE(BTL_TRACE_RX_BEGIN, length, 0);
+    if (BTL_Batch.BTL_RUNNING)
+    {
+        /* A sub-command reads its data from the batch, never past it */
+        if (length <= BTL_Batch.BTL_END - BTL_Batch.BTL_READ)
+        {
+            memcpy(data, &BTL_BatchRequest[BTL_Batch.BTL_READ], length);
+            BTL_Batch.BTL_READ += length;
+            BTL_STATUS = BTL_OK;
+        }
+    }
+    else if (BTL_Framing == BTL_FRAMING_OFF)
+    {
+        BTL_STATUS = BTL_PortReceive(data, length, timeout);
+    }
+    else if ((length == 0U) || (BTL_FrameLeft() != 0U) || (BTL_FrameWait(timeout) == BTL_OK))
+    {
+        /* A read is served by the frame it starts in, the next frame only
+         * begins once this one is all read */
+        BTL_STATUS = BTL_FrameRead(data, length);
+    }
+    BTL_TRACE(BTL_TRACE_RX_END, BTL_STATUS, 0);
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Receive a request of a fixed length after its header.
+ * @param messageBuffer Buffer holding the command header, the request is stored after it.
+ * @param dataLength Length of the request given by the header.
+ * @param requestLength Length the command takes.
+ * @return BTL_StatusTypeDef BTL_ERROR if the lengths differ, the request is dropped then, or on a timeout.
+ */
+static BTL_StatusTypeDef BTL_ReceiveRequest(uint8_t* messageBuffer, uint16_t dataLength, uint16_t requestLength)
+{
+    if (dataLength != requestLength)
+    {
+        BTL_DropRequest(messageBuffer, dataLength);
+        return BTL_ERROR;
+    }
+
+    return BTL_Receive(&messageBuffer[BTL_DONE_FLAG], requestLength, BTL_REQUEST_TIMEOUT);
+}
+
+/**
+ * @brief Read and drop the data of a refused request, the host has sent it already.
+ *
+ * Left in the receive ring, it would be taken for the headers of the next requests.
+ *
+ * @param messageBuffer Buffer holding the command header, the data is read after it.
+ * @param dataLength Length of the request given by the header.
+ */
+static void BTL_DropRequest(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    /* The rest of a frame is dropped with it, a batch moves on to its next sub-command by itself */
+    if ((BTL_Framing != BTL_FRAMING_OFF) || (BTL_Batch.BTL_RUNNING))
+    {
+        return;
+    }
+
+    while (dataLength != 0U)
+    {
+        uint16_t chunkLength = (dataLength < BTL_MAX_PACKET_SIZE) ? dataLength : BTL_MAX_PACKET_SIZE;
+
+        if (BTL_Receive(&messageBuffer[BTL_DONE_FLAG], chunkLength, BTL_REQUEST_TIMEOUT) != BTL_OK)
+        {
+            break;
+        }
+        dataLength -= chunkLength;
+    }
+}
+
+/**
+ * @brief Check whether a frame of the framed link is ready, answering the bad ones on the way.
+ * @return uint8_t 1 if a good frame is ready to read.
+ */
+static uint8_t BTL_FrameReceived(void)
+{
+    BTL_FrameStatusTypeDef frameStatus = BTL_FramePoll();
+
+    while (frameStatus == BTL_FRAME_BAD)
+    {
+        /* The host resends the frame it sent last */
+        BTL_SendMessage("%cframe=bad\r\n", 0);
+        frameStatus = BTL_FramePoll();
+    }
+
+    return frameStatus == BTL_FRAME_READY;
+}
+
+/**
+ * @brief Wait for the next frame of the framed link.
+ * @param timeout Timeout in milliseconds.
+ * @return BTL_StatusTypeDef BTL_ERROR if no good frame came in time.
+ */
+static BTL_StatusTypeDef BTL_FrameWait(uint32_t timeout)
+{
+    uint32_t startTick = BTL_PortGetTick();
+
+    while (!BTL_FrameReceived())
+    {
+        if ((timeout != BTL_PORT_MAX_DELAY) && (BTL_PortGetTick() - startTick >= timeout))
+        {
+            return BTL_ERROR;
+        }
+        BTL_PortIdle();
+    }
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Send acknowledgment for a command.
+ * @param cmdID ID of the command to acknowledge.
+ * @return BTL_StatusTypeDef Status of the acknowledgment transmission.
+ */
+static BTL_StatusTypeDef BTL_SendAck(BTL_CMDTypeDef cmdID)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, cmdID, 0);
+    /* Send cmd ID as Acknowledgment */
+    if (BTL_SendMessage("%c", cmdID) == BTL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Send a negative acknowledgment.
+ * @return BTL_StatusTypeDef Status of the negative acknowledgment transmission.
+ */
+static BTL_StatusTypeDef BTL_SendNAck()
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, 0, 0);
+    /* Send ID as A */
+    if (BTL_SendMessage("%c", 0) == BTL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Send a binary reply, the BTL_SendMessage counterpart for replies holding zero bytes.
+ * @param reply Buffer of BTL_REPLY_SIZE bytes, acknowledgment byte first.
+ * @param length Bytes of the reply in use, the rest are zeros.
+ * @return BTL_StatusTypeDef Status of the reply transmission.
+ */
+static BTL_StatusTypeDef BTL_SendReply(uint8_t* reply, uint16_t length)
+{
+    return BTL_TransmitReply(reply, length);
+}
+
+/**
+ * @brief Transmit a reply, or add it to the batch reply while a BTL_BATCH runs.
+ * @param reply Buffer of BTL_REPLY_SIZE bytes, acknowledgment byte first.
+ * @param length Bytes of the reply in use, the rest are zeros.
+ * @return BTL_StatusTypeDef BTL_ERROR if the reply could not be sent or does not fit the batch reply.
+ */
+static BTL_StatusTypeDef BTL_TransmitReply(uint8_t* reply, uint16_t length)
+{
+    if (!BTL_Batch.BTL_RUNNING)
+    {
+        /* On the link every reply takes BTL_REPLY_SIZE bytes */
+        return BTL_PortTransmit(reply, BTL_REPLY_SIZE, BTL_PORT_MAX_DELAY);
+    }
+
+    /* An empty reply is a NAck without text */
+    if ((length == 0U) || (reply[0] == 0U))
+    {
+        BTL_Batch.BTL_FAILED = 1;
+        length = (length == 0U) ? 1U : length;
+    }
+
+    if (BTL_Batch.BTL_REPLY_LENGTH + BTL_BATCH_ENTRY_HEADER + length > BTL_REPLY_SIZE)
+    {
+        BTL_Batch.BTL_OVERFLOW = 1;
+        return BTL_ERROR;
+    }
+
+    uint8_t* entry = &BTL_BatchReply[BTL_Batch.BTL_REPLY_LENGTH];
+
+    entry[0] = BTL_Batch.BTL_INDEX;
+    BTL_PutHalfWord(&entry[1], length);
+    memcpy(&entry[BTL_BATCH_ENTRY_HEADER], reply, length);
+    BTL_Batch.BTL_REPLY_LENGTH += BTL_BATCH_ENTRY_HEADER + length;
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Get the bootloader version and send it over UART.
+ * @param messageBuffer Buffer holding the command header.
+ * @param dataLength Length of the request, unused.
+ * @return BTL_StatusTypeDef Status of the version information transmission.
+ */
+BTL_StatusTypeDef BTL_GetVersion(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    if (BTL_SendMessage("Bootloader Version: %c.%c.%c\r\n", BTL_V_MAJOR, BTL_V_MINOR, BTL_V_PATCH) == BTL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Send the capability descriptor (see BTL_Private.h) over UART.
+ *
+ * The host reads the packet and record limits, the implemented commands,
+ * the baud rates and the flash layout from it and picks its fastest mode.
+ *
+ * @param messageBuffer Buffer holding the command header.
+ * @param dataLength Length of the request, unused.
+ * @return BTL_StatusTypeDef Status of the descriptor transmission.
+ */
+BTL_StatusTypeDef BTL_GetHelp(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    uint8_t reply[BTL_REPLY_SIZE] = {0};
+    uint16_t length = 0;
+    uint32_t commands = 0;
+
+    /* Every command with a handler in the command table is implemented */
+    for (uint8_t cmd = 0; cmd < BTL_NB_COMMANDS; cmd++)
+    {
+        if (BTL_Command[cmd].BTL_HANDLER != NULL)
+        {
+            commands |= 1UL << cmd;
+        }
+    }
+
+    reply[length++] = BTL_GET_HELP;
+    reply[length++] = BTL_PROTOCOL_VERSION;
+    reply[length++] = BTL_V_MAJOR - '0';
+    reply[length++] = BTL_V_MINOR - '0';
+    reply[length++] = BTL_V_PATCH - '0';
+    BTL_PutHalfWord(&reply[length], BTL_MAX_PACKET_SIZE);
+    length += 2;
+    reply[length++] = BTL_WINDOW_DEPTH;
+    reply[length++] = BTL_MAX_CC;
+    BTL_PutWord(&reply[length], commands);
+    length += 4;
+    BTL_PutWord(&reply[length], BTL_FORMATS);
+    length += 4;
+    BTL_PutHalfWord(&reply[length], BTL_MEM_READ_CHUNK);
+    length += 2;
+
+    reply[length++] = BTL_NB_BAUD_RATES;
+    for (uint8_t baudIndex = 0; baudIndex < BTL_NB_BAUD_RATES; baudIndex++)
+    {
+        BTL_PutWord(&reply[length], BTL_BaudRate[baudIndex]);
+        length += 4;
+    }
+
+    BTL_PutWord(&reply[length], BTL_MIN_ADDRESS);
+    length += 4;
+    reply[length++] = BTL_NB_SECTORS;
+    uint32_t appSize = 0;
+    for (uint8_t sector = 0; sector < BTL_NB_SECTORS; sector++)
+    {
+        BTL_PutWord(&reply[length], BTL_SectorSize[sector]);
+        length += 4;
+        if ((sector >= BTL_APP_FIRST_SECTOR) && (sector < BTL_APP_FIRST_SECTOR + BTL_APP_NB_SECTORS))
+        {
+            appSize += BTL_SectorSize[sector];
+        }
+    }
+    BTL_PutWord(&reply[length], BTL_MIN_ADDRESS + BTL_BOOTLOADER_SIZE);
+    length += 4;
+    /* The journal takes the end of the last sector, an image never reaches it */
+    BTL_PutWord(&reply[length], appSize - BTL_JOURNAL_SIZE);
+    length += 4;
+
+    BTL_PutWord(&reply[length], BTL_PortGetDeviceId());
+    length += 4;
+    BTL_PortGetUniqueId(&reply[length]);
+    length += 12;
+
+    return BTL_SendReply(reply, length);
+}
+
+/**
+ * @brief Send the device ID and the 96 bits unique ID over UART.
+ * @param messageBuffer Buffer holding the command header.
+ * @param dataLength Length of the request, unused.
+ * @return BTL_StatusTypeDef Status of the ID transmission.
+ */
+BTL_StatusTypeDef BTL_GetId(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    uint8_t reply[BTL_REPLY_SIZE] = {0};
+
+    reply[0] = BTL_GET_ID;
+    BTL_PutWord(&reply[1], BTL_PortGetDeviceId());
+    BTL_PortGetUniqueId(&reply[5]);
+
+    return BTL_SendReply(reply, 17);
+}
+
+/**
+ * @brief Send the RAM usage of the last session over UART, see BTL_MemoryUsageTypeDef.
+ * @param messageBuffer Buffer holding the command header.
+ * @param dataLength Length of the request, unused.
+ * @return BTL_StatusTypeDef Status of the report transmission.
+ */
+BTL_StatusTypeDef BTL_GetMemoryUsage(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    BTL_MemoryUsageTypeDef BTL_MEMORY = BTL_SessionMemory;
+    uint8_t flashPeak = BTL_SessionFlashPeak;
+
+    /* The query itself runs after the session, its frames are left out of a latched peak */
+    if (!BTL_SessionMemoryLatched)
+    {
+        BTL_PortGetMemoryUsage(&BTL_MEMORY);
+        flashPeak = BTL_FlashQueuePeak();
+    }
+
+    /* The flash queue depth is reported like the stack: peak, out of its size */
+    if (BTL_SendMessage("stack=%lu/%lu heap=%lu static=%lu flashq=%u/%u\r\n",
+                        (unsigned long) BTL_MEMORY.BTL_STACK_PEAK, (unsigned long) BTL_MEMORY.BTL_STACK_AVAILABLE,
+                        (unsigned long) BTL_MEMORY.BTL_HEAP_PEAK, (unsigned long) BTL_MEMORY.BTL_STATIC_SIZE,
+                        flashPeak, (unsigned int) BTL_FLASH_QUEUE_DEPTH) == BTL_OK)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Update firmware based on the provided message buffer.
+ *
+ * The first BTL_APP_FLASH header opens a session: it is acknowledged with
+ * the largest packet size and the application area is erased in the
+ * background, the session job then takes the first packet from the receive
+ * ring. Every later packet comes with its own BTL_APP_FLASH header and is
+ * programmed here, so status queries are answered between the packets.
+ *
+ * @param messageBuffer Buffer containing the firmware update data.
+ * @param dataLength Length of the data in the buffer.
+ * @return BTL_StatusTypeDef Status of the firmware update operation.
+ */
+BTL_StatusTypeDef BTL_UpdateFirmware(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    /* The host sizes every packet, refuse one that would overflow the buffer */
+    if (dataLength > BTL_MAX_PACKET_SIZE)
+    {
+        BTL_SendNAck();
+        if (BTL_Session.BTL_STATE == BTL_SESSION_NEXT_PACKET)
+        {
+            BTL_SessionSuspend();
+        }
+        return BTL_ERROR;
+    }
+
+    if (BTL_Session.BTL_STATE == BTL_SESSION_NEXT_PACKET)
+    {
+        /* The rest of the packet follows its header, a link lost in between suspends the session */
+        if (BTL_Receive(&messageBuffer[BTL_DONE_FLAG], dataLength + 4, BTL_PACKET_TIMEOUT) != BTL_OK)
+        {
+            BTL_SendNAck();
+            BTL_SessionSuspend();
+            return BTL_ERROR;
+        }
+        return BTL_SessionPacket(messageBuffer, dataLength);
+    }
+
+    /* A BTL_FLASH_ERASE is still running */
+    if (BTL_JobsActive())
+    {
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+
+    /* A new session drops a suspended one. The tick keeps the IDs of two
+     * runs of the bootloader apart, the previous ID two sessions in one tick */
+    BTL_Session.BTL_ID = (BTL_PortGetTick() << 8) | ((BTL_Session.BTL_ID + 1U) & 0xFFU);
+
+    /* Transmit an acknowledgment to signal MCU readiness for flashing,
+     * with the largest packet the host may size the next ones to */
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, BTL_APP_FLASH, 0);
+    BTL_STATUS = BTL_SendMessage("%cmax=%u session=%lu\r\n", BTL_APP_FLASH, (unsigned int) BTL_MAX_PACKET_SIZE,
+                                 (unsigned long) BTL_Session.BTL_ID);
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+    if (BTL_STATUS != BTL_OK) {
+        return BTL_ERROR;
+    }
+
+    BTL_Session.BTL_DATA_LENGTH = dataLength;
+    BTL_Session.BTL_ADDRESS_HIGH = BTL_MIN_ADDRESS >> 16;
+    BTL_Session.BTL_START = BTL_PortGetTick();
+    BTL_Session.BTL_BYTES = 0;
+    BTL_Session.BTL_ERASE_FAILED = 0;
+    BTL_Session.BTL_PROGRAM_FAILED = 0;
+    BTL_Session.BTL_ACTIVITY = BTL_Session.BTL_START;
+    BTL_Session.BTL_RECORDS = 0;
+    BTL_Session.BTL_OFFSET = 0;
+
+    BTL_PortCrcStart();
+    BTL_ImageCrc = 0xFFFFFFFFU;
+    BTL_ImageBytes = 0;
+    BTL_JournalBytes = 0;
+    BTL_Session.BTL_QUEUED_BYTES = 0;
+    BTL_SessionCheckpoint();
+    BTL_StripeReset();
+
+    /* The peaks of the session are measured from here and latched when it ends */
+    BTL_PortMemoryRestart();
+    BTL_FlashQueuePeakRestart();
+    BTL_SessionMemoryLatched = 0;
+
+    /* Start erasing the flash to prepare for writing, unless the host erased it already */
+    BTL_PortFlashUnlock();
+
+    if (BTL_AppErased)
+    {
+        /* The journal was erased with it and holds its link entry only */
+        BTL_Session.BTL_STATE = BTL_SESSION_FIRST_PACKET;
+    }
+    else if (BTL_EraseStart(BTL_APP_FIRST_SECTOR, BTL_APP_NB_SECTORS, 0) == BTL_OK)
+    {
+        BTL_Session.BTL_STATE = BTL_SESSION_ERASE;
+        BTL_JournalReset();
+        BTL_LinkKeep();
+    }
+    else
+    {
+        BTL_Session.BTL_ERASE_FAILED = 1;
+        BTL_Session.BTL_STATE = BTL_SESSION_FIRST_PACKET;
+    }
+    BTL_AppErased = 0;
+
+    /* The journal is erased with the application area, the first
+     * checkpoint is queued behind the erase */
+    BTL_JournalAppend(BTL_Session.BTL_ID, &BTL_Session.BTL_CHECKPOINT);
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Take on the session the update journal holds at reset, suspended at its last checkpoint.
+ *
+ * Power lost during a BTL_APP_FLASH session leaves the journal open, the
+ * host resumes the session with BTL_RESUME_START instead of erasing again.
+ */
+void BTL_SessionInit(void)
+{
+    uint32_t sessionId;
+
+    if (BTL_JournalInit(&sessionId, &BTL_Session.BTL_CHECKPOINT) == BTL_JOURNAL_OPEN)
+    {
+        BTL_Session.BTL_ID = sessionId;
+        BTL_Session.BTL_STATE = BTL_SESSION_SUSPENDED;
+        BTL_JournalBytes = BTL_Session.BTL_CHECKPOINT.BTL_IMAGE_BYTES;
+    }
+}
+
+/**
+ * @brief Session job: take the first packet once the erase is over and all
+ *        of it is in the receive ring, and every packet of a striped session.
+ * @param messageBuffer Buffer to receive the packet in.
+ */
+static void BTL_SessionStep(uint8_t* messageBuffer)
+{
+    uint16_t dataLength = BTL_Session.BTL_DATA_LENGTH;
+
+    /* A host gone between two packets leaves the session suspended at the last one */
+    if (((BTL_Session.BTL_STATE == BTL_SESSION_FIRST_PACKET) || (BTL_Session.BTL_STATE == BTL_SESSION_NEXT_PACKET)) &&
+        (BTL_PortGetTick() - BTL_Session.BTL_ACTIVITY >= BTL_SESSION_TIMEOUT))
+    {
+        if (BTL_SessionCheckpoint() == BTL_OK)
+        {
+            BTL_SessionSuspend();
+        }
+        else
+        {
+            BTL_SessionEnd();
+        }
+        return;
+    }
+
+    if (BTL_Stripe.BTL_BAUD_RATE != 0U)
+    {
+        if (((BTL_Session.BTL_STATE != BTL_SESSION_FIRST_PACKET) && (BTL_Session.BTL_STATE != BTL_SESSION_NEXT_PACKET)) ||
+            (!BTL_StripePending()))
+        {
+            return;
+        }
+
+        /* The header of the next packet comes in the stripes too */
+        if (BTL_Session.BTL_STATE == BTL_SESSION_NEXT_PACKET)
+        {
+            if ((BTL_SessionReceive(&messageBuffer[0], BTL_HEADER_SIZE) != BTL_OK) ||
+                (messageBuffer[BTL_CMD_TYPE] != BTL_APP_FLASH))
+            {
+                BTL_SendNAck();
+                BTL_SessionSuspend();
+                return;
+            }
+            dataLength = (messageBuffer[BTL_DATA_SIZE0] << 4) | messageBuffer[BTL_DATA_SIZE1];
+            if (dataLength > BTL_MAX_PACKET_SIZE)
+            {
+                BTL_SendNAck();
+                BTL_SessionSuspend();
+                return;
+            }
+        }
+    }
+    else if (BTL_Session.BTL_STATE != BTL_SESSION_FIRST_PACKET)
+    {
+        return;
+    }
+    else if ((BTL_Framing != BTL_FRAMING_OFF) ? (!BTL_FrameReceived()) : (BTL_PortReceiveAvailable() < dataLength + 4))
+    {
+        return;
+    }
+
+    /* Begin receiving the first packet of the program, prefixed with metadata:
+     * BTL_DONE_FLAG            0 - Indicates if this is the last packet or not.
+     * BTL_BUFFER_RECORDS0      1 - Indicates how many records are in the received buffer for iteration.
+     * BTL_BUFFER_NEXT_SIZE0    3
+     * BTL_BUFFER_NEXT_SIZE1    4 - Indicates how much data will be sent in the next packet.
+     */
+    if (BTL_SessionReceive(&messageBuffer[BTL_DONE_FLAG], dataLength + 4) != BTL_OK)
+    {
+        BTL_SendNAck();
+        BTL_SessionSuspend();
+    }
+    else if (BTL_Session.BTL_ERASE_FAILED)
+    {
+        BTL_SendNAck();
+        BTL_SessionEnd();
+    }
+    else
+    {
+        BTL_SessionPacket(messageBuffer, dataLength);
+    }
+    BTL_FrameRelease();
+}
+
+/**
+ * @brief Program one packet of the session and acknowledge it.
+ * @param messageBuffer Buffer holding the packet after its header.
+ * @param dataLength Length of the records in the packet.
+ * @return BTL_StatusTypeDef Status of the packet.
+ */
+static BTL_StatusTypeDef BTL_SessionPacket(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+
+    /* Update the status indicating whether the process is complete or ongoing */
+    BTL_StatusTypeDef BTL_DONE = messageBuffer[BTL_DONE_FLAG];
+
+    /* RecordsData holds the current record for writing to memory */
+    BTL_RecordTypeDef* RecordsData = malloc(sizeof(BTL_RecordTypeDef));
+
+    /* Check allocation error */
+    if (RecordsData == NULL)
+    {
+        BTL_SendNAck();
+        BTL_SessionEnd();
+        return BTL_ERROR;
+    }
+
+    /* Update information about the current records in the packet */
+    RecordsData->BTL_NO_OF_BUFFER_RECORDS = messageBuffer[BTL_BUFFER_RECORDS0];
+    RecordsData->BTL_RECORD_INDEX = 0;
+    RecordsData->BTL_ADDRESS_HIGH = BTL_Session.BTL_ADDRESS_HIGH;
+
+    /* Initiate flashing for the received packet. */
+    BTL_TRACE(BTL_TRACE_DECODE_BEGIN, RecordsData->BTL_NO_OF_BUFFER_RECORDS, 0);
+    BTL_StatusTypeDef BTL_FLASH_STATUS = BTL_FlashWrite(&messageBuffer[BTL_DATA_START], dataLength, RecordsData);
+    BTL_TRACE(BTL_TRACE_DECODE_END, BTL_FLASH_STATUS, 0);
+    BTL_Session.BTL_ADDRESS_HIGH = RecordsData->BTL_ADDRESS_HIGH;
+
+    /* The records are queued, programming goes on while the DMA receives the next packet and
+     * the checkpoint follows it from BTL_ProgramDone. The last packet waits for all of
+     * it, the image CRC reads the flash back */
+    if (BTL_DONE == BTL_OK)
+    {
+        BTL_FlashQueueWait();
+    }
+    else
+    {
+        BTL_FlashQueuePoll();
+    }
+    if (BTL_Session.BTL_PROGRAM_FAILED)
+    {
+        BTL_FLASH_STATUS = BTL_ERROR;
+    }
+
+    if (BTL_FLASH_STATUS == BTL_OK)
+    {
+        if (BTL_DONE == BTL_OK)
+        {
+            /* The image CRC is complete with the last record, no second pass is needed */
+            BTL_STATUS = BTL_SendImageAck(&messageBuffer[BTL_DATA_START], dataLength,
+                                          RecordsData->BTL_BUFFER_POINTER);
+        }
+        else
+        {
+            BTL_SendAck(BTL_APP_FLASH);
+            BTL_STATUS = BTL_OK;
+        }
+
+        BTL_Session.BTL_RECORDS += RecordsData->BTL_NO_OF_BUFFER_RECORDS;
+        BTL_Session.BTL_OFFSET += dataLength;
+        BTL_Session.BTL_ACTIVITY = BTL_PortGetTick();
+        BTL_SessionMark();
+        BTL_SessionJournal(0);
+
+        /* Log the packet size the host chose and the throughput it gives */
+        BTL_Session.BTL_BYTES += dataLength + BTL_DATA_START;
+        uint32_t sessionTime = BTL_PortGetTick() - BTL_Session.BTL_START;
+        BTL_TRACE(BTL_TRACE_PACKET, dataLength,
+                  (sessionTime != 0U) ? (BTL_Session.BTL_BYTES * 1000U / sessionTime) : 0U);
+    }
+    else
+    {
+        BTL_SendNAck();
+    }
+
+    free(RecordsData);
+
+    /* Clear the messageBuffer to prepare for receiving the next packet. */
+    memset(messageBuffer, 0, DATA_BUFFER_SIZE);
+
+    /* The last packet or a failed run ends the session, a bad record
+     * suspends it at the previous packet. The host resends the 3 bytes
+     * header before each of the other packets */
+    if ((BTL_DONE == BTL_OK) || (BTL_Session.BTL_PROGRAM_FAILED))
+    {
+        BTL_SessionEnd();
+    }
+    else if (BTL_FLASH_STATUS != BTL_OK)
+    {
+        BTL_SessionSuspend();
+    }
+    else
+    {
+        BTL_Session.BTL_STATE = BTL_SESSION_NEXT_PACKET;
+    }
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief End the BTL_APP_FLASH session, latch its RAM peaks and lock the flash again.
+ */
+static void BTL_SessionEnd(void)
+{
+    BTL_PortGetMemoryUsage(&BTL_SessionMemory);
+    BTL_SessionFlashPeak = BTL_FlashQueuePeak();
+    BTL_SessionMemoryLatched = 1;
+
+    BTL_Session.BTL_STATE = BTL_SESSION_IDLE;
+    BTL_JournalClose(BTL_Session.BTL_ID);
+    BTL_SessionStop();
+}
+
+/**
+ * @brief Suspend the BTL_APP_FLASH session at its checkpoint, BTL_RESUME takes it on again.
+ */
+static void BTL_SessionSuspend(void)
+{
+    /* A run that failed meanwhile leaves nothing to resume */
+    BTL_FlashQueueWait();
+    if (BTL_Session.BTL_PROGRAM_FAILED)
+    {
+        BTL_SessionEnd();
+        return;
+    }
+
+    BTL_Session.BTL_STATE = BTL_SESSION_SUSPENDED;
+    BTL_SessionJournal(1);
+    BTL_SessionStop();
+}
+
+/**
+ * @brief Let the queued runs finish, lock the flash and drop what is left of the session stream.
+ */
+static void BTL_SessionStop(void)
+{
+    BTL_FlashQueueWait();
+    BTL_PortFlashLock();
+
+    /* Frames left over from a failed striped session are dropped from both lanes */
+    if ((BTL_Stripe.BTL_BAUD_RATE != 0U) && (BTL_Stripe.BTL_SEQUENCE != 0U))
+    {
+        BTL_PortReceiveStart();
+        BTL_PortStripeStart(BTL_Stripe.BTL_BAUD_RATE);
+    }
+    BTL_StripeReset();
+}
+
+/**
+ * @brief Keep the state of the session as its checkpoint once the queued runs are programmed.
+ * @return BTL_StatusTypeDef BTL_ERROR if a run failed, the flash no longer matches the records.
+ */
+static BTL_StatusTypeDef BTL_SessionCheckpoint(void)
+{
+    const BTL_PacketMarkTypeDef current =
+    {
+        .BTL_RECORDS = BTL_Session.BTL_RECORDS,
+        .BTL_OFFSET = BTL_Session.BTL_OFFSET,
+        .BTL_IMAGE_BYTES = BTL_Session.BTL_QUEUED_BYTES,
+        .BTL_ADDRESS_HIGH = BTL_Session.BTL_ADDRESS_HIGH,
+    };
+
+    BTL_FlashQueueWait();
+    if (BTL_Session.BTL_PROGRAM_FAILED)
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_Session.BTL_MARK_COUNT = 0;
+    BTL_SessionLatch(&current);
+    BTL_SessionJournal(0);
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Mark the end of a decoded packet, its checkpoint is taken once its runs are programmed.
+ */
+static void BTL_SessionMark(void)
+{
+    uint8_t markIndex = BTL_Session.BTL_MARK_COUNT;
+
+    /* A full list moves its newest mark on, the checkpoint just skips a packet */
+    if (markIndex == BTL_SESSION_MARKS)
+    {
+        markIndex--;
+    }
+    else
+    {
+        BTL_Session.BTL_MARK_COUNT++;
+    }
+
+    BTL_Session.BTL_MARK[markIndex].BTL_RECORDS = BTL_Session.BTL_RECORDS;
+    BTL_Session.BTL_MARK[markIndex].BTL_OFFSET = BTL_Session.BTL_OFFSET;
+    BTL_Session.BTL_MARK[markIndex].BTL_IMAGE_BYTES = BTL_Session.BTL_QUEUED_BYTES;
+    BTL_Session.BTL_MARK[markIndex].BTL_ADDRESS_HIGH = BTL_Session.BTL_ADDRESS_HIGH;
+
+    /* A packet of address records only queued nothing */
+    BTL_SessionMarkReached();
+}
+
+/**
+ * @brief Take the checkpoint of the oldest marked packets once the image CRC holds all their runs.
+ */
+static void BTL_SessionMarkReached(void)
+{
+    /* Runs end in queue order and a packet ends with a run, the image CRC stops right at its end */
+    while ((BTL_Session.BTL_MARK_COUNT != 0U) && (!BTL_Session.BTL_PROGRAM_FAILED) &&
+           (BTL_Session.BTL_MARK[0].BTL_IMAGE_BYTES == BTL_ImageBytes))
+    {
+        BTL_SessionLatch(&BTL_Session.BTL_MARK[0]);
+        BTL_Session.BTL_MARK_COUNT--;
+        memmove(&BTL_Session.BTL_MARK[0], &BTL_Session.BTL_MARK[1],
+                BTL_Session.BTL_MARK_COUNT * sizeof(BTL_PacketMarkTypeDef));
+    }
+}
+
+/**
+ * @brief Keep a packet end and the image CRC as it stands as the checkpoint.
+ * @param mark End of the packet the image CRC stops at.
+ */
+static void BTL_SessionLatch(const BTL_PacketMarkTypeDef* mark)
+{
+    BTL_CheckpointTypeDef* checkpoint = &BTL_Session.BTL_CHECKPOINT;
+
+    checkpoint->BTL_RECORDS = mark->BTL_RECORDS;
+    checkpoint->BTL_OFFSET = mark->BTL_OFFSET;
+    checkpoint->BTL_ADDRESS_HIGH = mark->BTL_ADDRESS_HIGH;
+    checkpoint->BTL_IMAGE_CRC = BTL_ImageCrc;
+    checkpoint->BTL_IMAGE_BYTES = BTL_ImageBytes;
+    memcpy(checkpoint->BTL_IMAGE_WORD, BTL_ImageCrcWord, sizeof(BTL_ImageCrcWord));
+}
+
+/**
+ * @brief Append the checkpoint to the update journal every BTL_JOURNAL_INTERVAL bytes, and when suspending.
+ * @param suspending 1 to append any progress since the last journaled checkpoint.
+ */
+static void BTL_SessionJournal(uint8_t suspending)
+{
+    uint32_t journalGap = BTL_Session.BTL_CHECKPOINT.BTL_IMAGE_BYTES - BTL_JournalBytes;
+
+    /* A full journal keeps its last checkpoint, the session resumes from there after a reset */
+    if (((journalGap >= BTL_JOURNAL_INTERVAL) || ((suspending) && (journalGap != 0U))) &&
+        (BTL_JournalAppend(BTL_Session.BTL_ID, &BTL_Session.BTL_CHECKPOINT) == BTL_OK))
+    {
+        BTL_JournalBytes = BTL_Session.BTL_CHECKPOINT.BTL_IMAGE_BYTES;
+    }
+}
+
+/**
+ * @brief Take the session back to its checkpoint, the running CRC of the CRC unit included.
+ */
+static void BTL_SessionRollback(void)
+{
+    const BTL_CheckpointTypeDef* checkpoint = &BTL_Session.BTL_CHECKPOINT;
+
+    BTL_Session.BTL_RECORDS = checkpoint->BTL_RECORDS;
+    BTL_Session.BTL_OFFSET = checkpoint->BTL_OFFSET;
+    BTL_Session.BTL_ADDRESS_HIGH = checkpoint->BTL_ADDRESS_HIGH;
+    BTL_ImageCrc = checkpoint->BTL_IMAGE_CRC;
+    BTL_ImageBytes = checkpoint->BTL_IMAGE_BYTES;
+    memcpy(BTL_ImageCrcWord, checkpoint->BTL_IMAGE_WORD, sizeof(BTL_ImageCrcWord));
+    BTL_Session.BTL_QUEUED_BYTES = BTL_ImageBytes;
+    BTL_Session.BTL_MARK_COUNT = 0;
+
+    /* Other commands may have used the CRC unit meanwhile */
+    BTL_PortCrcStart();
+    if (BTL_ImageBytes >= 4U)
+    {
+        BTL_PortCrcAccumulate(BTL_ImageCrcFixup(BTL_ImageCrc));
+    }
+}
+
+/**
+ * @brief Get the word that takes the CRC unit from its reset value to a given CRC.
+ *
+ * The CRC unit cannot be loaded with a CRC. Feeding a word XORs it into the
+ * reset value and shifts the result 32 times, which is one to one, so the
+ * shifts are run backwards from the CRC to find that word.
+ *
+ * @param crc CRC the CRC unit has to hold.
+ * @return uint32_t Word to feed right after BTL_PortCrcStart.
+ */
+static uint32_t BTL_ImageCrcFixup(uint32_t crc)
+{
+    for (uint8_t bit = 0; bit < 32U; bit++)
+    {
+        /* A shift that applied the polynomial left bit 0 set */
+        crc = (crc & 1U) ? (((crc ^ BTL_IMAGE_CRC_POLYNOMIAL) >> 1) | 0x80000000U) : (crc >> 1);
+    }
+
+    return crc ^ 0xFFFFFFFFU;
+}
+
+/**
+ * @brief Report the session and its checkpoint, or take a session back to its checkpoint (see BTL_Private.h).
+ * @param messageBuffer Buffer holding the command header, the request is received after it.
+ * @param dataLength Length of the request, must be BTL_RESUME_REQUEST.
+ * @return BTL_StatusTypeDef Status of the query or the resume.
+ */
+BTL_StatusTypeDef BTL_ResumeSession(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    static const char* const stateName[] = { "none", "erase", "active", "active", "suspended" };
+
+    if ((BTL_ReceiveRequest(messageBuffer, dataLength, BTL_RESUME_REQUEST) != BTL_OK) ||
+        (messageBuffer[BTL_DONE_FLAG] > BTL_RESUME_START))
+    {
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+
+    /* A request between two packets means the host lost the session stream,
+     * the session stops at its last acknowledged packet */
+    if ((BTL_Session.BTL_STATE == BTL_SESSION_FIRST_PACKET) || (BTL_Session.BTL_STATE == BTL_SESSION_NEXT_PACKET))
+    {
+        if (BTL_SessionCheckpoint() != BTL_OK)
+        {
+            BTL_SendNAck();
+            BTL_SessionEnd();
+            return BTL_ERROR;
+        }
+        BTL_SessionSuspend();
+    }
+
+    if (messageBuffer[BTL_DONE_FLAG] == BTL_RESUME_START)
+    {
+        /* Only the current session resumes, once its erase is over */
+        if ((BTL_GetWord(&messageBuffer[BTL_DONE_FLAG + 1]) != BTL_Session.BTL_ID) ||
+            (BTL_Session.BTL_STATE != BTL_SESSION_SUSPENDED) || (BTL_Session.BTL_ERASE_FAILED))
+        {
+            BTL_SendNAck();
+            return BTL_ERROR;
+        }
+
+        /* The stream restarts with the header of the packet at the checkpoint */
+        BTL_SessionRollback();
+        BTL_PortFlashUnlock();
+        BTL_Session.BTL_ACTIVITY = BTL_PortGetTick();
+        BTL_Session.BTL_STATE = BTL_SESSION_NEXT_PACKET;
+    }
+
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, BTL_RESUME, 0);
+    BTL_STATUS = BTL_SendMessage("%csession=%lu state=%s records=%lu offset=%lu crc=%08lX\r\n", BTL_RESUME,
+                                 (unsigned long) BTL_Session.BTL_ID, stateName[BTL_Session.BTL_STATE],
+                                 (unsigned long) BTL_Session.BTL_CHECKPOINT.BTL_RECORDS,
+                                 (unsigned long) BTL_Session.BTL_CHECKPOINT.BTL_OFFSET,
+                                 (unsigned long) BTL_Session.BTL_CHECKPOINT.BTL_IMAGE_CRC);
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Run the sub-commands of a batch in order and answer them all in one reply (see BTL_Private.h).
+ * @param messageBuffer Buffer holding the command header, every sub-command runs in it.
+ * @param dataLength Length of the batch, up to BTL_BATCH_SIZE.
+ * @return BTL_StatusTypeDef BTL_ERROR if the batch is refused or stops at a failed sub-command.
+ */
+BTL_StatusTypeDef BTL_RunBatch(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_OK;
+    uint8_t count = 0;
+    uint8_t run = 0;
+    uint16_t offset = 0;
+
+    if (dataLength > BTL_BATCH_SIZE)
+    {
+        BTL_DropRequest(messageBuffer, dataLength);
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+
+    if ((BTL_Receive(BTL_BatchRequest, dataLength, BTL_REQUEST_TIMEOUT) != BTL_OK) ||
+        (BTL_BatchCount(dataLength, &count) != BTL_OK))
+    {
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+
+    memset(BTL_BatchReply, 0, sizeof(BTL_BatchReply));
+    memset(&BTL_Batch, 0, sizeof(BTL_Batch));
+    BTL_Batch.BTL_REPLY_LENGTH = BTL_BATCH_HEADER;
+    BTL_Batch.BTL_RUNNING = 1;
+
+    while ((BTL_STATUS == BTL_OK) && (run < count))
+    {
+        uint8_t BTL_CMD = BTL_BatchRequest[offset + BTL_CMD_TYPE];
+        uint16_t subLength = (BTL_BatchRequest[offset + BTL_DATA_SIZE0] << 4) | BTL_BatchRequest[offset + BTL_DATA_SIZE1];
+        const BTL_CommandTypeDef* command = ((BTL_CMD < BTL_NB_COMMANDS) && (BTL_Command[BTL_CMD].BTL_FLAGS & BTL_CMD_BATCH)) ?
+                                            &BTL_Command[BTL_CMD] : NULL;
+
+        /* Inside a batch BTL_APP_FLASH only opens a session, the packets of a running one come on their own */
+        if ((BTL_CMD == BTL_APP_FLASH) && (BTL_Session.BTL_STATE == BTL_SESSION_NEXT_PACKET))
+        {
+            command = NULL;
+        }
+
+        memcpy(messageBuffer, &BTL_BatchRequest[offset], BTL_HEADER_SIZE);
+        offset += BTL_HEADER_SIZE;
+        BTL_Batch.BTL_INDEX = run;
+        BTL_Batch.BTL_READ = offset;
+        /* The first packet of the session a BTL_APP_FLASH opens comes after the batch */
+        BTL_Batch.BTL_END = (BTL_CMD == BTL_APP_FLASH) ? offset : offset + subLength;
+        BTL_Batch.BTL_FAILED = 0;
+        offset = BTL_Batch.BTL_END;
+
+        BTL_STATUS = BTL_Dispatch(command, messageBuffer, subLength);
+        BTL_BatchWait();
+        run++;
+
+        if ((BTL_Batch.BTL_FAILED) || (BTL_Batch.BTL_OVERFLOW))
+        {
+            BTL_STATUS = BTL_ERROR;
+        }
+    }
+
+    BTL_Batch.BTL_RUNNING = 0;
+
+    BTL_BatchReply[0] = BTL_BATCH;
+    BTL_BatchReply[1] = run;
+    BTL_BatchReply[2] = count;
+    BTL_BatchReply[3] = BTL_STATUS;
+
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, BTL_BATCH, 0);
+    if (BTL_SendReply(BTL_BatchReply, BTL_Batch.BTL_REPLY_LENGTH) != BTL_OK)
+    {
+        BTL_STATUS = BTL_ERROR;
+    }
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Check the layout of the batch request and count its sub-commands.
+ * @param length Bytes of the batch request.
+ * @param count Filled with the number of sub-commands.
+ * @return BTL_StatusTypeDef BTL_ERROR if a sub-command runs past the end or a BTL_APP_FLASH is not the last one.
+ */
+static BTL_StatusTypeDef BTL_BatchCount(uint16_t length, uint8_t* count)
+{
+    uint16_t offset = 0;
+
+    *count = 0;
+    while (offset < length)
+    {
+        if ((length - offset < BTL_HEADER_SIZE) || (*count == UINT8_MAX))
+        {
+            return BTL_ERROR;
+        }
+
+        uint16_t subLength = (BTL_BatchRequest[offset + BTL_DATA_SIZE0] << 4) | BTL_BatchRequest[offset + BTL_DATA_SIZE1];
+
+        if (BTL_BatchRequest[offset + BTL_CMD_TYPE] == BTL_APP_FLASH)
+        {
+            subLength = 0;
+            if (offset + BTL_HEADER_SIZE != length)
+            {
+                return BTL_ERROR;
+            }
+        }
+
+        offset += BTL_HEADER_SIZE;
+        if (subLength > length - offset)
+        {
+            return BTL_ERROR;
+        }
+        offset += subLength;
+        (*count)++;
+    }
+
+    return (*count != 0U) ? BTL_OK : BTL_ERROR;
+}
+
+/**
+ * @brief Let the BTL_FLASH_ERASE a sub-command started run to its end, its progress goes to the batch reply.
+ */
+static void BTL_BatchWait(void)
+{
+    /* The erase of a new session runs on while its first packet comes in */
+    while ((BTL_EraseJob.BTL_SECTOR_COUNT != 0U) && (BTL_EraseJob.BTL_REPORT))
+    {
+        BTL_FlashQueuePoll();
+        BTL_EraseStep();
+        if (BTL_EraseJob.BTL_SECTOR_COUNT != 0U)
+        {
+            BTL_PortIdle();
+        }
+    }
+}
+
+/**
+ * @brief Receive bytes of the session stream, from the host link or from the stripes.
+ * @param data Buffer to store the received bytes.
+ * @param length Number of bytes to receive.
+ * @return BTL_StatusTypeDef Status of the reception.
+ */
+static BTL_StatusTypeDef BTL_SessionReceive(uint8_t* data, uint16_t length)
+{
+    if (BTL_Stripe.BTL_BAUD_RATE != 0U)
+    {
+        return BTL_StripeReceive(data, length, BTL_STRIPE_TIMEOUT);
+    }
+
+    return BTL_Receive(data, length, BTL_PACKET_TIMEOUT);
+}
+
+/**
+ * @brief Switch the second lane of the striped transfer on or off (see BTL_Private.h).
+ * @param messageBuffer Buffer holding the command header, the request is received after it.
+ * @param dataLength Length of the request, must be BTL_STRIPE_REQUEST.
+ * @return BTL_StatusTypeDef Status of the lane setup.
+ */
+BTL_StatusTypeDef BTL_SetStripe(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    uint8_t baudSupported = 0;
+
+    if ((BTL_ReceiveRequest(messageBuffer, dataLength, BTL_STRIPE_REQUEST) != BTL_OK) ||
+        (BTL_Framing != BTL_FRAMING_OFF))
+    {
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+
+    uint32_t baudRate = BTL_GetWord(&messageBuffer[BTL_DONE_FLAG]);
+
+    for (uint8_t baudIndex = 0; baudIndex < BTL_NB_BAUD_RATES; baudIndex++)
+    {
+        if (BTL_BaudRate[baudIndex] == baudRate)
+        {
+            baudSupported = 1;
+        }
+    }
+
+    BTL_Stripe.BTL_BAUD_RATE = 0;
+    if (((!baudSupported) && (baudRate != 0U)) || (BTL_PortStripeStart(baudRate) != BTL_OK))
+    {
+        BTL_PortStripeStart(0);
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+    BTL_Stripe.BTL_BAUD_RATE = baudRate;
+    BTL_StripeReset();
+
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, BTL_STRIPE, 0);
+    BTL_STATUS = BTL_SendMessage("%clanes=%u frame=%u baud=%lu\r\n", BTL_STRIPE, (baudRate != 0U) ? BTL_STRIPE_LANES : 1U,
+                                 (unsigned int) BTL_STRIPE_FRAME, (unsigned long) baudRate);
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Switch the framing of the requests (see BTL_Private.h and BTL_Frame.h).
+ * @param messageBuffer Buffer holding the command header, the request is received after it.
+ * @param dataLength Length of the request, must be BTL_FRAMING_REQUEST.
+ * @return BTL_StatusTypeDef Status of the framing switch.
+ */
+BTL_StatusTypeDef BTL_SetFraming(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    BTL_FrameStatsTypeDef frameStats;
+
+    /* The stripes carry their own frames, on two lanes */
+    if ((BTL_ReceiveRequest(messageBuffer, dataLength, BTL_FRAMING_REQUEST) != BTL_OK) ||
+        (messageBuffer[BTL_DONE_FLAG] > BTL_FRAMING_COBS) || (BTL_Stripe.BTL_BAUD_RATE != 0U))
+    {
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+
+    /* The counters of the framing that ends go into the acknowledgment */
+    BTL_FrameGetStats(&frameStats);
+    BTL_Framing = messageBuffer[BTL_DONE_FLAG];
+    BTL_FrameReset();
+
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, BTL_FRAMING, 0);
+    BTL_STATUS = BTL_SendMessage("%cframing=%u frames=%lu bad=%lu noise=%lu\r\n", BTL_FRAMING,
+                                 (unsigned int) BTL_Framing, (unsigned long) frameStats.BTL_FRAMES,
+                                 (unsigned long) frameStats.BTL_BAD_FRAMES,
+                                 (unsigned long) frameStats.BTL_NOISE_BYTES);
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Start the session stream over at sequence number 0.
+ */
+static void BTL_StripeReset(void)
+{
+    BTL_Stripe.BTL_SEQUENCE = 0;
+    BTL_Stripe.BTL_LANE = BTL_STRIPE_LANES;
+    BTL_Stripe.BTL_FRAME_LEFT = 0;
+    for (uint8_t lane = 0; lane < BTL_STRIPE_LANES; lane++)
+    {
+        BTL_Stripe.BTL_PENDING[lane] = 0;
+    }
+}
+
+/**
+ * @brief Get the number of bytes waiting on a lane.
+ * @param lane 0 for the host link, 1 for the second lane.
+ * @return uint16_t Bytes waiting in the receive ring of the lane.
+ */
+static uint16_t BTL_LaneAvailable(uint8_t lane)
+{
+    return (lane == 0U) ? BTL_PortReceiveAvailable() : BTL_PortStripeAvailable();
+}
+
+/**
+ * @brief Receive bytes from a lane.
+ * @param lane 0 for the host link, 1 for the second lane.
+ * @param data Buffer to store the received bytes.
+ * @param length Number of bytes to receive.
+ * @param timeout Timeout in milliseconds.
+ * @return BTL_StatusTypeDef Status of the reception.
+ */
+static BTL_StatusTypeDef BTL_LaneReceive(uint8_t lane, uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    return (lane == 0U) ? BTL_PortReceive(data, length, timeout) : BTL_PortStripeReceive(data, length, timeout);
+}
+
+/**
+ * @brief Check whether the session stream has bytes to read.
+ * @return uint8_t 1 if a frame is started or a lane has bytes waiting.
+ */
+static uint8_t BTL_StripePending(void)
+{
+    uint8_t pending = (BTL_Stripe.BTL_FRAME_LEFT != 0U);
+
+    for (uint8_t lane = 0; lane < BTL_STRIPE_LANES; lane++)
+    {
+        pending |= BTL_Stripe.BTL_PENDING[lane] || (BTL_LaneAvailable(lane) != 0U);
+    }
+
+    return pending;
+}
+
+/**
+ * @brief Read bytes of the session stream out of the frames of both lanes, in sequence order.
+ * @param data Buffer to store the bytes.
+ * @param length Number of bytes to read.
+ * @param timeout Timeout in milliseconds for each frame.
+ * @return BTL_StatusTypeDef BTL_ERROR on a timeout or a frame out of sequence.
+ */
+static BTL_StatusTypeDef BTL_StripeReceive(uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    uint8_t frameHeader[BTL_STRIPE_HEADER];
+
+    BTL_TRACE(BTL_TRACE_RX_BEGIN, length, 0);
+    while (length != 0U)
+    {
+        uint32_t startTick = BTL_PortGetTick();
+
+        /* Find the lane the next frame comes on, every lane carries its frames in order */
+        while (BTL_Stripe.BTL_FRAME_LEFT == 0U)
+        {
+            uint8_t pendingLanes = 0;
+
+            for (uint8_t lane = 0; lane < BTL_STRIPE_LANES; lane++)
+            {
+                if ((!BTL_Stripe.BTL_PENDING[lane]) && (BTL_LaneAvailable(lane) >= BTL_STRIPE_HEADER))
+                {
+                    BTL_LaneReceive(lane, frameHeader, BTL_STRIPE_HEADER, timeout);
+                    BTL_Stripe.BTL_PENDING_SEQUENCE[lane] = frameHeader[0] | (frameHeader[1] << 8);
+                    BTL_Stripe.BTL_PENDING_LENGTH[lane] = frameHeader[2] | (frameHeader[3] << 8);
+                    BTL_Stripe.BTL_PENDING[lane] = 1;
+                }
+
+                if (BTL_Stripe.BTL_PENDING[lane])
+                {
+                    pendingLanes++;
+                    if (BTL_Stripe.BTL_PENDING_SEQUENCE[lane] == BTL_Stripe.BTL_SEQUENCE)
+                    {
+                        BTL_Stripe.BTL_PENDING[lane] = 0;
+                        BTL_Stripe.BTL_LANE = lane;
+                        BTL_Stripe.BTL_FRAME_LEFT = BTL_Stripe.BTL_PENDING_LENGTH[lane];
+                        BTL_Stripe.BTL_SEQUENCE++;
+                        break;
+                    }
+                }
+            }
+
+            if ((BTL_Stripe.BTL_FRAME_LEFT == 0U) &&
+                ((pendingLanes == BTL_STRIPE_LANES) || (BTL_PortGetTick() - startTick >= timeout)))
+            {
+                /* Both lanes are ahead of the stream: a frame was lost */
+                BTL_TRACE(BTL_TRACE_RX_END, BTL_ERROR, 0);
+                return BTL_ERROR;
+            }
+        }
+
+        uint16_t chunkLength = (length < BTL_Stripe.BTL_FRAME_LEFT) ? length : BTL_Stripe.BTL_FRAME_LEFT;
+
+        if ((BTL_Stripe.BTL_FRAME_LEFT > BTL_STRIPE_FRAME) ||
+            (BTL_LaneReceive(BTL_Stripe.BTL_LANE, data, chunkLength, timeout) != BTL_OK))
+        {
+            BTL_TRACE(BTL_TRACE_RX_END, BTL_ERROR, 0);
+            return BTL_ERROR;
+        }
+
+        BTL_Stripe.BTL_FRAME_LEFT -= chunkLength;
+        data += chunkLength;
+        length -= chunkLength;
+    }
+    BTL_TRACE(BTL_TRACE_RX_END, BTL_OK, 0);
 
+    return BTL_OK;
+}
 
 /**
- * @brief Send a formatted message over UART.
- * @param messageFormat Format string for the message.
- * @param ... Variable number of arguments for the formatted message.
- * @return BTL_StatusTypeDef Status of the message transmission.
+ * @brief Add programmed bytes to the running image CRC.
+ * @param data Bytes read back from the flash, NULL when they cannot be read.
+ * @param length Number of bytes.
  */
-BTL_StatusTypeDef BTL_SendMessage(char* messageFormat, ...)
+static void BTL_ImageCrcFeed(const uint8_t* data, uint16_t length)
 {
-    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    for (uint16_t byteIndex = 0; byteIndex < length; byteIndex++)
+    {
+        /* Bytes that cannot be read back count as erased, the CRC then fails */
+        BTL_ImageCrcWord[BTL_ImageBytes & 3U] = (data != NULL) ? data[byteIndex] : BTL_IMAGE_CRC_PAD;
+        BTL_ImageBytes++;
 
-    char message[512] = {0};
-    /* Initialize va_list to handle the message */
-    va_list args;
-    va_start(args, messageFormat);
+        if ((BTL_ImageBytes & 3U) == 0U)
+        {
+            BTL_ImageCrc = BTL_PortCrcAccumulate(BTL_GetWord(BTL_ImageCrcWord));
+        }
+    }
+}
 
-    /* Use vsnprintf to format the message */
-    vsnprintf(message, sizeof(message), messageFormat, args);
+/**
+ * @brief Flash queue callback of a programmed run: read it back into the image CRC, and take
+ *        the checkpoint of a packet it ends.
+ * @param address First flash address of the run.
+ * @param length Bytes of the run.
+ * @param BTL_STATUS Result of the programming.
+ */
+static void BTL_ProgramDone(uint32_t address, uint16_t length, BTL_StatusTypeDef BTL_STATUS)
+{
+    if (BTL_STATUS != BTL_OK)
+    {
+        BTL_Session.BTL_PROGRAM_FAILED = 1;
+    }
 
-    /* Transmit the formatted data to the Host */
-    if (HAL_UART_Transmit(&huart1, (uint8_t*) message, sizeof(message), HAL_MAX_DELAY) == HAL_OK)
+    BTL_ImageCrcFeed((BTL_STATUS == BTL_OK) ? BTL_PortMemoryMap(address, length) : NULL, length);
+    BTL_SessionMarkReached();
+}
+
+/**
+ * @brief Acknowledge the last packet with the image CRC, checked against the one the host sent.
+ * @param dataBuffer Records of the last packet.
+ * @param dataLength Length of the packet.
+ * @param recordsEnd End of the last record, the expected CRC follows it when the host sent one.
+ * @return BTL_StatusTypeDef BTL_ERROR if the image does not match the expected CRC.
+ */
+static BTL_StatusTypeDef BTL_SendImageAck(const uint8_t* dataBuffer, uint16_t dataLength, uint16_t recordsEnd)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_OK;
+    uint32_t imageCrc = BTL_ImageCrc;
+    uint32_t imageBytes = BTL_ImageBytes;
+
+    /* Pad the unfinished word */
+    if ((imageBytes & 3U) != 0U)
     {
-        BTL_STATUS = BTL_OK;
+        for (uint32_t byteIndex = imageBytes & 3U; byteIndex < 4U; byteIndex++)
+        {
+            BTL_ImageCrcWord[byteIndex] = BTL_IMAGE_CRC_PAD;
+        }
+        imageCrc = BTL_PortCrcAccumulate(BTL_GetWord(BTL_ImageCrcWord));
     }
 
-    va_end(args);
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, BTL_APP_FLASH, 0);
+    if (dataLength < recordsEnd + BTL_IMAGE_CRC_SIZE)
+    {
+        /* Older hosts send no CRC */
+        BTL_STATUS = BTL_SendMessage("%ccrc=%08lX bytes=%lu verify=none\r\n", BTL_APP_FLASH,
+                                     (unsigned long) imageCrc, (unsigned long) imageBytes);
+    }
+    else if (BTL_GetWord(&dataBuffer[recordsEnd]) == imageCrc)
+    {
+        BTL_STATUS = BTL_SendMessage("%ccrc=%08lX bytes=%lu verify=ok\r\n", BTL_APP_FLASH,
+                                     (unsigned long) imageCrc, (unsigned long) imageBytes);
+    }
+    else
+    {
+        BTL_SendMessage("%ccrc=%08lX expected=%08lX bytes=%lu verify=fail\r\n", 0, (unsigned long) imageCrc,
+                        (unsigned long) BTL_GetWord(&dataBuffer[recordsEnd]), (unsigned long) imageBytes);
+        BTL_STATUS = BTL_ERROR;
+    }
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+
     return BTL_STATUS;
 }
 
 /**
- * @brief Receive a message from UART.
- * @param messageBuffer Buffer to store the received message.
- * @return BTL_CMDTypeDef Type of command received.
+ * @brief Send a range of flash or RAM to the host.
+ *
+ * The memory is sent in chunks of BTL_MEM_READ_CHUNK bytes, each framed by
+ * a header and a CRC-32 trailer. The UART DMA reads the chunk straight from
+ * the memory, no copy is made, and the CRC unit runs over the same bytes
+ * while the transfer is on the wire.
+ *
+ * @param messageBuffer Buffer holding the command header, the request is received after it.
+ * @param dataLength Length of the request, must be BTL_MEM_READ_REQUEST.
+ * @return BTL_StatusTypeDef Status of the read operation.
  */
-BTL_CMDTypeDef BTL_GetMessage(uint8_t* messageBuffer)
+BTL_StatusTypeDef BTL_MemRead(uint8_t* messageBuffer, uint16_t dataLength)
 {
-    BTL_CMDTypeDef BTL_CMD = BTL_ERROR_CMD;
+    BTL_StatusTypeDef BTL_STATUS = BTL_OK;
 
-    /* Get the size of the data & command type */
-    if (HAL_UART_Receive(&huart1, (uint8_t*) &messageBuffer[0], 3, HAL_MAX_DELAY) == HAL_OK)
+    if (BTL_ReceiveRequest(messageBuffer, dataLength, BTL_MEM_READ_REQUEST) != BTL_OK)
     {
-        BTL_CMD = messageBuffer[BTL_CMD_TYPE];
+        BTL_SendNAck();
+        return BTL_ERROR;
     }
 
-    return BTL_CMD;
+    uint32_t address = BTL_GetWord(&messageBuffer[BTL_DONE_FLAG]);
+    uint32_t length = BTL_GetWord(&messageBuffer[BTL_DONE_FLAG + 4]);
+
+    /* The CRC unit takes whole words */
+    const uint8_t* memory = BTL_PortMemoryMap(address, length);
+    if ((memory == NULL) || (length == 0U) || ((address | length) & 3U))
+    {
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, BTL_MEM_READ, 0);
+    BTL_STATUS = BTL_SendMessage("%cchunk=%u\r\n", BTL_MEM_READ, (unsigned int) BTL_MEM_READ_CHUNK);
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+
+    uint8_t chunkHeader[BTL_MEM_READ_HEADER];
+    uint8_t chunkTrailer[BTL_MEM_READ_TRAILER];
+    uint16_t sequence = 0;
+    uint32_t offset = 0;
+
+    while ((BTL_STATUS == BTL_OK) && (offset < length))
+    {
+        uint16_t chunkLength = (length - offset > BTL_MEM_READ_CHUNK) ? BTL_MEM_READ_CHUNK : (uint16_t) (length - offset);
+
+        BTL_PutWord(&chunkHeader[0], address + offset);
+        BTL_PutHalfWord(&chunkHeader[4], chunkLength);
+        BTL_PutHalfWord(&chunkHeader[6], sequence);
+
+        if ((BTL_PortTransmit(chunkHeader, sizeof(chunkHeader), BTL_MEM_READ_TIMEOUT) != BTL_OK) ||
+            (BTL_PortTransmitDMA(&memory[offset], chunkLength) != BTL_OK))
+        {
+            BTL_STATUS = BTL_ERROR;
+            break;
+        }
+
+        /* Overlaps the transfer, both only read the memory */
+        BTL_PutWord(chunkTrailer, BTL_PortCrc(&memory[offset], chunkLength));
+
+        if ((BTL_PortTransmitWait(BTL_MEM_READ_TIMEOUT) != BTL_OK) ||
+            (BTL_PortTransmit(chunkTrailer, sizeof(chunkTrailer), BTL_MEM_READ_TIMEOUT) != BTL_OK))
+        {
+            BTL_STATUS = BTL_ERROR;
+            break;
+        }
+
+        offset += chunkLength;
+        sequence++;
+    }
+
+    return BTL_STATUS;
 }
 
 /**
- * @brief Send acknowledgment for a command.
- * @param cmdID ID of the command to acknowledge.
- * @return BTL_StatusTypeDef Status of the acknowledgment transmission.
+ * @brief Erase a range of sectors and report every erased sector to the host.
+ *
+ * The sectors are erased one after the other in the background by the
+ * flash interrupt; after the acknowledgment the erase job sends one progress
+ * message per erased sector, or a NAck if a sector fails. Status queries are
+ * answered between two sectors.
+ *
+ * @param messageBuffer Buffer holding the command header, the request is received after it.
+ * @param dataLength Length of the request, must be BTL_ERASE_REQUEST.
+ * @return BTL_StatusTypeDef Status of the erase start.
  */
-static BTL_StatusTypeDef BTL_SendAck(BTL_CMDTypeDef cmdID)
+BTL_StatusTypeDef BTL_FlashErase(uint8_t* messageBuffer, uint16_t dataLength)
 {
-    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
-    /* Send cmd ID as Acknowledgment */
-    if (BTL_SendMessage("%c", cmdID) == BTL_OK)
+    BTL_StatusTypeDef BTL_STATUS = BTL_OK;
+
+    if (BTL_ReceiveRequest(messageBuffer, dataLength, BTL_ERASE_REQUEST) != BTL_OK)
     {
-        BTL_STATUS = BTL_OK;
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+
+    uint8_t firstSector = messageBuffer[BTL_DONE_FLAG];
+    uint8_t nbSectors = messageBuffer[BTL_DONE_FLAG + 1];
+
+    if (nbSectors == 0U)
+    {
+        firstSector = BTL_APP_FIRST_SECTOR;
+        nbSectors = BTL_APP_NB_SECTORS;
+    }
+
+    /* The bootloader sectors are never erased */
+    if ((firstSector < BTL_APP_FIRST_SECTOR) || (firstSector + nbSectors > BTL_NB_SECTORS))
+    {
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
+
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, BTL_FLASH_ERASE, 0);
+    BTL_STATUS = BTL_SendMessage("%cfirst=%u count=%u\r\n", BTL_FLASH_ERASE, firstSector, nbSectors);
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+    if (BTL_STATUS != BTL_OK)
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_AppErased = 0;
+    BTL_PortFlashUnlock();
+
+    /* The erase overwrites what a suspended session programmed */
+    if (BTL_Session.BTL_STATE == BTL_SESSION_SUSPENDED)
+    {
+        BTL_Session.BTL_STATE = BTL_SESSION_IDLE;
+        BTL_JournalClose(BTL_Session.BTL_ID);
+    }
+
+    BTL_STATUS = BTL_EraseStart(firstSector, nbSectors, 1);
+    if (BTL_STATUS != BTL_OK)
+    {
+        BTL_PortFlashLock();
+        BTL_SendNAck();
+    }
+    else if (firstSector + nbSectors > BTL_JOURNAL_SECTOR)
+    {
+        /* The erase job lets the link entry queued behind it be programmed before locking */
+        BTL_JournalReset();
+        BTL_LinkKeep();
     }
+
     return BTL_STATUS;
 }
 
 /**
- * @brief Send a negative acknowledgment.
- * @return BTL_StatusTypeDef Status of the negative acknowledgment transmission.
+ * @brief Start the erase job on a range of sectors, the flash must be unlocked.
+ * @param firstSector First sector to erase.
+ * @param nbSectors Number of sectors to erase.
+ * @param report 1 to send one progress message per erased sector.
+ * @return BTL_StatusTypeDef BTL_ERROR if a sector could not be queued, no job is started then.
  */
-static BTL_StatusTypeDef BTL_SendNAck()
+static BTL_StatusTypeDef BTL_EraseStart(uint8_t firstSector, uint8_t nbSectors, uint8_t report)
 {
-    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
-    /* Send ID as A */
-    if (BTL_SendMessage("%c", 0) == BTL_OK)
+    BTL_TRACE(BTL_TRACE_ERASE_BEGIN, firstSector, nbSectors);
+
+    BTL_EraseJob.BTL_FIRST_SECTOR = firstSector;
+    BTL_EraseJob.BTL_SECTOR_COUNT = nbSectors;
+    BTL_EraseJob.BTL_ERASED_SECTORS = 0;
+    BTL_EraseJob.BTL_DONE_SECTORS = 0;
+    BTL_EraseJob.BTL_FAILED = 0;
+    BTL_EraseJob.BTL_REPORT = report;
+    BTL_EraseJob.BTL_TICK = BTL_PortGetTick();
+
+    BTL_StatusTypeDef BTL_STATUS = BTL_OK;
+
+    /* One flash queue operation per sector, BTL_EraseDone counts them */
+    for (uint8_t sector = firstSector; sector < firstSector + nbSectors; sector++)
     {
-        BTL_STATUS = BTL_OK;
+        BTL_STATUS = BTL_FlashQueueErase(sector, BTL_EraseDone);
+        if (BTL_STATUS != BTL_OK)
+        {
+            break;
+        }
+    }
+
+    if (BTL_STATUS != BTL_OK)
+    {
+        /* No job is started, the sectors already queued are let run before the caller locks the flash */
+        BTL_FlashQueueWait();
+        BTL_TRACE(BTL_TRACE_ERASE_END, BTL_STATUS, 0);
+        BTL_EraseJob.BTL_SECTOR_COUNT = 0;
     }
+
     return BTL_STATUS;
 }
 
 /**
- * @brief Get the bootloader version and send it over UART.
- * @return BTL_StatusTypeDef Status of the version information transmission.
+ * @brief Flash queue callback of a sector erase.
+ * @param sector Erased sector.
+ * @param length Unused, 0 for an erase.
+ * @param BTL_STATUS Result of the erase.
  */
-BTL_StatusTypeDef BTL_GetVersion()
+static void BTL_EraseDone(uint32_t sector, uint16_t length, BTL_StatusTypeDef BTL_STATUS)
 {
-    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
-    if (BTL_SendMessage("Bootloader Version: %c.%c.%c\r\n", BTL_V_MAJOR, BTL_V_MINOR, BTL_V_PATCH) == BTL_OK)
+    if (BTL_STATUS == BTL_OK)
     {
-        BTL_STATUS = BTL_OK;
+        BTL_EraseJob.BTL_DONE_SECTORS++;
+    }
+    else
+    {
+        BTL_EraseJob.BTL_FAILED = 1;
     }
-    return BTL_STATUS;
 }
 
 /**
- * @brief Update firmware based on the provided message buffer.
- *
- * This function manages the firmware update process using the received
- * message buffer. It involves sending acknowledgment, erasing flash sectors,
- * and flashing the received packets to memory.
- *
- * @param messageBuffer Buffer containing the firmware update data.
- * @param dataLength Length of the data in the buffer.
- * @return BTL_StatusTypeDef Status of the firmware update operation.
+ * @brief Erase job: report the sectors erased since the last step and end the job on the last one or a failure.
  */
-BTL_StatusTypeDef BTL_UpdateFirmware(uint8_t* messageBuffer, uint16_t dataLength)
+static void BTL_EraseStep(void)
 {
-    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
-    BTL_StatusTypeDef BTL_DONE = BTL_ERROR;
+    uint8_t nbSectors = BTL_EraseJob.BTL_SECTOR_COUNT;
+    uint8_t erasedSectors = BTL_EraseJob.BTL_ERASED_SECTORS;
 
-    /* Transmit an acknowledgment to signal MCU readiness for flashing */
-    if (BTL_SendAck(BTL_APP_FLASH) != BTL_OK) {
-        return BTL_ERROR;
+    if (nbSectors == 0U)
+    {
+        return;
     }
 
-    /* Begin receiving the first packet of the program, prefixed with metadata:
-     * BTL_DONE_FLAG            0 - Indicates if this is the last packet or not.
-     * BTL_BUFFER_RECORDS0      1 - Indicates how many records are in the received buffer for iteration.
-     * BTL_BUFFER_NEXT_SIZE0    3
-     * BTL_BUFFER_NEXT_SIZE1    4 - Indicates how much data will be sent in the next packet.
-     */
-    if (HAL_UART_Receive(&huart1, &messageBuffer[BTL_DONE_FLAG], dataLength + 4, HAL_MAX_DELAY) != HAL_OK)
+    BTL_StatusTypeDef BTL_STATUS = BTL_EraseJob.BTL_FAILED ? BTL_ERROR : BTL_OK;
+
+    erasedSectors = BTL_EraseJob.BTL_DONE_SECTORS;
+
+    for (; BTL_EraseJob.BTL_ERASED_SECTORS < erasedSectors; BTL_EraseJob.BTL_ERASED_SECTORS++)
     {
-        return BTL_ERROR; /* Return error if packet reception fails */
+        BTL_EraseJob.BTL_TICK = BTL_PortGetTick();
+        if (BTL_EraseJob.BTL_REPORT)
+        {
+            BTL_SendMessage("%csector=%u erased=%u/%u\r\n", BTL_FLASH_ERASE,
+                            BTL_EraseJob.BTL_FIRST_SECTOR + BTL_EraseJob.BTL_ERASED_SECTORS,
+                            BTL_EraseJob.BTL_ERASED_SECTORS + 1U, nbSectors);
+        }
     }
 
-    /* Counter to exit the loop in case of too many failures */
-    uint8_t FlashFailure = 0;
+    /* Erasing a sector never takes longer than BTL_ERASE_SECTOR_TIMEOUT */
+    if ((BTL_STATUS == BTL_OK) && (erasedSectors < nbSectors) &&
+        (BTL_PortGetTick() - BTL_EraseJob.BTL_TICK < BTL_ERASE_SECTOR_TIMEOUT))
+    {
+        return;
+    }
+
+    if (erasedSectors < nbSectors)
+    {
+        BTL_STATUS = BTL_ERROR;
+    }
+    if (BTL_STATUS != BTL_OK)
+    {
+        /* Sectors still queued after a failure or a timeout are let run, whatever starts next never overlaps them */
+        BTL_FlashQueueWait();
+    }
+    BTL_TRACE(BTL_TRACE_ERASE_END, BTL_STATUS, 0);
+    BTL_EraseJob.BTL_SECTOR_COUNT = 0;
 
-    /* Start erasing the flash to prepare for writing */
-    static FLASH_EraseInitTypeDef EraseInitStruct;
-    uint32_t SECTOR_ERROR = 0;
+    if (!BTL_EraseJob.BTL_REPORT)
+    {
+        /* The session keeps the flash unlocked and refuses its first packet after a failure */
+        BTL_Session.BTL_ERASE_FAILED = (BTL_STATUS != BTL_OK);
+        BTL_Session.BTL_ACTIVITY = BTL_PortGetTick();
+        BTL_Session.BTL_STATE = BTL_SESSION_FIRST_PACKET;
+        return;
+    }
 
-    HAL_FLASH_Unlock();
+    /* The link entry queued behind the erase is programmed before the flash is locked */
+    BTL_FlashQueueWait();
+    BTL_PortFlashLock();
 
-    EraseInitStruct.TypeErase = FLASH_TYPEERASE_SECTORS;
-    EraseInitStruct.Banks = FLASH_BANK_1;
-    EraseInitStruct.Sector = FLASH_SECTOR_2;
-    EraseInitStruct.NbSectors = 4;
+    if (BTL_STATUS != BTL_OK)
+    {
+        BTL_SendNAck();
+    }
+    else if ((BTL_EraseJob.BTL_FIRST_SECTOR <= BTL_APP_FIRST_SECTOR) &&
+             (BTL_EraseJob.BTL_FIRST_SECTOR + nbSectors >= BTL_APP_FIRST_SECTOR + BTL_APP_NB_SECTORS))
+    {
+        BTL_AppErased = 1;
+    }
+}
 
-    HAL_FLASHEx_Erase(&EraseInitStruct, &SECTOR_ERROR);
+/**
+ * @brief Start the link in the profile kept in the update journal, if there is one.
+ *
+ * The first command must then arrive within BTL_LINK_PROBE_TIMEOUT at the
+ * stored baud rate, BTL_ProcessMessage and the link job fall back to the
+ * default one otherwise.
+ */
+void BTL_LinkInit(void)
+{
+    BTL_LinkDefaultBaud = BTL_PortGetBaudRate();
+    BTL_JournalFindLink(&BTL_LinkProfile);
 
-    /* If SECTOR_ERROR == 0xFFFFFFFFU, erasing is complete */
-    if (SECTOR_ERROR == 0xFFFFFFFFU)
+    if ((BTL_LinkProfile.BTL_BAUD_RATE != 0U) && (BTL_LinkProfile.BTL_BAUD_RATE != BTL_LinkDefaultBaud) &&
+        (BTL_PortSetBaudRate(BTL_LinkProfile.BTL_BAUD_RATE) == BTL_OK))
     {
-        do
-        {
-        	/* Update the status indicating whether the process is complete or ongoing */
-            BTL_DONE = messageBuffer[BTL_DONE_FLAG];
+        BTL_LinkProbing = 1;
+        BTL_LinkProbeStart = BTL_PortGetTick();
+    }
+    else
+    {
+        BTL_PortReceiveStart();
+    }
+}
 
-            /* RecordsData holds the current record for writing to memory */
-            BTL_RecordTypeDef* RecordsData = malloc(sizeof(BTL_RecordTypeDef));
+/**
+ * @brief Queue the link entry of the active profile behind an erase of the journal, the flash must be unlocked.
+ */
+static void BTL_LinkKeep(void)
+{
+    if (BTL_LinkProfile.BTL_BAUD_RATE != 0U)
+    {
+        BTL_JournalAppendLink(&BTL_LinkProfile);
+    }
+}
 
-            /* Check allocation error */
-            if (RecordsData == NULL)
-            {
-                return BTL_ERROR;
-            }
+/**
+ * @brief Link job: close the probe window of a stored profile the host did not answer in time.
+ */
+static void BTL_LinkStep(void)
+{
+    if ((BTL_LinkProbing) && (BTL_PortReceiveAvailable() < BTL_HEADER_SIZE) &&
+        (BTL_PortGetTick() - BTL_LinkProbeStart >= BTL_LINK_PROBE_TIMEOUT))
+    {
+        BTL_LinkProbing = 0;
+        BTL_PortSetBaudRate(BTL_LinkDefaultBaud);
+    }
+}
 
-            /* Update information about the current records in the packet */
-            RecordsData->BTL_NO_OF_BUFFER_RECORDS = messageBuffer[BTL_BUFFER_RECORDS0];
-            RecordsData->BTL_RECORD_INDEX = 0;
+/**
+ * @brief Switch the link to the profile the host requests and keep it in the update journal.
+ *
+ * The request is acknowledged at the current baud rate, the host then
+ * resends the BTL_SET_LINK header at the new one. Without that header
+ * within BTL_LINK_PROBE_TIMEOUT the link goes back to the current baud rate
+ * and nothing is stored. A link entry is only appended when the profile
+ * changes, and read back before it counts as stored.
+ *
+ * @param messageBuffer Buffer holding the command header, the request is received after it.
+ * @param dataLength Length of the request, must be BTL_LINK_REQUEST.
+ * @return BTL_StatusTypeDef Status of the profile switch.
+ */
+BTL_StatusTypeDef BTL_SetLink(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    BTL_LinkProfileTypeDef profile;
+    BTL_LinkProfileTypeDef storedProfile;
+    uint8_t baudSupported = 0;
 
-            /* Initiate flashing for the received packet. */
-            BTL_StatusTypeDef BTL_FLASH_STATUS = BTL_FlashWrite(&messageBuffer[BTL_DATA_START], dataLength, RecordsData);
+    if (BTL_ReceiveRequest(messageBuffer, dataLength, BTL_LINK_REQUEST) != BTL_OK)
+    {
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
 
-            /* Check for any allocation errors */
-            if (BTL_FLASH_STATUS == BTL_OK)
-            {
-                BTL_SendAck(BTL_APP_FLASH);
-                BTL_STATUS = BTL_OK;
-            }
-            else
-            {
-                BTL_SendNAck();
-                FlashFailure++;
-                BTL_STATUS = BTL_ERROR;
-                break;
-            }
+    profile.BTL_BAUD_RATE = BTL_GetWord(&messageBuffer[BTL_DONE_FLAG]);
+    profile.BTL_MAX_PACKET = messageBuffer[BTL_DONE_FLAG + 4] | (messageBuffer[BTL_DONE_FLAG + 5] << 8);
+    profile.BTL_MAX_RECORD = messageBuffer[BTL_DONE_FLAG + 6];
+    profile.BTL_FLAGS = messageBuffer[BTL_DONE_FLAG + 7];
 
-            /** Update the dataLength to begin receiving the next packet. */
-            dataLength = (messageBuffer[BTL_BUFFER_NEXT_SIZE0] << 4) | messageBuffer[BTL_BUFFER_NEXT_SIZE1];
+    for (uint8_t baudIndex = 0; baudIndex < BTL_NB_BAUD_RATES; baudIndex++)
+    {
+        if (BTL_BaudRate[baudIndex] == profile.BTL_BAUD_RATE)
+        {
+            baudSupported = 1;
+        }
+    }
 
-            /* Clear the messageBuffer to prepare for receiving the next packet. */
-            memset(messageBuffer, 0, DATA_BUFFER_SIZE);
+    if ((!baudSupported) || (profile.BTL_MAX_PACKET == 0U) || (profile.BTL_MAX_PACKET > BTL_MAX_PACKET_SIZE) ||
+        (profile.BTL_MAX_RECORD == 0U))
+    {
+        BTL_SendNAck();
+        return BTL_ERROR;
+    }
 
-            free(RecordsData);
+    uint32_t currentBaud = BTL_PortGetBaudRate();
 
-            /* Check for timeout or the last packet; if true, end the process. */
-            if ((FlashFailure >= MAX_TIMEOUT) || (BTL_DONE == BTL_OK)) {
-                break;
-            }
+    BTL_TRACE(BTL_TRACE_ACK_BEGIN, BTL_SET_LINK, 0);
+    BTL_STATUS = BTL_SendMessage("%cbaud=%lu\r\n", BTL_SET_LINK, (unsigned long) profile.BTL_BAUD_RATE);
+    BTL_TRACE(BTL_TRACE_ACK_END, BTL_STATUS, 0);
+    if (BTL_STATUS != BTL_OK)
+    {
+        return BTL_ERROR;
+    }
 
-            /** Start the reception of the next packet. */
-            else if (HAL_UART_Receive(&huart1, &messageBuffer[BTL_CMD_TYPE], dataLength + 4, HAL_MAX_DELAY) != HAL_OK)
-            {
-                return BTL_ERROR;
-            }
+    /* The host confirms the new baud rate with the header of the same command */
+    if ((BTL_PortSetBaudRate(profile.BTL_BAUD_RATE) != BTL_OK) ||
+        (BTL_Receive(&messageBuffer[0], BTL_HEADER_SIZE, BTL_LINK_PROBE_TIMEOUT) != BTL_OK) ||
+        (messageBuffer[BTL_CMD_TYPE] != BTL_SET_LINK))
+    {
+        BTL_PortSetBaudRate(currentBaud);
+        return BTL_ERROR;
+    }
 
-        } while (BTL_DONE != BTL_OK);
+    uint8_t stored = (memcmp(&BTL_LinkProfile, &profile, sizeof(profile)) == 0);
 
+    /* The entries left belong to the checkpoints of a suspended session */
+    if ((!stored) && (BTL_Session.BTL_STATE != BTL_SESSION_SUSPENDED))
+    {
+        BTL_PortFlashUnlock();
+        if (BTL_JournalAppendLink(&profile) == BTL_OK)
+        {
+            BTL_FlashQueueWait();
+            BTL_JournalFindLink(&storedProfile);
+            stored = (memcmp(&storedProfile, &profile, sizeof(profile)) == 0);
+        }
+        BTL_PortFlashLock();
     }
-    else
+    if (stored)
     {
-        BTL_STATUS = BTL_ERROR;
+        BTL_LinkProfile = profile;
     }
 
-    HAL_FLASH_Lock();
+    return BTL_SendMessage("%cstored=%u free=%u\r\n", BTL_SET_LINK, stored, BTL_JournalFree());
+}
 
-    return BTL_STATUS;
+/**
+ * @brief Send the current baud rate and the stored link profile (see BTL_Private.h).
+ * @param messageBuffer Buffer holding the command header.
+ * @param dataLength Length of the request, unused.
+ * @return BTL_StatusTypeDef Status of the profile transmission.
+ */
+BTL_StatusTypeDef BTL_OtpRead(uint8_t* messageBuffer, uint16_t dataLength)
+{
+    uint8_t reply[BTL_REPLY_SIZE] = {0};
+
+    reply[0] = BTL_OTP_READ;
+    BTL_PutWord(&reply[1], BTL_PortGetBaudRate());
+    BTL_PutWord(&reply[5], BTL_LinkProfile.BTL_BAUD_RATE);
+    BTL_PutHalfWord(&reply[9], BTL_LinkProfile.BTL_MAX_PACKET);
+    reply[11] = BTL_LinkProfile.BTL_MAX_RECORD;
+    reply[12] = BTL_LinkProfile.BTL_FLAGS;
+    reply[13] = (BTL_JOURNAL_ENTRIES - 1U) - BTL_JournalFree();
+    reply[14] = BTL_JOURNAL_ENTRIES - 1U;
+
+    return BTL_SendReply(reply, 15);
 }
 
 /**
@@ -266,8 +2159,6 @@ static BTL_StatusTypeDef BTL_HexFlasher(uint8_t* dataBuffer, BTL_RecordTypeDef*
 {
     BTL_StatusTypeDef BTL_STATUS = BTL_OK;
 
-    currentRecord->BTL_ADDRESS_HIGH = 0x0800;
-
     /* Parse the Record Type of the current record from the buffer */
     currentRecord->BTL_RECORD_TYPE = BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_RT_0]) << 4 |
                                      BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_RT_1]);
@@ -276,6 +2167,12 @@ static BTL_StatusTypeDef BTL_HexFlasher(uint8_t* dataBuffer, BTL_RecordTypeDef*
     currentRecord->BTL_CC = (BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_CC_0]) << 4) |
                              BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_CC_1]);
 
+    /* A long record must still end inside the packet */
+    if (currentRecord->BTL_BUFFER_POINTER + (currentRecord->BTL_CC) * 2 + BTL_RECORD_OVERHEAD > currentRecord->BTL_BUFFER_LENGTH)
+    {
+        return BTL_ERROR;
+    }
+
     /* Parse the CheckSum of the current record from the buffer */
     currentRecord->BTL_CHECKSUM = (BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + currentRecord->BTL_CC*2 + 8]) << 4) |
                                    BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + currentRecord->BTL_CC*2 + 9]);
@@ -283,9 +2180,12 @@ static BTL_StatusTypeDef BTL_HexFlasher(uint8_t* dataBuffer, BTL_RecordTypeDef*
     /* If End Of The file, then return BTL_OK */
     if (currentRecord->BTL_RECORD_TYPE == BTL_EOF_RECORD_TYPE)
     {
+        /* Point past it, the expected image CRC may follow */
+        currentRecord->BTL_BUFFER_POINTER += BTL_RECORD_OVERHEAD;
         return BTL_OK;
     }
-    else if (currentRecord->BTL_RECORD_TYPE == BTL_DATA_RECORD_TYPE)
+    else if ((currentRecord->BTL_RECORD_TYPE == BTL_DATA_RECORD_TYPE) ||
+             (currentRecord->BTL_RECORD_TYPE == BTL_FILL_RECORD_TYPE))
     {
         /* Begin parsing the address of the current record from the buffer */
         currentRecord->BTL_ADD = ((currentRecord->BTL_ADDRESS_HIGH) << 16) |
@@ -297,17 +2197,55 @@ static BTL_StatusTypeDef BTL_HexFlasher(uint8_t* dataBuffer, BTL_RecordTypeDef*
         /* Validate the record */
         if (BTL_CheckRecord(dataBuffer ,currentRecord) == BTL_OK)
         {
-            /* If the record is valid, then start flashing Record Byte by byte */
-            for (uint8_t bytesCounter = 0; bytesCounter < currentRecord->BTL_CC; bytesCounter++)
+            /* If the record is valid, decode its bytes and queue them as one run,
+             * the flash interrupt programs it, see BTL_FlashQueue.c for what runs meanwhile */
+            uint8_t recordData[BTL_MAX_CC];
+
+            for (uint16_t bytesCounter = 0; bytesCounter < currentRecord->BTL_CC; bytesCounter++)
             {
                 currentRecord->BTL_DATA = (BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_DATA_0 + bytesCounter * 2]) << 4) |
                                           BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_DATA_1 + bytesCounter * 2]);
+                recordData[bytesCounter] = currentRecord->BTL_DATA;
+            }
+
+            uint16_t runLength = currentRecord->BTL_CC;
+
+            /* A fill record stands for its run, queued from recordData filled with its byte */
+            if (currentRecord->BTL_RECORD_TYPE == BTL_FILL_RECORD_TYPE)
+            {
+                if (currentRecord->BTL_CC != BTL_FILL_CC)
+                {
+                    return BTL_ERROR;
+                }
+                runLength = (recordData[1] << 8) | recordData[2];
+                memset(recordData, recordData[0], sizeof(recordData));
+            }
+
+            /* The update journal ends the application area and the flash, a run
+             * must end before it: a fill record may stand for 64K bytes */
+            if (currentRecord->BTL_ADD + BTL_BOOTLOADER_SIZE + runLength > BTL_JOURNAL_BASE)
+            {
+                return BTL_ERROR;
+            }
 
-                BTL_STATUS = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, currentRecord->BTL_ADD + BTL_BOOTLOADER_SIZE + bytesCounter, currentRecord->BTL_DATA);
+            BTL_TRACE(BTL_TRACE_PROGRAM_BEGIN, currentRecord->BTL_ADD + BTL_BOOTLOADER_SIZE, runLength);
+            for (uint32_t runOffset = 0; (runOffset < runLength) && (BTL_STATUS == BTL_OK); runOffset += BTL_MAX_CC)
+            {
+                uint16_t chunkLength = (runLength - runOffset < BTL_MAX_CC) ? (runLength - runOffset) : BTL_MAX_CC;
+
+                /* BTL_ProgramDone reads the run back into the image CRC once it is programmed, the
+                 * queue skips the erased bytes so a run of them costs no program operation */
+                BTL_STATUS = BTL_FlashQueueProgram(currentRecord->BTL_ADD + BTL_BOOTLOADER_SIZE + runOffset,
+                                                   recordData, chunkLength, BTL_ProgramDone);
+                if (BTL_STATUS == BTL_OK)
+                {
+                    BTL_Session.BTL_QUEUED_BYTES += chunkLength;
+                }
             }
-            /* Shift the buffer pointer to point to the start of the next record
-             * 11 = 2 (CC) + 4 (ADD) + 2 (RT) + 2 (CHSUM) + 1 (\n) */
-            currentRecord->BTL_BUFFER_POINTER += (currentRecord->BTL_CC) * 2 + 11;
+            BTL_TRACE(BTL_TRACE_PROGRAM_END, BTL_STATUS, 0);
+
+            /* Shift the buffer pointer to point to the start of the next record */
+            currentRecord->BTL_BUFFER_POINTER += (currentRecord->BTL_CC) * 2 + BTL_RECORD_OVERHEAD;
         }
         else
         {
@@ -322,9 +2260,8 @@ static BTL_StatusTypeDef BTL_HexFlasher(uint8_t* dataBuffer, BTL_RecordTypeDef*
                                           ((BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_DATA_2])) << 4) |
                                           BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_DATA_3]);
 
-        /* Shift the buffer pointer to point to the start of the next record
-         * 11 = 2 (CC) + 4 (ADD) + 2 (RT) + 2 (CHSUM) + 1 (\n) */
-        currentRecord->BTL_BUFFER_POINTER += (currentRecord->BTL_CC) * 2 + 11;
+        /* Shift the buffer pointer to point to the start of the next record */
+        currentRecord->BTL_BUFFER_POINTER += (currentRecord->BTL_CC) * 2 + BTL_RECORD_OVERHEAD;
     }
     /* Set the full address */
     else if (currentRecord->BTL_RECORD_TYPE == BTL_START_LINEAR_ADDR_RECORD)
@@ -338,9 +2275,8 @@ static BTL_StatusTypeDef BTL_HexFlasher(uint8_t* dataBuffer, BTL_RecordTypeDef*
                                  ((BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_FULL_ADD6])) << 4)  |
                                  BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + BTL_FULL_ADD7]);
 
-        /* Shift the buffer pointer to point to the start of the next record
-         * 11 = 2 (CC) + 4 (ADD) + 2 (RT) + 2 (CHSUM) + 1 (\n) */
-        currentRecord->BTL_BUFFER_POINTER += (currentRecord->BTL_CC) * 2 + 11;
+        /* Shift the buffer pointer to point to the start of the next record */
+        currentRecord->BTL_BUFFER_POINTER += (currentRecord->BTL_CC) * 2 + BTL_RECORD_OVERHEAD;
     }
     else
     {
@@ -365,6 +2301,7 @@ static BTL_StatusTypeDef BTL_FlashWrite(uint8_t* dataBuffer, uint16_t dataLength
     uint8_t FlashFailure = 0;
 
     currentRecord->BTL_BUFFER_POINTER = 0;
+    currentRecord->BTL_BUFFER_LENGTH = dataLength;
 
     /* Iterate until all records received from the packet are flashed */
     while (currentRecord->BTL_RECORD_INDEX < currentRecord->BTL_NO_OF_BUFFER_RECORDS)
@@ -396,16 +2333,14 @@ static BTL_StatusTypeDef BTL_FlashWrite(uint8_t* dataBuffer, uint16_t dataLength
 static BTL_StatusTypeDef BTL_CheckRecord(uint8_t* dataBuffer, BTL_RecordTypeDef* currentRecord) {
     BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
 
-    /* Validate the address and the character count */
-    if ((currentRecord->BTL_ADD >= BTL_MIN_ADDRESS) && (currentRecord->BTL_ADD <= BTL_MAX_ADDRESS) &&
-        (currentRecord->BTL_CC >= BTL_MIN_CC) && (currentRecord->BTL_CC <= BTL_MAX_CC))
+    /* Validate the address, any character count up to BTL_MAX_CC fits the 8 bits BTL_CC */
+    if ((currentRecord->BTL_ADD >= BTL_MIN_ADDRESS) && (currentRecord->BTL_ADD <= BTL_MAX_ADDRESS))
     {
-        /* Calculate and check the checksum received from the PC */
-        uint8_t* CRC_Buffer = NULL;
-        CRC_Buffer = (uint8_t*)calloc(currentRecord->BTL_CC + 4, sizeof(uint8_t));
+        /* Byte count, address, record type and data of the longest record */
+        uint8_t CRC_Buffer[BTL_MAX_CC + 4];
 
         /* Calculate the checksum using some hard-code lol */
-        for (uint8_t bytesCounter = 0; bytesCounter < currentRecord->BTL_CC + 4; bytesCounter++)
+        for (uint16_t bytesCounter = 0; bytesCounter < currentRecord->BTL_CC + 4; bytesCounter++)
         {
             CRC_Buffer[bytesCounter] = (BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + bytesCounter * 2]) << 4) |
                                         BTL_ASCHIIToHex(dataBuffer[currentRecord->BTL_BUFFER_POINTER + bytesCounter * 2 + 1]);
@@ -417,8 +2352,6 @@ static BTL_StatusTypeDef BTL_CheckRecord(uint8_t* dataBuffer, BTL_RecordTypeDef*
         if (mcuCHECKSUM == currentRecord->BTL_CHECKSUM) {
             BTL_STATUS = BTL_OK;
         }
-
-        free(CRC_Buffer);
     }
 
     return BTL_STATUS;
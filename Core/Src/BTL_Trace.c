@@ -0,0 +1,128 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.1.1                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#include "BTL_Trace.h"
+#include "BTL_Port.h"
+
+#define BTL_TRACE_RING_MASK       (BTL_TRACE_RING_SIZE - 1U)
+
+/* The ring is lock-free: producers (thread or ISR) reserve a slot by moving
+ * BTL_TraceHead with a compare-and-swap and publish it by writing BTL_SYNC
+ * last. The only consumer is the USART2 DMA, it sends complete events
+ * straight from the ring and BTL_TraceTail moves when the transfer ends. */
+static BTL_TraceEventTypeDef BTL_TraceRing[BTL_TRACE_RING_SIZE];
+static uint32_t BTL_TraceHead;
+static uint32_t BTL_TraceTail;
+static uint32_t BTL_TraceInFlight;
+static uint32_t BTL_TraceDropped;
+static uint8_t BTL_TraceBusy;
+
+/**
+ * @brief Start the timestamp counter and record its clock as the first event.
+ */
+void BTL_TraceInit(void)
+{
+    BTL_TraceEvent(BTL_TRACE_CLOCK, BTL_PortTraceInit(), 0);
+}
+
+/**
+ * @brief Record one event, safe to call from thread and interrupt context.
+ * @param eventId ID of the event.
+ * @param arg0 First argument.
+ * @param arg1 Second argument.
+ */
+void BTL_TraceEvent(BTL_TraceIdTypeDef eventId, uint32_t arg0, uint32_t arg1)
+{
+    uint32_t head = __atomic_load_n(&BTL_TraceHead, __ATOMIC_RELAXED);
+
+    /* Reserve a slot, or drop the event when the DMA is too far behind */
+    do
+    {
+        if (head - __atomic_load_n(&BTL_TraceTail, __ATOMIC_ACQUIRE) >= BTL_TRACE_RING_SIZE)
+        {
+            __atomic_fetch_add(&BTL_TraceDropped, 1U, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&BTL_TraceHead, &head, head + 1U, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    BTL_TraceEventTypeDef* traceEvent = &BTL_TraceRing[head & BTL_TRACE_RING_MASK];
+
+    traceEvent->BTL_SEQUENCE = (uint8_t) head;
+    traceEvent->BTL_EVENT_ID = eventId;
+    traceEvent->BTL_TIMESTAMP = BTL_PortTraceTimestamp();
+    traceEvent->BTL_ARG0 = arg0;
+    traceEvent->BTL_ARG1 = arg1;
+    __atomic_store_n(&traceEvent->BTL_SYNC, BTL_TRACE_SYNC, __ATOMIC_RELEASE);
+
+    /* Report the losses as soon as there is room again */
+    uint32_t droppedEvents = __atomic_exchange_n(&BTL_TraceDropped, 0U, __ATOMIC_RELAXED);
+    if (droppedEvents != 0U)
+    {
+        BTL_TraceEvent(BTL_TRACE_DROPPED, droppedEvents, 0);
+    }
+
+    BTL_TraceDrain();
+}
+
+/**
+ * @brief Hand the complete events at the tail of the ring to the DMA.
+ */
+void BTL_TraceDrain(void)
+{
+    uint8_t idle = 0;
+
+    if (!__atomic_compare_exchange_n(&BTL_TraceBusy, &idle, 1U, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        /* A transfer is running, its completion drains the rest */
+        return;
+    }
+
+    uint32_t tail = BTL_TraceTail;
+    uint32_t head = __atomic_load_n(&BTL_TraceHead, __ATOMIC_ACQUIRE);
+    uint32_t firstSlot = tail & BTL_TRACE_RING_MASK;
+    uint32_t eventCount = 0;
+
+    /* The DMA needs contiguous memory, stop at the end of the ring */
+    while ((tail + eventCount != head) && (firstSlot + eventCount < BTL_TRACE_RING_SIZE) &&
+           (__atomic_load_n(&BTL_TraceRing[firstSlot + eventCount].BTL_SYNC, __ATOMIC_ACQUIRE) == BTL_TRACE_SYNC))
+    {
+        eventCount++;
+    }
+
+    if (eventCount != 0U)
+    {
+        BTL_TraceInFlight = eventCount;
+        if (BTL_PortTraceTransmit((uint8_t*) &BTL_TraceRing[firstSlot],
+                                  (uint16_t) (eventCount * sizeof(BTL_TraceEventTypeDef))) == BTL_OK)
+        {
+            return;
+        }
+        BTL_TraceInFlight = 0;
+    }
+
+    __atomic_store_n(&BTL_TraceBusy, 0U, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Release the events sent by the last transfer and start the next one.
+ */
+void BTL_TraceTransmitComplete(void)
+{
+    uint32_t tail = BTL_TraceTail;
+
+    for (uint32_t eventIndex = 0; eventIndex < BTL_TraceInFlight; eventIndex++)
+    {
+        BTL_TraceRing[(tail + eventIndex) & BTL_TRACE_RING_MASK].BTL_SYNC = 0;
+    }
+
+    __atomic_store_n(&BTL_TraceTail, tail + BTL_TraceInFlight, __ATOMIC_RELEASE);
+    BTL_TraceInFlight = 0;
+    __atomic_store_n(&BTL_TraceBusy, 0U, __ATOMIC_RELEASE);
+
+    BTL_TraceDrain();
+}
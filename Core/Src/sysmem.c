@@ -22,6 +22,7 @@
 
 /* Includes */
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -77,3 +78,21 @@ void *_sbrk(ptrdiff_t incr)
 
   return (void *)prev_heap_end;
 }
+
+/**
+ * @brief _sbrk_heap_usage() returns how much of the RAM was handed to the
+ *        newlib heap so far, which is the heap high watermark
+ *
+ * @return Heap size in bytes
+ */
+size_t _sbrk_heap_usage(void)
+{
+  extern uint8_t _end; /* Symbol defined in the linker script */
+
+  if (NULL == __sbrk_heap_end)
+  {
+    return 0;
+  }
+
+  return (size_t)(__sbrk_heap_end - &_end);
+}
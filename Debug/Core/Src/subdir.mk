@@ -5,7 +5,12 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 C_SRCS += \
+../Core/Src/BTL_FlashQueue.c \
+../Core/Src/BTL_Frame.c \
+../Core/Src/BTL_Journal.c \
+../Core/Src/BTL_Port.c \
 ../Core/Src/BTL_Program.c \
+../Core/Src/BTL_Trace.c \
 ../Core/Src/crc.c \
 ../Core/Src/gpio.c \
 ../Core/Src/main.c \
@@ -17,7 +22,12 @@ C_SRCS += \
 ../Core/Src/usart.c 
 
 OBJS += \
+./Core/Src/BTL_FlashQueue.o \
+./Core/Src/BTL_Frame.o \
+./Core/Src/BTL_Journal.o \
+./Core/Src/BTL_Port.o \
 ./Core/Src/BTL_Program.o \
+./Core/Src/BTL_Trace.o \
 ./Core/Src/crc.o \
 ./Core/Src/gpio.o \
 ./Core/Src/main.o \
@@ -29,7 +39,12 @@ OBJS += \
 ./Core/Src/usart.o 
 
 C_DEPS += \
+./Core/Src/BTL_FlashQueue.d \
+./Core/Src/BTL_Frame.d \
+./Core/Src/BTL_Journal.d \
+./Core/Src/BTL_Port.d \
 ./Core/Src/BTL_Program.d \
+./Core/Src/BTL_Trace.d \
 ./Core/Src/crc.d \
 ./Core/Src/gpio.d \
 ./Core/Src/main.d \
@@ -48,7 +63,7 @@ Core/Src/%.o Core/Src/%.su Core/Src/%.cyclo: ../Core/Src/%.c Core/Src/subdir.mk
 clean: clean-Core-2f-Src
 
 clean-Core-2f-Src:
-	-$(RM) ./Core/Src/BTL_Program.cyclo ./Core/Src/BTL_Program.d ./Core/Src/BTL_Program.o ./Core/Src/BTL_Program.su ./Core/Src/crc.cyclo ./Core/Src/crc.d ./Core/Src/crc.o ./Core/Src/crc.su ./Core/Src/gpio.cyclo ./Core/Src/gpio.d ./Core/Src/gpio.o ./Core/Src/gpio.su ./Core/Src/main.cyclo ./Core/Src/main.d ./Core/Src/main.o ./Core/Src/main.su ./Core/Src/stm32f4xx_hal_msp.cyclo ./Core/Src/stm32f4xx_hal_msp.d ./Core/Src/stm32f4xx_hal_msp.o ./Core/Src/stm32f4xx_hal_msp.su ./Core/Src/stm32f4xx_it.cyclo ./Core/Src/stm32f4xx_it.d ./Core/Src/stm32f4xx_it.o ./Core/Src/stm32f4xx_it.su ./Core/Src/syscalls.cyclo ./Core/Src/syscalls.d ./Core/Src/syscalls.o ./Core/Src/syscalls.su ./Core/Src/sysmem.cyclo ./Core/Src/sysmem.d ./Core/Src/sysmem.o ./Core/Src/sysmem.su ./Core/Src/system_stm32f4xx.cyclo ./Core/Src/system_stm32f4xx.d ./Core/Src/system_stm32f4xx.o ./Core/Src/system_stm32f4xx.su ./Core/Src/usart.cyclo ./Core/Src/usart.d ./Core/Src/usart.o ./Core/Src/usart.su
+	-$(RM) ./Core/Src/BTL_FlashQueue.cyclo ./Core/Src/BTL_FlashQueue.d ./Core/Src/BTL_FlashQueue.o ./Core/Src/BTL_FlashQueue.su ./Core/Src/BTL_Frame.cyclo ./Core/Src/BTL_Frame.d ./Core/Src/BTL_Frame.o ./Core/Src/BTL_Frame.su ./Core/Src/BTL_Journal.cyclo ./Core/Src/BTL_Journal.d ./Core/Src/BTL_Journal.o ./Core/Src/BTL_Journal.su ./Core/Src/BTL_Port.cyclo ./Core/Src/BTL_Port.d ./Core/Src/BTL_Port.o ./Core/Src/BTL_Port.su ./Core/Src/BTL_Program.cyclo ./Core/Src/BTL_Program.d ./Core/Src/BTL_Program.o ./Core/Src/BTL_Program.su ./Core/Src/BTL_Trace.cyclo ./Core/Src/BTL_Trace.d ./Core/Src/BTL_Trace.o ./Core/Src/BTL_Trace.su ./Core/Src/crc.cyclo ./Core/Src/crc.d ./Core/Src/crc.o ./Core/Src/crc.su ./Core/Src/gpio.cyclo ./Core/Src/gpio.d ./Core/Src/gpio.o ./Core/Src/gpio.su ./Core/Src/main.cyclo ./Core/Src/main.d ./Core/Src/main.o ./Core/Src/main.su ./Core/Src/stm32f4xx_hal_msp.cyclo ./Core/Src/stm32f4xx_hal_msp.d ./Core/Src/stm32f4xx_hal_msp.o ./Core/Src/stm32f4xx_hal_msp.su ./Core/Src/stm32f4xx_it.cyclo ./Core/Src/stm32f4xx_it.d ./Core/Src/stm32f4xx_it.o ./Core/Src/stm32f4xx_it.su ./Core/Src/syscalls.cyclo ./Core/Src/syscalls.d ./Core/Src/syscalls.o ./Core/Src/syscalls.su ./Core/Src/sysmem.cyclo ./Core/Src/sysmem.d ./Core/Src/sysmem.o ./Core/Src/sysmem.su ./Core/Src/system_stm32f4xx.cyclo ./Core/Src/system_stm32f4xx.d ./Core/Src/system_stm32f4xx.o ./Core/Src/system_stm32f4xx.su ./Core/Src/usart.cyclo ./Core/Src/usart.d ./Core/Src/usart.o ./Core/Src/usart.su
 
 .PHONY: clean-Core-2f-Src
 
@@ -0,0 +1,256 @@
+"""End-to-end flashing benchmark.
+
+Runs the flashing protocol over a matrix of image sizes, record lengths,
+packet sizes, baud rates and transfer modes and writes one CSV row per run.
+
+Against the host simulator (build it first with `make -C Host`):
+    python benchmark.py --sim --out before.csv
+
+Against a board in bootloader mode:
+    python benchmark.py --port /dev/ttyUSB0 --bauds 9600,115200 --out board.csv
+
+A board run switches the board to the baud rate of every run with
+BTL_SET_LINK first, --device-baud is the one it answers at when the
+benchmark starts. --framed sends every request as a COBS frame with a
+CRC-16. frame_retries counts the frames the device dropped and the host
+sent again, nack_retries the other requests sent again after a NAck.
+
+predicted_s is the simulator timing model. It is built from datasheet
+figures and has not been validated against a board, compare it with
+wall_s of a board run before relying on it.
+
+Synthetic images are generated from a fixed seed so two runs of the same
+matrix flash exactly the same bytes; use --hex to benchmark a real image.
+With --formats dense,sparse every run is made with and without fill
+records, tx_bytes and program_ops (simulator only) show what they save on
+a padded image:
+    python benchmark.py --sim --hex padded.hex --formats dense,sparse --bauds 115200
+"""
+import argparse
+import csv
+import itertools
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+import serial
+
+import btl_protocol
+
+DEFAULT_SIM = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'Host', 'btl_sim')
+APP_OFFSET = 0x8000  # BTL_BOOTLOADER_SIZE, the device adds it to every record address
+
+CSV_FIELDS = ['target', 'image', 'image_bytes', 'record_len', 'records_per_packet', 'packet_bytes', 'baud',
+              'mode', 'format', 'wall_s', 'payload_Bps', 'tx_bytes', 'rx_bytes', 'round_trips', 'frame_retries',
+              'nack_retries',
+              'predicted_s', 'program_ops', 'stack_peak', 'heap_peak', 'static_bytes', 'flash_queue_peak', 'status']
+FORMATS = ['dense', 'sparse']
+
+
+def synthetic_image(size, seed=2024):
+    generator = random.Random(seed)
+    return bytes(generator.randrange(256) for _ in range(size))
+
+
+def image_to_records(image, recordLength, base=0x08000000):
+    """Return the image as colon-less records, with an Extended Linear Address record every 64K."""
+    records = []
+    currentHigh = None
+    for offset in range(0, len(image), recordLength):
+        address = base + offset
+        if address >> 16 != currentHigh:
+            currentHigh = address >> 16
+            records.append(btl_protocol.hex_record(0, 0x04, currentHigh.to_bytes(2, 'big')))
+        records.append(btl_protocol.hex_record(address & 0xFFFF, 0x00, image[offset:offset + recordLength]))
+    records.append(btl_protocol.hex_record(0, 0x01, b''))
+    return records
+
+
+def records_payload_bytes(records):
+    return sum(btl_protocol.record_data_length(record) for record in records)
+
+
+class SimulatedDevice:
+    """btl_sim running on a private pty, with its flash saved to a file."""
+
+    def __init__(self, simPath, baud, turnaroundMs):
+        self.directory = tempfile.mkdtemp(prefix='btl_bench_')
+        self.link = os.path.join(self.directory, 'tty')
+        self.flashPath = os.path.join(self.directory, 'flash.bin')
+        self.log = open(os.path.join(self.directory, 'sim.log'), 'w+')
+        self.process = subprocess.Popen([simPath, '-f', self.flashPath, '-l', self.link, '-b', str(baud),
+                                         '-t', str(turnaroundMs)], stdout=subprocess.PIPE, stderr=self.log)
+        self.process.stdout.readline()
+
+    def predicted_seconds(self, first, last):
+        """Return the predicted time the simulator reported for commands first to last - 1, one per packet."""
+        self.log.seek(0)
+        matches = re.findall(r'predicted ([0-9.]+) s', self.log.read())[first:last]
+        return f'{sum(float(match) for match in matches):.3f}' if matches else ''
+
+    def program_ops(self):
+        """Return the flash program operations of the simulator so far, its counters are never reset."""
+        self.log.seek(0)
+        matches = re.findall(r'^(?:ok|error): rx \d+ tx \d+ program (\d+)', self.log.read(), re.MULTILINE)
+        return int(matches[-1]) if matches else ''
+
+    def flash_matches(self, image):
+        with open(self.flashPath, 'rb') as flashFile:
+            flashFile.seek(APP_OFFSET)
+            return flashFile.read(len(image)) == image
+
+    def close(self):
+        self.process.terminate()
+        self.process.wait()
+        self.log.close()
+
+
+def run_once(args, image, imageName, recordLength, recordsPerPacket, baud, mode, recordFormat):
+    records = image_to_records(image, recordLength) if image is not None else args.hexRecords
+    if recordFormat == 'sparse':
+        records = btl_protocol.reblock_records(records, recordLength, btl_protocol.FILL_MINIMUM)
+    packets = btl_protocol.build_packets(records, recordsPerPacket)
+    row = {
+        'target': 'sim' if args.sim else args.port,
+        'image': imageName,
+        'image_bytes': records_payload_bytes(records),
+        'record_len': recordLength,
+        'records_per_packet': recordsPerPacket,
+        'packet_bytes': len(packets[0][1]),
+        'baud': baud,
+        'mode': mode,
+        'format': recordFormat,
+    }
+
+    device = None
+    if args.sim:
+        turnaroundMs = int(btl_protocol.GUI_PACKET_DELAY * 1000) if mode == btl_protocol.MODE_GUI else 0
+        device = SimulatedDevice(args.simPath, baud, turnaroundMs)
+        portName = device.link
+    else:
+        portName = args.port
+
+    status = 'ok'
+    port = serial.Serial(portName, baudrate=baud if args.sim else args.deviceBaud, timeout=args.timeout)
+    link = btl_protocol.BootloaderLink(port, mode=mode, timeoutSeconds=args.timeout)
+    memoryUsage = {}
+    startTime = time.perf_counter()
+    try:
+        if not args.sim:
+            # The board is still at the baud rate of the last run
+            flags = btl_protocol.LINK_FLAG_ACK if mode == btl_protocol.MODE_ACK else 0
+            link.setLink(baud, max(len(packet) for header, packet in packets), recordLength, flags)
+            args.deviceBaud = baud
+        if args.framed:
+            link.setFraming(True)
+        startTime = time.perf_counter()
+        link.flashRecords(records, recordsPerPacket)
+        wallTime = time.perf_counter() - startTime
+        # The peaks of the session, latched when it ended
+        memoryUsage = link.getMemoryUsage()
+        if args.framed:
+            # The next run sets its link up bare
+            link.setFraming(False)
+    except btl_protocol.ProtocolError as error:
+        wallTime = time.perf_counter() - startTime
+        status = f'error: {error}'
+    port.close()
+
+    predicted = ''
+    programOps = ''
+    if device:
+        # Let the simulator finish its report before reading it
+        time.sleep(0.1)
+        # Framing, the commands of the flash, memory usage query, framing
+        framingCommands = 1 if args.framed else 0
+        predicted = device.predicted_seconds(framingCommands, -1 - framingCommands)
+        programOps = device.program_ops()
+        if status == 'ok' and image is not None and not device.flash_matches(image):
+            status = 'mismatch'
+        device.close()
+
+    row.update({
+        'wall_s': f'{wallTime:.4f}',
+        'payload_Bps': f'{row["image_bytes"] / wallTime:.0f}',
+        'tx_bytes': link.stats.bytesTx,
+        'rx_bytes': link.stats.bytesRx,
+        'round_trips': link.stats.roundTrips,
+        'frame_retries': link.stats.frameRetries,
+        'nack_retries': link.stats.nackRetries,
+        'predicted_s': predicted,
+        'program_ops': programOps,
+        'stack_peak': memoryUsage.get('stack', ''),
+        'heap_peak': memoryUsage.get('heap', ''),
+        'static_bytes': memoryUsage.get('static', ''),
+        'flash_queue_peak': memoryUsage.get('flashq', ''),
+        'status': status,
+    })
+    return row
+
+
+def int_list(text):
+    return [int(value, 0) for value in text.split(',')]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='End-to-end flashing benchmark, writes CSV.')
+    target = parser.add_mutually_exclusive_group(required=True)
+    target.add_argument('--port', help='serial port of a board in bootloader mode')
+    target.add_argument('--sim', action='store_true', help='run against Host/btl_sim')
+    parser.add_argument('--sim-path', dest='simPath', default=DEFAULT_SIM)
+    parser.add_argument('--hex', help='benchmark this .hex file instead of synthetic images')
+    parser.add_argument('--sizes', type=int_list, default=[4096, 16384, 65536, 196608])
+    parser.add_argument('--record-lengths', dest='recordLengths', type=int_list,
+                        default=[16, btl_protocol.DEFAULT_RECORD_LENGTH])
+    parser.add_argument('--records-per-packet', dest='recordsPerPacket', type=int_list, default=[10, 30, 45])
+    parser.add_argument('--bauds', type=int_list, default=[9600, 115200])
+    parser.add_argument('--device-baud', dest='deviceBaud', type=int, default=9600,
+                        help='baud rate the board answers at when the benchmark starts')
+    parser.add_argument('--framed', action='store_true', help='send every request as a COBS frame with a CRC-16')
+    parser.add_argument('--modes', default=btl_protocol.MODE_ACK,
+                        help='comma separated list of ack,gui (gui adds 0.7 s per packet)')
+    parser.add_argument('--formats', default='dense',
+                        help='comma separated list of dense,sparse (sparse sends runs of a repeated byte as fill '
+                             'records)')
+    parser.add_argument('--repeat', type=int, default=1)
+    parser.add_argument('--timeout', type=float, default=5)
+    parser.add_argument('--out', help='CSV file, default stdout')
+    args = parser.parse_args()
+    recordFormats = args.formats.split(',')
+    if not set(recordFormats) <= set(FORMATS):
+        parser.error(f'--formats takes {",".join(FORMATS)}')
+
+    if args.hex:
+        args.hexRecords = btl_protocol.read_hex_records(args.hex)
+        images = [(None, os.path.basename(args.hex))]
+        recordLengths = [max(int(record[0:2], 16) for record in args.hexRecords)]
+    else:
+        images = [(synthetic_image(size), f'synthetic-{size}') for size in args.sizes]
+        recordLengths = args.recordLengths
+
+    outFile = open(args.out, 'w', newline='') if args.out else sys.stdout
+    writer = csv.DictWriter(outFile, fieldnames=CSV_FIELDS)
+    writer.writeheader()
+
+    matrix = itertools.product(images, recordLengths, args.recordsPerPacket, args.bauds, args.modes.split(','),
+                               recordFormats)
+    for (image, imageName), recordLength, recordsPerPacket, baud, mode, recordFormat in matrix:
+        for _ in range(args.repeat):
+            try:
+                row = run_once(args, image, imageName, recordLength, recordsPerPacket, baud, mode, recordFormat)
+            except btl_protocol.ProtocolError as error:
+                print(f'{imageName} rpp={recordsPerPacket}: skipped, {error}', file=sys.stderr)
+                break
+            writer.writerow(row)
+            outFile.flush()
+
+    if outFile is not sys.stdout:
+        outFile.close()
+
+
+if __name__ == '__main__':
+    main()
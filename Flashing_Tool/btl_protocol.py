@@ -0,0 +1,1113 @@
+"""Host side of the bootloader serial protocol.
+
+Kept free of Qt so the GUI (main.py), the headless flasher (flash_cli.py)
+and the benchmark (benchmark.py) all run the same code.
+"""
+import binascii
+import queue
+import re
+import struct
+import threading
+import time
+
+CMD_GET_VERSION = 0x01
+CMD_GET_HELP = 0x02
+CMD_GET_ID = 0x03
+CMD_FLASH_APP = 0x04
+CMD_FLASH_ERASE = 0x05
+CMD_MEM_READ = 0x06
+CMD_OTP_READ = 0x07
+CMD_EXIT = 0x08
+CMD_GET_MEM_USAGE = 0x09
+CMD_SET_LINK = 0x0A
+CMD_STRIPE = 0x0B
+CMD_FRAMING = 0x0C
+CMD_RESUME = 0x0D
+CMD_BATCH = 0x0E
+
+# BTL_SendMessage always transmits its whole 512 bytes buffer
+REPLY_SIZE = 512
+# Largest packet the device buffer holds: DATA_BUFFER_SIZE - BTL_DATA_START,
+# newer devices report it in the first BTL_APP_FLASH acknowledgment
+MAX_PACKET_DATA = 2048 - 7
+# Longest data record the device parses (BTL_MAX_CC), older bootloaders stop at 16
+MAX_RECORD_LENGTH = 255
+# Length records are re-blocked to by default: the longest that keeps every
+# record word aligned
+DEFAULT_RECORD_LENGTH = 252
+# Adaptive packet sizing: first packet size, smallest size it shrinks to,
+# and acknowledged packets in a row before it grows again
+ADAPTIVE_INITIAL_SIZE = 512
+ADAPTIVE_MINIMUM_SIZE = 128
+ADAPTIVE_GROW_AFTER = 4
+
+# BTL_MEM_READ: request (address, length), chunk header (address, length,
+# sequence) and chunk trailer (CRC-32), all little endian
+MEM_READ_REQUEST = struct.Struct('<II')
+MEM_READ_HEADER = struct.Struct('<IHH')
+MEM_READ_TRAILER = struct.Struct('<I')
+# Times a chunk with a bad CRC is requested again
+MEM_READ_RETRIES = 3
+
+# BTL_SET_LINK request (baud rate, largest packet, longest record, flags) and
+# the BTL_OTP_READ reply after the acknowledgment byte (current baud rate,
+# stored profile, used and total entries of the device journal), all little endian
+LINK_REQUEST = struct.Struct('<IHBB')
+LINK_STATUS = struct.Struct('<IIHBBBB')
+LINK_FLAG_ACK = 0x01
+LINK_FLAG_ADAPTIVE = 0x02
+# The device waits BTL_LINK_PROBE_TIMEOUT (0.5 s) for the first frame at a new baud rate
+LINK_PROBE_SECONDS = 0.4
+
+# BTL_STRIPE request (baud rate of the second lane, 0 turns it off) and the
+# header of every frame of a striped session (sequence, length), little endian
+STRIPE_REQUEST = struct.Struct('<I')
+STRIPE_HEADER = struct.Struct('<HH')
+# Largest frame the device takes (BTL_STRIPE_FRAME)
+STRIPE_FRAME = 256
+
+# BTL_FRAMING request (framing of the requests that follow). A framed request
+# is COBS(request + CRC-16/CCITT-FALSE big endian) followed by FRAME_DELIMITER
+# (layout in BTL_Frame.h); a frame the device drops is answered with a NAck
+# holding frame=bad and sent again, up to FRAME_RETRIES times
+FRAMING_OFF = 0
+FRAMING_COBS = 1
+FRAME_DELIMITER = b'\0'
+FRAME_RETRIES = 3
+
+# BTL_RESUME request (operation, session ID), little endian. RESUME_QUERY
+# reports the session of the device and the records it resumes at,
+# RESUME_START takes it on again from there; every packet then goes out with
+# its header. The device gives up a packet cut short after its
+# BTL_PACKET_TIMEOUT (3 s), a link reopened on a broken session waits
+# RESUME_SETTLE_SECONDS first so its requests are not taken for the rest of
+# that packet
+RESUME_REQUEST = struct.Struct('<BI')
+RESUME_QUERY = 0
+RESUME_START = 1
+RESUME_SETTLE_SECONDS = 3.2
+# A query taken for session bytes is sent again once the device is past its
+# BTL_REQUEST_TIMEOUT (0.5 s) on what is left of it
+RESUME_RETRY_SECONDS = 0.6
+
+# BTL_BATCH: requests run in order in one round trip, answered by one reply
+# (layout in BTL_Private.h): header (BTL_BATCH, sub-commands run, sub-commands
+# sent, status) and an entry (index of the sub-command, length) in front of
+# every reply of the sub-commands run, little endian. A BTL_FLASH_ERASE in a
+# batch is answered once all its sectors are, up to BATCH_ERASE_SECTORS of them
+BATCH_SIZE = 256
+BATCH_REPLY = struct.Struct('<BBBB')
+BATCH_ENTRY = struct.Struct('<BH')
+BATCH_ERASE_SECTORS = 4
+
+# Expected image CRC appended to the last BTL_APP_FLASH packet, the last
+# word of the image is padded with this byte
+IMAGE_CRC = struct.Struct('<I')
+IMAGE_CRC_PAD = 0xFF
+
+# Transfer formats of the BTL_GET_HELP capability descriptor
+FORMAT_NAMES = {0x01: 'hex', 0x02: 'binary', 0x04: 'compressed', 0x08: 'delta', 0x10: 'sparse'}
+
+# Fill record of the sparse format (record type BTL_FILL_RECORD_TYPE): a run
+# of one repeated byte (value uint8, length uint16, big endian like the other
+# record fields) in place of the data records holding it. A run shorter than
+# FILL_MINIMUM bytes costs more on the wire as a fill record and the data
+# record it splits; runs are cut to whole words and at FILL_MAXIMUM bytes
+FILL_RECORD = 0x10
+FILL_MINIMUM = 16
+FILL_MAXIMUM = 0xFFFC
+
+# Transfer modes: 'gui' paces packets like the GUI (sleep + flush before every
+# packet), 'ack' sends the next packet as soon as the acknowledgment arrives
+MODE_GUI = 'gui'
+MODE_ACK = 'ack'
+GUI_PACKET_DELAY = 0.7
+# Read timeout of the port while a ReplyReader owns it, bounds how long stop() takes
+READER_POLL_SECONDS = 0.05
+
+
+class ProtocolError(Exception):
+    pass
+
+
+def check_hex_file_validity(lines):
+    for line in lines:
+        stripped_line = line.rstrip('\r\n')
+        if not stripped_line.startswith(':') or len(stripped_line) < 11 or (len(stripped_line) - 1) % 2 != 0:
+            return False
+    return True
+
+
+def iter_hex_records(file_path):
+    """Yield the records of a .hex file without the leading colon and line ending.
+
+    The file is checked once up front and then read again lazily, so it
+    never has to be held in memory.
+    """
+    with open(file_path, 'r') as file:
+        if not check_hex_file_validity(line for line in file if line.strip()):
+            raise ProtocolError("Invalid hex file format.")
+    with open(file_path, 'r') as file:
+        for line in file:
+            if line.strip():
+                yield line.strip().lstrip(':')
+
+
+def read_hex_records(file_path):
+    """Return the records of a .hex file without the leading colon and line ending."""
+    return list(iter_hex_records(file_path))
+
+
+def record_data_length(record):
+    """Number of image bytes a colon-less data or fill record stands for, 0 for the other record types."""
+    if record[6:8] == '00':
+        return int(record[0:2], 16)
+    if record[6:8] == f'{FILL_RECORD:02X}':
+        return int(record[10:14], 16)
+    return 0
+
+
+def record_data(record):
+    """Return the image bytes of a colon-less data or fill record, b'' for the other record types."""
+    if record[6:8] == f'{FILL_RECORD:02X}':
+        return bytes.fromhex(record[8:10]) * int(record[10:14], 16)
+    if record[6:8] != '00':
+        return b''
+    return bytes.fromhex(record[8:-2])
+
+
+def _crc32_table():
+    table = []
+    for index in range(256):
+        crc = index << 24
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else (crc << 1)
+        table.append(crc & 0xFFFFFFFF)
+    return table
+
+
+CRC32_TABLE = _crc32_table()
+
+
+def cobs_encode(data):
+    """Encode data with COBS, the result holds no 0x00 byte."""
+    encoded = bytearray()
+    for part in bytes(data).split(b'\0'):
+        # Runs of 254 bytes go out as full blocks, no 0x00 follows them
+        while len(part) >= 254:
+            encoded += b'\xff' + part[:254]
+            part = part[254:]
+        encoded += bytes([len(part) + 1]) + part
+    return bytes(encoded)
+
+
+def encode_frame(request):
+    """Frame one request for a device in the FRAMING_COBS framing."""
+    crc = binascii.crc_hqx(request, 0xFFFF)
+    return cobs_encode(request + crc.to_bytes(2, 'big')) + FRAME_DELIMITER
+
+
+def stm32_crc32(data, crc=0xFFFFFFFF):
+    """CRC of the STM32 CRC unit: polynomial 0x04C11DB7, fed one little endian word at a time.
+
+    len(data) must be a multiple of 4.
+    """
+    table = CRC32_TABLE
+    for offset in range(0, len(data), 4):
+        # The unit shifts the word in from its most significant bit
+        for byte in reversed(data[offset:offset + 4]):
+            crc = ((crc << 8) & 0xFFFFFFFF) ^ table[(crc >> 24) ^ byte]
+    return crc
+
+
+class ImageCrc:
+    """stm32_crc32 of the data bytes of a stream of records, the way the device
+    accumulates it while programming: the last word is padded with IMAGE_CRC_PAD."""
+
+    def __init__(self):
+        self.crc = 0xFFFFFFFF
+        self.pending = b''
+
+    def update(self, record):
+        data = record_data(record)
+        if not data:
+            return
+        data = self.pending + data
+        whole = len(data) & ~3
+        self.crc = stm32_crc32(data[:whole], self.crc)
+        self.pending = data[whole:]
+
+    def value(self):
+        if not self.pending:
+            return self.crc
+        return stm32_crc32(self.pending + bytes([IMAGE_CRC_PAD]) * (4 - len(self.pending)), self.crc)
+
+
+def image_crc(records):
+    """Return the CRC the device computes while programming records."""
+    crc = ImageCrc()
+    for record in records:
+        crc.update(record)
+    return crc.value()
+
+
+def image_crc_at(records, count):
+    """Return the CRC of the complete words of the first count records, the crc= of a session checkpoint."""
+    crc = ImageCrc()
+    for record in records[:count]:
+        crc.update(record)
+    return crc.crc
+
+
+def split_packet(packet, skip):
+    """Return the (header, packet) pair of a packet without its first skip records."""
+    records = packet[4:].split(b'\n', skip)
+    payload = records[skip]
+    return encode_length(len(payload)) + bytes([CMD_FLASH_APP]), bytes([packet[0], packet[1] - skip]) + packet[2:4] + payload
+
+
+def hex_record(address, recordType, data):
+    """Return one colon-less record."""
+    fields = bytes([len(data), (address >> 8) & 0xFF, address & 0xFF, recordType]) + bytes(data)
+    return fields.hex().upper() + '%02X' % (-sum(fields) & 0xFF)
+
+
+def fill_runs(address, data, fillMinimum=FILL_MINIMUM):
+    """Yield (start, end) offsets of the runs of one repeated byte in data worth a fill record.
+
+    The runs are cut to whole words of the flash, address is the one of data[0].
+    """
+    for match in re.finditer(rb'(.)\1{%d,}' % (fillMinimum - 1), data, re.DOTALL):
+        start = match.start() + (-(address + match.start()) % 4)
+        end = match.end() - ((address + match.end()) % 4)
+        if end - start >= fillMinimum:
+            yield start, end
+
+
+def reblock_records(records, recordLength=DEFAULT_RECORD_LENGTH, fillMinimum=0):
+    """Merge the data records into records of up to recordLength bytes.
+
+    Contiguous data is cut at recordLength bytes and at every 64K boundary,
+    where an Extended Linear Address record is emitted. Start Linear Address
+    records are kept, the End Of File record closes the result. With a
+    fillMinimum (sparse format) runs of that many equal bytes or more go out
+    as fill records instead.
+    """
+    if not 0 < recordLength <= MAX_RECORD_LENGTH:
+        raise ProtocolError(f"Record length must be between 1 and {MAX_RECORD_LENGTH}.")
+
+    runs = []
+    trailer = []
+    addressHigh = 0
+    for record in records:
+        fields = bytes.fromhex(record)
+        recordType = fields[3]
+        if recordType == 0x00:
+            address = (addressHigh << 16) | (fields[1] << 8) | fields[2]
+            data = fields[4:-1]
+            if runs and runs[-1][0] + len(runs[-1][1]) == address:
+                runs[-1][1].extend(data)
+            else:
+                runs.append((address, bytearray(data)))
+        elif recordType == 0x04:
+            addressHigh = (fields[4] << 8) | fields[5]
+        elif recordType == 0x05:
+            trailer.append(record)
+        elif recordType != 0x01:
+            raise ProtocolError(f"Record type {recordType:#04x} cannot be re-blocked.")
+
+    result = []
+    currentHigh = None
+    for address, data in runs:
+        fills = list(fill_runs(address, bytes(data), fillMinimum)) if fillMinimum else []
+        fills.append((len(data), len(data)))
+        offset = 0
+        for fillStart, fillEnd in fills:
+            while offset < fillEnd:
+                recordAddress = address + offset
+                if recordAddress >> 16 != currentHigh:
+                    currentHigh = recordAddress >> 16
+                    result.append(hex_record(0, 0x04, currentHigh.to_bytes(2, 'big')))
+                # Never cross a 64K boundary inside a record
+                boundary = 0x10000 - (recordAddress & 0xFFFF)
+                if offset < fillStart:
+                    length = min(recordLength, fillStart - offset, boundary)
+                    result.append(hex_record(recordAddress & 0xFFFF, 0x00, data[offset:offset + length]))
+                else:
+                    length = min(FILL_MAXIMUM, fillEnd - offset, boundary)
+                    result.append(hex_record(recordAddress & 0xFFFF, FILL_RECORD,
+                                             bytes([data[offset]]) + length.to_bytes(2, 'big')))
+                offset += length
+    return result + trailer + [hex_record(0, 0x01, b'')]
+
+
+def encode_length(value):
+    """Pack a length the way the device unpacks it: (byte0 << 4) | byte1."""
+    if value > 0xFFF:
+        raise ProtocolError(f"Length {value} does not fit the 12 bits length field.")
+    return bytes([value >> 4, value & 0x0F])
+
+
+def encode_request(command, data=b''):
+    """Return a request: header (data length, command) and its data."""
+    return encode_length(len(data)) + bytes([command]) + bytes(data)
+
+
+def parse_batch_reply(reply):
+    """Decode a BTL_BATCH reply into (status, replies).
+
+    status is 0 when every sub-command ran and none failed; replies holds,
+    for every sub-command run, the list of its replies padded to REPLY_SIZE
+    like replies off the link.
+    """
+    _, run, count, status = BATCH_REPLY.unpack_from(reply)
+    replies = [[] for _ in range(run)]
+    offset = BATCH_REPLY.size
+    while offset + BATCH_ENTRY.size <= len(reply):
+        index, length = BATCH_ENTRY.unpack_from(reply, offset)
+        if length == 0:
+            break
+        offset += BATCH_ENTRY.size
+        if index < run:
+            replies[index].append(reply[offset:offset + length].ljust(REPLY_SIZE, b'\0'))
+        offset += length
+    if run < count and not status:
+        status = 1
+    return status, replies
+
+
+def iter_packets(records, recordsPerPacket):
+    """Yield (header, packet) pairs ready to be written, reading the records lazily.
+
+    The header is [size0, size1, CMD_FLASH_APP], the packet is
+    [done, records, nextSize0, nextSize1] followed by the records, each ended by '\\n'.
+    A packet holds up to recordsPerPacket records, fewer when long records
+    would overflow MAX_PACKET_DATA. Only one packet is read ahead, to fill in
+    the size of the next one. The last packet ends with the image CRC the
+    device checks its programmed bytes against.
+    """
+    if not 0 < recordsPerPacket < 256:
+        raise ProtocolError("Records per packet must be between 1 and 255.")
+    # Every packet leaves room for the CRC, only the last one is known to be last
+    sizeLimit = MAX_PACKET_DATA - IMAGE_CRC.size
+
+    def payloads():
+        chunk = []
+        size = 0
+        crc = ImageCrc()
+        for record in records:
+            line = record.encode('ascii') + b'\n'
+            if len(line) > sizeLimit:
+                raise ProtocolError(f"Record of {len(line)} bytes does not fit the device buffer.")
+            if chunk and (len(chunk) == recordsPerPacket or size + len(line) > sizeLimit):
+                yield len(chunk), b''.join(chunk)
+                chunk = []
+                size = 0
+            chunk.append(line)
+            size += len(line)
+            crc.update(record)
+        if chunk:
+            yield len(chunk), b''.join(chunk) + IMAGE_CRC.pack(crc.value())
+
+    pending = payloads()
+    current = next(pending, None)
+    while current is not None:
+        following = next(pending, None)
+        yield encode_packet(current[1], current[0], len(following[1]) if following else None)
+        current = following
+
+
+def encode_packet(payload, recordCount, nextLength):
+    """Return the (header, packet) pair of one payload, nextLength is None for the last packet."""
+    header = encode_length(len(payload)) + bytes([CMD_FLASH_APP])
+    # The device treats a done flag of 0 (BTL_OK) as the last packet
+    prefix = bytes([0 if nextLength is None else 1, recordCount]) + encode_length(nextLength or 0)
+    return header, prefix + payload
+
+
+def take_records(records, start, sizeLimit):
+    """Return (record count, payload) of the records from start that fit sizeLimit bytes, at least one."""
+    payload = b''
+    index = start
+    while index < len(records) and index - start < 255:
+        line = records[index].encode('ascii') + b'\n'
+        if payload and len(payload) + len(line) > sizeLimit:
+            break
+        payload += line
+        index += 1
+    if len(payload) > MAX_PACKET_DATA:
+        raise ProtocolError(f"Record of {len(payload)} bytes does not fit the device buffer.")
+    return index - start, payload
+
+
+def build_packets(records, recordsPerPacket):
+    """Return all the (header, packet) pairs of iter_packets at once."""
+    return list(iter_packets(records, recordsPerPacket))
+
+
+class PacketSizer:
+    """Chooses the size of the next packet: doubles it after ADAPTIVE_GROW_AFTER
+    acknowledged packets in a row, halves it after a failed packet."""
+
+    def __init__(self, initial=ADAPTIVE_INITIAL_SIZE, minimum=ADAPTIVE_MINIMUM_SIZE, maximum=MAX_PACKET_DATA):
+        self.minimum = minimum
+        self.maximum = maximum
+        self.size = max(minimum, min(initial, maximum))
+        self.streak = 0
+
+    def setMaximum(self, maximum):
+        self.maximum = max(self.minimum, min(maximum, MAX_PACKET_DATA))
+        self.size = min(self.size, self.maximum)
+
+    def success(self):
+        self.streak += 1
+        if self.streak >= ADAPTIVE_GROW_AFTER and self.size < self.maximum:
+            self.size = min(self.size * 2, self.maximum)
+            self.streak = 0
+
+    def failure(self):
+        self.size = max(self.size // 2, self.minimum)
+        self.streak = 0
+
+
+def parse_reply_fields(reply):
+    """Return the key=value fields that follow the acknowledgment byte of a reply, as strings."""
+    text = reply[1:].split(b'\0', 1)[0].decode('ascii', 'replace')
+    return dict(field.split('=', 1) for field in text.split() if '=' in field)
+
+
+def parse_max_packet(reply):
+    """Return the max=<bytes> a BTL_APP_FLASH acknowledgment carries, None from older devices."""
+    value = parse_reply_fields(reply).get('max', '')
+    return int(value) if value.isdigit() else None
+
+
+def parse_session_id(reply):
+    """Return the session=<id> a BTL_APP_FLASH acknowledgment carries, None from older devices."""
+    value = parse_reply_fields(reply).get('session', '')
+    return int(value) if value.isdigit() else None
+
+
+def parse_capabilities(reply):
+    """Decode the capability descriptor of a BTL_GET_HELP reply (layout in BTL_Private.h) into a dict."""
+    fields = struct.unpack_from('<B3BHBBIIHB', reply, 1)
+    protocol, major, minor, patch, maxPacket, window, maxRecord, commands, formats, memReadChunk, baudCount = fields
+    offset = 1 + struct.calcsize('<B3BHBBIIHB')
+    bauds = list(struct.unpack_from(f'<{baudCount}I', reply, offset))
+    offset += 4 * baudCount
+    flashBase, sectorCount = struct.unpack_from('<IB', reply, offset)
+    offset += 5
+    sectors = list(struct.unpack_from(f'<{sectorCount}I', reply, offset))
+    offset += 4 * sectorCount
+    appStart, appSize, deviceId = struct.unpack_from('<III', reply, offset)
+    offset += 12
+    return {
+        'protocol': protocol,
+        'version': f'{major}.{minor}.{patch}',
+        'max_packet': maxPacket,
+        'window': window,
+        'max_record': maxRecord,
+        'commands': [command for command in range(32) if commands >> command & 1],
+        'formats': [name for bit, name in FORMAT_NAMES.items() if formats & bit],
+        'mem_read_chunk': memReadChunk,
+        'baud_rates': bauds,
+        'flash_base': flashBase,
+        'sectors': sectors,
+        'app_start': appStart,
+        'app_size': appSize,
+        'device_id': deviceId,
+        'uid': reply[offset:offset + 12].hex(),
+    }
+
+
+def fastest_settings(capabilities, maxBaud=0):
+    """Return the fastest settings a device supports, from its capability descriptor.
+
+    max_packet: largest packet both sides handle, max_record: longest record,
+    erase_first: erase with BTL_FLASH_ERASE (per sector progress) before flashing,
+    batch: requests can be sent together with BTL_BATCH,
+    sparse: the device takes fill records (reblock_records with a fillMinimum),
+    baud: fastest baud rate up to maxBaud the device switches to with
+    BTL_SET_LINK, None when it cannot switch.
+    """
+    bauds = [baud for baud in capabilities['baud_rates'] if baud <= maxBaud]
+    return {
+        'max_packet': min(capabilities['max_packet'], MAX_PACKET_DATA),
+        'max_record': min(capabilities['max_record'], MAX_RECORD_LENGTH),
+        'erase_first': CMD_FLASH_ERASE in capabilities['commands'],
+        'batch': CMD_BATCH in capabilities['commands'],
+        'sparse': 'sparse' in capabilities['formats'],
+        'baud': max(bauds) if bauds and CMD_SET_LINK in capabilities['commands'] else None,
+    }
+
+
+def parse_link_status(reply):
+    """Decode a BTL_OTP_READ reply: the current baud rate, the stored profile (None when there
+    is none) and the journal entries left for new profiles until the next flashing session."""
+    baud, storedBaud, maxPacket, maxRecord, flags, usedSlots, slots = LINK_STATUS.unpack_from(reply, 1)
+    stored = None
+    if storedBaud:
+        stored = {'baud': storedBaud, 'max_packet': maxPacket, 'max_record': maxRecord, 'flags': flags}
+    return {'baud': baud, 'stored': stored, 'free_slots': slots - usedSlots}
+
+
+class LinkStats:
+    def __init__(self):
+        self.bytesTx = 0
+        self.bytesRx = 0
+        self.roundTrips = 0
+        self.retries = 0
+        self.packets = 0
+        # Frames the device dropped and the host sent again
+        self.frameRetries = 0
+        # Other requests sent again after a NAck
+        self.nackRetries = 0
+        # CRC of the programmed image from the last acknowledgment, and whether
+        # it matched the expected one (None from devices that do not check)
+        self.imageCrc = None
+        self.verified = None
+
+
+class StripedWriter:
+    """Cuts the session stream into sequence-numbered frames and sends every
+    frame on the lane expected to finish it first.
+
+    The finish time of a lane is estimated from the bytes it was given and
+    its baud rate, so a faster lane carries more frames and a slow one is
+    never queued far ahead of the other.
+    """
+
+    def __init__(self, ports, frameSize=STRIPE_FRAME):
+        self.ports = ports
+        self.frameSize = frameSize
+        self.laneBytes = [0] * len(ports)
+        self.reset()
+
+    def reset(self):
+        """Start a new session stream, the device expects sequence 0 again."""
+        self.sequence = 0
+        self.busyUntil = [0.0] * len(self.ports)
+
+    def write(self, data):
+        """Send data, return the number of bytes put on the wire with the frame headers."""
+        sent = 0
+        for offset in range(0, len(data), self.frameSize):
+            chunk = data[offset:offset + self.frameSize]
+            frame = STRIPE_HEADER.pack(self.sequence & 0xFFFF, len(chunk)) + chunk
+            now = time.perf_counter()
+            lane = min(range(len(self.ports)), key=lambda index: max(self.busyUntil[index], now) +
+                       len(frame) * 10 / self.ports[index].baudrate)
+            self.busyUntil[lane] = max(self.busyUntil[lane], now) + len(frame) * 10 / self.ports[lane].baudrate
+            self.ports[lane].write(frame)
+            self.laneBytes[lane] += len(frame)
+            self.sequence += 1
+            sent += len(frame)
+        return sent
+
+
+class ReplyReader(threading.Thread):
+    """Collects the device replies in the background so the sender never polls the port.
+
+    Every complete reply is put on the replies queue; a read error is put
+    there instead and ends the thread.
+    """
+
+    def __init__(self, serialPort):
+        super().__init__(daemon=True)
+        self.serialPort = serialPort
+        self.replies = queue.Queue()
+        self.stopEvent = threading.Event()
+
+    def run(self):
+        pending = b''
+        while not self.stopEvent.is_set():
+            try:
+                data = self.serialPort.read(max(1, self.serialPort.in_waiting))
+            except Exception as error:
+                self.replies.put(ProtocolError(f"Serial read failed: {error}"))
+                return
+            pending += data
+            while len(pending) >= REPLY_SIZE:
+                self.replies.put(pending[:REPLY_SIZE])
+                pending = pending[REPLY_SIZE:]
+
+    def stop(self):
+        self.stopEvent.set()
+        self.join()
+
+
+class BootloaderLink:
+    """Protocol session over an open serial port (pyserial or compatible)."""
+
+    def __init__(self, serialPort, mode=MODE_ACK, timeoutSeconds=5):
+        self.serialPort = serialPort
+        self.mode = mode
+        self.timeoutSeconds = timeoutSeconds
+        self.stats = LinkStats()
+        self.reader = None
+        self.striper = None
+        self.framed = False
+        self.lastFrame = None
+        # Named by the first acknowledgment of a BTL_APP_FLASH session, BTL_RESUME takes it on again
+        self.sessionId = None
+        # Requests sent in one BTL_BATCH with the header opening the next session
+        self.sessionPrelude = []
+
+    def startReader(self):
+        """Hand the receive side of the port to a ReplyReader thread."""
+        if self.mode == MODE_GUI:
+            # The GUI pacing flushes the input, it would race with the reader
+            raise ProtocolError("The reply reader needs the ack transfer mode.")
+        self.serialPort.timeout = READER_POLL_SECONDS
+        self.reader = ReplyReader(self.serialPort)
+        self.reader.start()
+
+    def stopReader(self):
+        if self.reader:
+            self.reader.stop()
+            self.reader = None
+
+    def write(self, data):
+        """Write one request, as one frame when the link is framed."""
+        if self.framed:
+            data = self.lastFrame = encode_frame(bytes(data))
+        self.serialPort.write(data)
+        self.stats.bytesTx += len(data)
+
+    def writeSession(self, data):
+        """Write bytes of a BTL_APP_FLASH session after its first acknowledgment, striped when set up."""
+        if self.striper:
+            self.stats.bytesTx += self.striper.write(data)
+        else:
+            self.write(data)
+
+    def readReply(self):
+        reply = self.readFrameReply()
+        for _ in range(FRAME_RETRIES if self.framed else 0):
+            if reply[0] != 0 or parse_reply_fields(reply).get('frame') != 'bad':
+                break
+            # The delimiter in front ends whatever the device decoded of the lost frame
+            self.serialPort.write(FRAME_DELIMITER + self.lastFrame)
+            self.stats.bytesTx += len(self.lastFrame) + 1
+            self.stats.frameRetries += 1
+            reply = self.readFrameReply()
+        return reply
+
+    def readFrameReply(self):
+        """Read the next REPLY_SIZE reply."""
+        if self.reader:
+            try:
+                reply = self.reader.replies.get(timeout=self.timeoutSeconds)
+            except queue.Empty:
+                raise ProtocolError("Timeout reached while waiting for acknowledgment.")
+            if isinstance(reply, Exception):
+                raise reply
+            self.stats.bytesRx += len(reply)
+            return reply
+
+        deadline = time.time() + self.timeoutSeconds
+        reply = b''
+        while len(reply) < REPLY_SIZE and time.time() < deadline:
+            reply += self.serialPort.read(REPLY_SIZE - len(reply))
+        self.stats.bytesRx += len(reply)
+        if not reply:
+            raise ProtocolError("Timeout reached while waiting for acknowledgment.")
+        return reply
+
+    def waitAck(self, expectedValue):
+        self.stats.roundTrips += 1
+        reply = self.readReply()
+        if reply[0] != expectedValue:
+            raise ProtocolError(f"Unexpected acknowledgment: {reply[0]:#04x}")
+        return reply
+
+    def waitImageAck(self):
+        """Wait for the acknowledgment of the last packet, it carries the CRC of the programmed image."""
+        self.stats.roundTrips += 1
+        reply = self.readReply()
+        fields = parse_reply_fields(reply)
+        if reply[0] == 0 and fields.get('verify') == 'fail':
+            raise ProtocolError(f"Image CRC mismatch: programmed 0x{fields['crc']}, expected 0x{fields['expected']}.")
+        if reply[0] != CMD_FLASH_APP:
+            raise ProtocolError(f"Unexpected acknowledgment: {reply[0]:#04x}")
+        if 'crc' in fields:
+            self.stats.imageCrc = int(fields['crc'], 16)
+            self.stats.verified = fields.get('verify') == 'ok'
+        return reply
+
+    def getVersion(self):
+        self.write(bytes([0x00, 0x00, CMD_GET_VERSION]))
+        self.stats.roundTrips += 1
+        return self.readReply().split(b'\0', 1)[0].decode('ascii', 'replace')
+
+    def getCapabilities(self):
+        """Return the capability descriptor as a dict, None from devices without BTL_GET_HELP."""
+        self.write(bytes([0x00, 0x00, CMD_GET_HELP]))
+        self.stats.roundTrips += 1
+        reply = self.readReply()
+        if reply[0] == 0:
+            return None
+        if reply[0] != CMD_GET_HELP:
+            raise ProtocolError(f"Unexpected acknowledgment: {reply[0]:#04x}")
+        return parse_capabilities(reply)
+
+    def getId(self):
+        """Return (device ID, unique ID as hex) of the device."""
+        self.write(bytes([0x00, 0x00, CMD_GET_ID]))
+        reply = self.waitAck(CMD_GET_ID)
+        deviceId, = struct.unpack_from('<I', reply, 1)
+        return deviceId, reply[5:17].hex()
+
+    def getLinkStatus(self):
+        """Return the parse_link_status dict of the device, None from devices without link profiles."""
+        self.write(bytes([0x00, 0x00, CMD_OTP_READ]))
+        self.stats.roundTrips += 1
+        reply = self.readReply()
+        if reply[0] == 0:
+            return None
+        if reply[0] != CMD_OTP_READ:
+            raise ProtocolError(f"Unexpected acknowledgment: {reply[0]:#04x}")
+        return parse_link_status(reply)
+
+    def setLink(self, baud, maxPacket, maxRecord, flags):
+        """Switch the device and the port to baud and have the device keep the profile in its flash.
+
+        The request is acknowledged at the current baud rate, its header is
+        then sent again at the new one to confirm it. If that fails the port
+        goes back to its baud rate, the device does the same on its own
+        after LINK_PROBE_SECONDS. Returns True when the profile is stored.
+        """
+        if self.reader:
+            raise ProtocolError("Stop the reply reader before changing the baud rate.")
+        header = encode_length(LINK_REQUEST.size) + bytes([CMD_SET_LINK])
+        self.write(header + LINK_REQUEST.pack(baud, maxPacket, maxRecord, flags))
+        self.waitAck(CMD_SET_LINK)
+
+        previousBaud = self.serialPort.baudrate
+        previousTimeout = self.timeoutSeconds
+        self.serialPort.baudrate = baud
+        self.timeoutSeconds = LINK_PROBE_SECONDS
+        try:
+            self.write(header)
+            fields = parse_reply_fields(self.waitAck(CMD_SET_LINK))
+        except ProtocolError:
+            self.serialPort.baudrate = previousBaud
+            time.sleep(LINK_PROBE_SECONDS)
+            self.serialPort.reset_input_buffer()
+            raise
+        finally:
+            self.timeoutSeconds = previousTimeout
+        return fields.get('stored') == '1'
+
+    def setStripe(self, stripePort, baud):
+        """Have the device take the BTL_APP_FLASH sessions striped over this port and stripePort.
+
+        stripePort is the port of the second lane (USART2), opened at baud.
+        None turns striping off again. Returns the number of lanes.
+        """
+        baud = baud if stripePort else 0
+        self.write(encode_length(STRIPE_REQUEST.size) + bytes([CMD_STRIPE]) + STRIPE_REQUEST.pack(baud))
+        fields = parse_reply_fields(self.waitAck(CMD_STRIPE))
+        lanes = int(fields.get('lanes', 1))
+        self.striper = StripedWriter([self.serialPort, stripePort]) if lanes > 1 else None
+        return lanes
+
+    def setFraming(self, framed):
+        """Have the device take every request as one COBS frame with a CRC-16 (framed) or bare.
+
+        Returns the counters of the framing that ends: good frames, dropped
+        frames and noise bytes between frames, as a dict of ints.
+        """
+        if self.striper:
+            raise ProtocolError("Turn striping off before framing the link.")
+        self.write(encode_length(1) + bytes([CMD_FRAMING, FRAMING_COBS if framed else FRAMING_OFF]))
+        fields = parse_reply_fields(self.waitAck(CMD_FRAMING))
+        self.framed = framed
+        return {key: int(fields.get(key, 0)) for key in ('frames', 'bad', 'noise')}
+
+    def querySession(self, retry=True):
+        """Return the session of the device as a dict (session, state, records, offset, crc), None from older devices.
+
+        state is 'none', 'erase', 'active' or 'suspended'; records and offset
+        are the records and data bytes of the packets the session resumes at,
+        crc the image CRC of their complete words (None from older devices).
+        retry sends the query once more after a NAck.
+        """
+        request = encode_length(RESUME_REQUEST.size) + bytes([CMD_RESUME]) + RESUME_REQUEST.pack(RESUME_QUERY, 0)
+        # Once more after a NAck, a session still waiting for its stream takes the first query for it
+        for attempt in range(2 if retry else 1):
+            if attempt:
+                time.sleep(RESUME_RETRY_SECONDS)
+                self.serialPort.reset_input_buffer()
+                self.stats.nackRetries += 1
+            self.write(request)
+            self.stats.roundTrips += 1
+            reply = self.readReply()
+            if reply[0] == CMD_RESUME:
+                break
+        else:
+            return None
+        fields = parse_reply_fields(reply)
+        return {'session': int(fields['session']), 'state': fields['state'],
+                'records': int(fields['records']), 'offset': int(fields['offset']),
+                'crc': int(fields['crc'], 16) if 'crc' in fields else None}
+
+    def resumeSession(self, sessionId):
+        """Take session sessionId on again at its checkpoint, return the records to skip.
+
+        The packets from there go to flashPackets or flashAdaptive with resumeAt.
+        """
+        self.write(encode_length(RESUME_REQUEST.size) + bytes([CMD_RESUME]) +
+                   RESUME_REQUEST.pack(RESUME_START, sessionId))
+        fields = parse_reply_fields(self.waitAck(CMD_RESUME))
+        self.sessionId = sessionId
+        if self.striper:
+            self.striper.reset()
+        return int(fields['records'])
+
+    def runBatch(self, requests, timeoutSeconds=None):
+        """Run requests from encode_request in one BTL_BATCH, return the replies of every one.
+
+        Raises when the device refuses the batch or stops at a failed request.
+        A batch holding a BTL_FLASH_ERASE needs timeoutSeconds long enough for
+        all its sectors.
+        """
+        body = b''.join(requests)
+        if len(body) > BATCH_SIZE:
+            raise ProtocolError(f"Batch of {len(body)} bytes, the device takes {BATCH_SIZE}.")
+        self.write(encode_length(len(body)) + bytes([CMD_BATCH]) + body)
+        previousTimeout = self.timeoutSeconds
+        self.timeoutSeconds = timeoutSeconds or previousTimeout
+        try:
+            reply = self.waitAck(CMD_BATCH)
+        finally:
+            self.timeoutSeconds = previousTimeout
+        status, replies = parse_batch_reply(reply)
+        if status:
+            failed = requests[len(replies) - 1][2] if replies else None
+            raise ProtocolError(f"Batch stopped at request {len(replies)} of {len(requests)}"
+                                f"{f' (command {failed:#04x})' if failed is not None else ''}.")
+        return replies
+
+    def openSession(self, header):
+        """Send the header opening a BTL_APP_FLASH session, return its acknowledgment.
+
+        With a sessionPrelude the header goes out behind those requests in
+        one BTL_BATCH, the prelude is used once.
+        """
+        if not self.sessionPrelude:
+            self.write(header)
+            return self.waitAck(CMD_FLASH_APP)
+        requests = self.sessionPrelude + [header]
+        self.sessionPrelude = []
+        erases = sum(1 for request in requests if request[2] == CMD_FLASH_ERASE)
+        replies = self.runBatch(requests, self.timeoutSeconds * (1 + erases * BATCH_ERASE_SECTORS))
+        return replies[-1][0]
+
+    def getMemoryUsage(self):
+        """Return the device RAM usage as a dict of byte counts.
+
+        The peaks are those of the last BTL_APP_FLASH session once it ended,
+        of the running session since it opened, since reset before the first one.
+        """
+        self.write(bytes([0x00, 0x00, CMD_GET_MEM_USAGE]))
+        self.stats.roundTrips += 1
+        text = self.readReply().split(b'\0', 1)[0].decode('ascii', 'replace')
+        usage = {}
+        for field in text.split():
+            key, _, value = field.partition('=')
+            used, _, available = value.partition('/')
+            usage[key] = int(used)
+            if available:
+                usage[key + '_available'] = int(available)
+        return usage
+
+    def eraseFlash(self, firstSector=0, sectorCount=0, progress=None):
+        """Erase sectorCount sectors from firstSector, 0 sectors erases the whole application area.
+
+        The device reports every erased sector, so timeoutSeconds only has to
+        cover the erase of one sector. progress(sectorsErased, sectorCount)
+        is called after every sector. Returns the number of erased sectors.
+        """
+        self.write(encode_length(2) + bytes([CMD_FLASH_ERASE, firstSector, sectorCount]))
+        fields = parse_reply_fields(self.waitAck(CMD_FLASH_ERASE))
+        sectorCount = int(fields.get('count', sectorCount))
+        for erased in range(1, sectorCount + 1):
+            self.waitAck(CMD_FLASH_ERASE)
+            if progress:
+                progress(erased, sectorCount)
+        return sectorCount
+
+    def flashRecords(self, records, recordsPerPacket, progress=None):
+        """Flash an iterable of colon-less records, progress(packetsSent) is called after every ack."""
+        return self.flashPackets(iter_packets(records, recordsPerPacket), progress)
+
+    def flashPackets(self, packets, progress=None, resumeAt=None):
+        """Flash (header, packet) pairs from build_packets or iter_packets.
+
+        In MODE_ACK the next packet goes out as soon as the previous one is
+        acknowledged. A session taken on again by resumeSession skips its
+        first resumeAt records, the packet they end in goes out with the
+        records that follow them only; resumeAt is None for a new session.
+        """
+        recordsSkipped = 0
+        for index, (header, packet) in enumerate(packets):
+            if recordsSkipped < (resumeAt or 0):
+                recordsSkipped += packet[1]
+                if recordsSkipped <= resumeAt:
+                    continue
+                # Packed differently by the session that was cut short
+                header, packet = split_packet(packet, packet[1] - (recordsSkipped - resumeAt))
+            if index == 0 and resumeAt is None:
+                self.sessionId = parse_session_id(self.openSession(header))
+                if self.striper:
+                    self.striper.reset()
+                header = b''
+            elif self.mode == MODE_GUI:
+                self.writeSession(header)
+                header = b''
+            if self.mode == MODE_GUI:
+                time.sleep(GUI_PACKET_DELAY)
+                self.serialPort.reset_input_buffer()
+            # A packet goes out in one write with its header, one frame on a framed link
+            self.writeSession(b''.join((header, packet)))
+            # The done flag of the last packet is 0
+            if packet[0] == 0:
+                self.waitImageAck()
+            else:
+                self.waitAck(CMD_FLASH_APP)
+            self.stats.packets += 1
+            if progress:
+                progress(index + 1)
+        return self.stats
+
+    def flashAdaptive(self, records, sizer, progress=None, log=None, resumeAt=None):
+        """Flash a list of colon-less records with packets sized by a PacketSizer.
+
+        The size of packet N + 1 goes out in packet N, so every choice uses
+        the acknowledgments up to packet N - 1. A failure shrinks the sizer
+        and raises; the caller restarts the session with the same sizer.
+        progress(recordsSent, totalRecords) is called after every ack and
+        log(text) receives the size and throughput of every packet. A session
+        taken on again by resumeSession starts at record resumeAt, None for
+        a new session.
+        """
+        expectedCrc = IMAGE_CRC.pack(image_crc(records))
+
+        def take(start):
+            # Every packet leaves room for the CRC the last one ends with
+            recordCount, payload = take_records(records, start, sizer.size - IMAGE_CRC.size)
+            if start + recordCount == len(records):
+                payload += expectedCrc
+            return recordCount, payload
+
+        start = resumeAt or 0
+        current = take(start)
+        sessionStart = time.perf_counter()
+        sessionBytes = 0
+        try:
+            while current:
+                recordCount, payload = current
+                following = None
+                if start + recordCount < len(records):
+                    following = take(start + recordCount)
+                header, packet = encode_packet(payload, recordCount, len(following[1]) if following else None)
+
+                packetStart = time.perf_counter()
+                request = b''.join((header, packet))
+                if start == 0 and resumeAt is None:
+                    reply = self.openSession(header)
+                    self.sessionId = parse_session_id(reply)
+                    maximum = parse_max_packet(reply)
+                    if maximum:
+                        sizer.setMaximum(maximum)
+                    if self.striper:
+                        self.striper.reset()
+                    request = packet
+                self.writeSession(request)
+                if following:
+                    self.waitAck(CMD_FLASH_APP)
+                else:
+                    self.waitImageAck()
+                packetTime = time.perf_counter() - packetStart
+
+                sizer.success()
+                sessionBytes += len(header) + len(packet)
+                self.stats.packets += 1
+                if log:
+                    log(f"packet {self.stats.packets}: {len(packet)} bytes, {len(packet) / packetTime:.0f} B/s, "
+                        f"session {sessionBytes / (time.perf_counter() - sessionStart):.0f} B/s")
+                if progress:
+                    progress(start + recordCount, len(records))
+                start += recordCount
+                current = following
+        except ProtocolError:
+            sizer.failure()
+            raise
+        return self.stats
+
+    def readExact(self, length):
+        """Read exactly length raw bytes, outside of the REPLY_SIZE framing."""
+        deadline = time.time() + self.timeoutSeconds
+        data = b''
+        while len(data) < length and time.time() < deadline:
+            data += self.serialPort.read(length - len(data))
+        self.stats.bytesRx += len(data)
+        if len(data) < length:
+            raise ProtocolError("Timeout reached while reading memory.")
+        return data
+
+    def readMemoryChunks(self, address, length):
+        """Request a memory range and yield (address, data, crcOk) for every chunk the device sends."""
+        if self.reader:
+            # The chunks are not REPLY_SIZE frames, the reader would cut them up
+            raise ProtocolError("Stop the reply reader before reading memory.")
+        self.write(encode_length(MEM_READ_REQUEST.size) + bytes([CMD_MEM_READ]) +
+                   MEM_READ_REQUEST.pack(address, length))
+        self.waitAck(CMD_MEM_READ)
+
+        sequence = 0
+        offset = 0
+        while offset < length:
+            chunkAddress, chunkLength, chunkSequence = MEM_READ_HEADER.unpack(self.readExact(MEM_READ_HEADER.size))
+            if chunkAddress != address + offset or chunkSequence != sequence & 0xFFFF or not chunkLength:
+                raise ProtocolError(f"Memory read out of step at chunk {sequence} (0x{chunkAddress:08X}).")
+            data = self.readExact(chunkLength)
+            crc, = MEM_READ_TRAILER.unpack(self.readExact(MEM_READ_TRAILER.size))
+            yield chunkAddress, data, crc == stm32_crc32(data)
+            offset += chunkLength
+            sequence += 1
+
+    def memRead(self, address, length, out, progress=None):
+        """Read length bytes of device memory from address into the seekable binary stream out.
+
+        Both must be multiples of 4. The chunks are written as they arrive;
+        a chunk with a bad CRC is requested again once the range is done, up
+        to MEM_READ_RETRIES times. progress(bytesRead, length) is called
+        after every chunk.
+        """
+        if (address | length) & 3 or not length:
+            raise ProtocolError("Address and length must be non-zero multiples of 4.")
+        start = out.tell()
+        badChunks = []
+        bytesRead = 0
+        for chunkAddress, data, crcOk in self.readMemoryChunks(address, length):
+            out.write(data)
+            if not crcOk:
+                badChunks.append((chunkAddress, len(data)))
+            bytesRead += len(data)
+            if progress:
+                progress(bytesRead, length)
+
+        for chunkAddress, chunkLength in badChunks:
+            for _ in range(MEM_READ_RETRIES):
+                self.stats.retries += 1
+                _, data, crcOk = next(self.readMemoryChunks(chunkAddress, chunkLength))
+                if crcOk:
+                    out.seek(start + chunkAddress - address)
+                    out.write(data)
+                    break
+            else:
+                raise ProtocolError(f"Chunk at 0x{chunkAddress:08X} failed its CRC {MEM_READ_RETRIES + 1} times.")
+        out.seek(start + length)
+        return self.stats
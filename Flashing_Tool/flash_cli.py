@@ -0,0 +1,625 @@
+"""Headless flasher for fixtures and scripts.
+
+Streams a .hex image from disk to a board in bootloader mode with the same
+protocol code as the GUI (btl_protocol.py) and reports the result on stdout:
+
+    python flash_cli.py --port /dev/ttyUSB0 app.hex
+    python flash_cli.py --port /dev/ttyUSB0 --json app.hex
+
+The image is compiled once into the cache of image_cache.py and later runs
+only stream the cached packets; --no-cache streams the records from the
+.hex file instead. Every session first reads the capability descriptor of
+the device (BTL_GET_HELP) and uses the largest packets and the erase
+command it reports, the erase going out in one BTL_BATCH round trip with
+the header opening the session when the device runs batches; --no-probe
+keeps to the command line options. With --max-baud the session also
+switches the device to its fastest baud rate up to that one; the device
+keeps this link profile in its flash and the port keeps it in the cache
+directory, so the next session starts at that baud rate without probing
+(--no-profile turns both off):
+
+    python flash_cli.py --port /dev/ttyUSB0 --max-baud 460800 app.hex
+
+With --stripe-port the packets of a single port session are striped over
+that second port too, wired to USART2 RX of the same board:
+
+    python flash_cli.py --port /dev/ttyUSB0 --stripe-port /dev/ttyUSB1 --stripe-baud 460800 app.hex
+
+With --framed every request goes out as a COBS frame with a CRC-16. The
+device drops a frame with a lost or corrupted byte and the host sends it
+again, so line noise costs one frame instead of the whole session:
+
+    python flash_cli.py --port /dev/ttyUSB0 --max-baud 460800 --framed app.hex
+
+With --sparse the runs of a repeated byte, the 0xFF padding and gaps of
+linker output, go out as fill records of a few bytes each. The device
+programs no erased byte at all, with or without fill records:
+
+    python flash_cli.py --port /dev/ttyUSB0 --sparse padded.hex
+
+A restarted session (--retries) takes the session the failed attempt left
+on the device on again at its last acknowledged packet, without erasing
+it again. The device journals its sessions in flash, so one cut short by a
+reset or a power loss is taken on again by the next run too, once the
+image CRC of what it programmed matches this image; --no-resume restarts
+from the first packet instead.
+
+Several ports flash concurrently from the same packets, each port in its
+own session with its own retries:
+
+    python flash_cli.py --port /dev/ttyUSB0,/dev/ttyUSB1 --port /dev/ttyUSB2 --retries 2 --json app.hex
+
+Exit codes:
+    0  image flashed (on every port)
+    2  bad command line
+    3  image missing or not a valid .hex file
+    4  serial port could not be opened
+    5  the device did not answer or refused a packet
+    6  some ports flashed and some failed, see the per-port report
+"""
+import argparse
+import json
+import os
+import sys
+import threading
+import time
+
+import serial
+
+import btl_protocol
+import image_cache
+import link_profile
+import link_trace
+
+EXIT_OK = 0
+EXIT_USAGE = 2
+EXIT_INVALID_IMAGE = 3
+EXIT_PORT_ERROR = 4
+EXIT_PROTOCOL_ERROR = 5
+EXIT_PARTIAL_FAILURE = 6
+
+# Seconds between two aggregate progress lines
+PROGRESS_PERIOD = 1.0
+
+
+class RecordCounter:
+    """Pass the records through while counting them, their fill records and their data bytes."""
+
+    def __init__(self, records):
+        self.records = records
+        self.recordCount = 0
+        self.fillRecords = 0
+        self.payloadBytes = 0
+
+    def __iter__(self):
+        for record in self.records:
+            self.recordCount += 1
+            self.fillRecords += record[6:8] == f'{btl_protocol.FILL_RECORD:02X}'
+            self.payloadBytes += btl_protocol.record_data_length(record)
+            yield record
+
+
+class ImageSource:
+    """Packets of the image for one session.
+
+    Either the compiled image from the cache, or with the cache disabled the
+    records streamed from disk for every session. Adaptive sessions size
+    their own packets and read the record list instead. The sparse format
+    re-blocks the records, it reads the whole file first without the cache.
+    """
+
+    def __init__(self, filePath, recordsPerPacket, recordLength, cacheDir, sparse=False):
+        self.filePath = filePath
+        self.recordsPerPacket = recordsPerPacket
+        self.recordLength = recordLength
+        self.sparse = sparse
+        self.compiled = None
+        if cacheDir:
+            self.compiled = image_cache.load_or_compile(filePath, recordsPerPacket, recordLength, cacheDir, sparse)
+        else:
+            # Streamed records are only read once the session is open, a bad file has to fail before
+            with open(filePath, 'r') as hexFile:
+                if not btl_protocol.check_hex_file_validity(line for line in hexFile if line.strip()):
+                    raise btl_protocol.ProtocolError("Invalid hex file format.")
+        self.counter = None
+        self.recordList = None
+
+    def readRecords(self):
+        if not self.sparse:
+            return btl_protocol.iter_hex_records(self.filePath)
+        return btl_protocol.reblock_records(btl_protocol.read_hex_records(self.filePath),
+                                            self.recordLength or btl_protocol.DEFAULT_RECORD_LENGTH,
+                                            btl_protocol.FILL_MINIMUM)
+
+    def records(self):
+        if self.recordList is None:
+            if self.compiled:
+                self.recordList = self.compiled.records()
+            else:
+                self.counter = RecordCounter(self.readRecords())
+                self.recordList = list(self.counter)
+        return self.recordList
+
+    def open(self):
+        if self.compiled:
+            return self.compiled.packets
+        self.counter = RecordCounter(self.readRecords())
+        return btl_protocol.iter_packets(self.counter, self.recordsPerPacket)
+
+    @property
+    def recordCount(self):
+        return self.compiled.recordCount if self.compiled else self.counter.recordCount
+
+    @property
+    def payloadBytes(self):
+        return self.compiled.payloadBytes if self.compiled else self.counter.payloadBytes
+
+    @property
+    def fillRecords(self):
+        return self.compiled.meta['fill_records'] if self.compiled else self.counter.fillRecords
+
+    @property
+    def packetCount(self):
+        return self.compiled.packetCount if self.compiled else None
+
+
+class PortSession:
+    """Flashes one port, restarting the whole session on failure, and never raises."""
+
+    def __init__(self, portName, image, args):
+        self.portName = portName
+        self.image = image
+        self.args = args
+        self.packetsSent = 0
+        self.done = False
+        self.exitCode = EXIT_OK
+        self.report = {'status': 'error', 'port': portName, 'attempts': 0}
+        # Kept across attempts, a failed attempt restarts with smaller packets
+        self.sizer = btl_protocol.PacketSizer() if args.adaptive else None
+        self.traceFile = None
+        self.traceOrigin = time.perf_counter_ns()
+        self.profileDir = args.cacheDir or image_cache.DEFAULT_CACHE_DIR
+        # Left by a failed attempt: the session on the device and whether its requests are framed
+        self.sessionId = None
+        self.framed = False
+        # The device runs BTL_BATCH, set by probe()
+        self.batch = False
+
+    def run(self):
+        if self.args.trace:
+            self.traceFile = open(trace_path(self.args.trace, self.portName, len(self.args.ports)), 'wb')
+            self.report['trace'] = self.traceFile.name
+        for attempt in range(1, self.args.retries + 2):
+            self.report['attempts'] = attempt
+            self.packetsSent = 0
+            self.exitCode = self.flashOnce()
+            # A bad image fails the same way on every attempt
+            if self.exitCode in (EXIT_OK, EXIT_INVALID_IMAGE) or attempt > self.args.retries:
+                break
+            time.sleep(self.args.retryDelay)
+        if self.traceFile:
+            self.traceFile.close()
+        self.done = True
+
+    def flashOnce(self):
+        args = self.args
+        startTime = time.perf_counter()
+        profile = link_profile.load(self.profileDir, self.portName) if args.probe and args.profiles else None
+        try:
+            port = serial.Serial(self.portName, baudrate=profile['baud'] if profile else args.baud,
+                                 timeout=args.timeout)
+        except (serial.SerialException, ValueError) as error:
+            self.report['error'] = str(error)
+            return EXIT_PORT_ERROR
+        openTime = time.perf_counter()
+        if self.traceFile:
+            port = link_trace.TracingPort(port, self.traceFile, self.traceOrigin)
+
+        link = btl_protocol.BootloaderLink(port, mode=args.mode, timeoutSeconds=args.timeout)
+        link.framed = self.framed
+        stripePort = None
+        exitCode = EXIT_OK
+        try:
+            if self.sessionId is not None:
+                # The device gives up the packet the failed attempt cut short before it answers again
+                time.sleep(btl_protocol.RESUME_SETTLE_SECONDS)
+                port.reset_input_buffer()
+            eraseFirst = args.eraseFirst
+            if args.probe:
+                eraseFirst = self.probe(link, profile) or eraseFirst
+            # The query suspends the session, the link can be set up again before it resumes
+            state = self.querySession(link) if args.resume else None
+            if args.stripePort:
+                stripePort = self.openStripe(link)
+            if args.framed and not link.framed:
+                link.setFraming(True)
+            resumeAt = self.resumeSession(link, state) if state else None
+            if resumeAt is not None:
+                eraseFirst = False
+            if eraseFirst and self.batch:
+                # One round trip erases and opens the session, instead of one per sector and one for the header
+                link.sessionPrelude = [btl_protocol.encode_request(btl_protocol.CMD_FLASH_ERASE, bytes([0, 0]))]
+                self.report['erase_batched'] = True
+            elif eraseFirst:
+                eraseStart = time.perf_counter()
+                log = (lambda erased, count: print(f'{self.portName}: sector {erased}/{count} erased',
+                                                   file=sys.stderr)) if args.verbose else None
+                link.eraseFlash(progress=log)
+                self.report['erase_s'] = round(time.perf_counter() - eraseStart, 4)
+            if self.sizer:
+                log = (lambda text: print(f'{self.portName}: {text}', file=sys.stderr)) if args.verbose else None
+                link.flashAdaptive(self.image.records(), self.sizer,
+                                   lambda recordsSent, totalRecords: self.progress(link.stats.packets), log,
+                                   resumeAt=resumeAt)
+            else:
+                link.flashPackets(self.image.open(), self.progress, resumeAt=resumeAt)
+            self.report.pop('error', None)
+        except btl_protocol.ProtocolError as error:
+            self.report['error'] = str(error)
+            # Nothing was sent when the image is rejected up front
+            exitCode = EXIT_INVALID_IMAGE if link.stats.bytesTx == 0 else EXIT_PROTOCOL_ERROR
+        except serial.SerialException as error:
+            self.report['error'] = str(error)
+            exitCode = EXIT_PORT_ERROR
+        finally:
+            self.sessionId = link.sessionId if exitCode != EXIT_OK else None
+            if link.framed:
+                self.closeFraming(link)
+            if stripePort:
+                self.closeStripe(link, stripePort)
+            self.framed = link.framed
+            port.close()
+        endTime = time.perf_counter()
+
+        flashSeconds = endTime - openTime
+        payloadBytes = self.image.payloadBytes
+        self.report.update({
+            'status': 'ok' if exitCode == EXIT_OK else 'error',
+            'records': self.image.recordCount,
+            'payload_bytes': payloadBytes,
+            'packets': link.stats.packets,
+            'tx_bytes': link.stats.bytesTx,
+            'rx_bytes': link.stats.bytesRx,
+            'round_trips': link.stats.roundTrips,
+            'image_crc': f'{link.stats.imageCrc:08X}' if link.stats.imageCrc is not None else None,
+            'verified': link.stats.verified,
+            'open_s': round(openTime - startTime, 4),
+            'flash_s': round(flashSeconds, 4),
+            'total_s': round(endTime - startTime, 4),
+            'payload_Bps': round(payloadBytes / flashSeconds) if flashSeconds > 0 else 0,
+        })
+        if self.sizer:
+            self.report.update({'packet_size': self.sizer.size, 'packet_size_max': self.sizer.maximum})
+        if self.args.sparse:
+            self.report['fill_records'] = self.image.fillRecords
+        return exitCode
+
+    def openStripe(self, link):
+        """Open the second lane and have the device stripe the session over both, return the port."""
+        stripePort = serial.Serial(self.args.stripePort, baudrate=self.args.stripeBaud, timeout=self.args.timeout)
+        try:
+            link.setStripe(stripePort, self.args.stripeBaud)
+        except btl_protocol.ProtocolError:
+            stripePort.close()
+            raise
+        return stripePort
+
+    def closeStripe(self, link, stripePort):
+        """Turn striping off again so the next session runs on the port alone, and close the second lane."""
+        if link.striper:
+            self.report['stripe'] = {'port': self.args.stripePort, 'baud': self.args.stripeBaud,
+                                     'lane_bytes': link.striper.laneBytes}
+        try:
+            link.setStripe(None, 0)
+        except (btl_protocol.ProtocolError, serial.SerialException):
+            # The device drops it on its next reset
+            pass
+        stripePort.close()
+
+    def querySession(self, link):
+        """Return the state of the session to take on again, None to start a new one.
+
+        That is the session the failed attempt left on the device, or on the
+        first attempt one a reset cut short, if it programmed the start of
+        this image.
+        """
+        self.report.pop('resumed_at', None)
+        try:
+            state = link.querySession(retry=self.sessionId is not None)
+        except btl_protocol.ProtocolError:
+            return None
+        if not state or state['state'] != 'suspended':
+            return None
+        if self.sessionId is not None:
+            return state if state['session'] == self.sessionId else None
+        records = self.image.records()
+        if (state['crc'] is None or state['records'] > len(records) or
+                btl_protocol.image_crc_at(records, state['records']) != state['crc']):
+            return None
+        self.sessionId = state['session']
+        return state
+
+    def resumeSession(self, link, state):
+        """Take the suspended session on again, return the records to skip or None to restart."""
+        try:
+            resumeAt = link.resumeSession(self.sessionId)
+        except btl_protocol.ProtocolError:
+            return None
+        self.report['resumed_at'] = {'records': resumeAt, 'offset': state['offset']}
+        return resumeAt
+
+    def closeFraming(self, link):
+        """Turn framing off again and report the frames the device dropped and the host sent again."""
+        self.report['framing'] = {'frame_retries': link.stats.frameRetries}
+        try:
+            self.report['framing'].update(link.setFraming(False))
+        except (btl_protocol.ProtocolError, serial.SerialException):
+            # The device drops it on its next reset
+            pass
+
+    def probe(self, link, profile):
+        """Adopt the fastest settings the device reports, return whether to erase first.
+
+        The link profile kept from an earlier session is tried first, its
+        settings are then used without reading the capability descriptor.
+        """
+        if profile:
+            settings = self.resume(link, profile)
+            if settings:
+                return self.adopt(settings)
+        capabilities = link.getCapabilities()
+        if not capabilities:
+            # Bootloaders before 1.3.0, keep the command line options
+            return False
+        settings = btl_protocol.fastest_settings(capabilities, self.args.maxBaud)
+        self.report['device'] = {key: capabilities[key] for key in
+                                 ('version', 'protocol', 'uid', 'max_packet', 'max_record', 'baud_rates', 'formats')}
+        eraseFirst = self.adopt(settings)
+        if self.args.profiles and settings['baud'] and settings['baud'] != link.serialPort.baudrate:
+            self.switchLink(link, settings, capabilities['uid'])
+        return eraseFirst
+
+    def resume(self, link, profile):
+        """Check that the device runs the kept profile, return its settings or None."""
+        timeoutSeconds = link.timeoutSeconds
+        link.timeoutSeconds = btl_protocol.LINK_PROBE_SECONDS
+        try:
+            status = link.getLinkStatus()
+        except btl_protocol.ProtocolError:
+            status = None
+        finally:
+            link.timeoutSeconds = timeoutSeconds
+        if link_profile.matches(profile, status):
+            self.report['link'] = {'baud': profile['baud'], 'resumed': True}
+            return profile['settings']
+        if status is None:
+            # The device was not reset into the profile and went back to the default baud rate
+            link.serialPort.baudrate = self.args.baud
+            time.sleep(btl_protocol.LINK_PROBE_SECONDS)
+            link.serialPort.reset_input_buffer()
+        elif status['baud'] != link.serialPort.baudrate:
+            # Only a link without a baud rate (the simulator pty) answers at another one
+            link.serialPort.baudrate = status['baud']
+        else:
+            # Another device, or one that stored another profile
+            link_profile.forget(self.profileDir, self.portName)
+        return None
+
+    def switchLink(self, link, settings, uid):
+        """Switch the device to settings['baud'] and keep the profile when the device stored it."""
+        flags = ((btl_protocol.LINK_FLAG_ACK if self.args.mode == btl_protocol.MODE_ACK else 0) |
+                 (btl_protocol.LINK_FLAG_ADAPTIVE if self.args.adaptive else 0))
+        profile = {'baud': settings['baud'], 'max_packet': settings['max_packet'],
+                   'max_record': self.args.recordLength or settings['max_record'], 'flags': flags}
+        try:
+            stored = link.setLink(profile['baud'], profile['max_packet'], profile['max_record'], flags)
+        except btl_protocol.ProtocolError as error:
+            # Both sides are back at the previous baud rate
+            self.report['link'] = {'baud': link.serialPort.baudrate, 'error': str(error)}
+            return
+        self.report['link'] = {'baud': profile['baud'], 'resumed': False, 'stored': stored}
+        if stored:
+            link_profile.save(self.profileDir, self.portName, dict(profile, uid=uid, settings=settings))
+
+    def adopt(self, settings):
+        """Size the session to settings, return whether to erase first."""
+        if self.args.recordLength > settings['max_record']:
+            raise btl_protocol.ProtocolError(f"The device takes records of up to {settings['max_record']} bytes, "
+                                             f"use --record-length {settings['max_record']}.")
+        # The cached packets are built for MAX_PACKET_DATA, a smaller device buffer needs sized packets
+        if not self.sizer and settings['max_packet'] < btl_protocol.MAX_PACKET_DATA:
+            self.sizer = btl_protocol.PacketSizer(initial=settings['max_packet'], maximum=settings['max_packet'])
+        # Profiles kept by older versions have no batch setting
+        self.batch = settings.get('batch', False)
+        # Nor a sparse one, the device refuses the first fill record then
+        if self.args.sparse and settings.get('sparse') is False:
+            raise btl_protocol.ProtocolError("The device does not take fill records, flash without --sparse.")
+        return settings['erase_first']
+
+    def progress(self, packetsSent):
+        self.packetsSent = packetsSent
+        if self.args.verbose and not self.sizer:
+            print(f'{self.portName}: packet {packetsSent} acknowledged', file=sys.stderr)
+
+
+def trace_path(path, portName, portCount):
+    """With several ports every port gets its own trace, named after the port."""
+    if portCount == 1:
+        return path
+    root, extension = os.path.splitext(path)
+    return f'{root}.{os.path.basename(portName)}{extension}'
+
+
+def report_progress(sessions, image, startTime, stopEvent):
+    """Print one aggregate progress line every PROGRESS_PERIOD until stopEvent is set."""
+    if not image.packetCount or sessions[0].sizer:
+        return
+    totalPackets = image.packetCount * len(sessions)
+    while not stopEvent.wait(PROGRESS_PERIOD):
+        sentPackets = sum(session.packetsSent for session in sessions)
+        doneCount = sum(session.done for session in sessions)
+        sentBytes = image.payloadBytes * sentPackets / image.packetCount
+        print(f'{doneCount}/{len(sessions)} ports done, {sentPackets}/{totalPackets} packets, '
+              f'{sentBytes / (time.perf_counter() - startTime):.0f} B/s', file=sys.stderr)
+
+
+def flash(args):
+    """Flash args.hex on every port of args.ports, return (exit code, report dict)."""
+    report = {'status': 'error', 'image': args.hex, 'baud': args.baud, 'mode': args.mode,
+              'records_per_packet': args.recordsPerPacket}
+    if len(args.ports) == 1:
+        report['port'] = args.ports[0]
+
+    if not os.path.isfile(args.hex):
+        report['error'] = f'No such file: {args.hex}'
+        return EXIT_INVALID_IMAGE, report
+
+    try:
+        image = ImageSource(args.hex, args.recordsPerPacket, args.recordLength, args.cacheDir, args.sparse)
+        if args.adaptive:
+            image.records()
+    except (OSError, btl_protocol.ProtocolError) as error:
+        report['error'] = str(error)
+        return EXIT_INVALID_IMAGE, report
+
+    sessions = [PortSession(portName, image, args) for portName in args.ports]
+
+    if len(sessions) == 1:
+        sessions[0].run()
+        report.update(sessions[0].report)
+        del report['attempts']
+        return sessions[0].exitCode, report
+
+    # One thread per port, a port that fails or hangs only holds its own thread
+    startTime = time.perf_counter()
+    threads = [threading.Thread(target=session.run, daemon=True) for session in sessions]
+    for thread in threads:
+        thread.start()
+    stopEvent = threading.Event()
+    reporter = None
+    if args.progress:
+        reporter = threading.Thread(target=report_progress, args=(sessions, image, startTime, stopEvent), daemon=True)
+        reporter.start()
+    for thread in threads:
+        thread.join()
+    stopEvent.set()
+    if reporter:
+        reporter.join()
+    wallSeconds = time.perf_counter() - startTime
+
+    okCount = sum(session.exitCode == EXIT_OK for session in sessions)
+    exitCodes = {session.exitCode for session in sessions}
+    if okCount == len(sessions):
+        exitCode = EXIT_OK
+    elif okCount == 0 and len(exitCodes) == 1:
+        exitCode = exitCodes.pop()
+    else:
+        exitCode = EXIT_PARTIAL_FAILURE
+
+    report.update({
+        'status': 'ok' if exitCode == EXIT_OK else 'error',
+        'ports_ok': okCount,
+        'ports_failed': len(sessions) - okCount,
+        'records': image.recordCount,
+        'payload_bytes': image.payloadBytes,
+        'packets': image.packetCount,
+        'wall_s': round(wallSeconds, 4),
+        'aggregate_payload_Bps': round(image.payloadBytes * okCount / wallSeconds) if wallSeconds > 0 else 0,
+        'ports': [dict(session.report, exit_code=session.exitCode) for session in sessions],
+    })
+    return exitCode, report
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Flash a .hex image over the bootloader serial protocol.')
+    parser.add_argument('hex', help='Intel HEX image to flash')
+    parser.add_argument('--port', action='append', required=True,
+                        help='serial port of a board in bootloader mode, repeat it or give a comma separated '
+                             'list to flash several boards concurrently')
+    parser.add_argument('--baud', type=int, default=9600)
+    parser.add_argument('--records-per-packet', dest='recordsPerPacket', type=int, default=30)
+    parser.add_argument('--record-length', dest='recordLength', type=int, default=btl_protocol.DEFAULT_RECORD_LENGTH,
+                        help='re-block the image into records of this many data bytes, 0 keeps the records of '
+                             'the file, 16 for bootloaders older than 1.2.0')
+    parser.add_argument('--mode', choices=[btl_protocol.MODE_ACK, btl_protocol.MODE_GUI], default=btl_protocol.MODE_ACK,
+                        help='ack sends the next packet as soon as the device acknowledges (default), '
+                             'gui paces packets like the GUI')
+    parser.add_argument('--adaptive', action='store_true',
+                        help='size packets from the acknowledgments, up to the size the device reports, '
+                             'instead of --records-per-packet')
+    parser.add_argument('--erase-first', dest='eraseFirst', action='store_true',
+                        help='erase the application area with its own command first, the device then reports '
+                             'every sector instead of erasing inside the first packet')
+    parser.add_argument('--no-probe', dest='probe', action='store_false',
+                        help='do not read the capability descriptor of the device, use the options as given')
+    parser.add_argument('--max-baud', dest='maxBaud', type=int, default=0,
+                        help='switch the device to its fastest baud rate up to this one and keep the link '
+                             'profile for the next sessions of the port')
+    parser.add_argument('--no-profile', dest='profiles', action='store_false',
+                        help='neither use nor keep link profiles, every session starts at --baud')
+    parser.add_argument('--stripe-port', dest='stripePort',
+                        help='second serial port of the board (USART2), the packets are striped over both ports')
+    parser.add_argument('--stripe-baud', dest='stripeBaud', type=int, default=115200,
+                        help='baud rate of --stripe-port')
+    parser.add_argument('--framed', action='store_true',
+                        help='send every request as a COBS frame with a CRC-16, the device drops a damaged '
+                             'frame and the host sends it again')
+    parser.add_argument('--sparse', action='store_true',
+                        help='send the runs of a repeated byte as fill records, for devices reporting the sparse '
+                             'format')
+    parser.add_argument('--no-resume', dest='resume', action='store_false',
+                        help='restart a failed session from the first packet instead of resuming it')
+    parser.add_argument('--timeout', type=float, default=5, help='seconds to wait for every acknowledgment')
+    parser.add_argument('--retries', type=int, default=0, help='times a failed port restarts its session')
+    parser.add_argument('--retry-delay', dest='retryDelay', type=float, default=1.0,
+                        help='seconds a port waits before restarting its session')
+    parser.add_argument('--cache-dir', dest='cacheDir', default=image_cache.DEFAULT_CACHE_DIR,
+                        help='where compiled images are kept')
+    parser.add_argument('--no-cache', dest='cacheDir', action='store_const', const=None,
+                        help='stream the records from the .hex file as they are, needs a single port')
+    parser.add_argument('--trace', help='record every frame to this file, analyze it with link_trace.py '
+                                        '(one file per port, named after it, with several ports)')
+    parser.add_argument('--json', action='store_true', help='print the report as one JSON object')
+    parser.add_argument('--progress', action='store_true', help='print aggregate progress on stderr (several ports)')
+    parser.add_argument('-v', '--verbose', action='store_true', help='log every acknowledged packet on stderr')
+    # argparse exits with EXIT_USAGE (2) on a bad command line
+    args = parser.parse_args()
+    if not 0 < args.recordsPerPacket < 256:
+        parser.error('--records-per-packet must be between 1 and 255')
+    if not 0 <= args.recordLength <= btl_protocol.MAX_RECORD_LENGTH:
+        parser.error(f'--record-length must be between 0 and {btl_protocol.MAX_RECORD_LENGTH}')
+    if args.retries < 0:
+        parser.error('--retries must not be negative')
+    args.ports = [name for value in args.port for name in value.split(',') if name]
+    if len(set(args.ports)) != len(args.ports):
+        parser.error('a port is given twice')
+    if not args.cacheDir and len(args.ports) > 1:
+        parser.error('--no-cache streams the file for one session, it needs a single port')
+
+    if args.stripePort and (len(args.ports) > 1 or args.mode != btl_protocol.MODE_ACK):
+        parser.error('--stripe-port needs a single port in the ack mode')
+    if args.framed and (args.stripePort or args.mode != btl_protocol.MODE_ACK):
+        parser.error('--framed needs the ack mode and no --stripe-port')
+
+    exitCode, report = flash(args)
+
+    if args.json:
+        print(json.dumps(report))
+    elif 'ports' in report:
+        for portReport in report['ports']:
+            if portReport['status'] == 'ok':
+                print(f'{portReport["port"]}: ok, {portReport["flash_s"]:.2f} s ({portReport["payload_Bps"]} B/s)')
+            else:
+                print(f'{portReport["port"]}: {portReport["error"]}', file=sys.stderr)
+        print(f'{report["ports_ok"]}/{len(report["ports"])} ports flashed in {report["wall_s"]:.2f} s '
+              f'({report["aggregate_payload_Bps"]} B/s aggregate)')
+    elif exitCode == EXIT_OK:
+        print(f'{report["image"]}: {report["payload_bytes"]} bytes in {report["packets"]} packets, '
+              f'{report["flash_s"]:.2f} s ({report["payload_Bps"]} B/s)')
+    else:
+        print(f'{report["image"]}: {report["error"]}', file=sys.stderr)
+    return exitCode
+
+
+if __name__ == '__main__':
+    sys.exit(main())
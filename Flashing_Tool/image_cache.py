@@ -0,0 +1,236 @@
+"""Compiled images, cached by content hash.
+
+Compiling a .hex file validates and decodes it once, then stores what a
+flashing session needs as two files in the cache directory:
+
+    <key>.bin   the headers and packets, concatenated in wire order
+    <key>.json  packet sizes, record and byte counts, the sector map with the
+                expected CRC of every sector, the application header and
+                the image CRC the device checks after programming
+
+The records are re-blocked to --record-length data bytes first (0 keeps
+the records of the file). With --sparse the runs of a repeated byte, the
+0xFF padding and gaps of linker output, go out as fill records instead of
+data records (the device must report the sparse format). The key is the
+SHA-256 of the .hex contents plus the record and packet layout, so a
+changed file or other options compile again while repeat and multi-device
+flashes only slice the cached bytes.
+
+    python image_cache.py app.hex          # compile (or find) and print the summary
+    python image_cache.py --sparse app.hex # the same, with the wire bytes fill records save
+"""
+import argparse
+import hashlib
+import json
+import os
+import sys
+
+import btl_protocol
+
+# Bump when the artifact layout changes, old entries are then ignored
+CACHE_FORMAT = 2
+DEFAULT_CACHE_DIR = os.path.join(os.path.expanduser('~'), '.cache', 'btl_flash')
+
+# STM32F401CC flash geometry, the device adds BTL_BOOTLOADER_SIZE to every record address
+FLASH_BASE = 0x08000000
+SECTOR_SIZES = [0x4000, 0x4000, 0x4000, 0x4000, 0x10000, 0x20000]
+APP_OFFSET = 0x8000
+ERASED_VALUE = 0xFF
+
+
+def decode_records(records):
+    """Return the data records as {flash address: bytes}, checking every record checksum."""
+    segments = {}
+    addressHigh = 0
+    for record in records:
+        fields = bytes.fromhex(record)
+        if len(fields) != fields[0] + 5 or sum(fields) & 0xFF:
+            raise btl_protocol.ProtocolError(f"Bad record: {record}")
+        recordType = fields[3]
+        if recordType in (0x00, btl_protocol.FILL_RECORD):
+            address = (addressHigh << 16) + (fields[1] << 8) + fields[2] + APP_OFFSET
+            segments[address] = btl_protocol.record_data(record)
+        elif recordType == 0x04:
+            addressHigh = (fields[4] << 8) + fields[5]
+    return segments
+
+
+def sector_bounds():
+    """Yield (sector number, first address, size) of every flash sector."""
+    address = FLASH_BASE
+    for sector, size in enumerate(SECTOR_SIZES):
+        yield sector, address, size
+        address += size
+
+
+def sector_map(segments):
+    """Return one entry per sector the image touches, with the CRC of the sector once programmed."""
+    sectors = []
+    for sector, start, size in sector_bounds():
+        content = bytearray([ERASED_VALUE]) * size
+        touched = False
+        for address, data in segments.items():
+            begin, end = max(address, start), min(address + len(data), start + size)
+            if begin < end:
+                content[begin - start:end - start] = data[begin - address:end - address]
+                touched = True
+        if touched:
+            sectors.append({'sector': sector, 'address': start, 'size': size,
+                            'crc': btl_protocol.stm32_crc32(content)})
+    return sectors
+
+
+def app_header(segments):
+    """Describe the application: span, CRC over the span and the first two vector table entries."""
+    if not segments:
+        return {}
+    start = min(segments)
+    end = max(address + len(data) for address, data in segments.items())
+    # The CRC unit takes whole words, pad the span with erased bytes
+    end += -(end - start) % 4
+    span = bytearray([ERASED_VALUE]) * (end - start)
+    for address, data in segments.items():
+        span[address - start:address - start + len(data)] = data
+    return {
+        'address': start,
+        'size': end - start,
+        'crc': btl_protocol.stm32_crc32(span),
+        'initial_sp': int.from_bytes(span[0:4], 'little'),
+        'reset_handler': int.from_bytes(span[4:8], 'little'),
+    }
+
+
+class CompiledImage:
+    """A compiled image: wire bytes plus the metadata to slice them into packets."""
+
+    def __init__(self, meta, wire):
+        self.meta = meta
+        self.wire = wire
+        self.packets = []
+        view = memoryview(wire)
+        offset = 0
+        for headerLength, packetLength in meta['packets']:
+            header = view[offset:offset + headerLength]
+            packet = view[offset + headerLength:offset + headerLength + packetLength]
+            self.packets.append((header, packet))
+            offset += headerLength + packetLength
+
+    def records(self):
+        """Return the colon-less records back out of the packets, for adaptive packet sizing."""
+        # packet[1] is the record count, the image CRC follows the records of the last packet
+        return [line.decode('ascii') for _, packet in self.packets
+                for line in bytes(packet[4:]).split(b'\n')[:packet[1]]]
+
+    @property
+    def recordCount(self):
+        return self.meta['records']
+
+    @property
+    def payloadBytes(self):
+        return self.meta['payload_bytes']
+
+    @property
+    def packetCount(self):
+        return len(self.packets)
+
+
+def compile_image(filePath, recordsPerPacket, recordLength, key='', sparse=False):
+    """Validate, re-block and encode a .hex file, return a CompiledImage."""
+    records = btl_protocol.read_hex_records(filePath)
+    segments = decode_records(records)
+    if recordLength or sparse:
+        # Fill records are cut out of re-blocked data, the sparse format always re-blocks
+        records = btl_protocol.reblock_records(records, recordLength or btl_protocol.DEFAULT_RECORD_LENGTH,
+                                               btl_protocol.FILL_MINIMUM if sparse else 0)
+    packets = btl_protocol.build_packets(records, recordsPerPacket)
+    meta = {
+        'format': CACHE_FORMAT,
+        'key': key,
+        'source': os.path.abspath(filePath),
+        'records_per_packet': recordsPerPacket,
+        'record_length': recordLength,
+        'sparse': sparse,
+        'records': len(records),
+        'fill_records': sum(1 for record in records if record[6:8] == f'{btl_protocol.FILL_RECORD:02X}'),
+        'payload_bytes': sum(btl_protocol.record_data_length(record) for record in records),
+        'packets': [[len(header), len(packet)] for header, packet in packets],
+        'sectors': sector_map(segments),
+        'app_header': app_header(segments),
+        'image_crc': btl_protocol.image_crc(records),
+    }
+    return CompiledImage(meta, b''.join(header + packet for header, packet in packets))
+
+
+def image_key(filePath, recordsPerPacket, recordLength, sparse=False):
+    digest = hashlib.sha256()
+    with open(filePath, 'rb') as file:
+        for block in iter(lambda: file.read(1 << 16), b''):
+            digest.update(block)
+    digest.update(f':{CACHE_FORMAT}:{recordsPerPacket}:{recordLength}'.encode('ascii'))
+    if sparse:
+        digest.update(b':sparse')
+    return digest.hexdigest()
+
+
+def load_or_compile(filePath, recordsPerPacket, recordLength=btl_protocol.DEFAULT_RECORD_LENGTH,
+                    cacheDir=DEFAULT_CACHE_DIR, sparse=False):
+    """Return the cached CompiledImage of filePath, compiling and storing it on a miss."""
+    key = image_key(filePath, recordsPerPacket, recordLength, sparse)
+    metaPath = os.path.join(cacheDir, key + '.json')
+    wirePath = os.path.join(cacheDir, key + '.bin')
+
+    try:
+        with open(metaPath, 'r') as metaFile:
+            meta = json.load(metaFile)
+        with open(wirePath, 'rb') as wireFile:
+            wire = wireFile.read()
+        if meta.get('format') == CACHE_FORMAT and len(wire) == sum(map(sum, meta['packets'])):
+            return CompiledImage(meta, wire)
+    except (OSError, ValueError, KeyError):
+        pass
+
+    image = compile_image(filePath, recordsPerPacket, recordLength, key, sparse)
+    os.makedirs(cacheDir, exist_ok=True)
+    # The metadata goes last, an entry only counts once both files are complete
+    for path, data, mode in ((wirePath, image.wire, 'wb'), (metaPath, json.dumps(image.meta, indent=1), 'w')):
+        temporaryPath = f'{path}.{os.getpid()}.tmp'
+        with open(temporaryPath, mode) as file:
+            file.write(data)
+        os.replace(temporaryPath, path)
+    return image
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Compile a .hex image into the flashing cache.')
+    parser.add_argument('hex')
+    parser.add_argument('--records-per-packet', dest='recordsPerPacket', type=int, default=30)
+    parser.add_argument('--record-length', dest='recordLength', type=int, default=btl_protocol.DEFAULT_RECORD_LENGTH)
+    parser.add_argument('--cache-dir', dest='cacheDir', default=DEFAULT_CACHE_DIR)
+    parser.add_argument('--sparse', action='store_true', help='send runs of a repeated byte as fill records')
+    args = parser.parse_args()
+
+    try:
+        image = load_or_compile(args.hex, args.recordsPerPacket, args.recordLength, args.cacheDir, args.sparse)
+        dense = None
+        if args.sparse:
+            dense = load_or_compile(args.hex, args.recordsPerPacket, args.recordLength, args.cacheDir)
+    except (OSError, btl_protocol.ProtocolError) as error:
+        print(f'{args.hex}: {error}', file=sys.stderr)
+        return 1
+
+    header = image.meta['app_header']
+    print(f'{image.meta["key"][:16]}: {image.recordCount} records, {image.payloadBytes} bytes, '
+          f'{image.packetCount} packets, {len(image.wire)} wire bytes')
+    if dense:
+        print(f'sparse: {image.meta["fill_records"]} fill records, {len(dense.wire) - len(image.wire)} wire bytes '
+              f'and {dense.packetCount - image.packetCount} packets less than the dense image')
+    if header:
+        print(f'app 0x{header["address"]:08X} size {header["size"]} crc 0x{header["crc"]:08X} '
+              f'sp 0x{header["initial_sp"]:08X} reset 0x{header["reset_handler"]:08X}')
+    for sector in image.meta['sectors']:
+        print(f'sector {sector["sector"]} 0x{sector["address"]:08X} crc 0x{sector["crc"]:08X}')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,66 @@
+"""Link profiles of the serial ports, kept between flashing sessions.
+
+Once a port has switched its device to a faster link with BTL_SET_LINK,
+the device keeps the profile in its flash and starts in it after its next reset.
+The host keeps the same profile per port name, so the next session opens
+the port straight at that baud rate and skips the capability probe:
+
+    <cache dir>/link_profiles.json   {port name: profile}
+
+A profile holds the baud rate, largest packet, longest record and
+transfer mode flags the device stores, plus the settings of
+btl_protocol.fastest_settings and the unique ID of the device.
+"""
+import json
+import os
+import threading
+
+PROFILE_FILE = 'link_profiles.json'
+
+# Several port sessions of flash_cli update the file concurrently
+_lock = threading.Lock()
+
+
+def _read(path):
+    try:
+        with open(path) as file:
+            return json.load(file)
+    except (OSError, ValueError):
+        return {}
+
+
+def _write(path, profiles):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    temporaryPath = path + '.tmp'
+    with open(temporaryPath, 'w') as file:
+        json.dump(profiles, file, indent=1, sort_keys=True)
+    os.replace(temporaryPath, path)
+
+
+def load(cacheDir, portName):
+    """Return the profile kept for portName, None if there is none."""
+    with _lock:
+        return _read(os.path.join(cacheDir, PROFILE_FILE)).get(portName)
+
+
+def save(cacheDir, portName, profile):
+    with _lock:
+        path = os.path.join(cacheDir, PROFILE_FILE)
+        profiles = _read(path)
+        profiles[portName] = profile
+        _write(path, profiles)
+
+
+def forget(cacheDir, portName):
+    with _lock:
+        path = os.path.join(cacheDir, PROFILE_FILE)
+        profiles = _read(path)
+        if profiles.pop(portName, None) is not None:
+            _write(path, profiles)
+
+
+def matches(profile, linkStatus):
+    """Whether the device runs the profile: it is the one it stored and the current baud rate."""
+    stored = linkStatus['stored'] if linkStatus else None
+    return bool(stored) and linkStatus['baud'] == profile['baud'] and \
+        all(stored[key] == profile[key] for key in ('baud', 'max_packet', 'max_record', 'flags'))
@@ -0,0 +1,227 @@
+"""Host side protocol trace: recorder and analyzer.
+
+TracingPort wraps an open serial port and records every frame the host
+sends and every reply it receives, with nanosecond timestamps, into a
+compact binary file. flash_cli.py records one with --trace.
+
+    python link_trace.py session.btltrace            # analysis
+    python link_trace.py --frames session.btltrace   # frame list, then analysis
+
+File layout, little endian: the 8 byte magic, the baud rate (uint32), then
+one FRAME_FORMAT entry per frame: start and end in ns since the trace
+opened, direction, type, length and CRC-32 of the frame bytes.
+
+Frame types reuse the command values of btl_protocol (the same values the
+GUI exposes as STM32F4FlashingTool.CMD_*): a sent header is typed with its
+command, a sent packet with TYPE_PACKET, a reply with its first byte (the
+acknowledged command, 0 for a NAck).
+"""
+import argparse
+import statistics
+import struct
+import sys
+import threading
+import time
+import zlib
+
+import btl_protocol
+
+TRACE_MAGIC = b'BTLTRC01'
+HEADER_FORMAT = struct.Struct('<8sI')
+FRAME_FORMAT = struct.Struct('<QQBBHI')
+
+DIRECTION_TX = 0
+DIRECTION_RX = 1
+TYPE_PACKET = 0x80
+TYPE_NACK = 0x00
+
+COMMAND_NAMES = {value: name[len('CMD_'):].lower() for name, value in vars(btl_protocol).items()
+                 if name.startswith('CMD_')}
+# Gaps before a sent frame longer than this are listed one by one
+IDLE_GAP_SECONDS = 0.05
+# Wire bits per byte: start, 8 data bits, stop
+BITS_PER_BYTE = 10
+
+
+class TracingPort:
+    """Serial port wrapper that records the frames going through it.
+
+    Every write() is one frame; received bytes are grouped into replies of
+    btl_protocol.REPLY_SIZE bytes, timed from their first to their last byte.
+    Several ports opened one after the other (session retries) can share a
+    trace file and its time origin.
+    """
+
+    def __init__(self, serialPort, traceFile, origin=None):
+        self.serialPort = serialPort
+        self.traceFile = traceFile
+        self.lock = threading.Lock()
+        self.origin = time.perf_counter_ns() if origin is None else origin
+        self.reply = b''
+        self.replyStart = 0
+        if traceFile.tell() == 0:
+            traceFile.write(HEADER_FORMAT.pack(TRACE_MAGIC, getattr(serialPort, 'baudrate', 0) or 0))
+
+    def now(self):
+        return time.perf_counter_ns() - self.origin
+
+    def record(self, start, end, direction, frame):
+        if direction == DIRECTION_TX:
+            frameType = frame[2] if len(frame) == 3 else TYPE_PACKET
+        else:
+            frameType = frame[0]
+        with self.lock:
+            self.traceFile.write(FRAME_FORMAT.pack(start, end, direction, frameType, len(frame),
+                                                   zlib.crc32(frame)))
+
+    def write(self, data):
+        start = self.now()
+        written = self.serialPort.write(data)
+        self.record(start, self.now(), DIRECTION_TX, bytes(data))
+        return written
+
+    def read(self, size=1):
+        data = self.serialPort.read(size)
+        if data:
+            if not self.reply:
+                self.replyStart = self.now()
+            self.reply += data
+            while len(self.reply) >= btl_protocol.REPLY_SIZE:
+                self.record(self.replyStart, self.now(), DIRECTION_RX, self.reply[:btl_protocol.REPLY_SIZE])
+                self.reply = self.reply[btl_protocol.REPLY_SIZE:]
+                self.replyStart = self.now()
+        return data
+
+    def reset_input_buffer(self):
+        self.reply = b''
+        self.serialPort.reset_input_buffer()
+
+    def close(self):
+        self.serialPort.close()
+        self.traceFile.flush()
+
+    @property
+    def timeout(self):
+        return self.serialPort.timeout
+
+    @timeout.setter
+    def timeout(self, value):
+        self.serialPort.timeout = value
+
+    @property
+    def baudrate(self):
+        return self.serialPort.baudrate
+
+    @baudrate.setter
+    def baudrate(self, value):
+        self.serialPort.baudrate = value
+
+    def __getattr__(self, name):
+        return getattr(self.serialPort, name)
+
+
+def read_trace(stream):
+    """Return (baud rate, list of frame tuples) of a trace file."""
+    magic, baudRate = HEADER_FORMAT.unpack(stream.read(HEADER_FORMAT.size))
+    if magic != TRACE_MAGIC:
+        raise ValueError('not a bootloader link trace')
+    frames = []
+    while True:
+        entry = stream.read(FRAME_FORMAT.size)
+        if len(entry) < FRAME_FORMAT.size:
+            return baudRate, frames
+        frames.append(FRAME_FORMAT.unpack(entry))
+
+
+def frame_name(direction, frameType):
+    if direction == DIRECTION_TX:
+        return 'packet' if frameType == TYPE_PACKET else COMMAND_NAMES.get(frameType, f'{frameType:#04x}')
+    if frameType == TYPE_NACK:
+        return 'nack'
+    return 'ack ' + COMMAND_NAMES.get(frameType, f'{frameType:#04x}')
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def analyze(baudRate, frames, out):
+    """Write link utilisation, round trip times, idle gaps and retransmits of a trace."""
+    if not frames:
+        out.write('empty trace\n')
+        return
+
+    duration = (frames[-1][1] - frames[0][0]) / 1e9
+    txBytes = sum(frame[4] for frame in frames if frame[2] == DIRECTION_TX)
+    rxBytes = sum(frame[4] for frame in frames if frame[2] == DIRECTION_RX)
+
+    # Round trip: end of a sent packet or header to the end of the reply that follows it
+    roundTrips = []
+    pendingEnd = None
+    for start, end, direction, frameType, length, crc in frames:
+        if direction == DIRECTION_TX:
+            pendingEnd = end
+        elif pendingEnd is not None:
+            roundTrips.append((end - pendingEnd) / 1e9)
+            pendingEnd = None
+
+    # Idle: the host holding the link, from the end of any frame to the start of the next frame it sends
+    gaps = []
+    for previous, current in zip(frames, frames[1:]):
+        if current[2] == DIRECTION_TX:
+            gaps.append(((current[0] - previous[1]) / 1e9, previous[1]))
+
+    # Retransmit: a packet with the same length and CRC as one sent before
+    seenPackets = set()
+    retransmits = 0
+    for frame in frames:
+        if frame[2] == DIRECTION_TX and frame[3] == TYPE_PACKET:
+            key = (frame[4], frame[5])
+            retransmits += key in seenPackets
+            seenPackets.add(key)
+
+    nacks = sum(1 for frame in frames if frame[2] == DIRECTION_RX and frame[3] == TYPE_NACK)
+
+    out.write(f'frames      {len(frames)} ({sum(f[2] == DIRECTION_TX for f in frames)} sent, '
+              f'{sum(f[2] == DIRECTION_RX for f in frames)} received)\n')
+    out.write(f'duration    {duration:.3f} s\n')
+    out.write(f'bytes       {txBytes} sent, {rxBytes} received\n')
+    if baudRate and duration > 0:
+        busy = (txBytes + rxBytes) * BITS_PER_BYTE / baudRate
+        out.write(f'utilisation {100 * busy / duration:.1f} % of {baudRate} baud (half duplex)\n')
+    if roundTrips:
+        out.write(f'round trip  min {min(roundTrips) * 1e3:.2f} ms, median {statistics.median(roundTrips) * 1e3:.2f} ms, '
+                  f'p95 {percentile(roundTrips, 0.95) * 1e3:.2f} ms, max {max(roundTrips) * 1e3:.2f} ms '
+                  f'over {len(roundTrips)}\n')
+    if gaps:
+        idle = sum(gap for gap, _ in gaps)
+        longGaps = [(gap, at) for gap, at in gaps if gap >= IDLE_GAP_SECONDS]
+        out.write(f'idle        {idle:.3f} s host side ({100 * idle / duration:.1f} %), '
+                  f'{len(longGaps)} gaps >= {IDLE_GAP_SECONDS * 1e3:.0f} ms\n')
+        for gap, at in sorted(longGaps, reverse=True)[:5]:
+            out.write(f'            {gap * 1e3:.1f} ms at {at / 1e9:.3f} s\n')
+    out.write(f'retransmits {retransmits}\n')
+    out.write(f'nacks       {nacks}\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Analyze a host side bootloader link trace.')
+    parser.add_argument('trace')
+    parser.add_argument('--frames', action='store_true', help='list every frame before the analysis')
+    args = parser.parse_args()
+
+    with open(args.trace, 'rb') as stream:
+        baudRate, frames = read_trace(stream)
+
+    if args.frames:
+        sys.stdout.write(f'{"start_ms":>12} {"dur_ms":>9}  dir  {"type":<16} {"len":>5}  crc\n')
+        for start, end, direction, frameType, length, crc in frames:
+            sys.stdout.write(f'{start / 1e6:12.3f} {(end - start) / 1e6:9.3f}  {"tx" if direction == DIRECTION_TX else "rx"}   '
+                             f'{frame_name(direction, frameType):<16} {length:5d}  {crc:08x}\n')
+        sys.stdout.write('\n')
+    analyze(baudRate, frames, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,28 +1,64 @@
 import sys
 from PyQt5.QtWidgets import QApplication, QWidget, QPushButton, QVBoxLayout, QHBoxLayout, QLabel, \
-    QMessageBox, QTextEdit, QComboBox, QFileDialog
+    QMessageBox, QTextEdit, QComboBox, QFileDialog, QProgressBar, QInputDialog
 from PyQt5.QtGui import QPalette, QColor, QFont
-from PyQt5.QtCore import Qt
+from PyQt5.QtCore import Qt, QObject, QThread, pyqtSignal
 import serial.tools.list_ports
 import serial
 import time
+import btl_protocol
+import image_cache
+import link_profile
+
+
+class SerialWorker(QObject):
+    """Runs one bootloader command on its own thread and reports back through signals.
+
+    The worker owns the serial port for the whole command and closes it when done.
+    """
+    progress = pyqtSignal(int, int)
+    log = pyqtSignal(str)
+    finished = pyqtSignal(bool, str)
+
+    def __init__(self, serialPort, job, timeoutSeconds):
+        super().__init__()
+        self.serialPort = serialPort
+        self.job = job
+        self.timeoutSeconds = timeoutSeconds
+
+    def run(self):
+        link = btl_protocol.BootloaderLink(self.serialPort, mode=btl_protocol.MODE_ACK,
+                                           timeoutSeconds=self.timeoutSeconds)
+        try:
+            link.startReader()
+            self.finished.emit(True, self.job(self, link))
+        except Exception as e:
+            self.finished.emit(False, str(e))
+        finally:
+            link.stopReader()
+            self.serialPort.close()
+
 
 class STM32F4FlashingTool(QWidget):
-    CMD_GET_VERSION = 0x01
-    CMD_GET_HELP = 0x02
-    CMD_GET_ID = 0x03
-    CMD_FLASH_APP = 0x04
-    CMD_FLASH_ERASE = 0x05
-    CMD_MEM_READ = 0x06
-    CMD_OTP_READ = 0x07
-    CMD_EXIT = 0x08
+    CMD_GET_VERSION = btl_protocol.CMD_GET_VERSION
+    CMD_GET_HELP = btl_protocol.CMD_GET_HELP
+    CMD_GET_ID = btl_protocol.CMD_GET_ID
+    CMD_FLASH_APP = btl_protocol.CMD_FLASH_APP
+    CMD_FLASH_ERASE = btl_protocol.CMD_FLASH_ERASE
+    CMD_MEM_READ = btl_protocol.CMD_MEM_READ
+    CMD_OTP_READ = btl_protocol.CMD_OTP_READ
+    CMD_EXIT = btl_protocol.CMD_EXIT
 
     def __init__(self):
         super().__init__()
 
         self.serialPort = None
         self.timeoutSeconds = 5
-        self.tempFilePath = "temp.hex"
+        self.recordsPerPacket = 30
+        # Kept for the whole GUI session, the packet size stays tuned to the cable in use
+        self.packetSizer = btl_protocol.PacketSizer()
+        self.workerThread = None
+        self.worker = None
         self.filePath = ""
 
         self.initUI()
@@ -38,6 +74,8 @@ class STM32F4FlashingTool(QWidget):
         title_label.setAlignment(Qt.AlignCenter)
 
         self.serialComboBox = QComboBox(self)
+        # Editable so a pty path of the host simulator (Host/btl_sim) can be typed in
+        self.serialComboBox.setEditable(True)
         self.updateSerialPorts()
 
         serial_label = QLabel('Please select the COM port:', self)
@@ -85,6 +123,9 @@ class STM32F4FlashingTool(QWidget):
             layout.addWidget(button)
 
 
+        self.progressBar = QProgressBar(self)
+        self.progressBar.setValue(0)
+
         self.logBox = QTextEdit(self)
         self.logBox.setReadOnly(True)
 
@@ -93,6 +134,7 @@ class STM32F4FlashingTool(QWidget):
         layout.addWidget(self.serialComboBox)
         layout.addWidget(refresh_button)
         layout.addSpacing(20)  # Adjust the spacing as needed
+        layout.addWidget(self.progressBar)
         layout.addWidget(self.logBox)
 
         self.setLayout(layout)
@@ -117,7 +159,10 @@ class STM32F4FlashingTool(QWidget):
 
     def openSerialPort(self, port_name):
         try:
-            ser = serial.Serial(port_name, baudrate=9600, timeout=5)
+            # A board that kept a link profile answers at the profile's baud after a reset
+            profile = link_profile.load(image_cache.DEFAULT_CACHE_DIR, port_name)
+            baud = profile['baud'] if profile else 9600
+            ser = serial.Serial(port_name, baudrate=baud, timeout=5)
             print(f"Opened serial port: {port_name}")
             return ser
         except Exception as e:
@@ -166,6 +211,9 @@ class STM32F4FlashingTool(QWidget):
     def runCommand(self):
         # if self.serialPort:
         button_text = self.sender().text()
+        if self.workerThread:
+            self.logBox.append("A command is still running, please wait for it to finish.")
+            return
         self.openSerialConnection()
 
         if button_text == 'Request Firmware Version':
@@ -188,135 +236,173 @@ class STM32F4FlashingTool(QWidget):
         #     print(f"Failed to open serial port")
 
     def cblGetHelpCmd(self):
-        if self.serialPort:
-            QMessageBox.information(self, "Request for Information", "Requesting information or assistance.")
-        else:
+        if not self.serialPort:
             QMessageBox.information(self, "Error", "Serial port is not open. Please open a serial connection.")
+            return
 
-    def cblGetCidCmd(self):
-        if self.serialPort:
-            QMessageBox.information(self, "Retrieve Chip ID", "Retrieving the identification number of the chip.")
+        def helpJob(worker, link):
+            capabilities = link.getCapabilities()
+            if not capabilities:
+                return "The bootloader does not report its capabilities (older than 1.3.0)."
+            return (f"Bootloader {capabilities['version']}, protocol {capabilities['protocol']}\n"
+                    f"Packets up to {capabilities['max_packet']} bytes, records up to {capabilities['max_record']} bytes\n"
+                    f"Formats: {', '.join(capabilities['formats'])}\n"
+                    f"Baud rates: {', '.join(map(str, capabilities['baud_rates']))}\n"
+                    f"Application: 0x{capabilities['app_start']:08X}, {capabilities['app_size'] // 1024} KB\n"
+                    f"Unique ID: {capabilities['uid']}")
+
+        self.startWorker(helpJob, self.helpFinished)
+
+    def helpFinished(self, success, message):
+        if success:
+            self.logBox.append(message)
+            QMessageBox.information(self, "Bootloader Information", message)
         else:
+            self.logBox.append(f"Error: {message}")
+
+    def cblGetCidCmd(self):
+        if not self.serialPort:
             QMessageBox.information(self, "Error", "Serial port is not open. Please open a serial connection.")
+            return
+
+        def idJob(worker, link):
+            deviceId, uniqueId = link.getId()
+            return f"Device 0x{deviceId & 0xFFF:03X} revision 0x{deviceId >> 16:04X}, unique ID {uniqueId}"
+
+        self.startWorker(idJob, self.helpFinished)
 
     def cblFlashEraseCmd(self):
-        if self.serialPort:
-            QMessageBox.information(self, "Flash Memory Erase", "Clearing the content of the flash memory.")
-        else:
+        if not self.serialPort:
             QMessageBox.information(self, "Error", "Serial port is not open. Please open a serial connection.")
+            return
+
+        self.logBox.append("Erasing the application area")
+
+        def eraseJob(worker, link):
+            startTime = time.perf_counter()
+            sectorCount = link.eraseFlash(progress=worker.progress.emit)
+            return f"{sectorCount} sectors in {time.perf_counter() - startTime:.2f} s"
+
+        self.startWorker(eraseJob, self.eraseFinished)
+
+    def eraseFinished(self, success, message):
+        if success:
+            self.logBox.append(f"<font color='green'>Application area erased ({message}).</font>")
+        else:
+            self.logBox.append(f"Error: {message}")
 
     def cblMemWriteCmd(self):
         if (self.selectHexFile() == None):
             return
-        try:
-            self.logBox.append(f"Start to flash application: {self.filePath}")
-            if not self.check_hex_file_validity(self.filePath):
-                raise Exception("Invalid hex file format. Aborting CBL_MEM_WRITE_CMD.")
-
-            if not self.serialPort:
-                raise Exception("Serial port is not open. Please open a serial connection.")
-
-            # Command to store data in the device's memory
-            if not self.check_hex_file_validity(self.filePath):
-                QMessageBox.information(self, "Error", "Invalid hex file format. Aborting CBL_MEM_WRITE_CMD.")
-                return
-
-            self.remove_colon_from_hex_file(self.filePath, self.tempFilePath)
-
-            with open(self.tempFilePath, 'r') as file:
-                lines = file.readlines()
-
-            recordsPerIteration = 30
-            totalRecords = len(lines)
-            totalCharacters = sum(len(record.strip()) for record in lines)
-            hexTotalCharacters = hex(totalCharacters)[2:].upper()
-            iterationCount = 0
-
-            while iterationCount * recordsPerIteration < totalRecords:
-                startIndex = iterationCount * recordsPerIteration
-                endIndex = min(startIndex + recordsPerIteration, totalRecords)
-                records = lines[startIndex:endIndex]
-
-                bufferRecordsNo = endIndex - startIndex
-                bufferRecordsByteArray = self.valueToHex2ByteArray(bufferRecordsNo)
-
-                firstIterationBytesLength = sum(len(record.strip()) + 1 for record in records)
-                firstIterationByteArray = self.valueToHex2ByteArray(firstIterationBytesLength)
-
-                commandBytes = bytearray([firstIterationByteArray[0], firstIterationByteArray[1], self.CMD_FLASH_APP])
-                self.sendData(commandBytes)
-
-                if iterationCount == 0:
-                    acknowledgment = self.checkAcknowledgement(self.CMD_FLASH_APP)
-                    if acknowledgment:
-                        pass
-                    else:
-                        self.logBox.append("Unexpected acknowledgment or timeout. Exiting loop.")
-                        break
-
-                while True:
-                    nextStartIndex = (iterationCount + 1) * recordsPerIteration
-                    nextEndIndex = min(nextStartIndex + recordsPerIteration, totalRecords)
-                    nextRecords = lines[nextStartIndex:nextEndIndex]
-                    nextIterationBytesLength = sum(len(record.strip()) + 1 for record in nextRecords)
-                    nextIterationByteArray = self.valueToHex2ByteArray(nextIterationBytesLength)
-
-                    if nextIterationBytesLength == 0:
-                        print(f"Sending Packet No.{(iterationCount + 1)}")
-                        self.logBox.append(f"Sending Packet No.{(iterationCount + 1)}")
-                        modifiedString = ''.join(
-                            [chr(byte) for byte in [bufferRecordsByteArray[0], 0, 0]] + [record.strip() + '\n' for
-                                                                                         record in records])
-                    else:
-                        print(f"Sending Packet No.{(iterationCount + 1)}")
-                        self.logBox.append(f"Sending Packet No.{(iterationCount + 1)}")
-                        modifiedString = ''.join([chr(byte) for byte in
-                                                  [bufferRecordsByteArray[0], nextIterationByteArray[0],
-                                                   nextIterationByteArray[1]]] + [record.strip() + '\n' for record in
-                                                                                  records])
-
-                    if iterationCount == (totalRecords // recordsPerIteration):
-                        modifiedString = '\x00' + modifiedString
-                    else:
-                        modifiedString = '\x01' + modifiedString
-
-                    chunksByteArray = modifiedString.encode('utf-8')
-                    time.sleep(0.7)
-                    self.flush()
-                    self.sendData(chunksByteArray)
-
-                    acknowledgment = self.checkAcknowledgement(self.CMD_FLASH_APP)
-
-                    if acknowledgment:
-                        iterationCount += 1
-                        break
-                    else:
-                        self.logBox.append("Error, Unexpected acknowledgment: {}".format(acknowledgment))
-                        break
+        if not self.serialPort:
+            self.logBox.append("Error: Serial port is not open. Please open a serial connection.")
+            return
 
+        self.logBox.append(f"Start to flash application: {self.filePath}")
+        filePath = self.filePath
+        recordsPerPacket = self.recordsPerPacket
+        packetSizer = self.packetSizer
+
+        def flashJob(worker, link):
+            startTime = time.perf_counter()
+            capabilities = link.getCapabilities()
+            settings = btl_protocol.fastest_settings(capabilities) if capabilities else None
+            # The image is decoded once (and cached), packets are then sized from the acks.
+            # Padding and gaps go out as fill records when the device takes them
+            records = image_cache.load_or_compile(filePath, recordsPerPacket,
+                                                  sparse=bool(settings and settings['sparse'])).records()
+            worker.progress.emit(0, len(records))
+            if settings:
+                packetSizer.setMaximum(settings['max_packet'])
+                if settings['erase_first'] and settings['batch']:
+                    # The erase goes out in one batch with the session header
+                    link.sessionPrelude = [btl_protocol.encode_request(btl_protocol.CMD_FLASH_ERASE, bytes([0, 0]))]
+                elif settings['erase_first']:
+                    link.eraseFlash()
+            link.flashAdaptive(records, packetSizer, worker.progress.emit, worker.log.emit)
+            verified = f", image CRC {link.stats.imageCrc:08X} verified" if link.stats.verified else ""
+            return (f"{link.stats.packets} packets in {time.perf_counter() - startTime:.2f} s, "
+                    f"packet size {packetSizer.size}/{packetSizer.maximum} bytes{verified}")
+
+        self.startWorker(flashJob, self.flashFinished)
+
+    def flashFinished(self, success, message):
+        if success:
+            self.logBox.append(f"<font color='green'>Application flashed successfully ({message}).</font>")
             QMessageBox.information(self, 'Flashing done', "Your application has been flashed")
-            message = "<font color='green'>Application flashed successfully.</font>"
-            self.logBox.append(message)
+        else:
+            self.logBox.append(f"Error: {message}")
 
-        except Exception as e:
-            self.logBox.append(f"Error: {e}")
+    def startWorker(self, job, onFinished):
+        self.workerThread = QThread(self)
+        self.worker = SerialWorker(self.serialPort, job, self.timeoutSeconds)
+        # The worker closes the port, keep closeEvent() away from it
+        self.serialPort = None
+        self.worker.moveToThread(self.workerThread)
+
+        self.workerThread.started.connect(self.worker.run)
+        self.worker.log.connect(self.logBox.append)
+        self.worker.progress.connect(self.updateProgress)
+        self.worker.finished.connect(onFinished)
+        self.worker.finished.connect(self.workerThread.quit)
+        self.workerThread.finished.connect(self.workerFinished)
+        self.workerThread.start()
+
+    def workerFinished(self):
+        self.workerThread.wait()
+        self.worker.deleteLater()
+        self.workerThread.deleteLater()
+        self.workerThread = None
+        self.worker = None
+
+    def updateProgress(self, sent, total):
+        self.progressBar.setMaximum(total)
+        self.progressBar.setValue(sent)
 
-    def checkAcknowledgement(self, expectedValue):
-        start_time = time.time()
-        while self.serialPort.inWaiting() < 1:
-            if time.time() - start_time > self.timeoutSeconds:
-                self.logBox.append("Timeout reached while waiting for acknowledgment.")
-                return False
+    def cblMemReadCmd(self):
+        if not self.serialPort:
+            QMessageBox.information(self, "Error", "Serial port is not open. Please open a serial connection.")
+            return
 
-        data = self.readData(self.serialPort.inWaiting())
-        data = data[0]
-        return data == chr(expectedValue)
+        # The application area by default
+        defaultRange = (f"0x{image_cache.FLASH_BASE + image_cache.APP_OFFSET:08X} "
+                        f"0x{sum(image_cache.SECTOR_SIZES) - image_cache.APP_OFFSET:X}")
+        text, accepted = QInputDialog.getText(self, "Memory Read", "Address and length (multiples of 4):",
+                                              text=defaultRange)
+        if not accepted:
+            return
+        try:
+            address, length = (int(value, 0) for value in text.split())
+        except ValueError:
+            self.logBox.append(f"Error: '{text}' is not an address and a length.")
+            return
 
-    def cblMemReadCmd(self):
-        if self.serialPort:
-            QMessageBox.information(self, "Memory Read", "Performing CBL_MEM_READ_CMD: Retrieving data from the device's memory.")
+        options = QFileDialog.Options()
+        options |= QFileDialog.DontUseNativeDialog
+        outPath, _ = QFileDialog.getSaveFileName(self, "Save Memory To", "", "Binary Files (*.bin);;All Files (*)",
+                                                 options=options)
+        if not outPath:
+            self.logBox.append("File selection canceled.")
+            return
+
+        self.logBox.append(f"Reading {length} bytes from 0x{address:08X} into {outPath}")
+
+        def memReadJob(worker, link):
+            # The chunks are raw bytes, not 512 bytes replies
+            link.stopReader()
+            startTime = time.perf_counter()
+            with open(outPath, 'wb') as out:
+                link.memRead(address, length, out, worker.progress.emit)
+            return (f"{length} bytes in {time.perf_counter() - startTime:.2f} s, "
+                    f"{link.stats.retries} chunks read again")
+
+        self.startWorker(memReadJob, self.memReadFinished)
+
+    def memReadFinished(self, success, message):
+        if success:
+            self.logBox.append(f"<font color='green'>Memory read done ({message}).</font>")
         else:
-            QMessageBox.information(self, "Error", "Serial port is not open. Please open a serial connection.")
+            self.logBox.append(f"Error: {message}")
 
     def selectHexFile(self):
         options = QFileDialog.Options()
@@ -333,70 +419,43 @@ class STM32F4FlashingTool(QWidget):
             return None
 
     def cblOtpReadCmd(self):
-        if self.serialPort:
-            QMessageBox.information(self, "OTP Memory Read", "Reading data from One-Time Programmable (OTP) memory.")
-        else:
+        if not self.serialPort:
             QMessageBox.information(self, "Error", "Serial port is not open. Please open a serial connection.")
+            return
 
-    def valueToHex2ByteArray(self, value):
-        hexValue = hex(value)[2:].upper()
-        byteArray = [int(hexValue[i:i + 2], 16) for i in range(0, len(hexValue), 2)]
-        return byteArray
+        def linkStatusJob(worker, link):
+            status = link.getLinkStatus()
+            if not status:
+                return "This bootloader does not keep link profiles."
+            stored = status['stored']
+            profile = (f"{stored['baud']} baud, packets up to {stored['max_packet']} bytes, "
+                       f"records up to {stored['max_record']} bytes, flags 0x{stored['flags']:02X}"
+                       if stored else "none")
+            return (f"Link running at {status['baud']} baud\n"
+                    f"Stored profile: {profile}\n"
+                    f"Free profile slots: {status['free_slots']}")
+
+        self.startWorker(linkStatusJob, self.linkStatusFinished)
+
+    def linkStatusFinished(self, success, message):
+        if success:
+            self.logBox.append(message)
+            QMessageBox.information(self, "Link Status", message)
+        else:
+            self.logBox.append(f"Error: {message}")
 
     def cblGetVerCmd(self):
         if self.serialPort:
-            commandBytes = bytearray([0x00, 0x00, self.CMD_GET_VERSION])
-            self.sendData(commandBytes)
-            version = self.readData(27)
-            self.logBox.append(version)
-            QMessageBox.information(self, "Firmware Version", version)
-
-
+            self.startWorker(lambda worker, link: link.getVersion(), self.versionFinished)
         else:
             QMessageBox.information(self, "Error", "Serial port is not open. Please open a serial connection.")
 
-    def sendData(self, command):
-        try:
-            if self.serialPort:
-                self.serialPort.flushOutput()
-                self.serialPort.write(command)
-            else:
-                print("Serial port is not open.")
-        except Exception as e:
-            print(f"Failed to send the message on port. Error: {e}")
-
-    def readData(self, dataNum):
-        try:
-            if self.serialPort:
-                data = self.serialPort.read(dataNum).decode('utf-8')
-                return data
-            else:
-                print("Serial port is not open.")
-        except Exception as e:
-            print(f"Failed to read data from serial port. Error: {e}")
-
-    def remove_colon_from_hex_file(self, input_file, output_file):
-        with open(input_file, 'r') as infile, open(output_file, 'w') as outfile:
-            for line in infile:
-                cleaned_line = line.lstrip(':')
-                outfile.write(cleaned_line)
-
-    def check_hex_file_validity(self, file_path):
-        with open(file_path, 'r') as file:
-            lines = file.readlines()
-
-        for line in lines:
-            stripped_line = line.rstrip('\n')
-            if not stripped_line.startswith(':') or len(stripped_line) < 11 or (len(stripped_line) - 1) % 2 != 0:
-                return False
-        return True
-
-    def flush(self):
-        if self.serialPort:
-            self.serialPort.flushOutput()
-            self.serialPort.flushInput()
+    def versionFinished(self, success, message):
+        if success:
+            self.logBox.append(message)
+            QMessageBox.information(self, "Firmware Version", message)
         else:
-            print("Serial port is not open.")
+            self.logBox.append(f"Error: {message}")
 
     def closeEvent(self):
         if self.serialPort and self.serialPort.is_open:
@@ -0,0 +1,70 @@
+"""Read device memory back to a .bin file (BTL_MEM_READ).
+
+The device streams the range in CRC checked chunks straight from flash or
+RAM; chunks that fail their CRC are read again before the file is closed.
+
+    python mem_read.py --port /dev/ttyUSB0 --address 0x08008000 --length 0x38000 --out app.bin
+
+Flash (0x08000000, 256K), SRAM (0x20000000, 64K) and the OTP area
+(0x1FFF7800, 528 bytes) can be read. Exit codes follow flash_cli.py:
+0 read, 2 bad command line, 4 port error, 5 protocol error.
+"""
+import argparse
+import sys
+import time
+
+import serial
+
+import btl_protocol
+
+EXIT_OK = 0
+EXIT_USAGE = 2
+EXIT_PORT_ERROR = 4
+EXIT_PROTOCOL_ERROR = 5
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Read device memory over the bootloader serial protocol.')
+    parser.add_argument('--port', required=True, help='serial port of a board in bootloader mode')
+    parser.add_argument('--baud', type=int, default=9600)
+    parser.add_argument('--address', type=lambda value: int(value, 0), required=True,
+                        help='first address, a multiple of 4')
+    parser.add_argument('--length', type=lambda value: int(value, 0), required=True,
+                        help='bytes to read, a multiple of 4')
+    parser.add_argument('--out', required=True, help='binary file to write')
+    parser.add_argument('--timeout', type=float, default=5, help='seconds to wait for every chunk')
+    parser.add_argument('--progress', action='store_true', help='print the progress on stderr')
+    args = parser.parse_args()
+    if (args.address | args.length) & 3 or args.length <= 0:
+        parser.error('--address and --length must be multiples of 4, --length not 0')
+
+    try:
+        port = serial.Serial(args.port, baudrate=args.baud, timeout=args.timeout)
+    except serial.SerialException as error:
+        print(f'{args.port}: {error}', file=sys.stderr)
+        return EXIT_PORT_ERROR
+
+    def progress(bytesRead, length):
+        print(f'\r{bytesRead}/{length} bytes', end='', file=sys.stderr, flush=True)
+
+    link = btl_protocol.BootloaderLink(port, timeoutSeconds=args.timeout)
+    startTime = time.perf_counter()
+    try:
+        with open(args.out, 'wb') as out:
+            link.memRead(args.address, args.length, out, progress if args.progress else None)
+    except btl_protocol.ProtocolError as error:
+        print(f'{args.port}: {error}', file=sys.stderr)
+        return EXIT_PROTOCOL_ERROR
+    finally:
+        port.close()
+        if args.progress:
+            print(file=sys.stderr)
+    wallTime = time.perf_counter() - startTime
+
+    print(f'{args.out}: {args.length} bytes from 0x{args.address:08X} in {wallTime:.2f} s '
+          f'({args.length / wallTime:.0f} B/s, {link.stats.retries} chunks read again)')
+    return EXIT_OK
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,144 @@
+"""Decoder for the bootloader trace stream (USART2, see Core/Inc/BTL_Trace.h).
+
+Renders a timeline of the receive, decode, program, ack and erase phases
+and a per-phase summary.
+
+Live from a board:
+    python trace_decoder.py --port /dev/ttyUSB1
+From a capture or the simulator (Host/btl_sim -T trace.bin):
+    python trace_decoder.py trace.bin
+"""
+import argparse
+import struct
+import sys
+
+TRACE_SYNC = 0xB7
+EVENT_FORMAT = struct.Struct('<BBHIII')
+
+CLOCK = 0x00
+DROPPED = 0x0B
+PACKET = 0x0C
+# ID of the BEGIN event -> phase name, the END event is always BEGIN + 1
+PHASES = {0x01: 'rx', 0x03: 'decode', 0x05: 'program', 0x07: 'ack', 0x09: 'erase'}
+DEFAULT_CLOCK_HZ = 16000000
+
+
+def read_events(stream):
+    """Yield (sequence, eventId, timestamp, arg0, arg1), resynchronising on the sync byte."""
+    buffer = b''
+    while True:
+        chunk = stream.read(EVENT_FORMAT.size * 16)
+        if not chunk:
+            return
+        buffer += chunk
+        while len(buffer) >= EVENT_FORMAT.size:
+            if buffer[0] != TRACE_SYNC:
+                buffer = buffer[1:]
+                continue
+            _, sequence, eventId, timestamp, arg0, arg1 = EVENT_FORMAT.unpack_from(buffer)
+            buffer = buffer[EVENT_FORMAT.size:]
+            yield sequence, eventId, timestamp, arg0, arg1
+
+
+def describe(eventId, arg0, arg1):
+    if eventId == 0x01:
+        return f'len={arg0}'
+    if eventId == 0x03:
+        return f'records={arg0}'
+    if eventId == 0x05:
+        return f'addr=0x{arg0:08X} bytes={arg1}'
+    if eventId == 0x07:
+        return f'cmd=0x{arg0:02X}' if arg0 else 'nack'
+    if eventId == 0x09:
+        return f'sectors={arg0}..{arg0 + arg1 - 1}'
+    return ''
+
+
+def decode(stream, out, showTimeline=True):
+    clockHz = DEFAULT_CLOCK_HZ
+    lastSequence = None
+    lastTimestamp = None
+    timeOffset = 0
+    origin = None
+    openPhases = {}
+    totals = {name: [0, 0.0] for name in PHASES.values()}
+    lost = 0
+    packetSizes = []
+    rate = 0
+
+    if showTimeline:
+        out.write(f'{"t_ms":>12} {"dur_ms":>10}  {"phase":<8} args\n')
+
+    for sequence, eventId, timestamp, arg0, arg1 in read_events(stream):
+        if lastSequence is not None and sequence != (lastSequence + 1) & 0xFF:
+            lost += (sequence - lastSequence - 1) & 0xFF
+        lastSequence = sequence
+
+        if eventId == CLOCK:
+            clockHz = arg0 or DEFAULT_CLOCK_HZ
+            lastTimestamp = None
+            continue
+        if eventId == DROPPED:
+            lost += arg0
+            continue
+
+        # The counter is 32 bits wide, unwrap it
+        if lastTimestamp is not None and timestamp < lastTimestamp:
+            timeOffset += 1 << 32
+        lastTimestamp = timestamp
+        timeMs = (timestamp + timeOffset) * 1000.0 / clockHz
+        if origin is None:
+            origin = timeMs
+
+        if eventId == PACKET:
+            packetSizes.append(arg0)
+            rate = arg1
+            if showTimeline:
+                out.write(f'{timeMs - origin:12.3f} {"":>10}  {"packet":<8} size={arg0} session={arg1} B/s\n')
+        elif eventId in PHASES:
+            openPhases[eventId] = (timeMs, describe(eventId, arg0, arg1))
+        elif eventId - 1 in PHASES and eventId - 1 in openPhases:
+            beginMs, args = openPhases.pop(eventId - 1)
+            name = PHASES[eventId - 1]
+            duration = timeMs - beginMs
+            totals[name][0] += 1
+            totals[name][1] += duration
+            if arg0 != 0:
+                args += ' FAILED'
+            if showTimeline:
+                out.write(f'{beginMs - origin:12.3f} {duration:10.3f}  {name:<8} {args}\n')
+
+    out.write('\nphase       count   total_ms\n')
+    for name, (count, totalMs) in totals.items():
+        out.write(f'{name:<8} {count:8d} {totalMs:10.3f}\n')
+    if packetSizes:
+        out.write(f'\n{len(packetSizes)} packets, size {min(packetSizes)}..{max(packetSizes)} '
+                  f'last {packetSizes[-1]}, session {rate} B/s\n')
+    if lost:
+        out.write(f'\n{lost} events lost\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Render the bootloader trace stream as a timeline.')
+    parser.add_argument('file', nargs='?', help='binary trace capture')
+    parser.add_argument('--port', help='read the trace live from this serial port (USART2)')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--summary', action='store_true', help='only print the per-phase summary')
+    args = parser.parse_args()
+
+    if args.port:
+        import serial
+        stream = serial.Serial(args.port, baudrate=args.baud, timeout=None)
+    elif args.file:
+        stream = open(args.file, 'rb')
+    else:
+        parser.error('give a trace file or --port')
+
+    try:
+        decode(stream, sys.stdout, showTimeline=not args.summary)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,217 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.1.1                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include "BTL_SimPort.h"
+#include "BTL_SimTiming.h"
+#include "BTL_Interface.h"
+#include "BTL_Trace.h"
+
+static void BTL_SimUsage(const char* programName)
+{
+    fprintf(stderr,
+            "Usage: %s [-f image.bin] [-O otp.bin] [-l link] [-S link2] [-T trace.bin] [-x bytes] [-b baud] [-P 8|16|32] [-t ms] [-w us]\n"
+            "  -f image.bin  Load the flash from image.bin and save it back after every command\n"
+            "  -O otp.bin    Load the OTP area from otp.bin and save it back after every command\n"
+            "  -l link       Create a symlink named link pointing to the pty\n"
+            "  -S link2      Open a second pty for the striped transfer (USART2 RX on the target), symlinked as link2\n"
+            "  -T trace.bin  Write the trace stream (USART2 on the target) to trace.bin\n"
+            "  -x bytes      Cut the power once that many flash bytes are programmed: the flash is saved and the simulator exits\n"
+            "Timing model, a predicted time is printed after every command (datasheet figures, not validated on hardware):\n"
+            "  -b baud       Link baud rate (default 9600)\n"
+            "  -P 8|16|32    Flash erase parallelism, programs run x32 like the port (default 32)\n"
+            "  -t ms         Host turnaround between a reply and the next frame (default 0)\n"
+            "  -w us         Time of one flash program operation (default 16)\n",
+            programName);
+}
+
+/**
+ * @brief Open a pseudo terminal the flashing tool can use as a serial port.
+ * @param slaveFd Returns a descriptor kept open on the slave side so the
+ *        master never sees a hang-up while the host reopens the port.
+ * @return int Master side descriptor, -1 on failure.
+ */
+static int BTL_SimOpenPty(int* slaveFd)
+{
+    struct termios rawMode;
+    int masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if ((masterFd < 0) || (grantpt(masterFd) != 0) || (unlockpt(masterFd) != 0))
+    {
+        return -1;
+    }
+
+    *slaveFd = open(ptsname(masterFd), O_RDWR | O_NOCTTY);
+    if (*slaveFd < 0)
+    {
+        return -1;
+    }
+
+    tcgetattr(*slaveFd, &rawMode);
+    cfmakeraw(&rawMode);
+    tcsetattr(*slaveFd, TCSANOW, &rawMode);
+
+    return masterFd;
+}
+
+/**
+ * @brief Print the activity of the last command or job and save the memories.
+ * @param BTL_STATUS Status of the command.
+ * @param imagePath Flash image to save, NULL for none.
+ * @param otpPath OTP image to save, NULL for none.
+ */
+static void BTL_SimReport(BTL_StatusTypeDef BTL_STATUS, const char* imagePath, const char* otpPath)
+{
+    const BTL_SimStatsTypeDef* BTL_STATS = BTL_SimGetStats();
+
+    fprintf(stderr, "%s: rx %u tx %u program %u erase %u\n", (BTL_STATUS == BTL_OK) ? "ok" : "error",
+            BTL_STATS->BTL_BYTES_RX, BTL_STATS->BTL_BYTES_TX,
+            BTL_STATS->BTL_PROGRAM_OPS, BTL_STATS->BTL_ERASE_OPS);
+    BTL_SimTimingReport(stderr);
+    BTL_SimTimingReset();
+
+    if (imagePath != NULL)
+    {
+        BTL_SimSaveImage(imagePath);
+    }
+    if (otpPath != NULL)
+    {
+        BTL_SimSaveOtp(otpPath);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    static uint8_t messageBuffer[DATA_BUFFER_SIZE];
+    const char* imagePath = NULL;
+    const char* otpPath = NULL;
+    const char* linkPath = NULL;
+    const char* stripePath = NULL;
+    const char* tracePath = NULL;
+    uint32_t powerCutBytes = 0;
+    BTL_SimTimingConfigTypeDef timingConfig = {0};
+    int slaveFd = -1;
+    int stripeSlaveFd = -1;
+    int option;
+
+    BTL_PortMemoryInit();
+
+    while ((option = getopt(argc, argv, "f:O:l:S:T:x:b:P:t:w:h")) != -1)
+    {
+        switch (option)
+        {
+            case 'f': imagePath = optarg; break;
+            case 'O': otpPath = optarg; break;
+            case 'l': linkPath = optarg; break;
+            case 'S': stripePath = optarg; break;
+            case 'T': tracePath = optarg; break;
+            case 'x': powerCutBytes = strtoul(optarg, NULL, 0); break;
+            case 'b': timingConfig.BTL_BAUD_RATE = strtoul(optarg, NULL, 0); break;
+            case 'P': timingConfig.BTL_PARALLELISM = strtoul(optarg, NULL, 0); break;
+            case 't': timingConfig.BTL_TURNAROUND_US = strtoul(optarg, NULL, 0) * 1000U; break;
+            case 'w': timingConfig.BTL_PROGRAM_US = strtoul(optarg, NULL, 0); break;
+            default: BTL_SimUsage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    int masterFd = BTL_SimOpenPty(&slaveFd);
+
+    if (BTL_SimInit(masterFd) != BTL_OK)
+    {
+        perror("pty");
+        return EXIT_FAILURE;
+    }
+    BTL_SimTimingInit(&timingConfig);
+
+    if (tracePath != NULL)
+    {
+        FILE* traceFile = fopen(tracePath, "wb");
+        if (traceFile == NULL)
+        {
+            perror(tracePath);
+            return EXIT_FAILURE;
+        }
+        BTL_SimSetTraceFile(traceFile);
+    }
+    BTL_TraceInit();
+
+    if ((imagePath != NULL) && (BTL_SimLoadImage(imagePath) != BTL_OK))
+    {
+        perror(imagePath);
+        return EXIT_FAILURE;
+    }
+
+    if ((otpPath != NULL) && (BTL_SimLoadOtp(otpPath) != BTL_OK))
+    {
+        perror(otpPath);
+        return EXIT_FAILURE;
+    }
+    BTL_LinkInit();
+    BTL_SessionInit();
+    BTL_SimSetPowerCut(imagePath, powerCutBytes);
+
+    if (linkPath != NULL)
+    {
+        unlink(linkPath);
+        if (symlink(ptsname(masterFd), linkPath) != 0)
+        {
+            perror(linkPath);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (stripePath != NULL)
+    {
+        int stripeFd = BTL_SimOpenPty(&stripeSlaveFd);
+
+        unlink(stripePath);
+        if ((stripeFd < 0) || (symlink(ptsname(stripeFd), stripePath) != 0))
+        {
+            perror(stripePath);
+            return EXIT_FAILURE;
+        }
+        BTL_SimSetStripeLink(stripeFd);
+    }
+
+    printf("%s\n", (linkPath != NULL) ? linkPath : ptsname(masterFd));
+    fflush(stdout);
+
+    uint8_t jobsActive = 0;
+
+    while (1)
+    {
+        /* Same loop as BTL_Poll, with a report after every command and every finished job */
+        uint8_t jobsWereActive = jobsActive;
+        jobsActive = BTL_RunJobs(messageBuffer);
+        uint8_t jobsFinished = jobsWereActive && !jobsActive;
+
+        /* A finished job is saved before the next command is answered, whatever the host asks next sees it */
+        if (jobsFinished)
+        {
+            BTL_SimReport(BTL_OK, imagePath, otpPath);
+        }
+
+        if (BTL_MessagePending())
+        {
+            BTL_SimReport(BTL_ProcessMessage(messageBuffer), imagePath, otpPath);
+        }
+        else if (!jobsFinished)
+        {
+            BTL_PortIdle();
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,725 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.1.1                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "BTL_SimPort.h"
+#include "BTL_SimTiming.h"
+#include "BTL_Trace.h"
+#include "BTL_FlashQueue.h"
+
+/* Sector sizes of the STM32F401CC: 4 x 16K, 1 x 64K, 1 x 128K */
+static const uint32_t BTL_SimSectorSize[BTL_SIM_NB_SECTORS] =
+{
+    0x4000U, 0x4000U, 0x4000U, 0x4000U, 0x10000U, 0x20000U
+};
+
+static uint8_t BTL_SimFlash[BTL_SIM_FLASH_SIZE];
+static uint8_t BTL_SimRam[BTL_SIM_RAM_SIZE];
+static uint8_t BTL_SimOtp[BTL_SIM_OTP_SIZE];
+static uint8_t BTL_SimFlashLocked = 1;
+/* Operation the simulated flash works on, it ends at the next BTL_PortIdle */
+static uint8_t BTL_SimFlashRunning;
+static uint8_t BTL_SimFlashKind;
+static uint32_t BTL_SimFlashAddress;
+static const uint8_t* BTL_SimFlashData;
+static uint16_t BTL_SimFlashLength;
+
+static void BTL_SimFlashInterrupt(void);
+static int BTL_SimLinkFd = -1;
+static int BTL_SimStripeFd = -1;
+static uint8_t BTL_SimStripeOn;
+static BTL_SimStatsTypeDef BTL_SimStats;
+static struct timespec BTL_SimStartTime;
+static uintptr_t BTL_SimStackBottom;
+static uintptr_t BTL_SimStackTop;
+static uint32_t BTL_SimStackAvailable;
+static uint32_t BTL_SimStaticSize;
+static FILE* BTL_SimTraceFile;
+static uint32_t BTL_SimCrc;
+/* Power cut: flash bytes left to program, 0 for none, and where the flash is saved then */
+static uint32_t BTL_SimPowerCutBytes;
+static const char* BTL_SimPowerCutImage;
+
+/**
+ * @brief Initialize the simulated device.
+ * @param linkFd File descriptor of the host link (pty master or socket).
+ * @return BTL_StatusTypeDef Status of the initialization.
+ */
+BTL_StatusTypeDef BTL_SimInit(int linkFd)
+{
+    if (linkFd < 0)
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_SimLinkFd = linkFd;
+    BTL_SimFlashLocked = 1;
+
+    /* A blank device comes out of the factory fully erased */
+    memset(BTL_SimFlash, BTL_SIM_ERASED_VALUE, sizeof(BTL_SimFlash));
+    memset(BTL_SimOtp, BTL_SIM_ERASED_VALUE, sizeof(BTL_SimOtp));
+    memset(&BTL_SimStats, 0, sizeof(BTL_SimStats));
+    clock_gettime(CLOCK_MONOTONIC, &BTL_SimStartTime);
+
+    return BTL_OK;
+}
+
+static BTL_StatusTypeDef BTL_SimLoadFile(const char* filePath, uint8_t* memory, size_t size)
+{
+    FILE* imageFile = fopen(filePath, "rb");
+
+    if (imageFile == NULL)
+    {
+        return (errno == ENOENT) ? BTL_OK : BTL_ERROR;
+    }
+
+    fread(memory, 1, size, imageFile);
+    fclose(imageFile);
+
+    return BTL_OK;
+}
+
+static BTL_StatusTypeDef BTL_SimSaveFile(const char* filePath, const uint8_t* memory, size_t size)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_ERROR;
+    char tempPath[PATH_MAX];
+    FILE* imageFile;
+
+    /* Written aside and renamed: a simulator stopped while saving leaves the last whole image */
+    if (snprintf(tempPath, sizeof(tempPath), "%s.tmp", filePath) >= (int)sizeof(tempPath))
+    {
+        return BTL_ERROR;
+    }
+    imageFile = fopen(tempPath, "wb");
+    if (imageFile == NULL)
+    {
+        return BTL_ERROR;
+    }
+
+    if (fwrite(memory, 1, size, imageFile) == size)
+    {
+        BTL_STATUS = BTL_OK;
+    }
+    if ((fclose(imageFile) != 0) || (BTL_STATUS != BTL_OK) || (rename(tempPath, filePath) != 0))
+    {
+        unlink(tempPath);
+        BTL_STATUS = BTL_ERROR;
+    }
+
+    return BTL_STATUS;
+}
+
+/**
+ * @brief Cut the power once a number of flash bytes are programmed.
+ * @param imagePath Flash image saved at the cut, NULL for none.
+ * @param programBytes Bytes programmed before the cut, 0 for none.
+ */
+void BTL_SimSetPowerCut(const char* imagePath, uint32_t programBytes)
+{
+    BTL_SimPowerCutImage = imagePath;
+    BTL_SimPowerCutBytes = programBytes;
+}
+
+/**
+ * @brief Load the flash content from a raw binary file.
+ * @param filePath Path of the image, a missing file keeps the flash erased.
+ * @return BTL_StatusTypeDef Status of the load operation.
+ */
+BTL_StatusTypeDef BTL_SimLoadImage(const char* filePath)
+{
+    return BTL_SimLoadFile(filePath, BTL_SimFlash, sizeof(BTL_SimFlash));
+}
+
+/**
+ * @brief Save the flash content to a raw binary file.
+ * @param filePath Path of the image.
+ * @return BTL_StatusTypeDef Status of the save operation.
+ */
+BTL_StatusTypeDef BTL_SimSaveImage(const char* filePath)
+{
+    return BTL_SimSaveFile(filePath, BTL_SimFlash, sizeof(BTL_SimFlash));
+}
+
+/**
+ * @brief Load the OTP area from a raw binary file.
+ * @param filePath Path of the OTP image, a missing file keeps the area blank.
+ * @return BTL_StatusTypeDef Status of the load operation.
+ */
+BTL_StatusTypeDef BTL_SimLoadOtp(const char* filePath)
+{
+    return BTL_SimLoadFile(filePath, BTL_SimOtp, sizeof(BTL_SimOtp));
+}
+
+/**
+ * @brief Save the OTP area to a raw binary file.
+ * @param filePath Path of the OTP image.
+ * @return BTL_StatusTypeDef Status of the save operation.
+ */
+BTL_StatusTypeDef BTL_SimSaveOtp(const char* filePath)
+{
+    return BTL_SimSaveFile(filePath, BTL_SimOtp, sizeof(BTL_SimOtp));
+}
+
+/**
+ * @brief Get the activity counters of the simulated device.
+ * @return const BTL_SimStatsTypeDef* Pointer to the counters.
+ */
+const BTL_SimStatsTypeDef* BTL_SimGetStats(void)
+{
+    return &BTL_SimStats;
+}
+
+/**
+ * @brief Get the simulated flash array (mapped at BTL_SIM_FLASH_BASE).
+ * @return uint8_t* Pointer to the flash array.
+ */
+uint8_t* BTL_SimGetFlash(void)
+{
+    return BTL_SimFlash;
+}
+
+/**
+ * @brief Set the file trace events are written to, in place of USART2.
+ * @param traceFile Open binary stream, NULL discards the events.
+ */
+void BTL_SimSetTraceFile(FILE* traceFile)
+{
+    BTL_SimTraceFile = traceFile;
+}
+
+BTL_StatusTypeDef BTL_PortTransmit(uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    uint16_t bytesSent = 0;
+
+    (void) timeout;
+
+    while (bytesSent < length)
+    {
+        ssize_t result = write(BTL_SimLinkFd, &data[bytesSent], length - bytesSent);
+
+        if (result < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+            {
+                continue;
+            }
+            return BTL_ERROR;
+        }
+        bytesSent += (uint16_t) result;
+    }
+
+    BTL_SimStats.BTL_BYTES_TX += length;
+    BTL_SimTimingTransmit(length);
+
+    return BTL_OK;
+}
+
+/**
+ * @brief Set the second lane of the striped transfer, in place of USART2 RX.
+ * @param stripeFd File descriptor of the second lane (pty master), -1 for none.
+ */
+void BTL_SimSetStripeLink(int stripeFd)
+{
+    BTL_SimStripeFd = stripeFd;
+}
+
+static BTL_StatusTypeDef BTL_SimReceive(int linkFd, uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    uint16_t bytesReceived = 0;
+    uint32_t startTick = BTL_PortGetTick();
+
+    while (bytesReceived < length)
+    {
+        int waitTime = -1;
+
+        if (timeout != BTL_PORT_MAX_DELAY)
+        {
+            uint32_t elapsedTime = BTL_PortGetTick() - startTick;
+            if (elapsedTime >= timeout)
+            {
+                return BTL_ERROR;
+            }
+            waitTime = (int) (timeout - elapsedTime);
+        }
+
+        struct pollfd linkPoll = { .fd = linkFd, .events = POLLIN };
+
+        if (poll(&linkPoll, 1, waitTime) <= 0)
+        {
+            continue;
+        }
+
+        ssize_t result = read(linkFd, &data[bytesReceived], length - bytesReceived);
+
+        if (result > 0)
+        {
+            bytesReceived += (uint16_t) result;
+        }
+        else if ((result == 0) || ((errno != EINTR) && (errno != EAGAIN) && (errno != EIO)))
+        {
+            /* The other end of a socket went away for good */
+            return BTL_ERROR;
+        }
+    }
+
+    BTL_SimStats.BTL_BYTES_RX += length;
+
+    return BTL_OK;
+}
+
+static uint16_t BTL_SimAvailable(int linkFd)
+{
+    int pendingBytes = 0;
+
+    if (ioctl(linkFd, FIONREAD, &pendingBytes) != 0)
+    {
+        return 0;
+    }
+
+    return (pendingBytes > (int) UINT16_MAX) ? UINT16_MAX : (uint16_t) pendingBytes;
+}
+
+BTL_StatusTypeDef BTL_PortReceive(uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    if (BTL_SimReceive(BTL_SimLinkFd, data, length, timeout) != BTL_OK)
+    {
+        return BTL_ERROR;
+    }
+    BTL_SimTimingReceive(length);
+
+    return BTL_OK;
+}
+
+void BTL_PortReceiveStart(void)
+{
+    /* A pty delivers the bytes unchanged at any baud rate, none need dropping */
+}
+
+uint16_t BTL_PortReceiveAvailable(void)
+{
+    return BTL_SimAvailable(BTL_SimLinkFd);
+}
+
+BTL_StatusTypeDef BTL_PortStripeStart(uint32_t baudRate)
+{
+    BTL_SimStripeOn = 0;
+    if (baudRate == 0U)
+    {
+        return BTL_OK;
+    }
+
+    /* Without a second pty the device has no second lane */
+    if (BTL_SimStripeFd < 0)
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_SimTimingSetStripeBaudRate(baudRate);
+    BTL_SimStripeOn = 1;
+
+    return BTL_OK;
+}
+
+BTL_StatusTypeDef BTL_PortStripeReceive(uint8_t* data, uint16_t length, uint32_t timeout)
+{
+    if ((!BTL_SimStripeOn) || (BTL_SimReceive(BTL_SimStripeFd, data, length, timeout) != BTL_OK))
+    {
+        return BTL_ERROR;
+    }
+    BTL_SimTimingStripe(length);
+
+    return BTL_OK;
+}
+
+uint16_t BTL_PortStripeAvailable(void)
+{
+    return BTL_SimStripeOn ? BTL_SimAvailable(BTL_SimStripeFd) : 0;
+}
+
+void BTL_PortIdle(void)
+{
+    /* The end of a flash operation is the interrupt that wakes the core up first */
+    if (BTL_SimFlashRunning)
+    {
+        BTL_SimFlashInterrupt();
+        return;
+    }
+
+    /* Stands for WFI: wake up on the next byte of either lane or after one SysTick period */
+    struct pollfd linkPoll[2] = { { .fd = BTL_SimLinkFd, .events = POLLIN },
+                                  { .fd = BTL_SimStripeOn ? BTL_SimStripeFd : -1, .events = POLLIN } };
+
+    poll(linkPoll, 2, 1);
+}
+
+void BTL_PortFlashUnlock(void)
+{
+    BTL_SimFlashLocked = 0;
+}
+
+void BTL_PortFlashLock(void)
+{
+    BTL_SimFlashLocked = 1;
+}
+
+/**
+ * @brief Program one unit, a byte or an aligned word, in one flash operation.
+ * @param address Flash or OTP address of the unit.
+ * @param data Bytes of the unit.
+ * @param size Bytes of the unit, 1 or 4.
+ * @return BTL_StatusTypeDef Status of the operation.
+ */
+static BTL_StatusTypeDef BTL_SimFlashProgramUnit(uint32_t address, const uint8_t* data, uint8_t size)
+{
+    if (BTL_SimFlashLocked)
+    {
+        return BTL_ERROR;
+    }
+
+    /* OTP bits can only be cleared too, and no erase ever sets them back */
+    if ((address >= BTL_SIM_OTP_BASE) && (address + size <= BTL_SIM_OTP_BASE + BTL_SIM_OTP_SIZE))
+    {
+        for (uint8_t byteIndex = 0; byteIndex < size; byteIndex++)
+        {
+            BTL_SimOtp[address - BTL_SIM_OTP_BASE + byteIndex] &= data[byteIndex];
+        }
+        BTL_SimStats.BTL_PROGRAM_OPS++;
+        BTL_SimTimingProgram();
+        return BTL_OK;
+    }
+
+    if ((address < BTL_SIM_FLASH_BASE) || (address + size > BTL_SIM_FLASH_BASE + BTL_SIM_FLASH_SIZE))
+    {
+        return BTL_ERROR;
+    }
+
+    /* NOR flash programming can only clear bits, setting them back needs an erase */
+    for (uint8_t byteIndex = 0; byteIndex < size; byteIndex++)
+    {
+        BTL_SimFlash[address - BTL_SIM_FLASH_BASE + byteIndex] &= data[byteIndex];
+    }
+    BTL_SimStats.BTL_PROGRAM_OPS++;
+    BTL_SimTimingProgram();
+
+    /* The cut lands after the unit that reaches the byte count */
+    if ((BTL_SimPowerCutBytes != 0U) && (BTL_SimPowerCutBytes <= size))
+    {
+        /* Nothing runs after a power cut, the flash keeps what was programmed so far */
+        if (BTL_SimPowerCutImage != NULL)
+        {
+            BTL_SimSaveImage(BTL_SimPowerCutImage);
+        }
+        fprintf(stderr, "power cut at 0x%08X\n", (unsigned int) address);
+        exit(EXIT_SUCCESS);
+    }
+    if (BTL_SimPowerCutBytes != 0U)
+    {
+        BTL_SimPowerCutBytes -= size;
+    }
+
+    return BTL_OK;
+}
+
+BTL_StatusTypeDef BTL_PortFlashProgram(uint32_t address, uint8_t data)
+{
+    return BTL_SimFlashProgramUnit(address, &data, 1);
+}
+
+static BTL_StatusTypeDef BTL_SimFlashErase(uint8_t firstSector, uint8_t nbSectors)
+{
+    uint32_t sectorAddress = 0;
+
+    if ((BTL_SimFlashLocked) || (firstSector + nbSectors > BTL_SIM_NB_SECTORS))
+    {
+        return BTL_ERROR;
+    }
+
+    for (uint8_t sector = 0; sector < firstSector; sector++)
+    {
+        sectorAddress += BTL_SimSectorSize[sector];
+    }
+
+    for (uint8_t sector = firstSector; sector < firstSector + nbSectors; sector++)
+    {
+        memset(&BTL_SimFlash[sectorAddress], BTL_SIM_ERASED_VALUE, BTL_SimSectorSize[sector]);
+        sectorAddress += BTL_SimSectorSize[sector];
+        BTL_SimStats.BTL_ERASE_OPS++;
+        BTL_SimTimingErase(BTL_SimSectorSize[sector]);
+    }
+
+    return BTL_OK;
+}
+
+BTL_StatusTypeDef BTL_PortFlashProgramStart(uint32_t address, const uint8_t* data, uint16_t length)
+{
+    if ((BTL_SimFlashLocked) || (BTL_SimFlashRunning) || (length == 0U))
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_SimFlashKind = BTL_FLASH_OP_PROGRAM;
+    BTL_SimFlashAddress = address;
+    BTL_SimFlashData = data;
+    BTL_SimFlashLength = length;
+    BTL_SimFlashRunning = 1;
+
+    return BTL_OK;
+}
+
+BTL_StatusTypeDef BTL_PortFlashEraseStart(uint8_t sector)
+{
+    if ((BTL_SimFlashLocked) || (BTL_SimFlashRunning) || (sector >= BTL_SIM_NB_SECTORS))
+    {
+        return BTL_ERROR;
+    }
+
+    BTL_SimFlashKind = BTL_FLASH_OP_ERASE;
+    BTL_SimFlashAddress = sector;
+    BTL_SimFlashRunning = 1;
+
+    return BTL_OK;
+}
+
+/**
+ * @brief End the running flash operation, stands for the flash interrupt.
+ */
+static void BTL_SimFlashInterrupt(void)
+{
+    BTL_StatusTypeDef BTL_STATUS = BTL_OK;
+
+    if (BTL_SimFlashKind == BTL_FLASH_OP_ERASE)
+    {
+        BTL_STATUS = BTL_SimFlashErase((uint8_t) BTL_SimFlashAddress, 1);
+    }
+    else
+    {
+        uint16_t byteIndex = 0;
+
+        /* The units of the port: words x32 where the run is word aligned, bytes
+         * x8 at its ends. Units of erased bytes take no program operation */
+        while ((byteIndex < BTL_SimFlashLength) && (BTL_STATUS == BTL_OK))
+        {
+            uint32_t address = BTL_SimFlashAddress + byteIndex;
+            uint8_t size = (((address & 3U) == 0U) && ((uint16_t) (BTL_SimFlashLength - byteIndex) >= 4U)) ? 4U : 1U;
+
+            for (uint8_t unitIndex = 0; unitIndex < size; unitIndex++)
+            {
+                if (BTL_SimFlashData[byteIndex + unitIndex] != BTL_FLASH_ERASED_VALUE)
+                {
+                    BTL_STATUS = BTL_SimFlashProgramUnit(address, &BTL_SimFlashData[byteIndex], size);
+                    break;
+                }
+            }
+            byteIndex += size;
+        }
+    }
+
+    BTL_SimFlashRunning = 0;
+    BTL_FlashQueueOpDone(BTL_STATUS);
+}
+
+const uint8_t* BTL_PortMemoryMap(uint32_t address, uint32_t length)
+{
+    if ((address >= BTL_SIM_FLASH_BASE) && (length <= BTL_SIM_FLASH_SIZE) &&
+        (address - BTL_SIM_FLASH_BASE <= BTL_SIM_FLASH_SIZE - length))
+    {
+        return &BTL_SimFlash[address - BTL_SIM_FLASH_BASE];
+    }
+
+    if ((address >= BTL_SIM_RAM_BASE) && (length <= BTL_SIM_RAM_SIZE) &&
+        (address - BTL_SIM_RAM_BASE <= BTL_SIM_RAM_SIZE - length))
+    {
+        return &BTL_SimRam[address - BTL_SIM_RAM_BASE];
+    }
+
+    if ((address >= BTL_SIM_OTP_BASE) && (length <= BTL_SIM_OTP_SIZE) &&
+        (address - BTL_SIM_OTP_BASE <= BTL_SIM_OTP_SIZE - length))
+    {
+        return &BTL_SimOtp[address - BTL_SIM_OTP_BASE];
+    }
+
+    return NULL;
+}
+
+BTL_StatusTypeDef BTL_PortTransmitDMA(const uint8_t* data, uint16_t length)
+{
+    /* The "DMA" finishes right away, the wait only reports its status */
+    return BTL_PortTransmit((uint8_t*) data, length, BTL_PORT_MAX_DELAY);
+}
+
+BTL_StatusTypeDef BTL_PortTransmitWait(uint32_t timeout)
+{
+    return BTL_OK;
+}
+
+/**
+ * @brief Software model of the STM32 CRC unit: polynomial 0x04C11DB7,
+ *        fed one word at a time.
+ */
+static uint32_t BTL_SimCrcWord(uint32_t crc, uint32_t word)
+{
+    crc ^= word;
+
+    for (uint8_t bit = 0; bit < 32; bit++)
+    {
+        crc = (crc & 0x80000000U) ? (crc << 1) ^ 0x04C11DB7U : (crc << 1);
+    }
+
+    return crc;
+}
+
+uint32_t BTL_PortCrc(const uint8_t* data, uint32_t length)
+{
+    /* Reset value 0xFFFFFFFF, little endian words */
+    BTL_SimCrc = 0xFFFFFFFFU;
+
+    for (uint32_t offset = 0; offset + 4U <= length; offset += 4U)
+    {
+        BTL_SimCrc = BTL_SimCrcWord(BTL_SimCrc, (uint32_t) data[offset] | ((uint32_t) data[offset + 1] << 8) |
+                                                ((uint32_t) data[offset + 2] << 16) | ((uint32_t) data[offset + 3] << 24));
+    }
+
+    return BTL_SimCrc;
+}
+
+void BTL_PortCrcStart(void)
+{
+    BTL_SimCrc = 0xFFFFFFFFU;
+}
+
+uint32_t BTL_PortCrcAccumulate(uint32_t word)
+{
+    BTL_SimCrc = BTL_SimCrcWord(BTL_SimCrc, word);
+
+    return BTL_SimCrc;
+}
+
+uint32_t BTL_PortGetBaudRate(void)
+{
+    return BTL_SimTimingBaudRate();
+}
+
+BTL_StatusTypeDef BTL_PortSetBaudRate(uint32_t baudRate)
+{
+    /* A pty has no baud rate, only the timing model follows it */
+    BTL_SimTimingSetBaudRate(baudRate);
+
+    return BTL_OK;
+}
+
+uint32_t BTL_PortGetDeviceId(void)
+{
+    return BTL_SIM_DEVICE_ID;
+}
+
+void BTL_PortGetUniqueId(uint8_t* uniqueId)
+{
+    /* "BTLSIM" and the process ID, two simulators never share an ID */
+    uint32_t processId = (uint32_t) getpid();
+
+    memcpy(uniqueId, "BTLSIM", 6);
+    memset(&uniqueId[6], 0, BTL_UID_SIZE - 6);
+    memcpy(&uniqueId[8], &processId, sizeof(processId));
+}
+
+uint32_t BTL_PortGetTick(void)
+{
+    struct timespec currentTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+
+    return (uint32_t) ((currentTime.tv_sec - BTL_SimStartTime.tv_sec) * 1000 +
+                       (currentTime.tv_nsec - BTL_SimStartTime.tv_nsec) / 1000000);
+}
+
+/**
+ * @brief Paint the host stack the same way the target paints its free RAM.
+ *
+ * The array lives right below the frame of the caller, which is the area
+ * the bootloader core will use for its own frames afterwards.
+ */
+static void __attribute__((noinline)) BTL_SimStackPaint(void)
+{
+    volatile uint32_t stackArea[BTL_SIM_STACK_PAINT_SIZE / sizeof(uint32_t)];
+
+    for (size_t wordIndex = 0; wordIndex < sizeof(stackArea) / sizeof(uint32_t); wordIndex++)
+    {
+        stackArea[wordIndex] = BTL_STACK_PAINT_VALUE;
+    }
+    BTL_SimStackBottom = (uintptr_t) stackArea;
+}
+
+void BTL_PortMemoryInit(void)
+{
+    BTL_SimStackTop = (uintptr_t) __builtin_frame_address(0);
+    BTL_SimStaticSize = sizeof(BTL_SimFlash) + sizeof(BTL_SimRam) + sizeof(BTL_SimOtp) + sizeof(BTL_SimStats);
+    BTL_SimStackPaint();
+    BTL_SimStackAvailable = (uint32_t) (BTL_SimStackTop - BTL_SimStackBottom);
+}
+
+void BTL_PortMemoryRestart(void)
+{
+    /* Painted below the frame of the caller, deeper than at reset */
+    BTL_SimStackPaint();
+}
+
+void BTL_PortGetMemoryUsage(BTL_MemoryUsageTypeDef* memoryUsage)
+{
+    volatile uint32_t* stackWord = (volatile uint32_t*) BTL_SimStackBottom;
+
+    while (((uintptr_t) stackWord < BTL_SimStackTop) && (*stackWord == BTL_STACK_PAINT_VALUE))
+    {
+        stackWord++;
+    }
+
+    memoryUsage->BTL_STACK_PEAK = (uint32_t) (BTL_SimStackTop - (uintptr_t) stackWord);
+    memoryUsage->BTL_STACK_AVAILABLE = BTL_SimStackAvailable;
+    /* The glibc arena only grows for allocations this small, it is the heap high watermark */
+    memoryUsage->BTL_HEAP_PEAK = (uint32_t) mallinfo2().arena;
+    memoryUsage->BTL_STATIC_SIZE = BTL_SimStaticSize;
+}
+
+uint32_t BTL_PortTraceInit(void)
+{
+    /* Timestamps are microseconds */
+    return 1000000U;
+}
+
+uint32_t BTL_PortTraceTimestamp(void)
+{
+    struct timespec currentTime;
+
+    clock_gettime(CLOCK_MONOTONIC, &currentTime);
+
+    return (uint32_t) ((currentTime.tv_sec - BTL_SimStartTime.tv_sec) * 1000000 +
+                       (currentTime.tv_nsec - BTL_SimStartTime.tv_nsec) / 1000);
+}
+
+BTL_StatusTypeDef BTL_PortTraceTransmit(uint8_t* data, uint16_t length)
+{
+    if (BTL_SimTraceFile != NULL)
+    {
+        fwrite(data, 1, length, BTL_SimTraceFile);
+        fflush(BTL_SimTraceFile);
+    }
+
+    /* The "DMA" finishes right away */
+    BTL_TraceTransmitComplete();
+
+    return BTL_OK;
+}
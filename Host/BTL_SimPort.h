@@ -0,0 +1,54 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.1.1                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#ifndef HOST_BTL_SIMPORT_H_
+#define HOST_BTL_SIMPORT_H_
+
+#include <stdio.h>
+#include "BTL_Port.h"
+
+/* STM32F401CC flash geometry */
+#define BTL_SIM_FLASH_BASE        0x08000000U
+#define BTL_SIM_FLASH_SIZE        0x40000U /* 256 Kilobyte */
+#define BTL_SIM_NB_SECTORS        6
+#define BTL_SIM_ERASED_VALUE      0xFFU
+
+/* STM32F401CC SRAM, readable with BTL_MEM_READ */
+#define BTL_SIM_RAM_BASE          0x20000000U
+#define BTL_SIM_RAM_SIZE          0x10000U /* 64 Kilobyte */
+
+/* STM32F401CC OTP area: 16 blocks of 32 bytes, then the 16 lock bytes */
+#define BTL_SIM_OTP_BASE          0x1FFF7800U
+#define BTL_SIM_OTP_SIZE          0x210U
+
+/* DBGMCU IDCODE of an STM32F401xB/C, revision Z */
+#define BTL_SIM_DEVICE_ID         0x10010423U
+
+/* Size of the host stack area painted below main() */
+#define BTL_SIM_STACK_PAINT_SIZE  0x10000U
+
+/* Counters of the simulated flash and link activity */
+typedef struct
+{
+  uint32_t BTL_BYTES_RX;            /* Bytes received from the host */
+  uint32_t BTL_BYTES_TX;            /* Bytes transmitted to the host */
+  uint32_t BTL_PROGRAM_OPS;         /* Flash program operations */
+  uint32_t BTL_ERASE_OPS;           /* Sector erase operations */
+} BTL_SimStatsTypeDef;
+
+BTL_StatusTypeDef BTL_SimInit(int linkFd);
+BTL_StatusTypeDef BTL_SimLoadImage(const char* filePath);
+BTL_StatusTypeDef BTL_SimSaveImage(const char* filePath);
+BTL_StatusTypeDef BTL_SimLoadOtp(const char* filePath);
+BTL_StatusTypeDef BTL_SimSaveOtp(const char* filePath);
+const BTL_SimStatsTypeDef* BTL_SimGetStats(void);
+uint8_t* BTL_SimGetFlash(void);
+void BTL_SimSetTraceFile(FILE* traceFile);
+void BTL_SimSetStripeLink(int stripeFd);
+void BTL_SimSetPowerCut(const char* imagePath, uint32_t programBytes);
+
+#endif /* HOST_BTL_SIMPORT_H_ */
@@ -0,0 +1,255 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.1.1                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#include <string.h>
+#include "BTL_SimTiming.h"
+
+/* The model is built from datasheet figures and the bytes on the wire
+ * only. It has not been checked against a board: its predictions rank
+ * transfer settings, they are no measurement of a real flashing time */
+
+/* Typical sector erase times in milliseconds from the STM32F401xC datasheet
+ * (flash memory programming characteristics), per parallelism x8/x16/x32 */
+typedef struct
+{
+  uint32_t BTL_SECTOR_SIZE;
+  uint32_t BTL_ERASE_MS[3];
+} BTL_SimEraseTimeTypeDef;
+
+static const BTL_SimEraseTimeTypeDef BTL_SimEraseTime[] =
+{
+    { 0x4000U,  {  400,  300,  250 } },
+    { 0x10000U, { 1200,  700,  550 } },
+    { 0x20000U, { 2000, 1300, 1000 } },
+};
+
+static BTL_SimTimingConfigTypeDef BTL_SimTimingConfig =
+{
+    .BTL_BAUD_RATE = 9600,
+    .BTL_PARALLELISM = 32,
+    .BTL_TURNAROUND_US = 0,
+    .BTL_PROGRAM_US = 16,
+};
+
+static BTL_SimTimingTypeDef BTL_SimTiming;
+
+/* The device alternates between receiving and replying, a turnaround is
+ * charged every time the host has to answer a reply */
+static uint8_t BTL_SimLastWasTransmit = 0;
+
+/* Time charged since the last reply. The flash works while the DMA receives
+ * the next frame: an exchange takes the longer of the two, the flash time
+ * past the frame is what the reply waits for */
+static uint64_t BTL_SimExchangeLink;
+static uint64_t BTL_SimExchangeStripe;
+static uint64_t BTL_SimExchangeFlash;
+
+/* Baud rate of the second lane of a striped transfer */
+static uint32_t BTL_SimStripeBaudRate = 115200U;
+
+/**
+ * @brief Configure the timing model and clear the accumulated time.
+ * @param timingConfig Parameters of the model, zero fields keep the defaults.
+ */
+void BTL_SimTimingInit(const BTL_SimTimingConfigTypeDef* timingConfig)
+{
+    if (timingConfig->BTL_BAUD_RATE != 0)
+    {
+        BTL_SimTimingConfig.BTL_BAUD_RATE = timingConfig->BTL_BAUD_RATE;
+    }
+    if (timingConfig->BTL_PARALLELISM != 0)
+    {
+        BTL_SimTimingConfig.BTL_PARALLELISM = timingConfig->BTL_PARALLELISM;
+    }
+    if (timingConfig->BTL_PROGRAM_US != 0)
+    {
+        BTL_SimTimingConfig.BTL_PROGRAM_US = timingConfig->BTL_PROGRAM_US;
+    }
+    BTL_SimTimingConfig.BTL_TURNAROUND_US = timingConfig->BTL_TURNAROUND_US;
+
+    BTL_SimTimingReset();
+}
+
+/**
+ * @brief Clear the accumulated time.
+ */
+void BTL_SimTimingReset(void)
+{
+    memset(&BTL_SimTiming, 0, sizeof(BTL_SimTiming));
+    BTL_SimLastWasTransmit = 0;
+    BTL_SimExchangeLink = 0;
+    BTL_SimExchangeStripe = 0;
+    BTL_SimExchangeFlash = 0;
+}
+
+/**
+ * @brief Close the exchange charged since the last reply: the frame and the flash overlap.
+ */
+static void BTL_SimTimingSettle(void)
+{
+    /* Both lanes carry their bytes at the same time, the slower one sets the frame time */
+    uint64_t frameTime = (BTL_SimExchangeStripe > BTL_SimExchangeLink) ? BTL_SimExchangeStripe : BTL_SimExchangeLink;
+
+    if (BTL_SimExchangeFlash > frameTime)
+    {
+        BTL_SimTiming.BTL_HIDDEN_US += frameTime;
+        BTL_SimTiming.BTL_STALL_US += BTL_SimExchangeFlash - frameTime;
+        BTL_SimTiming.BTL_TOTAL_US += BTL_SimExchangeFlash;
+    }
+    else
+    {
+        BTL_SimTiming.BTL_HIDDEN_US += BTL_SimExchangeFlash;
+        BTL_SimTiming.BTL_TOTAL_US += frameTime;
+    }
+
+    BTL_SimExchangeLink = 0;
+    BTL_SimExchangeStripe = 0;
+    BTL_SimExchangeFlash = 0;
+}
+
+static uint64_t BTL_SimTimingLinkTime(uint32_t length)
+{
+    return ((uint64_t) length * BTL_SIM_BITS_PER_BYTE * 1000000U) / BTL_SimTimingConfig.BTL_BAUD_RATE;
+}
+
+/**
+ * @brief Charge the reception of bytes from the host.
+ * @param length Number of bytes received.
+ */
+void BTL_SimTimingReceive(uint32_t length)
+{
+    uint64_t linkTime = BTL_SimTimingLinkTime(length);
+
+    if (BTL_SimLastWasTransmit)
+    {
+        BTL_SimTiming.BTL_STALL_US += BTL_SimTimingConfig.BTL_TURNAROUND_US;
+        BTL_SimTiming.BTL_TOTAL_US += BTL_SimTimingConfig.BTL_TURNAROUND_US;
+        BTL_SimLastWasTransmit = 0;
+    }
+    BTL_SimTiming.BTL_LINK_US += linkTime;
+    BTL_SimExchangeLink += linkTime;
+}
+
+/**
+ * @brief Charge the transmission of bytes to the host.
+ * @param length Number of bytes transmitted.
+ */
+void BTL_SimTimingTransmit(uint32_t length)
+{
+    uint64_t linkTime = BTL_SimTimingLinkTime(length);
+
+    /* The reply leaves once the frame is in and the flash work it waits for is done */
+    BTL_SimTimingSettle();
+    BTL_SimTiming.BTL_LINK_US += linkTime;
+    BTL_SimTiming.BTL_TOTAL_US += linkTime;
+    BTL_SimLastWasTransmit = 1;
+}
+
+/**
+ * @brief Charge the reception of bytes on the second lane, which runs alongside the link.
+ * @param length Number of bytes received.
+ */
+void BTL_SimTimingStripe(uint32_t length)
+{
+    uint64_t stripeTime = ((uint64_t) length * BTL_SIM_BITS_PER_BYTE * 1000000U) / BTL_SimStripeBaudRate;
+
+    BTL_SimTiming.BTL_STRIPE_US += stripeTime;
+    BTL_SimExchangeStripe += stripeTime;
+}
+
+/**
+ * @brief Charge one flash program operation.
+ */
+void BTL_SimTimingProgram(void)
+{
+    BTL_SimTiming.BTL_PROGRAM_US += BTL_SimTimingConfig.BTL_PROGRAM_US;
+    BTL_SimExchangeFlash += BTL_SimTimingConfig.BTL_PROGRAM_US;
+}
+
+/**
+ * @brief Charge one sector erase.
+ * @param sectorSize Size of the erased sector in bytes.
+ */
+void BTL_SimTimingErase(uint32_t sectorSize)
+{
+    uint8_t parallelismIndex = (BTL_SimTimingConfig.BTL_PARALLELISM >= 32) ? 2 :
+                               (BTL_SimTimingConfig.BTL_PARALLELISM >= 16) ? 1 : 0;
+
+    for (size_t sizeIndex = 0; sizeIndex < sizeof(BTL_SimEraseTime) / sizeof(BTL_SimEraseTime[0]); sizeIndex++)
+    {
+        if (BTL_SimEraseTime[sizeIndex].BTL_SECTOR_SIZE == sectorSize)
+        {
+            uint64_t eraseTime = (uint64_t) BTL_SimEraseTime[sizeIndex].BTL_ERASE_MS[parallelismIndex] * 1000U;
+
+            BTL_SimTiming.BTL_ERASE_US += eraseTime;
+            BTL_SimExchangeFlash += eraseTime;
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Get the time accumulated since the last reset.
+ * @return const BTL_SimTimingTypeDef* Pointer to the accumulated time.
+ */
+const BTL_SimTimingTypeDef* BTL_SimTimingGet(void)
+{
+
+    return &BTL_SimTiming;
+}
+
+/**
+ * @brief Get the modelled link baud rate.
+ * @return uint32_t Baud rate.
+ */
+uint32_t BTL_SimTimingBaudRate(void)
+{
+    return BTL_SimTimingConfig.BTL_BAUD_RATE;
+}
+
+/**
+ * @brief Change the modelled link baud rate, for the bytes that follow.
+ * @param baudRate Baud rate.
+ */
+void BTL_SimTimingSetBaudRate(uint32_t baudRate)
+{
+    BTL_SimTimingConfig.BTL_BAUD_RATE = baudRate;
+}
+
+/**
+ * @brief Change the modelled baud rate of the second lane.
+ * @param baudRate Baud rate.
+ */
+void BTL_SimTimingSetStripeBaudRate(uint32_t baudRate)
+{
+    BTL_SimStripeBaudRate = baudRate;
+}
+
+/**
+ * @brief Print the predicted time and its breakdown.
+ *
+ * Erase and program are the flash work, hidden is the part of it done while
+ * the host was sending. Stall is the host turnaround plus the rest of the
+ * flash work, the replies waited for it.
+ *
+ * @param reportFile Stream to print to.
+ */
+void BTL_SimTimingReport(FILE* reportFile)
+{
+    BTL_SimTimingSettle();
+
+    fprintf(reportFile,
+            "predicted %.3f s @%u baud x%u: link %.3f s, erase %.3f s, program %.3f s, hidden %.3f s, stall %.3f s\n",
+            BTL_SimTiming.BTL_TOTAL_US / 1e6, BTL_SimTimingConfig.BTL_BAUD_RATE, BTL_SimTimingConfig.BTL_PARALLELISM,
+            BTL_SimTiming.BTL_LINK_US / 1e6, BTL_SimTiming.BTL_ERASE_US / 1e6,
+            BTL_SimTiming.BTL_PROGRAM_US / 1e6, BTL_SimTiming.BTL_HIDDEN_US / 1e6,
+            BTL_SimTiming.BTL_STALL_US / 1e6);
+    if (BTL_SimTiming.BTL_STRIPE_US != 0U)
+    {
+        fprintf(reportFile, "stripe %.3f s @%u baud\n", BTL_SimTiming.BTL_STRIPE_US / 1e6, BTL_SimStripeBaudRate);
+    }
+}
@@ -0,0 +1,51 @@
+/*****************************************************/
+/*                 SWC: Bootloader                   */
+/*            Author: Abdulrahman Omar               */
+/*                 Version: v 1.1.1                  */
+/*              Date: 18 Oct - 2026                  */
+/*****************************************************/
+
+#ifndef HOST_BTL_SIMTIMING_H_
+#define HOST_BTL_SIMTIMING_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Bits on the wire per byte (8N1 framing) */
+#define BTL_SIM_BITS_PER_BYTE     10
+
+/* Parameters of the timing model */
+typedef struct
+{
+  uint32_t BTL_BAUD_RATE;           /* Link baud rate */
+  uint8_t  BTL_PARALLELISM;         /* Flash program/erase parallelism: 8, 16 or 32 */
+  uint32_t BTL_TURNAROUND_US;       /* Host delay between a device reply and its next frame */
+  uint32_t BTL_PROGRAM_US;          /* Time of one flash program operation */
+} BTL_SimTimingConfigTypeDef;
+
+/* Predicted time accumulated since the last reset, in microseconds */
+typedef struct
+{
+  uint64_t BTL_LINK_US;             /* Bytes on the wire in both directions */
+  uint64_t BTL_STRIPE_US;           /* Bytes on the second lane, alongside the link */
+  uint64_t BTL_ERASE_US;            /* Sector erases */
+  uint64_t BTL_PROGRAM_US;          /* Flash program operations */
+  uint64_t BTL_HIDDEN_US;           /* Flash time spent while the host was sending */
+  uint64_t BTL_STALL_US;            /* Host turnaround, and flash time a reply waited for */
+  uint64_t BTL_TOTAL_US;            /* Predicted end-to-end time */
+} BTL_SimTimingTypeDef;
+
+void BTL_SimTimingInit(const BTL_SimTimingConfigTypeDef* timingConfig);
+void BTL_SimTimingReset(void);
+void BTL_SimTimingReceive(uint32_t length);
+void BTL_SimTimingTransmit(uint32_t length);
+void BTL_SimTimingStripe(uint32_t length);
+void BTL_SimTimingProgram(void);
+void BTL_SimTimingErase(uint32_t sectorSize);
+const BTL_SimTimingTypeDef* BTL_SimTimingGet(void);
+uint32_t BTL_SimTimingBaudRate(void);
+void BTL_SimTimingSetBaudRate(uint32_t baudRate);
+void BTL_SimTimingSetStripeBaudRate(uint32_t baudRate);
+void BTL_SimTimingReport(FILE* reportFile);
+
+#endif /* HOST_BTL_SIMTIMING_H_ */
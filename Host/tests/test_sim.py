@@ -0,0 +1,356 @@
+"""
+Protocol tests of the bootloader core, run against btl_sim.
+
+Every test starts its own simulator on a private pty with a blank flash and
+talks to it with the Flashing_Tool protocol module:
+
+    make -C Host check
+
+padded.hex is an application image padded the way linker scripts pad one:
+code, an erased gap, a configuration block, a zero-filled area, a version
+string and erased padding up to 48K. It is the image the sparse format was
+measured with:
+    python Flashing_Tool/benchmark.py --sim --hex Host/tests/padded.hex --formats dense,sparse --bauds 115200
+"""
+
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import unittest
+
+import serial
+
+HOST_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, os.path.join(HOST_DIR, '..', 'Flashing_Tool'))
+
+import btl_protocol  # noqa: E402
+
+SIM_PATH = os.path.join(HOST_DIR, 'btl_sim')
+FLASH_CLI = os.path.join(HOST_DIR, '..', 'Flashing_Tool', 'flash_cli.py')
+PADDED_HEX = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'padded.hex')
+BAUD = 115200
+
+FLASH_BASE = 0x08000000
+FLASH_SIZE = 0x40000
+APP_BASE = 0x08008000
+
+
+class SimTestCase(unittest.TestCase):
+    """Runs every test against a fresh btl_sim."""
+
+    def setUp(self):
+        self.directory = tempfile.mkdtemp(prefix='btl_test_')
+        self.flashPath = os.path.join(self.directory, 'flash.bin')
+        self.log = open(os.path.join(self.directory, 'sim.log'), 'w+')
+        self.startSim()
+
+    def tearDown(self):
+        self.stopSim()
+        self.log.close()
+        shutil.rmtree(self.directory)
+
+    def startSim(self, baud=BAUD, options=()):
+        """Start the simulator on the flash left by the last one, the port opens at baud."""
+        linkPath = os.path.join(self.directory, 'tty')
+        self.sim = subprocess.Popen([SIM_PATH, '-f', self.flashPath, '-l', linkPath, '-b', str(BAUD), *options],
+                                    stdout=subprocess.PIPE, stderr=self.log)
+        self.sim.stdout.readline()
+        self.port = serial.Serial(linkPath, baud, timeout=1)
+        self.link = btl_protocol.BootloaderLink(self.port, timeoutSeconds=3)
+
+    def stopSim(self):
+        self.port.close()
+        self.sim.terminate()
+        self.sim.wait()
+        self.sim.stdout.close()
+
+    def resetSim(self, baud=BAUD):
+        """Power cycle the device, its flash is kept."""
+        # The flash is saved after a reply: one more request waits for the save of the last one
+        self.link.getVersion()
+        self.stopSim()
+        self.startSim(baud)
+
+    def readFlash(self, address, length):
+        """Return flash bytes as the simulator saved them after its last reply."""
+        # The flash is saved after a reply: one more request waits for the save of the last one
+        self.link.getVersion()
+        with open(self.flashPath, 'rb') as flashFile:
+            flashFile.seek(address - FLASH_BASE)
+            return flashFile.read(length)
+
+    def assertAlive(self):
+        """The device still answers a plain request in step with the host."""
+        reply = self.link.getVersion()
+        self.assertTrue(reply)
+        self.assertEqual(self.port.in_waiting, 0)
+
+
+def image_bytes(records, length):
+    """Return the first length bytes of the application area once records are programmed."""
+    image = bytearray(b'\xFF' * length)
+    addressHigh = 0
+    for record in records:
+        fields = bytes.fromhex(record)
+        if fields[3] == 0x04:
+            addressHigh = (fields[4] << 8) | fields[5]
+        offset = (addressHigh << 16 | fields[1] << 8 | fields[2]) - FLASH_BASE
+        data = btl_protocol.record_data(record)
+        image[offset:offset + len(data)] = data
+    return bytes(image)
+
+
+def fill_image(flashAddress, value, length):
+    """Records of one fill record at flashAddress, the records are linked at FLASH_BASE."""
+    address = flashAddress - (APP_BASE - FLASH_BASE)
+    return [btl_protocol.hex_record(0, 0x04, (address >> 16).to_bytes(2, 'big')),
+            btl_protocol.hex_record(address & 0xFFFF, btl_protocol.FILL_RECORD,
+                                    bytes([value]) + length.to_bytes(2, 'big')),
+            btl_protocol.hex_record(0, 0x01, b'')]
+
+
+class FillRecordTest(SimTestCase):
+
+    def flashRefused(self, records):
+        with self.assertRaises(btl_protocol.ProtocolError):
+            self.link.flashRecords(records, len(records))
+
+    def test_fill_ending_past_the_application_area_is_refused(self):
+        # Starts in the application area, ends 4K past the end of the flash: nothing of it is programmed
+        self.flashRefused(fill_image(0x0803E000, 0x00, 0x3000))
+        self.assertEqual(self.readFlash(0x0803E000, 0x1000), b'\xFF' * 0x1000)
+        self.assertAlive()
+
+    def test_fill_starting_past_the_flash_is_refused(self):
+        # The record address is below BTL_MAX_ADDRESS, the run is not in the flash at all
+        self.flashRefused(fill_image(FLASH_BASE + FLASH_SIZE, 0x00, 0x100))
+        self.assertAlive()
+
+    def test_fill_of_the_advertised_application_size(self):
+        capabilities = self.link.getCapabilities()
+        appStart, appSize = capabilities['app_start'], capabilities['app_size']
+        records = []
+        for offset in range(0, appSize, 0x8000):
+            records += fill_image(appStart + offset, 0x00, min(0x8000, appSize - offset))[:2]
+        records.append(btl_protocol.hex_record(0, 0x01, b''))
+        self.assertTrue(self.link.flashRecords(records, 30).verified)
+        self.assertEqual(self.readFlash(appStart, appSize), b'\x00' * appSize)
+
+    def test_sparse_image_programs_like_the_dense_one(self):
+        records = btl_protocol.read_hex_records(PADDED_HEX)
+        dense = btl_protocol.reblock_records(records, 16)
+        sparse = btl_protocol.reblock_records(records, 16, btl_protocol.FILL_MINIMUM)
+        stats = self.link.flashRecords(sparse, 30)
+        self.assertTrue(stats.verified)
+        self.assertEqual(stats.imageCrc, btl_protocol.image_crc(dense))
+        self.assertLess(stats.bytesTx, sum(len(record) for record in dense) // 4)
+        self.assertEqual(self.readFlash(APP_BASE, 0xC000), image_bytes(dense, 0xC000))
+
+
+class RefusedRequestTest(SimTestCase):
+    """A refused request is read to its end, the next one is understood."""
+
+    def sendRefused(self, command, data):
+        self.link.write(btl_protocol.encode_request(command, data))
+        self.assertEqual(self.link.readReply()[0], 0)
+        self.assertAlive()
+
+    def test_oversized_batch(self):
+        # Version requests: any of them parsed as a header would answer
+        self.sendRefused(btl_protocol.CMD_BATCH, btl_protocol.encode_request(btl_protocol.CMD_GET_VERSION) * 100)
+
+    def test_request_of_the_wrong_length(self):
+        version = btl_protocol.encode_request(btl_protocol.CMD_GET_VERSION)
+        for command in (btl_protocol.CMD_FLASH_ERASE, btl_protocol.CMD_MEM_READ, btl_protocol.CMD_SET_LINK,
+                        btl_protocol.CMD_STRIPE, btl_protocol.CMD_FRAMING, btl_protocol.CMD_RESUME):
+            with self.subTest(command=command):
+                self.sendRefused(command, version * 3)
+
+
+class ResumeTest(SimTestCase):
+    """A session cut short by the link takes on again at its checkpoint, without a second erase."""
+
+    def setUp(self):
+        super().setUp()
+        # 13 byte records: the checkpoints fall inside a word of the image CRC
+        self.records = btl_protocol.reblock_records(btl_protocol.read_hex_records(PADDED_HEX), 13)
+        self.packets = btl_protocol.build_packets(self.records, 30)
+        self.assertGreater(len(self.packets), 6)
+
+    def flashFirst(self, count):
+        """Flash the first count packets, return the records they hold."""
+        self.link.flashPackets(self.packets[:count])
+        return sum(packet[1] for header, packet in self.packets[:count])
+
+    def eraseOps(self):
+        """Return the sectors erased so far, from the activity the simulator reports."""
+        self.log.flush()
+        self.log.seek(0)
+        return int(re.findall(r' erase (\d+)$', self.log.read(), re.MULTILINE)[-1])
+
+    def resumeAndFinish(self, records, eraseOps=4):
+        state = self.link.querySession()
+        self.assertEqual(state['state'], 'suspended')
+        self.assertEqual(state['records'], records)
+        self.assertEqual(state['crc'], btl_protocol.image_crc_at(self.records, records))
+        resumeAt = self.link.resumeSession(state['session'])
+        self.assertEqual(resumeAt, records)
+        stats = self.link.flashPackets(self.packets, resumeAt=resumeAt)
+        self.assertTrue(stats.verified)
+        self.assertEqual(stats.imageCrc, btl_protocol.image_crc(self.records))
+        self.assertEqual(self.readFlash(APP_BASE, 0xC000), image_bytes(self.records, 0xC000))
+        self.assertEqual(self.eraseOps(), eraseOps)
+
+    def test_drop_between_packets(self):
+        records = self.flashFirst(3)
+        self.resumeAndFinish(records)
+
+    def test_drop_inside_a_packet(self):
+        records = self.flashFirst(4)
+        header, packet = self.packets[4]
+        self.link.write(header + packet[:len(packet) // 2])
+        # The device gives the packet up after BTL_PACKET_TIMEOUT
+        self.link.timeoutSeconds = 5
+        self.assertEqual(self.link.readReply()[0], 0)
+        self.resumeAndFinish(records)
+
+    def test_power_cut_inside_the_image(self):
+        # The simulator exits once 4K of the image are programmed, its flash saved
+        self.stopSim()
+        self.startSim(options=('-x', str(0x1000)))
+        with self.assertRaises((btl_protocol.ProtocolError, serial.SerialException)):
+            self.link.flashPackets(self.packets)
+        self.sim.wait()
+        self.stopSim()
+        self.startSim()
+        records = self.link.querySession()['records']
+        self.assertGreater(records, 0)
+        self.assertLess(records, len(self.records))
+        # The restarted simulator erases nothing: the sectors erased before the cut are kept
+        self.resumeAndFinish(records, eraseOps=0)
+
+
+class FlashCliTest(SimTestCase):
+
+    def test_invalid_streamed_image_fails_before_the_session(self):
+        hexPath = os.path.join(self.directory, 'bad.hex')
+        with open(hexPath, 'w') as hexFile:
+            hexFile.write(':020000040800F2\nthis is not a record\n:00000001FF\n')
+        self.port.close()
+        result = subprocess.run([sys.executable, FLASH_CLI, '--port', os.path.join(self.directory, 'tty'),
+                                 '--baud', str(BAUD), '--no-cache', '--json', hexPath], capture_output=True)
+        # EXIT_INVALID_IMAGE, and the device was sent nothing
+        self.assertEqual(result.returncode, 3)
+        self.port.open()
+        self.assertAlive()
+        self.log.seek(0)
+        self.assertEqual(self.log.read().count('ok:'), 1)
+
+
+class MemoryUsageTest(SimTestCase):
+
+    def test_session_peaks_are_latched(self):
+        records = btl_protocol.reblock_records(btl_protocol.read_hex_records(PADDED_HEX), 16)
+        self.assertTrue(self.link.flashRecords(records, 30).verified)
+        usage = self.link.getMemoryUsage()
+        self.assertGreater(usage['stack'], 0)
+        self.assertGreater(usage['flashq'], 0)
+        # Later commands and queries leave the peaks of the session as they were
+        self.link.getCapabilities()
+        self.assertEqual(self.link.getMemoryUsage(), usage)
+
+
+class DamagingPort:
+    """Serial port whose writes are damaged on the way to the device, by write index."""
+
+    def __init__(self, port, damages):
+        self.port = port
+        self.damages = damages
+        self.writes = 0
+
+    def write(self, data):
+        damage = self.damages.get(self.writes)
+        self.writes += 1
+        middle = len(data) // 2
+        if damage == 'flip':
+            # A flipped bit that is never the delimiter
+            data = data[:middle] + bytes([data[middle] ^ 0x01 or 0x03]) + data[middle + 1:]
+        elif damage == 'drop':
+            data = data[:middle] + data[middle + 4:]
+        elif damage == 'noise':
+            data = FramedLinkTest.NOISE + data
+        elif damage == 'overflow':
+            # No delimiter ends the garbage, the frame it runs into is too long
+            data = b'\x55' * FramedLinkTest.FRAME_SIZE + data
+        return self.port.write(data)
+
+    def __getattr__(self, name):
+        return getattr(self.port, name)
+
+
+class FramedLinkTest(SimTestCase):
+    # BTL_FRAME_SIZE, and two bytes between frames the device counts as noise
+    FRAME_SIZE = 2048 + 2
+    NOISE = bytes([0x03, 0x11, 0x22]) + btl_protocol.FRAME_DELIMITER
+
+    def test_damaged_frames_are_sent_again(self):
+        records = btl_protocol.reblock_records(btl_protocol.read_hex_records(PADDED_HEX), 16)
+        self.assertEqual(self.link.setFraming(True), {'frames': 0, 'bad': 0, 'noise': 0})
+        damages = {3: 'flip', 6: 'noise', 9: 'drop', 12: 'overflow', 15: 'noise', 18: 'flip'}
+        self.link.serialPort = DamagingPort(self.port, damages)
+        stats = self.link.flashRecords(records, 30)
+        self.link.serialPort = self.port
+        self.assertTrue(stats.verified)
+        self.assertEqual(stats.imageCrc, btl_protocol.image_crc(records))
+        self.assertEqual(stats.frameRetries, 4)
+        counters = self.link.setFraming(False)
+        self.assertEqual(counters['bad'], 4)
+        self.assertEqual(counters['noise'], 2 * 2)
+        self.assertGreater(counters['frames'], len(damages))
+        self.assertEqual(self.readFlash(APP_BASE, 0xC000), image_bytes(records, 0xC000))
+
+
+class LinkProfileTest(SimTestCase):
+    PROFILE = {'baud': 460800, 'max_packet': 1024, 'max_record': 64, 'flags': btl_protocol.LINK_FLAG_ACK}
+
+    def setProfile(self, profile):
+        return self.link.setLink(profile['baud'], profile['max_packet'], profile['max_record'], profile['flags'])
+
+    def test_profile_changes_never_run_out(self):
+        # Each change took one of the 16 OTP slots for good
+        other = dict(self.PROFILE, baud=230400)
+        for profile in [self.PROFILE, other] * 20:
+            self.assertTrue(self.setProfile(profile))
+            self.assertEqual(self.link.getLinkStatus()['stored'], profile)
+
+    def test_unchanged_profile_takes_no_entry(self):
+        self.assertTrue(self.setProfile(self.PROFILE))
+        freeEntries = self.link.getLinkStatus()['free_slots']
+        self.assertTrue(self.setProfile(self.PROFILE))
+        self.assertEqual(self.link.getLinkStatus()['free_slots'], freeEntries)
+
+    def test_profile_outlives_flashing_and_erasing(self):
+        self.assertTrue(self.setProfile(self.PROFILE))
+        records = btl_protocol.reblock_records(btl_protocol.read_hex_records(PADDED_HEX), 16)
+        self.assertTrue(self.link.flashRecords(records, 30).verified)
+        self.link.eraseFlash()
+        self.resetSim(self.PROFILE['baud'])
+        status = self.link.getLinkStatus()
+        self.assertEqual(status['baud'], self.PROFILE['baud'])
+        self.assertEqual(status['stored'], self.PROFILE)
+
+    def test_noise_in_the_probe_window_falls_back(self):
+        self.assertTrue(self.setProfile(self.PROFILE))
+        self.resetSim(self.PROFILE['baud'])
+        # A known command behind a length the host never sends
+        self.port.write(bytes([0x55, 0x33, btl_protocol.CMD_GET_VERSION]))
+        self.port.baudrate = BAUD
+        self.assertEqual(self.link.getLinkStatus()['baud'], BAUD)
+        self.assertEqual(self.port.in_waiting, 0)
+
+
+if __name__ == '__main__':
+    unittest.main()